@@ -156,17 +156,30 @@ extern "C" {
  __attribute__((visibility("default"))) wasi_nn_error
  init_execution_context_with_session_id(void *ctx, const char *session_id, graph_execution_context *exec_ctx);
  
+ // Index 0 sets the prompt, index 1 an optional runtime config JSON for the
+ // next compute() (run_inference keys plus "priority", "timeout_ms",
+ // "deadline_ms" and "tenant").
  __attribute__((visibility("default"))) wasi_nn_error
  set_input(void *ctx, graph_execution_context exec_ctx, uint32_t index,
 	  tensor *wasi_nn_tensor);
  
+ // Queues the input for inference and returns without waiting for it;
+ // timeout if it could not start or finish in time at the measured throughput.
  __attribute__((visibility("default"))) wasi_nn_error
  compute(void *ctx, graph_execution_context exec_ctx);
  
+ // Blocks until the last compute() finishes, then copies out its result.
+ // *output_tensor_size holds the capacity on entry and the result size (with
+ // NUL) on return; a result that does not fit gives too_large and stays
+ // available, so the call can be repeated with a large enough buffer.
  __attribute__((visibility("default"))) wasi_nn_error
  get_output(void *ctx, graph_execution_context exec_ctx, uint32_t index,
 	  tensor_data output_tensor, uint32_t *output_tensor_size);
  
+ // Sets *ready once get_output() would return without blocking.
+ __attribute__((visibility("default"))) wasi_nn_error
+ poll_output(void *ctx, graph_execution_context exec_ctx, bool *ready);
+ 
  __attribute__((visibility("default"))) wasi_nn_error
  init_backend(void **ctx) ;
  
@@ -174,15 +187,131 @@ extern "C" {
  deinit_backend(void *ctx);
 
  
+ // Runs one chat turn and writes the response to output_tensor. Sizes work as
+ // for get_output(): if the response does not fit (pass a NULL buffer of size
+ // 0 to only ask), too_large is returned with the required size and the
+ // response is kept for get_output() on the same exec_ctx, not regenerated.
  __attribute__((visibility("default"))) wasi_nn_error
  run_inference(void *ctx, graph_execution_context exec_ctx, uint32_t index,
 		   tensor *input_tensor, tensor_data output_tensor, uint32_t *output_tensor_size,
 		   const char *runtime_config, uint32_t config_len);
 
+ // Streaming callback for run_inference_stream. Called on the inference thread
+ // with each chunk of generated text as it is produced; chunks always end on a
+ // UTF-8 character boundary and are not NUL-terminated. Return false to stop
+ // generation early; the text delivered so far is kept in the session history.
+ typedef bool (*wasi_nn_stream_callback)(const char *chunk, uint32_t chunk_len, void *user_data);
+
+ // Like run_inference, but delivers the response through `callback` instead of
+ // an output tensor. Returns once generation has finished or was stopped.
+ __attribute__((visibility("default"))) wasi_nn_error
+ run_inference_stream(void *ctx, graph_execution_context exec_ctx, uint32_t index,
+		   tensor *input_tensor, const char *runtime_config, uint32_t config_len,
+		   wasi_nn_stream_callback callback, void *user_data);
+
+// Parses a run_inference runtime config once and returns a handle (never 0)
+// for it. Requests made with the handle skip JSON parsing and reuse the slot
+// parameters and sampler cache key prepared for it. Invalid JSON gives
+// invalid_argument. Handles stay valid across model switches until released.
+__attribute__((visibility("default"))) wasi_nn_error
+register_runtime_config(void *ctx, const char *runtime_config, uint32_t config_len,
+		   uint32_t *config_handle);
+
+__attribute__((visibility("default"))) wasi_nn_error
+release_runtime_config(void *ctx, uint32_t config_handle);
+
+// run_inference and run_inference_stream with a registered runtime config
+// instead of a JSON string; an unknown handle gives invalid_argument.
+__attribute__((visibility("default"))) wasi_nn_error
+run_inference_with_config_handle(void *ctx, graph_execution_context exec_ctx, uint32_t index,
+		   tensor *input_tensor, tensor_data output_tensor, uint32_t *output_tensor_size,
+		   uint32_t config_handle);
+
+__attribute__((visibility("default"))) wasi_nn_error
+run_inference_stream_with_config_handle(void *ctx, graph_execution_context exec_ctx, uint32_t index,
+		   tensor *input_tensor, uint32_t config_handle,
+		   wasi_nn_stream_callback callback, void *user_data);
+
+ // Runs n_inputs independent single-turn prompts together and writes response i
+ // to output_tensors[i]. The prompts do not touch the session history; they are
+ // decoded side by side in shared batches. output_tensor_sizes[i] holds the
+ // buffer capacity on entry and the full response size (with NUL) on return;
+ // responses that do not fit are left empty and the call returns too_large.
+ __attribute__((visibility("default"))) wasi_nn_error
+ run_inference_batch(void *ctx, graph_execution_context exec_ctx,
+		  tensor *input_tensors, uint32_t n_inputs,
+		  tensor_data *output_tensors, uint32_t *output_tensor_sizes,
+		  const char *runtime_config, uint32_t config_len);
+
+ // Embeds n_inputs texts together and writes input i's embedding to
+ // output_tensors[i] as fp32: one L2-normalized vector of the model's n_embd
+ // values, or one per token if the model was loaded with pooling "none".
+ // Sizes are in bytes and work as for run_inference_batch. Each input must fit
+ // in one micro-batch (n_ubatch tokens) unless pooling is "last".
+ __attribute__((visibility("default"))) wasi_nn_error
+ compute_embeddings(void *ctx, graph_execution_context exec_ctx,
+		  tensor *input_tensors, uint32_t n_inputs,
+		  tensor_data *output_tensors, uint32_t *output_tensor_sizes);
+
+ // Scores n_documents texts against query_tensor with a reranking model
+ // (pooling "rank") and writes one fp32 score per document, in order, to
+ // output_tensor. *output_tensor_size is in bytes, as for compute_embeddings.
+ // Models without rank pooling give unsupported_operation.
+ __attribute__((visibility("default"))) wasi_nn_error
+ rerank(void *ctx, graph_execution_context exec_ctx, tensor *query_tensor,
+		  tensor *document_tensors, uint32_t n_documents,
+		  tensor_data output_tensor, uint32_t *output_tensor_size);
+
+ // Loads a LoRA adapter for the current model and returns its id. `scale` is
+ // the default for requests whose runtime config has no "lora" list; pass 0 to
+ // apply the adapter only where a request selects it. Ids stay valid until the
+ // adapter is unloaded or another model is installed.
+ __attribute__((visibility("default"))) wasi_nn_error
+ load_lora_adapter(void *ctx, const char *path, uint32_t path_len, float scale,
+		  uint32_t *adapter_id);
+
+ // Detaches the adapter without waiting; requests already running with it keep
+ // it until they finish, then it is freed. Other ids are unchanged.
+ __attribute__((visibility("default"))) wasi_nn_error
+ unload_lora_adapter(void *ctx, uint32_t adapter_id);
+
+// Output formats of get_backend_metrics().
+typedef enum {
+	WASI_NN_METRICS_JSON = 0,
+	WASI_NN_METRICS_PROMETHEUS = 1,
+} wasi_nn_metrics_format;
+
+// Writes a snapshot of throughput, latency, queue and cache counters as JSON
+// or Prometheus text. `*metrics_size` always receives the size including NUL;
+// when `buffer` is NULL or too small nothing is written and too_large is returned.
+__attribute__((visibility("default"))) wasi_nn_error
+get_backend_metrics(void *ctx, wasi_nn_metrics_format format, char *buffer,
+		    uint32_t buffer_size, uint32_t *metrics_size);
+
+// Starts or stops span recording (see "logging.trace"). Starting drops the
+// spans of the previous run.
+__attribute__((visibility("default"))) wasi_nn_error
+set_tracing(void *ctx, bool enabled);
+
+// Writes the recorded spans as Chrome trace JSON. `exec_ctx` 0 selects every
+// span, otherwise the session's own spans plus the batch-wide ones that ran
+// during its requests. Returns too_large, with `*trace_size` set to the size
+// including NUL, when `buffer` is too small.
+__attribute__((visibility("default"))) wasi_nn_error
+get_trace(void *ctx, graph_execution_context exec_ctx, char *buffer,
+	  uint32_t buffer_size, uint32_t *trace_size);
+
  // Additional API functions
  __attribute__((visibility("default"))) wasi_nn_error
  init_backend_with_config(void **ctx, const char *config, uint32_t config_len);
 
+ // Sets *ready once a model is loaded and, with "preload" in the backend
+ // config, warmed up. Loads and new execution contexts wait for the preload
+ // anyway; this lets a host report readiness without blocking. Returns the
+ // preload's error if it failed.
+ __attribute__((visibility("default"))) wasi_nn_error
+ poll_backend_ready(void *ctx, bool *ready);
+
  __attribute__((visibility("default"))) wasi_nn_error
  load_by_name(void *ctx, const char *filename, uint32_t filename_len, graph *g);
 
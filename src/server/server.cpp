@@ -1,5 +1,6 @@
 #include "chat.h"
 #include "utils.hpp"
+#include "../utils/tracer.h"
 
 #include "arg.h"
 #include "common.h"
@@ -124,6 +125,16 @@ struct slot_params
 
     struct common_params_sampling sampling;
     struct common_params_speculative speculative;
+    int32_t lookup_ngram = 0; // max n-gram for prompt lookup drafting when there is no draft model, 0 = disabled
+
+    // sampling_key() and its hash computed ahead of time for a registered
+    // runtime config; empty = acquire_sampler() computes them
+    std::string sampling_key_prepared;
+    size_t sampling_hash_prepared = 0;
+
+    // scheduling priority, 0 = low .. 3 = urgent; update_slots() lets a slot
+    // sit out steps while one with a higher priority is running
+    int32_t priority = 1;
 
     // OAI-compat fields
     bool verbose = false;
@@ -200,11 +211,47 @@ struct slot_params
             {"speculative.n_max", speculative.n_max},
             {"speculative.n_min", speculative.n_min},
             {"speculative.p_min", speculative.p_min},
+            {"lookup_ngram", lookup_ngram},
             {"timings_per_token", timings_per_token},
             {"post_sampling_probs", post_sampling_probs},
             {"lora", lora},
         };
     }
+
+    // Everything common_sampler_init() reads; equal keys build identical samplers
+    std::string sampling_key() const
+    {
+        std::vector<int> samplers;
+        samplers.reserve(sampling.samplers.size());
+        for (const auto &sampler : sampling.samplers)
+        {
+            samplers.push_back((int)sampler);
+        }
+
+        auto grammar_triggers = json::array();
+        for (const auto &trigger : sampling.grammar_triggers)
+        {
+            grammar_triggers.push_back({(int)trigger.type, trigger.value, trigger.token});
+        }
+
+        auto logit_bias = json::array();
+        for (const auto &bias : sampling.logit_bias)
+        {
+            logit_bias.push_back({bias.token, bias.bias});
+        }
+
+        return json{
+            sampling.seed, sampling.n_prev, sampling.n_probs, sampling.min_keep,
+            sampling.top_k, sampling.top_p, sampling.min_p, sampling.xtc_probability,
+            sampling.xtc_threshold, sampling.typ_p, sampling.temp, sampling.dynatemp_range,
+            sampling.dynatemp_exponent, sampling.penalty_last_n, sampling.penalty_repeat,
+            sampling.penalty_freq, sampling.penalty_present, sampling.dry_multiplier,
+            sampling.dry_base, sampling.dry_allowed_length, sampling.dry_penalty_last_n,
+            sampling.mirostat, sampling.top_n_sigma, sampling.mirostat_tau, sampling.mirostat_eta,
+            sampling.ignore_eos, sampling.no_perf, sampling.dry_sequence_breakers, samplers,
+            sampling.grammar, sampling.grammar_lazy, grammar_triggers, logit_bias,
+        }.dump();
+    }
 };
 
 struct server_task
@@ -630,6 +677,7 @@ struct result_timings
         {
             base["draft_n"] = draft_n;
             base["draft_n_accepted"] = draft_n_accepted;
+            base["draft_acceptance_rate"] = (double)draft_n_accepted / draft_n;
         }
 
         return base;
@@ -1394,6 +1442,10 @@ struct server_slot
     int id;
     int id_task = -1;
 
+    // skipped this step for a higher-priority slot, and for how many steps in a row
+    bool preempted = false;
+    int32_t n_preempted = 0;
+
     // only used for completion/embedding/infill/rerank
     server_task_type task_type = SERVER_TASK_TYPE_COMPLETION;
 
@@ -1447,11 +1499,13 @@ struct server_slot
     stop_type stop;
 
     std::string stopping_word;
+    stop_string_matcher stop_matcher; // built from params.antiprompt at launch
 
     // sampling
     json json_schema;
 
     struct common_sampler *smpl = nullptr;
+    std::string smpl_key; // slot_params::sampling_key() smpl was built from
 
     llama_token sampled;
 
@@ -1484,6 +1538,7 @@ struct server_slot
         truncated = false;
         stop = STOP_TYPE_NONE;
         stopping_word = "";
+        stop_matcher.reset();
         n_past = 0;
         n_sent_text = 0;
         task_type = SERVER_TASK_TYPE_COMPLETION;
@@ -1551,7 +1606,7 @@ struct server_slot
 
     bool can_speculate() const
     {
-        return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
+        return (ctx_dft || params.lookup_ngram > 0) && params.speculative.n_max > 0 && params.cache_prompt;
     }
 
     void add_token(const completion_token_output &token)
@@ -1617,42 +1672,6 @@ struct server_slot
         return chat_msg;
     }
 
-    size_t find_stopping_strings(const std::string &text, const size_t last_token_size, bool is_full_stop)
-    {
-        size_t stop_pos = std::string::npos;
-
-        for (const std::string &word : params.antiprompt)
-        {
-            size_t pos;
-
-            if (is_full_stop)
-            {
-                const size_t tmp = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-
-                pos = text.find(word, from_pos);
-            }
-            else
-            {
-                // otherwise, partial stop
-                pos = string_find_partial_stop(text, word);
-            }
-
-            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos))
-            {
-                if (is_full_stop)
-                {
-                    stop = STOP_TYPE_WORD;
-                    stopping_word = word;
-                    has_next_token = false;
-                }
-                stop_pos = pos;
-            }
-        }
-
-        return stop_pos;
-    }
-
     void print_timings() const
     {
         const double t_prompt = t_prompt_processing / n_prompt_tokens_processed;
@@ -1765,7 +1784,7 @@ struct server_metrics
 struct server_queue
 {
     int id = 0;
-    bool running;
+    bool running = true; // the owner resets this before restarting start_loop() after terminate()
 
     // queues
     std::deque<server_task> queue_tasks;
@@ -1889,8 +1908,6 @@ struct server_queue
      */
     void start_loop()
     {
-        running = true;
-
         while (true)
         {
             QUE_DBG("%s", "processing new tasks\n");
@@ -2144,11 +2161,33 @@ struct server_context
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
+    // Most consecutive steps a slot waits for higher-priority slots, 0 = never
+    int32_t preempt_max_steps = 32;
+
+    // Tokens per decode step while slots are generating, so long prompts are
+    // prefilled in chunks between their tokens; 0 = n_ubatch, -1 = n_batch
+    int32_t step_token_budget = 0;
+
+    // Idle samplers from finished tasks, most recently used first. Building a
+    // sampler parses and compiles its grammar; a cached one is only reset.
+    struct cached_sampler
+    {
+        size_t hash;
+        std::string key;
+        common_sampler *smpl;
+    };
+    std::deque<cached_sampler> sampler_cache;
+    size_t sampler_cache_size = 8;
+    uint64_t n_sampler_cache_hits = 0;
+    uint64_t n_sampler_cache_misses = 0;
+
     common_chat_templates_ptr chat_templates;
     oaicompat_parser_options oai_parser_opt;
 
     ~server_context()
     {
+        clear_sampler_cache();
+
         // Clear any sampling context
         for (server_slot &slot : slots)
         {
@@ -2171,9 +2210,16 @@ struct server_context
     {
         SRV_INF("loading model '%s'\n", params.model.path.c_str());
 
+        return load_model(params, common_init_from_params(params));
+    }
+
+    // Finish loading from a model and context created (and warmed up) beforehand
+    // with common_init_from_params(params), e.g. while another model was serving
+    bool load_model(const common_params &params, common_init_result &&preloaded)
+    {
         params_base = params;
 
-        llama_init = common_init_from_params(params_base);
+        llama_init = std::move(preloaded);
 
         model = llama_init.model.get();
         ctx = llama_init.context.get();
@@ -2420,6 +2466,79 @@ struct server_context
         return ret;
     }
 
+    // Return the slot's sampler to the cache for a later task with the same settings
+    void release_sampler(server_slot &slot)
+    {
+        if (slot.smpl == nullptr)
+        {
+            return;
+        }
+
+        if (sampler_cache_size == 0)
+        {
+            common_sampler_free(slot.smpl);
+        }
+        else
+        {
+            sampler_cache.push_front({std::hash<std::string>{}(slot.smpl_key), std::move(slot.smpl_key), slot.smpl});
+            while (sampler_cache.size() > sampler_cache_size)
+            {
+                common_sampler_free(sampler_cache.back().smpl);
+                sampler_cache.pop_back();
+            }
+        }
+        slot.smpl = nullptr;
+        slot.smpl_key.clear();
+    }
+
+    // Take a cached sampler matching the slot's sampling params, or build one
+    common_sampler *acquire_sampler(server_slot &slot)
+    {
+        std::string key;
+        size_t hash;
+        if (!slot.params.sampling_key_prepared.empty())
+        {
+            key = std::move(slot.params.sampling_key_prepared);
+            hash = slot.params.sampling_hash_prepared;
+        }
+        else
+        {
+            key = slot.params.sampling_key();
+            hash = std::hash<std::string>{}(key);
+        }
+
+        for (auto it = sampler_cache.begin(); it != sampler_cache.end(); ++it)
+        {
+            if (it->hash == hash && it->key == key)
+            {
+                common_sampler *smpl = it->smpl;
+                sampler_cache.erase(it);
+                common_sampler_reset(smpl);
+                n_sampler_cache_hits++;
+                slot.smpl_key = std::move(key);
+                return smpl;
+            }
+        }
+
+        common_sampler *smpl = common_sampler_init(model, slot.params.sampling);
+        n_sampler_cache_misses++;
+        if (smpl != nullptr)
+        {
+            slot.smpl_key = std::move(key);
+        }
+        return smpl;
+    }
+
+    // Samplers reference the model vocab; drop them before the model goes away
+    void clear_sampler_cache()
+    {
+        for (auto &entry : sampler_cache)
+        {
+            common_sampler_free(entry.smpl);
+        }
+        sampler_cache.clear();
+    }
+
     bool launch_slot_with_task(server_slot &slot, server_task &&task)
     {
         slot.reset();
@@ -2428,6 +2547,7 @@ struct server_context
         slot.task_type = task.type;
         slot.params = std::move(task.params);
         slot.prompt_tokens = std::move(task.prompt_tokens);
+        slot.stop_matcher.build(slot.params.antiprompt);
 
         if (!are_lora_equal(slot.params.lora, slot.lora))
         {
@@ -2450,13 +2570,18 @@ struct server_context
             slot.params.n_predict = slot.n_predict;
         }
 
+        // room for the expected output (~4 bytes per token), so appending each
+        // token rarely reallocates; send_final_response() moves the text out
         {
-            if (slot.smpl != nullptr)
-            {
-                common_sampler_free(slot.smpl);
-            }
+            const int n_expected = slot.params.n_predict > 0 ? slot.params.n_predict : 1024;
+            slot.generated_text.reserve(std::min<size_t>((size_t)n_expected * 4, 64 * 1024));
+        }
 
-            slot.smpl = common_sampler_init(model, slot.params.sampling);
+        {
+            release_sampler(slot);
+
+            WASI_NN_TRACE_SCOPE("acquire_sampler", slot.id_task);
+            slot.smpl = acquire_sampler(slot);
             if (slot.smpl == nullptr)
             {
                 // for now, the only error that may happen here is invalid grammar
@@ -2465,7 +2590,7 @@ struct server_context
             }
         }
 
-        if (slot.ctx_dft)
+        if (slot.can_speculate())
         {
             llama_batch_free(slot.batch_spec);
 
@@ -2490,6 +2615,8 @@ struct server_context
 
     bool process_token(completion_token_output &result, server_slot &slot)
     {
+        WASI_NN_TRACE_SCOPE("process_token", slot.id_task);
+
         // remember which tokens were sampled - used for repetition penalties during sampling
         const std::string token_str = result.text_to_send;
         slot.sampled = result.tok;
@@ -2501,6 +2628,9 @@ struct server_context
         }
         slot.has_next_token = true;
 
+        // only the new piece is scanned; the matcher carries state across tokens
+        slot.stop_matcher.feed(token_str);
+
         // check if there is incomplete UTF-8 character at the end
         bool incomplete = validate_utf8(slot.generated_text) < slot.generated_text.size();
 
@@ -2508,22 +2638,25 @@ struct server_context
         if (!incomplete)
         {
             size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
-
-            const std::string str_test = slot.generated_text.substr(pos);
             bool send_text = true;
 
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), true);
-            if (stop_pos != std::string::npos)
+            if (slot.stop_matcher.matched())
             {
+                slot.stop = STOP_TYPE_WORD;
+                slot.stopping_word = slot.stop_matcher.matched_word();
+                slot.has_next_token = false;
+
+                // text already sent cannot be taken back
+                const size_t stop_pos = std::max(slot.stop_matcher.match_begin(), pos);
                 slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
+                    slot.generated_text.begin() + stop_pos,
                     slot.generated_text.end());
                 pos = std::min(slot.n_sent_text, slot.generated_text.size());
             }
             else if (slot.has_next_token)
             {
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), false);
-                send_text = stop_pos == std::string::npos;
+                // hold the text back while its tail may still become a stop string
+                send_text = slot.stop_matcher.partial_length() == 0;
             }
 
             // check if there is any token to predict
@@ -2790,7 +2923,6 @@ struct server_context
         res->id_slot = slot.id;
 
         res->index = slot.index;
-        res->content = slot.generated_text;
         res->tokens = std::move(slot.generated_tokens);
         res->timings = slot.get_timings();
         res->prompt = slot.prompt_tokens.detokenize(ctx, true);
@@ -2811,6 +2943,7 @@ struct server_context
         res->oaicompat_model = slot.params.oaicompat_model;
         res->oaicompat_cmpl_id = slot.params.oaicompat_cmpl_id;
         res->oaicompat_msg = slot.update_chat_msg(res->oaicompat_msg_diffs);
+        res->content = std::move(slot.generated_text); // the slot is done with it
 
         // populate res.probs_output
         if (slot.params.sampling.n_probs > 0)
@@ -3279,6 +3412,8 @@ struct server_context
 
     void update_slots()
     {
+        WASI_NN_TRACE_SCOPE("update_slots");
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -3356,6 +3491,26 @@ struct server_context
             }
         }
 
+        // lower-priority slots sit out while a higher-priority slot runs,
+        // for at most preempt_max_steps steps in a row so they keep progressing
+        {
+            int32_t priority_max = -1;
+            for (const auto &slot : slots)
+            {
+                if (slot.is_processing())
+                {
+                    priority_max = std::max(priority_max, slot.params.priority);
+                }
+            }
+
+            for (auto &slot : slots)
+            {
+                slot.preempted = preempt_max_steps > 0 && slot.is_processing() &&
+                                 slot.params.priority < priority_max && slot.n_preempted < preempt_max_steps;
+                slot.n_preempted = slot.preempted ? slot.n_preempted + 1 : 0;
+            }
+        }
+
         // start populating the batch for this iteration
         common_batch_clear(batch);
 
@@ -3370,7 +3525,7 @@ struct server_context
         // frist, add sampled tokens from any ongoing sequences
         for (auto &slot : slots)
         {
-            if (slot.state != SLOT_STATE_GENERATING)
+            if (slot.state != SLOT_STATE_GENERATING || slot.preempted)
             {
                 continue;
             }
@@ -3400,11 +3555,25 @@ struct server_context
         int32_t n_batch = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
+        // with tokens being generated, prompts only get what is left of the
+        // step budget, and always at least one token so they keep progressing
+        int32_t n_step_max = n_batch;
+        if (batch.n_tokens > 0 && step_token_budget >= 0)
+        {
+            const int32_t budget = step_token_budget > 0 ? step_token_budget : n_ubatch;
+            n_step_max = std::min(n_batch, std::max(budget, batch.n_tokens + 1));
+        }
+
         // next, batch any pending prompts without exceeding n_batch
         if (params_base.cont_batching || batch.n_tokens == 0)
         {
             for (auto &slot : slots)
             {
+                if (slot.preempted)
+                {
+                    continue;
+                }
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing())
                 {
@@ -3624,6 +3793,11 @@ struct server_context
                         slot.n_prompt_tokens_processed = 0;
                     }
 
+                    // a prompt that cannot be split goes in whole, so it is exempt
+                    // from the step budget and only bounded by n_batch; capping it
+                    // would cut it or starve it while other slots generate
+                    const int32_t n_slot_max = slot.can_split() ? n_step_max : n_batch;
+
                     if (!slot.can_split())
                     {
                         // cannot fit the prompt in the current batch - will try next iter
@@ -3649,7 +3823,7 @@ struct server_context
                     slot.cache_tokens.keep_first(slot.n_past);
 
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch)
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_slot_max)
                     {
                         // get next token to process
                         llama_token cur_tok = slot.prompt_tokens[slot.n_past];
@@ -3695,7 +3869,7 @@ struct server_context
                     }
                 }
 
-                if (batch.n_tokens >= n_batch)
+                if (batch.n_tokens >= n_step_max)
                 {
                     break;
                 }
@@ -3735,7 +3909,12 @@ struct server_context
                 batch.logits + i,
             };
 
-            const int ret = llama_decode(ctx, batch_view);
+            int ret;
+            {
+                wasi_nn_trace_span span("llama_decode");
+                span.set_value(n_tokens);
+                ret = llama_decode(ctx, batch_view);
+            }
 
             metrics.on_decoded(slots);
 
@@ -3824,12 +4003,15 @@ struct server_context
 
                 const int tok_idx = slot.i_batch - i;
 
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+                llama_token id;
+                {
+                    WASI_NN_TRACE_SCOPE("sample", slot.id_task);
+                    id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+                    common_sampler_accept(slot.smpl, id, true);
+                }
 
                 slot.i_batch = -1;
 
-                common_sampler_accept(slot.smpl, id, true);
-
                 slot.n_decoded += 1;
 
                 const int64_t t_current = ggml_time_us();
@@ -3867,7 +4049,7 @@ struct server_context
             // do speculative decoding
             for (auto &slot : slots)
             {
-                if (!slot.is_processing() || !slot.can_speculate())
+                if (!slot.is_processing() || !slot.can_speculate() || slot.preempted)
                 {
                     continue;
                 }
@@ -3900,13 +4082,28 @@ struct server_context
 
                 llama_token id = slot.sampled;
 
-                struct common_speculative_params params_spec;
-                params_spec.n_draft = n_draft_max;
-                params_spec.n_reuse = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
-                params_spec.p_min = slot.params.speculative.p_min;
-
                 const llama_tokens &cached_text_tokens = slot.cache_tokens.get_text_tokens();
-                llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, cached_text_tokens, id);
+                llama_tokens draft;
+
+                if (slot.ctx_dft)
+                {
+                    struct common_speculative_params params_spec;
+                    params_spec.n_draft = n_draft_max;
+                    params_spec.n_reuse = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
+                    params_spec.p_min = slot.params.speculative.p_min;
+
+                    WASI_NN_TRACE_SCOPE("draft", slot.id_task);
+                    draft = common_speculative_gen_draft(slot.spec, params_spec, cached_text_tokens, id);
+                }
+                else
+                {
+                    // no draft model: copy the continuation of a repeated n-gram from the context
+                    draft = prompt_lookup_draft(cached_text_tokens, id, slot.params.lookup_ngram, n_draft_max);
+                    if (draft.empty())
+                    {
+                        continue; // no match, `id` is decoded by the regular batch
+                    }
+                }
 
                 // ignore small drafts
                 if (slot.params.speculative.n_min > (int)draft.size())
@@ -3930,10 +4127,15 @@ struct server_context
 
                 SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
 
-                llama_decode(ctx, slot.batch_spec);
+                std::vector<llama_token> ids;
+                {
+                    wasi_nn_trace_span span("verify_draft", slot.id_task);
+                    span.set_value(slot.batch_spec.n_tokens);
+                    llama_decode(ctx, slot.batch_spec);
 
-                // the accepted tokens from the speculation
-                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+                    // the accepted tokens from the speculation
+                    ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+                }
 
                 slot.n_past += ids.size();
                 slot.n_decoded += ids.size();
@@ -321,6 +321,215 @@ static size_t validate_utf8(const std::string &text)
     return len;
 }
 
+// streaming multi-pattern stop string matcher (Aho-Corasick over bytes)
+// text is fed piece by piece as it is generated; every byte costs amortized O(1)
+// whatever the number of stop strings, and the automaton state is the length of
+// the longest suffix that may still become a stop string (partial-match holdback)
+struct stop_string_matcher
+{
+    struct node
+    {
+        std::vector<std::pair<unsigned char, int>> next;
+        int fail = 0;
+        int depth = 0;
+        int word = -1; // longest stop string ending at this node or along its fail chain
+    };
+
+    std::vector<std::string> words;
+    std::vector<node> nodes;
+    int state = 0;
+    size_t n_fed = 0;                       // bytes consumed since reset()
+    size_t match_end = std::string::npos;   // end offset of the earliest-starting stop string found
+    int match_word = -1;
+
+    // rebuild the automaton only when the stop strings change
+    void build(const std::vector<std::string> &stop_words)
+    {
+        if (stop_words != words || nodes.empty())
+        {
+            words = stop_words;
+            nodes.assign(1, node());
+            for (size_t i = 0; i < words.size(); ++i)
+            {
+                if (words[i].empty())
+                {
+                    continue;
+                }
+                int cur = 0;
+                for (unsigned char c : words[i])
+                {
+                    int child = find_child(cur, c);
+                    if (child < 0)
+                    {
+                        child = (int)nodes.size();
+                        nodes.emplace_back();
+                        nodes[child].depth = nodes[cur].depth + 1;
+                        nodes[cur].next.emplace_back(c, child);
+                    }
+                    cur = child;
+                }
+                if (nodes[cur].word < 0)
+                {
+                    nodes[cur].word = (int)i;
+                }
+            }
+
+            // breadth-first, so every fail target is complete before its users
+            std::vector<int> order(1, 0);
+            for (size_t head = 0; head < order.size(); ++head)
+            {
+                const int u = order[head];
+                for (const auto &edge : nodes[u].next)
+                {
+                    const int v = edge.second;
+                    nodes[v].fail = u == 0 ? 0 : step(nodes[u].fail, edge.first);
+                    if (nodes[v].word < 0)
+                    {
+                        nodes[v].word = nodes[nodes[v].fail].word;
+                    }
+                    order.push_back(v);
+                }
+            }
+        }
+        reset();
+    }
+
+    void reset()
+    {
+        state = 0;
+        n_fed = 0;
+        match_end = std::string::npos;
+        match_word = -1;
+    }
+
+    bool empty() const
+    {
+        return nodes.size() <= 1;
+    }
+
+    // consume the next piece of generated text. Of the stop strings ending in
+    // this piece the one that starts earliest wins, as when the whole text is
+    // searched for each stop string; bytes after a match are ignored
+    void feed(const std::string &piece)
+    {
+        if (empty() || matched())
+        {
+            n_fed += piece.size();
+            return;
+        }
+        const size_t start = n_fed;
+        n_fed += piece.size();
+        size_t best_begin = std::string::npos;
+        for (size_t i = 0; i < piece.size(); ++i)
+        {
+            const size_t end = start + i + 1;
+            state = step(state, (unsigned char)piece[i]);
+            // the longest stop string ending here starts earliest
+            const int word = nodes[state].word;
+            if (word >= 0 && end - words[word].size() < best_begin)
+            {
+                best_begin = end - words[word].size();
+                match_word = word;
+                match_end = end;
+            }
+            // no later match can start before the current partial match
+            if (matched() && end - nodes[state].depth >= best_begin)
+            {
+                return;
+            }
+        }
+    }
+
+    bool matched() const
+    {
+        return match_word >= 0;
+    }
+
+    // offset of the matched stop string in the fed text
+    size_t match_begin() const
+    {
+        return match_end - words[match_word].size();
+    }
+
+    const std::string &matched_word() const
+    {
+        return words[match_word];
+    }
+
+    // trailing bytes that are a prefix of some stop string
+    size_t partial_length() const
+    {
+        return matched() ? 0 : (size_t)nodes[state].depth;
+    }
+
+private:
+    int find_child(int u, unsigned char c) const
+    {
+        for (const auto &edge : nodes[u].next)
+        {
+            if (edge.first == c)
+            {
+                return edge.second;
+            }
+        }
+        return -1;
+    }
+
+    int step(int u, unsigned char c) const
+    {
+        while (true)
+        {
+            const int child = find_child(u, c);
+            if (child >= 0)
+            {
+                return child;
+            }
+            if (u == 0)
+            {
+                return 0;
+            }
+            u = nodes[u].fail;
+        }
+    }
+};
+
+// prompt lookup decoding: find the most recent earlier occurrence of the trailing
+// n-gram of `tokens` + `last` (trying n = n_max down to 1) and propose the tokens
+// that followed it as the draft; returns an empty draft if nothing matches
+static llama_tokens prompt_lookup_draft(const llama_tokens &tokens, llama_token last, int n_max, int n_draft)
+{
+    llama_tokens draft;
+    if (n_max <= 0 || n_draft <= 0)
+        return draft;
+
+    // the searched sequence is `tokens` + `last`; the context is not copied, so
+    // the key is the last n - 1 context tokens followed by `last`
+    const int n_tokens = (int)tokens.size();
+
+    for (int n = std::min(n_max, n_tokens); n >= 1; --n)
+    {
+        const llama_token *key = tokens.data() + n_tokens - (n - 1);
+
+        // the match must end before the key itself, so it lies within `tokens`
+        for (int i = n_tokens - n; i >= 0; --i)
+        {
+            if (tokens[i + n - 1] != last || !std::equal(key, key + n - 1, tokens.data() + i))
+                continue;
+
+            const int start = i + n;
+            const int end = std::min(start + n_draft, n_tokens + 1);
+            draft.assign(tokens.begin() + start, tokens.begin() + std::min(end, n_tokens));
+            if (end > n_tokens)
+            {
+                draft.push_back(last);
+            }
+            return draft;
+        }
+    }
+
+    return draft;
+}
+
 //
 // template utils
 //
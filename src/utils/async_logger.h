@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2019 Intel Corporation.  All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+ */
+
+#ifndef WASI_NN_ASYNC_LOGGER_H
+#define WASI_NN_ASYNC_LOGGER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/* Runtime levels, ordered like NN_LOG_LEVEL */
+enum {
+    NN_LEVEL_DEBUG = 0,
+    NN_LEVEL_INFO = 1,
+    NN_LEVEL_WARN = 2,
+    NN_LEVEL_ERROR = 3,
+    NN_LEVEL_NONE = 4,
+};
+
+/*
+ * Process-wide logger behind the NN_*_PRINTF and WASI_NN_LOG_* macros.
+ * Callers format into a cell of a bounded lock-free ring (Vyukov's
+ * sequence-numbered MPMC queue); one writer thread drains it to stdout and the
+ * optional log file, so a logging call costs one vsnprintf and never a
+ * syscall. The macros test the level first, so filtered messages do not
+ * evaluate or format their arguments. When the ring is full, errors are
+ * written synchronously and other messages are dropped and counted.
+ */
+class wasi_nn_async_logger
+{
+  public:
+    static constexpr size_t n_cells = 2048; /* power of two */
+    static constexpr size_t line_max = 384;
+
+    static wasi_nn_async_logger &instance()
+    {
+        static wasi_nn_async_logger logger;
+        return logger;
+    }
+
+    bool enabled(int level) const
+    {
+        return level >= min_level.load(std::memory_order_relaxed);
+    }
+
+    // `by` identifies the backend context applying its settings
+    void configure(int level, bool with_timestamps, bool with_colors, const std::string &path,
+                   const void *by = nullptr)
+    {
+        flush();
+        std::lock_guard<std::mutex> lock(output_mutex);
+        configured_by = by;
+        min_level.store(level, std::memory_order_relaxed);
+        timestamps = with_timestamps;
+        colors = with_colors;
+        if (path != file_path) {
+            if (file) {
+                fclose(file);
+                file = nullptr;
+            }
+            file_path = path;
+            if (!file_path.empty()) {
+                file = fopen(file_path.c_str(), "a");
+                if (!file) {
+                    fprintf(stdout, "[%s ERROR] Cannot open log file %s\n", __FILE__, file_path.c_str());
+                }
+            }
+        }
+    }
+
+    // Restore the defaults of an unconfigured process and close the log file,
+    // unless a context other than `by` applied the current settings
+    void unconfigure(const void *by)
+    {
+        {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            if (by != configured_by) {
+                return;
+            }
+        }
+        configure(NN_LOG_LEVEL, false, false, std::string());
+    }
+
+#if defined(__GNUC__)
+    __attribute__((format(printf, 5, 6)))
+#endif
+    void write(int level, const char *src_file, int line, const char *fmt, ...)
+    {
+        va_list args;
+        va_start(args, fmt);
+        cell *c = claim();
+        if (c) {
+            format(c->text, level, src_file, line, fmt, args);
+            c->level = level;
+            c->t_us = now_us();
+            publish(c);
+        }
+        else if (level >= NN_LEVEL_ERROR) {
+            char text[line_max];
+            format(text, level, src_file, line, fmt, args);
+            std::lock_guard<std::mutex> lock(output_mutex);
+            emit(level, now_us(), text);
+            fflush(stdout);
+        }
+        else {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        va_end(args);
+    }
+
+    // Wait until every message queued before the call has been written
+    void flush()
+    {
+        const size_t target = head.load(std::memory_order_acquire);
+        while (written.load(std::memory_order_acquire) < target
+               && running.load(std::memory_order_relaxed)) {
+            wake.notify_one();
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+  private:
+    struct cell {
+        std::atomic<size_t> seq;
+        int level;
+        int64_t t_us;
+        char text[line_max];
+    };
+
+    cell cells[n_cells];
+    std::atomic<size_t> head{ 0 };    /* next cell producers claim */
+    std::atomic<size_t> written{ 0 }; /* cells the writer has emitted */
+    std::atomic<int> min_level{ NN_LOG_LEVEL };
+    std::atomic<uint64_t> dropped{ 0 };
+    std::atomic<bool> writer_idle{ false };
+    std::atomic<bool> running{ true };
+
+    std::mutex output_mutex; /* writer, synchronous fallback and configure() */
+    bool timestamps = false;
+    bool colors = false;
+    std::string file_path;
+    FILE *file = nullptr;
+    const void *configured_by = nullptr;
+
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::thread writer;
+
+    wasi_nn_async_logger()
+    {
+        for (size_t i = 0; i < n_cells; ++i) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        writer = std::thread([this]() { writer_loop(); });
+    }
+
+    ~wasi_nn_async_logger()
+    {
+        running.store(false, std::memory_order_release);
+        wake.notify_one();
+        if (writer.joinable()) {
+            writer.join();
+        }
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    static int64_t now_us()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static void format(char *text, int level, const char *src_file, int line, const char *fmt,
+                       va_list args)
+    {
+        static const char *names[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+        int n = snprintf(text, line_max, "[%s:%d %s] ", src_file, line,
+                         names[level < NN_LEVEL_ERROR ? level : NN_LEVEL_ERROR]);
+        if (n >= 0 && (size_t)n < line_max) {
+            vsnprintf(text + n, line_max - n, fmt, args);
+        }
+    }
+
+    cell *claim()
+    {
+        if (!running.load(std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            cell *c = &cells[pos & (n_cells - 1)];
+            const size_t seq = c->seq.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    return c;
+                }
+            }
+            else if (diff < 0) {
+                return nullptr; /* full */
+            }
+            else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void publish(cell *c)
+    {
+        const size_t pos = c->seq.load(std::memory_order_relaxed);
+        c->seq.store(pos + 1, std::memory_order_release);
+        if (writer_idle.load(std::memory_order_acquire)) {
+            wake.notify_one();
+        }
+    }
+
+    // Caller holds output_mutex
+    void emit(int level, int64_t t_us, const char *text)
+    {
+        char stamp[32] = "";
+        if (timestamps) {
+            const time_t secs = (time_t)(t_us / 1000000);
+            struct tm tm_local;
+            localtime_r(&secs, &tm_local);
+            size_t n = strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm_local);
+            snprintf(stamp + n, sizeof(stamp) - n, ".%03d ", (int)(t_us / 1000 % 1000));
+        }
+        const char *color = "";
+        if (colors) {
+            color = level == NN_LEVEL_DEBUG ? "\033[90m"
+                    : level == NN_LEVEL_WARN ? "\033[33m"
+                    : level >= NN_LEVEL_ERROR ? "\033[31m"
+                                              : "";
+        }
+        fprintf(stdout, "%s%s%s%s\n", stamp, color, text, *color ? "\033[0m" : "");
+        if (file) {
+            fprintf(file, "%s%s\n", stamp, text);
+        }
+    }
+
+    bool ready(size_t pos) const
+    {
+        return cells[pos & (n_cells - 1)].seq.load(std::memory_order_acquire) == pos + 1;
+    }
+
+    void writer_loop()
+    {
+        size_t tail = 0;
+        while (true) {
+            if (ready(tail)) {
+                std::lock_guard<std::mutex> lock(output_mutex);
+                while (ready(tail)) {
+                    cell &c = cells[tail & (n_cells - 1)];
+                    emit(c.level, c.t_us, c.text);
+                    c.seq.store(tail + n_cells, std::memory_order_release);
+                    written.store(++tail, std::memory_order_release);
+                }
+                const uint64_t n_dropped = dropped.exchange(0, std::memory_order_relaxed);
+                if (n_dropped > 0) {
+                    fprintf(stdout, "[%s WARNING] Log ring full, %llu messages dropped\n", __FILE__,
+                            (unsigned long long)n_dropped);
+                }
+                fflush(stdout);
+                if (file) {
+                    fflush(file);
+                }
+                continue;
+            }
+            if (!running.load(std::memory_order_acquire)) {
+                break;
+            }
+
+            // Producers only notify while the writer is idle; the timeout
+            // bounds the delay of a notification that raced with going idle
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            writer_idle.store(true, std::memory_order_release);
+            wake.wait_for(lock, std::chrono::milliseconds(10), [&]() {
+                return ready(tail) || !running.load(std::memory_order_acquire);
+            });
+            writer_idle.store(false, std::memory_order_relaxed);
+        }
+    }
+};
+
+/* Runtime-filtered entry point; arguments are only evaluated when enabled */
+#define WASI_NN_LOG_AT(level, fmt, ...)                                        \
+    do {                                                                       \
+        wasi_nn_async_logger &nn_logger_ = wasi_nn_async_logger::instance();   \
+        if (nn_logger_.enabled(level)) {                                       \
+            nn_logger_.write(level, __FILENAME__, __LINE__, fmt, ##__VA_ARGS__); \
+        }                                                                      \
+    } while (0)
+
+#endif
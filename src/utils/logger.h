@@ -24,44 +24,27 @@
 #define NN_LOG_LEVEL 2
 #endif
 
-// Definition of the levels
+#include "async_logger.h"
+
+// Definition of the levels. Messages below NN_LOG_LEVEL are compiled out; the
+// rest are filtered again by the runtime level and written asynchronously.
 #if NN_LOG_LEVEL <= 3
-#define NN_ERR_PRINTF(fmt, ...)                                              \
-    do {                                                                     \
-        printf("[%s:%d ERROR] " fmt, __FILENAME__, __LINE__, ##__VA_ARGS__); \
-        printf("\n");                                                        \
-        fflush(stdout);                                                      \
-    } while (0)
+#define NN_ERR_PRINTF(fmt, ...) WASI_NN_LOG_AT(NN_LEVEL_ERROR, fmt, ##__VA_ARGS__)
 #else
 #define NN_ERR_PRINTF(fmt, ...)
 #endif
 #if NN_LOG_LEVEL <= 2
-#define NN_WARN_PRINTF(fmt, ...)                                               \
-    do {                                                                       \
-        printf("[%s:%d WARNING] " fmt, __FILENAME__, __LINE__, ##__VA_ARGS__); \
-        printf("\n");                                                          \
-        fflush(stdout);                                                        \
-    } while (0)
+#define NN_WARN_PRINTF(fmt, ...) WASI_NN_LOG_AT(NN_LEVEL_WARN, fmt, ##__VA_ARGS__)
 #else
 #define NN_WARN_PRINTF(fmt, ...)
 #endif
 #if NN_LOG_LEVEL <= 1
-#define NN_INFO_PRINTF(fmt, ...)                                            \
-    do {                                                                    \
-        printf("[%s:%d INFO] " fmt, __FILENAME__, __LINE__, ##__VA_ARGS__); \
-        printf("\n");                                                       \
-        fflush(stdout);                                                     \
-    } while (0)
+#define NN_INFO_PRINTF(fmt, ...) WASI_NN_LOG_AT(NN_LEVEL_INFO, fmt, ##__VA_ARGS__)
 #else
 #define NN_INFO_PRINTF(fmt, ...)
 #endif
 #if NN_LOG_LEVEL <= 0
-#define NN_DBG_PRINTF(fmt, ...)                                              \
-    do {                                                                     \
-        printf("[%s:%d DEBUG] " fmt, __FILENAME__, __LINE__, ##__VA_ARGS__); \
-        printf("\n");                                                        \
-        fflush(stdout);                                                      \
-    } while (0)
+#define NN_DBG_PRINTF(fmt, ...) WASI_NN_LOG_AT(NN_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
 #else
 #define NN_DBG_PRINTF(fmt, ...)
 #endif
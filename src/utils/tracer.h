@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2019 Intel Corporation.  All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+ */
+
+#ifndef WASI_NN_TRACER_H
+#define WASI_NN_TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/* One finished span */
+struct wasi_nn_trace_event {
+    const char *name; /* string literal */
+    int64_t ts_us;    /* start, steady clock */
+    int64_t dur_us;
+    int32_t tid;      /* tracer thread number */
+    int32_t session;  /* exec_ctx of the request, 0 = none */
+    int32_t task;     /* server task id, -1 = none */
+    int64_t value;    /* span-specific count such as tokens, -1 = none */
+};
+
+/*
+ * Process-wide span recorder behind WASI_NN_TRACE_SCOPE. Each thread appends
+ * finished spans to its own ring, so recording takes an uncontended lock and
+ * never allocates; a full ring overwrites its oldest spans. While disabled a
+ * span costs one relaxed load. Rings of exited threads are handed to new ones.
+ */
+class wasi_nn_tracer
+{
+  public:
+    static wasi_nn_tracer &instance()
+    {
+        static wasi_nn_tracer tracer;
+        return tracer;
+    }
+
+    bool enabled() const
+    {
+        return on.load(std::memory_order_relaxed);
+    }
+
+    // Switching tracing on drops the spans of the previous run. `by`
+    // identifies the backend context that switched it
+    void configure(bool enable, size_t events_per_thread, const void *by = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        configured_by = by;
+        if (enable && !enabled()) {
+            capacity = events_per_thread > 0 ? events_per_thread : 1;
+            for (auto &r : rings) {
+                std::lock_guard<std::mutex> ring_lock(r->mutex);
+                r->reset(capacity);
+            }
+        }
+        on.store(enable, std::memory_order_relaxed);
+    }
+
+    // Switch tracing off, unless a context other than `by` switched it last
+    void unconfigure(const void *by)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        if (by == configured_by) {
+            on.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    static int64_t now_us()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    void record(const char *name, int64_t ts_us, int64_t dur_us, int32_t task, int64_t value)
+    {
+        thread_ring &local = local_ring();
+        ring &r = *local.r;
+        const wasi_nn_trace_event event = { name, ts_us, dur_us, local.tid, current_session(), task, value };
+        std::lock_guard<std::mutex> lock(r.mutex);
+        if (r.events.size() < r.capacity) {
+            r.events.push_back(event);
+        }
+        else {
+            r.events[r.next] = event;
+            r.next = (r.next + 1) % r.capacity;
+        }
+    }
+
+    // Copy the spans of every thread
+    void snapshot(std::vector<wasi_nn_trace_event> &out)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (auto &r : rings) {
+            std::lock_guard<std::mutex> ring_lock(r->mutex);
+            out.insert(out.end(), r->events.begin(), r->events.end());
+        }
+    }
+
+    // Session that spans of the calling thread are tagged with
+    static int32_t &current_session()
+    {
+        static thread_local int32_t session = 0;
+        return session;
+    }
+
+  private:
+    struct ring {
+        std::mutex mutex;
+        std::vector<wasi_nn_trace_event> events;
+        size_t capacity = 0;
+        size_t next = 0;     /* oldest event once full */
+        bool in_use = false; /* guarded by registry_mutex */
+
+        void reset(size_t n)
+        {
+            events.clear();
+            events.shrink_to_fit();
+            events.reserve(n);
+            capacity = n;
+            next = 0;
+        }
+    };
+
+    struct thread_ring {
+        ring *r = nullptr;
+        int32_t tid = 0;
+
+        ~thread_ring()
+        {
+            if (r) {
+                instance().release(r);
+            }
+        }
+    };
+
+    std::atomic<bool> on{ false };
+    std::mutex registry_mutex;
+    const void *configured_by = nullptr;
+    std::vector<std::unique_ptr<ring>> rings;
+    size_t capacity = 16384;
+    int32_t n_threads = 0;
+
+    thread_ring &local_ring()
+    {
+        static thread_local thread_ring local;
+        if (!local.r) {
+            acquire(local);
+        }
+        return local;
+    }
+
+    void acquire(thread_ring &local)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (auto &r : rings) {
+            if (!r->in_use) {
+                local.r = r.get();
+                break;
+            }
+        }
+        if (!local.r) {
+            rings.push_back(std::unique_ptr<ring>(new ring()));
+            local.r = rings.back().get();
+            std::lock_guard<std::mutex> ring_lock(local.r->mutex);
+            local.r->reset(capacity);
+        }
+        local.r->in_use = true;
+        local.tid = ++n_threads;
+    }
+
+    void release(ring *r)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        r->in_use = false;
+    }
+};
+
+/* Records the enclosing scope as a span when tracing is on */
+class wasi_nn_trace_span
+{
+  public:
+    explicit wasi_nn_trace_span(const char *name, int32_t task = -1)
+        : name(name), task(task),
+          start(wasi_nn_tracer::instance().enabled() ? wasi_nn_tracer::now_us() : -1)
+    {
+    }
+
+    ~wasi_nn_trace_span()
+    {
+        if (start >= 0) {
+            wasi_nn_tracer::instance().record(name, start, wasi_nn_tracer::now_us() - start, task, value);
+        }
+    }
+
+    void set_task(int32_t id) { task = id; }
+    void set_value(int64_t v) { value = v; }
+
+    wasi_nn_trace_span(const wasi_nn_trace_span &) = delete;
+    wasi_nn_trace_span &operator=(const wasi_nn_trace_span &) = delete;
+
+  private:
+    const char *name;
+    int32_t task;
+    int64_t value = -1;
+    int64_t start;
+};
+
+/* Tags the spans the calling thread records in this scope with a session */
+class wasi_nn_trace_session
+{
+  public:
+    explicit wasi_nn_trace_session(int32_t session)
+        : previous(wasi_nn_tracer::current_session())
+    {
+        wasi_nn_tracer::current_session() = session;
+    }
+
+    ~wasi_nn_trace_session()
+    {
+        wasi_nn_tracer::current_session() = previous;
+    }
+
+  private:
+    int32_t previous;
+};
+
+#define WASI_NN_TRACE_CONCAT_(a, b) a##b
+#define WASI_NN_TRACE_CONCAT(a, b) WASI_NN_TRACE_CONCAT_(a, b)
+#define WASI_NN_TRACE_SCOPE(...) \
+    wasi_nn_trace_span WASI_NN_TRACE_CONCAT(nn_trace_span_, __LINE__)(__VA_ARGS__)
+
+#endif
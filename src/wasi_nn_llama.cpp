@@ -6,11 +6,13 @@
 #include "../include/wasi_nn_llama.h"
 #include "cJSON.h"
 #include "utils/logger.h"
+#include "utils/tracer.h"
 
 // Include llama.cpp headers
 #include "arg.h"
 #include "chat.h"
 #include "common.h"
+#include "gguf.h"
 #include "llama.h"
 #include "log.h"
 #include "sampling.h"
@@ -21,6 +23,13 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <list>
+#include <map>
+#include <optional>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -29,12 +38,21 @@
 #include <deque>
 #include <thread>
 #include <condition_variable>
-
-// Enhanced logging macros that work with both old and new systems
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Enhanced logging macros that work with both old and new systems. Once the
+// backend has configured logging, messages are filtered by the runtime level
+// only; before that, NN_LOG_LEVEL also applies.
 #define WASI_NN_LOG_DEBUG(ctx, fmt, ...) \
   do { \
     if (ctx && ctx->log_initialized) { \
-      LOG_DBG("[WASI-NN] " fmt, ##__VA_ARGS__); \
+      WASI_NN_LOG_AT(NN_LEVEL_DEBUG, "[WASI-NN] " fmt, ##__VA_ARGS__); \
     } else { \
       NN_DBG_PRINTF(fmt, ##__VA_ARGS__); \
     } \
@@ -43,7 +61,7 @@
 #define WASI_NN_LOG_INFO(ctx, fmt, ...) \
   do { \
     if (ctx && ctx->log_initialized) { \
-      LOG_INF("[WASI-NN] " fmt, ##__VA_ARGS__); \
+      WASI_NN_LOG_AT(NN_LEVEL_INFO, "[WASI-NN] " fmt, ##__VA_ARGS__); \
     } else { \
       NN_INFO_PRINTF(fmt, ##__VA_ARGS__); \
     } \
@@ -52,7 +70,7 @@
 #define WASI_NN_LOG_WARN(ctx, fmt, ...) \
   do { \
     if (ctx && ctx->log_initialized) { \
-      LOG_WRN("[WASI-NN] " fmt, ##__VA_ARGS__); \
+      WASI_NN_LOG_AT(NN_LEVEL_WARN, "[WASI-NN] " fmt, ##__VA_ARGS__); \
     } else { \
       NN_WARN_PRINTF(fmt, ##__VA_ARGS__); \
     } \
@@ -61,7 +79,7 @@
 #define WASI_NN_LOG_ERROR(ctx, fmt, ...) \
   do { \
     if (ctx && ctx->log_initialized) { \
-      LOG_ERR("[WASI-NN] " fmt, ##__VA_ARGS__); \
+      WASI_NN_LOG_AT(NN_LEVEL_ERROR, "[WASI-NN] " fmt, ##__VA_ARGS__); \
     } else { \
       NN_ERR_PRINTF(fmt, ##__VA_ARGS__); \
     } \
@@ -124,6 +142,19 @@ struct wasi_nn_runtime_params
   // Grammar (optional)
   std::string grammar;
   bool grammar_set = false;
+
+  // Speculative decoding (draft model or prompt lookup)
+  int32_t speculative_n_max = -1;
+  int32_t speculative_n_min = -1;
+  float speculative_p_min = -1.0f;
+  int32_t lookup_ngram = -1;
+
+  // LoRA adapters (id, scale) for this request; unlisted adapters are off
+  std::vector<std::pair<int32_t, float>> lora;
+  bool lora_set = false;
+
+  // Slot scheduling priority (wasi_nn_task_priority), -1 = normal
+  int32_t priority = -1;
   
   wasi_nn_runtime_params() = default;
 };
@@ -138,7 +169,15 @@ struct wasi_nn_task
   std::chrono::steady_clock::time_point timeout_at;
   uint32_t timeout_ms = 30000; // Default 30 second timeout
   std::string prompt;
+  std::string runtime_config;  // set_input index 1, applied like run_inference's runtime_config
   bool is_queued = false;
+
+  // Scheduling
+  std::string tenant;         // fair-share flow: "tenant" of the runtime config, else the session
+  uint32_t cost_tokens = 1;   // estimated prompt tokens plus generation budget
+  double cost_ms = 0.0;       // expected run time at the measured throughput, 0 = not known yet
+  double finish_tag = 0.0;    // virtual finish time, set by enqueue_task()
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();  // "deadline_ms"
   
   wasi_nn_task() : created_at(std::chrono::steady_clock::now()) 
   {
@@ -149,13 +188,154 @@ struct wasi_nn_task
 // Forward declaration for task queue
 struct wasi_nn_task_queue;
 
+// A loaded model that is not installed in server_ctx. Its weights and context
+// stay in memory so that switching back to it does not read the GGUF again.
+struct resident_model
+{
+  graph id;
+  std::string path;
+  std::string config;   // load config; with path it identifies the model
+  common_params params;
+  common_init_result init;
+  uint64_t size_bytes = 0;    // weights, KV cache and compute buffers
+  std::chrono::steady_clock::time_point last_used;
+
+  // The parked context keeps its KV cache; these restore the slots and
+  // sessions that were using it when the model is installed again
+  std::vector<server_tokens> slot_caches;
+  std::vector<graph_execution_context> seq_owner;
+};
+
+// Memory of the loaded model by component, read from llama/ggml. The fixed
+// parts are measured at model load; KV occupancy is refreshed per request.
+struct memory_accounting
+{
+  uint64_t weights_bytes = 0;
+  uint64_t weights_device_bytes = 0;  // offloaded layers' share of the weights
+  uint64_t kv_bytes = 0;              // allocated KV cache
+  uint64_t kv_device_bytes = 0;
+  uint64_t kv_bytes_per_cell = 0;
+  uint64_t device_bytes = 0;          // weights, KV and compute buffers on the device
+  uint64_t compute_device_bytes = 0;  // compute and output buffers, estimated
+  uint32_t kv_cells_total = 0;
+  uint32_t kv_cells_used = 0;         // summed over sequences; shared prefixes count per sequence
+  std::vector<uint32_t> seq_cells;    // cells used by each slot's sequence
+};
+
+// Latency histogram with fixed bucket bounds in milliseconds. Observing only
+// touches relaxed atomics, so metrics stay on without slowing requests.
+struct latency_histogram
+{
+  static constexpr size_t n_bounds = 12;
+  static constexpr double bounds_ms[n_bounds] = {1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000};
+  std::atomic<uint64_t> buckets[n_bounds + 1] = {};  // last bucket is +Inf
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum_us{0};
+
+  void observe(double ms)
+  {
+    ms = std::max(ms, 0.0);
+    size_t i = 0;
+    while (i < n_bounds && ms > bounds_ms[i])
+    {
+      ++i;
+    }
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum_us.fetch_add((uint64_t)(ms * 1000.0), std::memory_order_relaxed);
+  }
+
+  void add(const latency_histogram &other)
+  {
+    for (size_t i = 0; i <= n_bounds; ++i)
+    {
+      buckets[i].fetch_add(other.buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    count.fetch_add(other.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    sum_us.fetch_add(other.sum_us.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+};
+
+// Counters behind get_backend_metrics(). Requests update them as they finish;
+// the slot scheduler publishes its own state after every update_slots() step.
+struct backend_metrics
+{
+  std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+  std::atomic<uint64_t> requests_total{0};
+  std::atomic<uint64_t> requests_failed{0};
+  std::atomic<uint64_t> prompt_tokens{0};
+  std::atomic<uint64_t> prompt_us{0};
+  std::atomic<uint64_t> predicted_tokens{0};
+  std::atomic<uint64_t> predicted_us{0};
+  latency_histogram ttft;         // task posted -> first generated token
+  latency_histogram inter_token;  // generation time per token, per request
+  latency_histogram queue_wait;   // compute() queued -> picked up by a worker
+
+  // Published by the slot scheduler
+  std::atomic<uint64_t> decode_steps{0};
+  std::atomic<uint64_t> busy_slot_steps{0};
+  std::atomic<uint32_t> slots_total{0};
+  std::atomic<uint32_t> slots_busy{0};
+  std::atomic<uint32_t> kv_cells_total{0};
+  std::atomic<uint32_t> kv_cells_used{0};
+  std::atomic<uint64_t> kv_bytes{0};
+  std::atomic<uint64_t> sampler_cache_hits{0};
+  std::atomic<uint64_t> sampler_cache_misses{0};
+
+  // Cold start: the last model load, and backend init -> first model ready
+  std::atomic<uint64_t> model_load_us{0};
+  std::atomic<uint64_t> cold_start_us{0};
+};
+
+// Prompt prefix whose KV can be copied into another session's sequence
+struct shared_prefix_entry
+{
+  uint64_t hash;        // hash_tokens() of tokens
+  llama_tokens tokens;
+  uint32_t hits = 0;
+  bool pinned = false;  // configured system prompt, never evicted
+};
+
 struct SessionInfo
 {
   std::string session_id;
   std::vector<common_chat_msg> chat_history;
   std::chrono::steady_clock::time_point last_activity;
+  llama_seq_id seq_id = -1; // KV sequence (= slot id) owned by this session, -1 = none
+  int n_running = 0;        // completions of this session currently in the scheduler
+
+  // Formatted prompt of the last turn and its tokens; the next turn only
+  // tokenizes the text appended after it
+  std::string prompt_text;
+  server_tokens prompt_tokens;
+
+  std::string state_path;   // saved KV snapshot to load into seq_id on the next turn, "" = none
+  graph model = 0;          // model (graph handle) this session talks to
+  std::list<graph_execution_context>::iterator lru_pos;  // node in LlamaChatContext::session_lru
+
+  // set_input/compute/get_output pipeline
+  std::string pending_input;     // prompt for the next compute()
+  std::string pending_config;    // runtime config for the next compute()
+  bool compute_pending = false;  // a compute() task is queued or running
+  bool output_ready = false;
+  wasi_nn_error output_status = success;
+  std::string output;
+};
+
+// Runtime config registered with register_runtime_config(). The JSON is
+// parsed once; the slot parameters it gives are rebuilt only when the model
+// or its LoRA adapters change, so requests using the handle just copy them.
+struct registered_runtime_config
+{
+  wasi_nn_runtime_params runtime_params;
+  uint64_t prepared_generation = 0;  // slot_params_generation of prepared, 0 = not built
+  slot_params prepared;              // with sampling_key_prepared filled in
 };
 
+// seq_owner entry of a sequence held by a batch call or the pinned system
+// prompt prefix: no session can be given it or take it over
+static const graph_execution_context SEQ_RESERVED = UINT32_MAX;
+
 struct LlamaChatContext
 {
   // Server context (from server.cpp)
@@ -163,7 +343,28 @@ struct LlamaChatContext
 
   // Session management (updated)
   std::unordered_map<graph_execution_context, SessionInfo> sessions;
+  std::unordered_map<std::string, graph_execution_context> session_index;  // session_id -> exec_ctx
+  std::list<graph_execution_context> session_lru;  // least recently active first
   graph_execution_context next_exec_ctx_id;
+  std::mutex sessions_mutex;                       // guards the session tables and every SessionInfo
+
+  // Idle sessions expire on their own thread instead of on the request path
+  std::thread session_reaper_thread;
+  std::condition_variable session_reaper_condition;
+  bool session_reaper_running = false;             // guarded by sessions_mutex
+
+  // Slot scheduler: server_context task loop running on its own thread.
+  // update_slots() batches all active slots into one llama_decode per step.
+  std::thread server_loop_thread;
+  std::atomic<bool> server_loop_running{false};
+  std::mutex server_loop_mutex;              // held while the loop touches slots or KV memory
+  std::atomic<uint32_t> active_requests{0};  // completions submitted and not yet returned
+
+  // Model handover: new requests wait while the loaded model is being replaced
+  bool model_handover = false;              // guarded by handover_mutex
+  std::mutex handover_mutex;
+  std::condition_variable handover_condition;
+  std::vector<graph_execution_context> seq_owner;  // session owning each slot sequence, 0 = free, or SEQ_RESERVED
 
   // Auto-cleanup configuration
   uint32_t max_sessions;
@@ -175,8 +376,10 @@ struct LlamaChatContext
   
   // Advanced task queue system
   std::shared_ptr<wasi_nn_task_queue> task_queue;
-  std::thread task_processor_thread;
+  std::vector<std::thread> task_workers;      // run compute() tasks, max_concurrent of them
   bool task_processing_enabled = true;
+  uint32_t max_concurrent = 10;
+  std::condition_variable output_condition;   // signalled (with sessions_mutex) when a compute() finishes
   
   // Task timeout and priority settings
   uint32_t default_task_timeout_ms = 30000;
@@ -201,6 +404,10 @@ struct LlamaChatContext
   bool enable_token_cache_reuse = true;
   std::string cache_deletion_strategy = "lru";  // lru, fifo, or smart
   uint32_t max_memory_mb = 0;               // 0 = no limit
+  std::string session_state_dir;            // KV snapshots of closed/evicted sessions, "" = disabled
+  uint32_t prefix_cache_min_tokens = 32;    // shortest prefix worth copying between sequences
+  std::vector<shared_prefix_entry> shared_prefixes;  // guarded by server_loop_mutex
+  int pinned_prefix_slot = -1;  // slot holding the system prompt prefix, -1 = none; guarded by server_loop_mutex
   
   // Memory monitoring
   std::atomic<uint64_t> current_memory_usage{0};
@@ -215,9 +422,37 @@ struct LlamaChatContext
   bool enable_colors;
   
   // Logging system state
-  struct common_log * log_instance;
   bool log_initialized;
-  
+
+  // Spans kept per thread while tracing (logging.trace, set_tracing())
+  uint32_t trace_events_per_thread = 16384;
+  
+  // LoRA adapters of the loaded model are server_ctx.params_base.lora_adapters,
+  // indexed by adapter id; an unloaded adapter leaves a null entry so ids stay stable
+  std::mutex lora_mutex;
+  // Unloaded adapters still applied by a running slot, freed once no slot
+  // uses them. Guarded by server_loop_mutex.
+  std::vector<llama_adapter_lora_ptr> retired_lora;
+
+  // Model registry: graph handles name models; the active one is installed in
+  // server_ctx, up to max_resident_models - 1 others stay loaded
+  std::atomic<graph> active_model{0};     // written under model_swap_mutex
+  graph next_model_id = 1;
+  std::string active_model_config;
+  uint32_t max_resident_models = 1;
+  std::vector<resident_model> resident_models;                            // guarded by model_swap_mutex
+  std::map<graph, std::pair<std::string, std::string>> model_sources;     // id -> (path, config)
+
+  // Model loaded (and warmed up) by init_backend_with_config on preload_thread;
+  // loads and new sessions wait for it to finish
+  std::string preload_model_path;
+  std::string preload_model_config;
+  bool preload_warmup = true;
+  std::thread preload_thread;
+  std::mutex preload_mutex;                 // joins preload_thread once
+  std::atomic<bool> preload_pending{false};
+  wasi_nn_error preload_result = success;   // written before preload_pending is cleared
+
   // Phase 5.2: Model Hot-Swapping
   std::string current_model_path;
   std::string current_model_version;
@@ -231,9 +466,51 @@ struct LlamaChatContext
   std::string model_architecture;
   std::string model_name;
 
+  // KV cache layout of the loaded model
+  uint32_t kv_n_ctx = 0;            // total cells, split across kv_n_parallel slots
+  uint32_t kv_n_parallel = 0;
+  std::string kv_cache_type_k;
+  std::string kv_cache_type_v;
+  bool kv_flash_attn = false;
+  memory_accounting memory;         // refreshed under server_loop_mutex
+
+  // Generation budget assumed for a compute() task without max_tokens, set
+  // with the model so the task queue can read it without model_swap_mutex
+  std::atomic<int32_t> default_max_tokens{1};
+
   // Performance settings
   bool batch_processing_enabled;
   uint32_t batch_size;
+  bool pause_threads_when_idle = false;  // park the compute threads between requests
+
+  // CPU threadpools attached to the model context, created on model load and
+  // kept across a model switch when the thread settings stay the same
+  ggml_threadpool *threadpool = nullptr;
+  ggml_threadpool *threadpool_batch = nullptr;
+  ggml_threadpool_params threadpool_params = {};
+  ggml_threadpool_params threadpool_batch_params = {};
+
+  // NUMA placement (backend "numa", "numa_replicas"). With replicas this
+  // context serves node 0 and owns one replica backend per further node;
+  // replica r hands out exec ctx ids r + 1, r + 1 + stride, ...
+  ggml_numa_strategy numa_strategy = GGML_NUMA_STRATEGY_DISABLED;
+  bool numa_replicas = false;
+  int32_t numa_node = -1;                      // node threads and KV memory are pinned to, -1 = none
+  std::vector<LlamaChatContext *> replicas;    // nodes 1.. of the primary; empty on replicas
+  bool is_replica = false;                     // process-wide setup is left to the primary
+  uint32_t exec_ctx_stride = 1;
+
+  // Speculative decoding: prompt lookup n-gram used when no draft model is loaded
+  int32_t lookup_ngram = 0;
+  std::atomic<uint64_t> draft_tokens_total{0};
+  std::atomic<uint64_t> draft_tokens_accepted{0};
+
+  backend_metrics metrics;
+
+  // Registered runtime configs; handle h is runtime_configs[h - 1], null once released
+  std::vector<std::unique_ptr<registered_runtime_config>> runtime_configs;
+  std::mutex runtime_configs_mutex;                  // taken before lora_mutex
+  std::atomic<uint64_t> slot_params_generation{1};  // bumped when the slot parameter defaults change
 
   LlamaChatContext()
       : next_exec_ctx_id(1),
@@ -245,7 +522,7 @@ struct LlamaChatContext
         cache_deletion_strategy("lru"), max_memory_mb(0),
         current_memory_usage(0), cache_hits(0), cache_misses(0),
         log_level("info"), enable_debug_log(false), enable_timestamps(true), enable_colors(false),
-        log_instance(nullptr), log_initialized(false),
+        log_initialized(false),
         current_model_path(""), current_model_version(""),
         model_swapping_in_progress(false), model_context_length(0), model_vocab_size(0),
         model_architecture(""), model_name(""),
@@ -257,18 +534,33 @@ struct LlamaChatContext
 
 // Forward declarations for helper functions
 static void parse_config_to_params(const char *config_json, common_params &params, LlamaChatContext *chat_ctx = nullptr);
-
-// Task queue with priority management
+static void process_compute_task(LlamaChatContext *chat_ctx, const wasi_nn_task &task);
+static void prefill_shared_prefix(LlamaChatContext *chat_ctx);
+static void complete_compute_task(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx,
+                                  wasi_nn_error status, std::string &&output);
+static void start_session_reaper(LlamaChatContext *chat_ctx);
+static void stop_session_reaper(LlamaChatContext *chat_ctx);
+static void refresh_memory_accounting(LlamaChatContext *chat_ctx);
+
+// Weighted fair queue of compute() tasks. Each tenant has a FIFO; a task is
+// tagged with the virtual time at which its tenant's share would have served
+// it (self-clocked fair queueing: max(virtual_time, tenant's last tag) +
+// cost_tokens / weight), and the head with the smallest tag runs next, so a
+// tenant sending long generations cannot starve the others. Weights follow the
+// priority; urgent tasks skip the fair share. Tasks that cannot start before
+// timeout_at or finish before their deadline are refused instead of queued.
 struct wasi_nn_task_queue
 {
-  std::deque<wasi_nn_task> high_priority_queue;    // Priority 3 (urgent)
-  std::deque<wasi_nn_task> normal_priority_queue;  // Priority 1-2 (normal/high)
-  std::deque<wasi_nn_task> low_priority_queue;     // Priority 0 (low)
+  std::deque<wasi_nn_task> urgent_queue;                  // Priority 3, served first in arrival order
+  std::map<std::string, std::deque<wasi_nn_task>> flows;  // Priority 0-2 by tenant
+  double virtual_time = 0.0;                              // finish tag of the last task started
+  double queued_ms = 0.0;                                 // cost_ms of everything queued
   
   std::mutex queue_mutex;
   std::condition_variable queue_condition;
   
   uint32_t max_queue_size = 50;
+  uint32_t n_workers = 1;   // tasks run concurrently, for wait estimates
   uint32_t current_size = 0;
   bool running = true;
   int next_task_id = 1;
@@ -278,80 +570,561 @@ struct wasi_nn_task_queue
   uint32_t tasks_completed = 0;
   uint32_t tasks_timeout = 0;
   uint32_t tasks_rejected = 0;
+
+  // Tasks dropped by cleanup_expired_tasks(), waiting to be failed by a worker
+  std::vector<wasi_nn_task> expired_tasks;
   
-  // Add task to appropriate priority queue
-  bool enqueue_task(wasi_nn_task &&task, LlamaChatContext* ctx = nullptr);
+  // Tag and queue a task; runtime_error if the queue is full, timeout if it
+  // could not start or finish in time
+  wasi_nn_error enqueue_task(wasi_nn_task &&task, LlamaChatContext* ctx = nullptr);
   
-  // Get next task based on priority
+  // Get the next task in fair-share order
   bool dequeue_task(wasi_nn_task &task, LlamaChatContext* ctx = nullptr);
   
-  // Clean up expired tasks
+  // Drop tasks that can no longer start before timeout_at or finish before their deadline
   void cleanup_expired_tasks();
+
+  // Hand over the tasks that expired before they could start
+  void take_expired_tasks(std::vector<wasi_nn_task> &tasks);
   
   // Get queue status
   void get_queue_status(uint32_t &queued, uint32_t &active, uint32_t &capacity);
+
+  static double priority_weight(wasi_nn_task_priority priority)
+  {
+    return priority == WASI_NN_PRIORITY_HIGH ? 4.0 : priority == WASI_NN_PRIORITY_LOW ? 1.0 : 2.0;
+  }
 };
 
 // Implementation of LlamaChatContext destructor
 LlamaChatContext::~LlamaChatContext() {
-  // Cleanup logging system
-  if (log_initialized && log_instance) {
-    common_log_free(log_instance);
-    log_instance = nullptr;
-    log_initialized = false;
+  stop_session_reaper(this);
+
+  // Stop the slot scheduler before server_ctx is torn down
+  if (server_loop_thread.joinable()) {
+    server_loop_running = false;
+    server_ctx.queue_tasks.terminate();
+    server_loop_thread.join();
   }
-  
-  // Cleanup task processing thread
-  if (task_processing_enabled && task_processor_thread.joinable()) {
-    if (task_queue) {
+
+  // Cleanup task workers; a running compute() returns once the loop is gone
+  if (task_queue) {
+    {
+      std::lock_guard<std::mutex> lock(task_queue->queue_mutex);
       task_queue->running = false;
-      task_queue->queue_condition.notify_all();
     }
-    task_processor_thread.join();
+    task_queue->queue_condition.notify_all();
+  }
+  for (auto &worker : task_workers) {
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  // Write out what is still queued before the context goes away
+  if (log_initialized) {
+    wasi_nn_async_logger::instance().flush();
+    log_initialized = false;
   }
 }
 
 // ==============================================================================
-// Phase 5.2: Stable Model Switching Implementation
+// Slot Scheduler (server_context task loop)
 // ==============================================================================
 
-// Wait for all active tasks to complete
-static wasi_nn_error wait_for_tasks_completion(LlamaChatContext *chat_ctx, uint32_t timeout_ms = 30000) {
-  if (!chat_ctx || !chat_ctx->task_queue) {
-    return success; // No tasks to wait for
+// CPU backend entry points are looked up through the backend registry (as in main.cpp)
+template <typename T>
+static T *cpu_backend_proc(const char *name) {
+  auto *reg = ggml_backend_dev_backend_reg(ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
+  return (T *)ggml_backend_reg_get_proc_address(reg, name);
+}
+
+// CPUs of a NUMA node, read from sysfs; empty when the node does not exist
+static std::vector<int> numa_node_cpus(int node) {
+  std::vector<int> cpus;
+#if defined(__linux__)
+  std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+  std::string list;
+  if (!std::getline(in, list)) {
+    return cpus;
+  }
+  std::stringstream ranges(list);
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    int first = -1, last = -1;
+    if (sscanf(range.c_str(), "%d-%d", &first, &last) == 1) {
+      last = first;
+    }
+    for (int cpu = first; cpu >= 0 && cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
   }
-  
-  auto start_time = std::chrono::steady_clock::now();
-  auto timeout = std::chrono::milliseconds(timeout_ms);
-  
-  NN_INFO_PRINTF("Waiting for active tasks to complete before model switch...");
-  
-  while (true) {
-    uint32_t queued = 0, active = 0, capacity = 0;
-    chat_ctx->task_queue->get_queue_status(queued, active, capacity);
-    
-    if (active == 0 && queued == 0) {
-      NN_INFO_PRINTF("All tasks completed, ready for model switch");
-      return success;
+#endif
+  return cpus;
+}
+
+// Nodes with CPUs; memory-only nodes come last and cannot host a replica
+static int numa_node_count() {
+  int n = 0;
+  while (!numa_node_cpus(n).empty()) {
+    ++n;
+  }
+  return n;
+}
+
+// Pin the calling thread to a node's CPUs for the binding's lifetime. Memory
+// is placed on the node of its first touch, so buffers allocated and cleared
+// meanwhile (the KV cache, non-mmapped weights) end up local to the node.
+struct numa_thread_binding {
+#if defined(__linux__)
+  cpu_set_t saved;
+#endif
+  bool bound = false;
+
+  explicit numa_thread_binding(int node) {
+#if defined(__linux__)
+    std::vector<int> cpus = node >= 0 ? numa_node_cpus(node) : std::vector<int>();
+    if (cpus.empty() || pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) != 0) {
+      return;
     }
-    
-    auto elapsed = std::chrono::steady_clock::now() - start_time;
-    if (elapsed > timeout) {
-      NN_WARN_PRINTF("Timeout waiting for tasks completion, proceeding with model switch");
-      return success; // Proceed anyway after timeout
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+      if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    bound = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+  }
+
+  ~numa_thread_binding() {
+#if defined(__linux__)
+    if (bound) {
+      pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+    }
+#endif
+  }
+
+  numa_thread_binding(const numa_thread_binding &) = delete;
+  numa_thread_binding &operator=(const numa_thread_binding &) = delete;
+};
+
+// Restrict a threadpool to a node's cores, one thread per core
+static void pin_cpu_params_to_numa_node(int node, cpu_params &cpuparams) {
+  const std::vector<int> cpus = numa_node_cpus(node);
+  if (cpus.empty()) {
+    return;
+  }
+  std::fill(std::begin(cpuparams.cpumask), std::end(cpuparams.cpumask), false);
+  for (int cpu : cpus) {
+    if (cpu < GGML_MAX_N_THREADS) {
+      cpuparams.cpumask[cpu] = true;
+    }
+  }
+  cpuparams.mask_valid = true;
+  cpuparams.strict_cpu = true;
+  if (cpuparams.n_threads <= 0 || cpuparams.n_threads > (int)cpus.size()) {
+    cpuparams.n_threads = (int)cpus.size();
+  }
+}
+
+// Replica that owns a session, from the id it was issued
+static LlamaChatContext *home_replica(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx) {
+  if (!chat_ctx || chat_ctx->replicas.empty() || exec_ctx == 0) {
+    return chat_ctx;
+  }
+  const uint32_t r = (uint32_t)(exec_ctx - 1) % chat_ctx->exec_ctx_stride;
+  return r == 0 ? chat_ctx : chat_ctx->replicas[r - 1];
+}
+
+// Runs a model-level call on every replica before the primary runs it, so the
+// ids it hands out (graphs, adapters, config handles) agree across replicas.
+// Every replica must succeed and issue the same id, and commit() checks the
+// primary's id against theirs. Otherwise the call is undone on the replicas it
+// already succeeded on; a call without undo logs that they no longer match.
+struct replica_call {
+  using undo_fn = std::function<void(LlamaChatContext *, uint32_t)>;
+
+  LlamaChatContext *chat_ctx;
+  const char *what;
+  undo_fn undo;
+  std::vector<std::pair<LlamaChatContext *, uint32_t>> done;  // replicas and the ids they issued
+  bool committed = false;
+
+  replica_call(LlamaChatContext *ctx, const char *name, undo_fn undo_call = nullptr)
+      : chat_ctx(ctx), what(name), undo(std::move(undo_call)) {}
+
+  // fn(replica, id) runs the call on one replica and stores the id it issued
+  template <typename Fn>
+  wasi_nn_error run(Fn &&fn) {
+    for (LlamaChatContext *replica : chat_ctx->replicas) {
+      uint32_t id = 0;
+      wasi_nn_error err = fn(replica, id);
+      if (err != success) {
+        WASI_NN_LOG_ERROR(chat_ctx, "%s failed on NUMA replica %zu", what, done.size() + 1);
+        return err;
+      }
+      done.emplace_back(replica, id);
+      if (id != done.front().second) {
+        WASI_NN_LOG_ERROR(chat_ctx, "%s issued id %u on NUMA replica %zu but %u on replica 1", what, id,
+                          done.size(), done.front().second);
+        return runtime_error;
+      }
+    }
+    return success;
+  }
+
+  // The primary ran the call as well and issued id
+  wasi_nn_error commit(uint32_t id) {
+    if (!done.empty() && id != done.front().second) {
+      WASI_NN_LOG_ERROR(chat_ctx, "%s issued id %u on the primary but %u on its NUMA replicas", what, id,
+                        done.front().second);
+      if (undo) {
+        undo(chat_ctx, id);
+      }
+      return runtime_error;
+    }
+    committed = true;
+    return success;
+  }
+
+  ~replica_call() {
+    if (committed || done.empty()) {
+      return;
+    }
+    if (!undo) {
+      WASI_NN_LOG_ERROR(chat_ctx, "%s cannot be undone on %zu NUMA replicas, they no longer match the primary",
+                        what, done.size());
+      return;
+    }
+    for (const auto &replica : done) {
+      undo(replica.first, replica.second);
+    }
+  }
+};
+
+// Detach and free the model context's threadpools
+static void release_threadpools(LlamaChatContext *chat_ctx) {
+  if (!chat_ctx->threadpool && !chat_ctx->threadpool_batch) {
+    return;
+  }
+
+  if (chat_ctx->server_ctx.ctx) {
+    llama_detach_threadpool(chat_ctx->server_ctx.ctx);
+  }
+  auto *threadpool_free_fn = cpu_backend_proc<decltype(ggml_threadpool_free)>("ggml_threadpool_free");
+  if (chat_ctx->threadpool_batch) {
+    threadpool_free_fn(chat_ctx->threadpool_batch);
+    chat_ctx->threadpool_batch = nullptr;
+  }
+  if (chat_ctx->threadpool) {
+    threadpool_free_fn(chat_ctx->threadpool);
+    chat_ctx->threadpool = nullptr;
+  }
+}
+
+// Create the compute threadpools for the loaded model context (from main.cpp).
+// They live as long as the context; sessions share them. Threadpools kept by a
+// model switch are attached again if the new model uses the same thread settings.
+static wasi_nn_error setup_threadpools(LlamaChatContext *chat_ctx)
+{
+  common_params& params = chat_ctx->server_ctx.params_base;
+  auto *threadpool_new_fn = cpu_backend_proc<decltype(ggml_threadpool_new)>("ggml_threadpool_new");
+
+  // A replica computes on the cores of its own node only
+  if (chat_ctx->numa_node >= 0) {
+    pin_cpu_params_to_numa_node(chat_ctx->numa_node, params.cpuparams);
+    pin_cpu_params_to_numa_node(chat_ctx->numa_node, params.cpuparams_batch);
+  }
+
+  struct ggml_threadpool_params tpp_batch =
+      ggml_threadpool_params_from_cpu_params(params.cpuparams_batch);
+  struct ggml_threadpool_params tpp =
+      ggml_threadpool_params_from_cpu_params(params.cpuparams);
+
+  if (chat_ctx->threadpool && ggml_threadpool_params_match(&tpp, &chat_ctx->threadpool_params) &&
+      ggml_threadpool_params_match(&tpp_batch, &chat_ctx->threadpool_batch_params)) {
+    llama_attach_threadpool(chat_ctx->server_ctx.ctx, chat_ctx->threadpool, chat_ctx->threadpool_batch);
+    NN_INFO_PRINTF("Threadpools reused: threads=%d, threads_batch=%d",
+                   params.cpuparams.n_threads, params.cpuparams_batch.n_threads);
+    return success;
+  }
+  release_threadpools(chat_ctx);
+
+  // Create batch threadpool if different from main threadpool
+  ggml_threadpool* threadpool_batch = nullptr;
+  if (!ggml_threadpool_params_match(&tpp, &tpp_batch))
+  {
+    threadpool_batch = threadpool_new_fn(&tpp_batch);
+    if (!threadpool_batch)
+    {
+      NN_ERR_PRINTF("Failed to create batch threadpool");
+      return runtime_error;
+    }
+    tpp.paused = true;
+  }
+
+  ggml_threadpool* threadpool = threadpool_new_fn(&tpp);
+  if (!threadpool)
+  {
+    NN_ERR_PRINTF("Failed to create threadpool");
+    if (threadpool_batch) {
+      cpu_backend_proc<decltype(ggml_threadpool_free)>("ggml_threadpool_free")(threadpool_batch);
+    }
+    return runtime_error;
+  }
+
+  llama_attach_threadpool(chat_ctx->server_ctx.ctx, threadpool, threadpool_batch);
+  chat_ctx->threadpool = threadpool;
+  chat_ctx->threadpool_batch = threadpool_batch;
+  chat_ctx->threadpool_params = ggml_threadpool_params_from_cpu_params(params.cpuparams);
+  chat_ctx->threadpool_batch_params = tpp_batch;
+
+  NN_INFO_PRINTF("Threadpools created: threads=%d, threads_batch=%d, cpu_mask=%s, poll=%u, numa_node=%d",
+                 params.cpuparams.n_threads, params.cpuparams_batch.n_threads,
+                 params.cpuparams.mask_valid ? "custom" : "any", params.cpuparams.poll, chat_ctx->numa_node);
+  return success;
+}
+
+// Park the compute threads once the scheduler has nothing left to decode; the
+// next graph compute wakes them. Called from the loop with server_loop_mutex held.
+static void pause_idle_threadpools(LlamaChatContext *chat_ctx) {
+  if (!chat_ctx->pause_threads_when_idle || !chat_ctx->threadpool) {
+    return;
+  }
+  for (const auto &slot : chat_ctx->server_ctx.slots) {
+    if (slot.is_processing()) {
+      return;
+    }
+  }
+
+  auto *threadpool_pause_fn = cpu_backend_proc<decltype(ggml_threadpool_pause)>("ggml_threadpool_pause");
+  threadpool_pause_fn(chat_ctx->threadpool);
+  if (chat_ctx->threadpool_batch) {
+    threadpool_pause_fn(chat_ctx->threadpool_batch);
+  }
+}
+
+// Publish the scheduler's counters and KV occupancy for get_backend_metrics().
+// Called from the loop with server_loop_mutex held; costs O(slots).
+static void publish_loop_metrics(LlamaChatContext *chat_ctx) {
+  const server_context &server_ctx = chat_ctx->server_ctx;
+  backend_metrics &metrics = chat_ctx->metrics;
+  uint32_t busy = 0;
+  for (const auto &slot : server_ctx.slots) {
+    busy += slot.is_processing() ? 1 : 0;
+  }
+  refresh_memory_accounting(chat_ctx);
+  metrics.slots_total.store((uint32_t)server_ctx.slots.size(), std::memory_order_relaxed);
+  metrics.slots_busy.store(busy, std::memory_order_relaxed);
+  metrics.decode_steps.store(server_ctx.metrics.n_decode_total, std::memory_order_relaxed);
+  metrics.busy_slot_steps.store(server_ctx.metrics.n_busy_slots_total, std::memory_order_relaxed);
+  metrics.kv_cells_total.store(chat_ctx->memory.kv_cells_total, std::memory_order_relaxed);
+  metrics.kv_cells_used.store(chat_ctx->memory.kv_cells_used, std::memory_order_relaxed);
+  metrics.kv_bytes.store(chat_ctx->memory.kv_bytes, std::memory_order_relaxed);
+  metrics.sampler_cache_hits.store(server_ctx.n_sampler_cache_hits, std::memory_order_relaxed);
+  metrics.sampler_cache_misses.store(server_ctx.n_sampler_cache_misses, std::memory_order_relaxed);
+}
+
+// A task built before its adapter was unloaded still points at it; disable
+// those entries before it can launch, so only running slots keep a retired
+// adapter alive. Deferred tasks pass through here again when re-queued.
+// Called from the loop with server_loop_mutex held.
+static void detach_unloaded_lora(LlamaChatContext *chat_ctx, server_task &task) {
+  const auto &adapters = chat_ctx->server_ctx.params_base.lora_adapters;
+  auto &lora = task.params.lora;
+  for (size_t i = 0; i < lora.size(); ++i) {
+    if (lora[i].ptr && (i >= adapters.size() || lora[i].ptr != adapters[i].ptr)) {
+      lora[i] = i < adapters.size() ? adapters[i] : common_adapter_lora_info();
+      lora[i].scale = 0.0f;
+    }
+  }
+}
+
+// Free retired adapters that no running slot applies any more. An idle slot
+// that last ran with one drops its cached tokens, computed with the adapter.
+// Called from the loop with server_loop_mutex held, between decode steps.
+static void free_retired_lora(LlamaChatContext *chat_ctx) {
+  auto &retired = chat_ctx->retired_lora;
+  if (retired.empty()) {
+    return;
+  }
+  server_context &server_ctx = chat_ctx->server_ctx;
+  auto in_use = [&server_ctx](const llama_adapter_lora *ptr) {
+    for (const auto &slot : server_ctx.slots) {
+      if (!slot.is_processing()) {
+        continue;
+      }
+      for (const auto &la : slot.lora) {
+        if (la.ptr == ptr) {
+          return true;
+        }
+      }
+    }
+    return false;
+  };
+
+  const bool any_free = std::any_of(retired.begin(), retired.end(),
+                                    [&in_use](const llama_adapter_lora_ptr &la) { return !in_use(la.get()); });
+  if (!any_free) {
+    return;
+  }
+  // Adapters are set again for every batch; drop them from the context
+  // before any is freed
+  if (server_ctx.ctx) {
+    llama_clear_adapter_lora(server_ctx.ctx);
+  }
+
+  const size_t n_before = retired.size();
+  for (auto it = retired.begin(); it != retired.end();) {
+    llama_adapter_lora *ptr = it->get();
+    if (in_use(ptr)) {
+      ++it;
+      continue;
+    }
+    for (auto &slot : server_ctx.slots) {
+      for (auto &la : slot.lora) {
+        if (la.ptr != ptr) {
+          continue;
+        }
+        if (la.scale != 0.0f && !slot.cache_tokens.empty()) {
+          slot.cache_tokens.clear();
+          llama_memory_seq_rm(llama_get_memory(server_ctx.ctx), slot.id, -1, -1);
+        }
+        la = common_adapter_lora_info();
+      }
+    }
+    it = retired.erase(it);
+  }
+  NN_INFO_PRINTF("Freed %zu unloaded LoRA adapters", n_before - retired.size());
+}
+
+// Start the server_context task loop on a dedicated thread. Completion tasks
+// posted by run_inference land in process_single_task() and are advanced together
+// by update_slots(), so concurrent sessions share every llama_decode call.
+static void start_server_loop(LlamaChatContext *chat_ctx) {
+  server_context &server_ctx = chat_ctx->server_ctx;
+
+  // Slot selection prefers the slot whose cached prompt matches best
+  server_ctx.slot_prompt_similarity = server_ctx.params_base.slot_prompt_similarity;
+
+  // Slot caches outlive idle periods; the KV memory is only cleared explicitly
+  server_ctx.clean_kv_cache = false;
+
+  // The configured n_predict is applied per request as a default, so a runtime
+  // max_tokens is bounded by the slot context rather than by the config value
+  for (auto &slot : server_ctx.slots) {
+    slot.n_predict = -1;
+  }
+
+  server_ctx.queue_tasks.on_new_task([chat_ctx](server_task &&task) {
+    std::lock_guard<std::mutex> lock(chat_ctx->server_loop_mutex);
+    detach_unloaded_lora(chat_ctx, task);
+    chat_ctx->server_ctx.process_single_task(std::move(task));
+  });
+  server_ctx.queue_tasks.on_update_slots([chat_ctx]() {
+    std::lock_guard<std::mutex> lock(chat_ctx->server_loop_mutex);
+    chat_ctx->server_ctx.update_slots();
+    free_retired_lora(chat_ctx);
+    publish_loop_metrics(chat_ctx);
+    pause_idle_threadpools(chat_ctx);
+  });
+
+  // Slots start empty, so no session owns a sequence yet
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    chat_ctx->seq_owner.assign(server_ctx.slots.size(), 0);
+    for (auto &pair : chat_ctx->sessions) {
+      pair.second.seq_id = -1;
+    }
+  }
+
+  // Threadpools follow the model context: one set per load, shared by all sessions
+  if (setup_threadpools(chat_ctx) != success) {
+    WASI_NN_LOG_WARN(chat_ctx, "Using the default per-compute threads");
+  }
+
+  prefill_shared_prefix(chat_ctx);
+
+  server_ctx.queue_tasks.running = true;
+  chat_ctx->server_loop_running = true;
+  chat_ctx->server_loop_thread = std::thread([chat_ctx]() {
+    numa_thread_binding numa_binding(chat_ctx->numa_node);
+    chat_ctx->server_ctx.queue_tasks.start_loop();
+  });
+
+  NN_INFO_PRINTF("Slot scheduler started: n_slots=%zu, cont_batching=%s",
+                 server_ctx.slots.size(), server_ctx.params_base.cont_batching ? "true" : "false");
+}
+
+// Stop the task loop and wait for the current update_slots() step to finish.
+// keep_threadpools detaches the threadpools so the next model can reuse them.
+static void stop_server_loop(LlamaChatContext *chat_ctx, bool keep_threadpools = false) {
+  if (!chat_ctx->server_loop_thread.joinable()) {
+    return;
+  }
+
+  chat_ctx->server_loop_running = false;
+  chat_ctx->server_ctx.queue_tasks.terminate();
+  chat_ctx->server_loop_thread.join();
+  if (keep_threadpools) {
+    if (chat_ctx->server_ctx.ctx) {
+      llama_detach_threadpool(chat_ctx->server_ctx.ctx);
+    }
+  } else {
+    release_threadpools(chat_ctx);
+  }
+
+  NN_INFO_PRINTF("Slot scheduler stopped");
+}
+
+// ==============================================================================
+// Phase 5.2: Stable Model Switching Implementation
+// ==============================================================================
+
+// Stop admitting requests to the loaded model and wait until the ones already
+// running on it have returned. Queued compute() tasks stay queued and run on the
+// new model once end_model_handover() reopens admission, which the caller also
+// does after a timeout.
+static wasi_nn_error begin_model_handover(LlamaChatContext *chat_ctx, uint32_t timeout_ms = 30000) {
+  std::unique_lock<std::mutex> lock(chat_ctx->handover_mutex);
+  chat_ctx->model_handover = true;
+
+  NN_INFO_PRINTF("Draining %u in-flight requests before model handover",
+                 chat_ctx->active_requests.load());
+  if (!chat_ctx->handover_condition.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                                              [chat_ctx] { return chat_ctx->active_requests == 0; })) {
+    NN_WARN_PRINTF("Timeout waiting for %u in-flight requests before model handover",
+                   chat_ctx->active_requests.load());
+    return timeout;
+  }
+  return success;
+}
+
+// admit counts the caller's own request in active_requests before anyone else
+// is let in, so the model it switched to cannot be switched away under it
+static void end_model_handover(LlamaChatContext *chat_ctx, bool admit = false) {
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->handover_mutex);
+    chat_ctx->model_handover = false;
+    if (admit) {
+      chat_ctx->active_requests++;
     }
-    
-    NN_DBG_PRINTF("Waiting for tasks: queued=%u, active=%u", queued, active);
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
   }
+  chat_ctx->handover_condition.notify_all();
 }
 
-// Clean up all slots and contexts before model switch
-static void cleanup_all_slots(LlamaChatContext *chat_ctx) {
+// Clean up all slots and contexts before model switch. keep_kv leaves the
+// context's KV cache in place for a model that stays resident.
+static void cleanup_all_slots(LlamaChatContext *chat_ctx, bool keep_kv = false) {
   if (!chat_ctx) return;
   
   WASI_NN_LOG_INFO(chat_ctx, "Cleaning up all slots before model switch");
   
+  chat_ctx->server_ctx.clear_sampler_cache();
+  chat_ctx->slot_params_generation.fetch_add(1);
+  
   // Clear all slots using server context approach
   for (auto& slot : chat_ctx->server_ctx.slots) {
     // Free sampling context
@@ -391,8 +1164,16 @@ static void cleanup_all_slots(LlamaChatContext *chat_ctx) {
     chat_ctx->server_ctx.batch = {};
   }
   
+  // Adapters unloaded while requests still ran belong to the outgoing model
+  if (!chat_ctx->retired_lora.empty()) {
+    if (chat_ctx->server_ctx.ctx) {
+      llama_clear_adapter_lora(chat_ctx->server_ctx.ctx);
+    }
+    chat_ctx->retired_lora.clear();
+  }
+
   // Clear KV cache
-  if (chat_ctx->server_ctx.ctx) {
+  if (chat_ctx->server_ctx.ctx && !keep_kv) {
     llama_memory_t mem = llama_get_memory(chat_ctx->server_ctx.ctx);
     if (mem) {
       llama_memory_clear(mem, true);
@@ -402,52 +1183,523 @@ static void cleanup_all_slots(LlamaChatContext *chat_ctx) {
   WASI_NN_LOG_INFO(chat_ctx, "All slots cleaned up successfully");
 }
 
-// Safely switch to a new model
-static wasi_nn_error safe_model_switch(LlamaChatContext *chat_ctx, const char *filename, 
-                                       uint32_t filename_len, const char *config) {
-  if (!chat_ctx) {
-    return invalid_argument;
-  }
-  
-  // Lock to prevent concurrent access during model switch
-  std::lock_guard<std::mutex> lock(chat_ctx->model_swap_mutex);
-  
-  if (chat_ctx->model_swapping_in_progress) {
-    WASI_NN_LOG_WARN(chat_ctx, "Model switch already in progress, skipping");
-    return runtime_error;
-  }
-  
-  chat_ctx->model_swapping_in_progress = true;
-  
-  WASI_NN_LOG_INFO(chat_ctx, "Starting safe model switch to: %.*s", (int)filename_len, filename);
-  
-  try {
-    // Step 1: Wait for all active tasks to complete
-    wasi_nn_error wait_result = wait_for_tasks_completion(chat_ctx, 30000);
-    if (wait_result != success) {
-      WASI_NN_LOG_WARN(chat_ctx, "Task completion wait failed, continuing with model switch");
+// Free memory on GPU devices, summed; false if there is no GPU device
+static bool device_memory_free(uint64_t &free_bytes) {
+  bool has_gpu = false;
+  free_bytes = 0;
+  for (size_t i = 0; i < ggml_backend_dev_count(); ++i) {
+    ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+    if (ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_GPU) {
+      continue;
     }
-    
-    // Step 2: Backup current parameters
+    size_t free = 0, total = 0;
+    ggml_backend_dev_memory(dev, &free, &total);
+    free_bytes += free;
+    has_gpu = true;
+  }
+  return has_gpu;
+}
+
+// KV cache bytes per token for every layer, given the K and V element types
+static uint64_t kv_bytes_per_token(uint32_t n_layer, uint32_t n_embd_k_gqa, uint32_t n_embd_v_gqa,
+                                   ggml_type type_k, ggml_type type_v) {
+  return (uint64_t)n_layer * (ggml_row_size(type_k, n_embd_k_gqa) + ggml_row_size(type_v, n_embd_v_gqa));
+}
+
+// Compute and output buffers of a context. llama.cpp does not report the
+// scheduler's buffers, so they are estimated per ubatch token: a row of logits
+// and a few n_embd activations, plus the attention scores over the whole
+// context when flash attention is off.
+static uint64_t context_compute_bytes(llama_context *ctx, const llama_model *model, bool flash_attn) {
+  const uint64_t n_ubatch = llama_n_ubatch(ctx);
+  const uint64_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+  const uint64_t n_embd = (uint64_t)std::max(llama_model_n_embd(model), 0);
+  uint64_t per_token = n_vocab + 4 * n_embd;
+  if (!flash_attn) {
+    per_token += (uint64_t)std::max(llama_model_n_head(model), 1) * llama_n_ctx(ctx);
+  }
+  return n_ubatch * per_token * sizeof(float);
+}
+
+// Record name, version and shape of the model now in server_ctx, and the
+// memory it holds: llama_model_size() for the weights, the KV cache from its
+// layout, and the context's compute buffers. Process-wide device counters are
+// not used, so other processes' allocations do not count.
+static void update_model_info(LlamaChatContext *chat_ctx, const char *filename, uint32_t filename_len) {
+  chat_ctx->current_model_path = std::string(filename, filename_len);
+  chat_ctx->model_context_length = llama_model_n_ctx_train(chat_ctx->server_ctx.model);
+  chat_ctx->model_vocab_size = llama_vocab_n_tokens(chat_ctx->server_ctx.vocab);
+
+  // Get model architecture and name if available
+  char model_desc[256] = {0};
+  if (llama_model_desc(chat_ctx->server_ctx.model, model_desc, sizeof(model_desc)) > 0) {
+    chat_ctx->model_architecture = std::string(model_desc);
+  }
+
+  // Extract model name from path
+  std::string path(filename, filename_len);
+  size_t last_slash = path.find_last_of("/\\");
+  chat_ctx->model_name = (last_slash != std::string::npos) ?
+                         path.substr(last_slash + 1) : path;
+
+  // Generate version string
+  struct stat file_stat;
+  if (stat(path.c_str(), &file_stat) == 0) {
+    char version_buf[64];
+    snprintf(version_buf, sizeof(version_buf), "size_%ld_mtime_%ld",
+             file_stat.st_size, file_stat.st_mtime);
+    chat_ctx->current_model_version = std::string(version_buf);
+  }
+
+  // KV layout as created; head sizes are assumed to be n_embd / n_head
+  const common_params &params = chat_ctx->server_ctx.params_base;
+  const llama_model *model = chat_ctx->server_ctx.model;
+  const int32_t n_head = std::max(llama_model_n_head(model), 1);
+  const uint32_t n_embd_gqa = (uint32_t)(llama_model_n_embd(model) / n_head * llama_model_n_head_kv(model));
+  chat_ctx->kv_n_ctx = llama_n_ctx(chat_ctx->server_ctx.ctx);
+  chat_ctx->kv_n_parallel = (uint32_t)params.n_parallel;
+  chat_ctx->kv_cache_type_k = ggml_type_name(params.cache_type_k);
+  chat_ctx->kv_cache_type_v = ggml_type_name(params.cache_type_v);
+  chat_ctx->kv_flash_attn = params.flash_attn;
+  const int n_ctx_slot = chat_ctx->server_ctx.slots.empty()
+                             ? (int)(chat_ctx->kv_n_ctx / std::max(chat_ctx->kv_n_parallel, 1u))
+                             : chat_ctx->server_ctx.slots[0].n_ctx;
+  chat_ctx->default_max_tokens = params.n_predict > 0 ? params.n_predict : std::max(n_ctx_slot / 4, 1);
+
+  // Layers offloaded to a GPU hold their share of the weights and, with
+  // offload_kqv, of the KV cache; the compute buffers live there too
+  memory_accounting &memory = chat_ctx->memory;
+  const int32_t n_layer = std::max(llama_model_n_layer(model), 1);
+  uint64_t device_free = 0;
+  const bool has_gpu = device_memory_free(device_free);
+  const double offloaded = has_gpu ? std::max(std::min(params.n_gpu_layers, n_layer), 0) / (double)n_layer : 0.0;
+  memory = memory_accounting();
+  memory.weights_bytes = llama_model_size(model);
+  memory.weights_device_bytes = (uint64_t)(memory.weights_bytes * offloaded);
+  memory.kv_bytes = chat_ctx->kv_n_ctx * kv_bytes_per_token(n_layer, n_embd_gqa, n_embd_gqa,
+                                                             params.cache_type_k, params.cache_type_v);
+  memory.kv_device_bytes = params.no_kv_offload ? 0 : (uint64_t)(memory.kv_bytes * offloaded);
+  memory.kv_bytes_per_cell = chat_ctx->kv_n_ctx > 0 ? memory.kv_bytes / chat_ctx->kv_n_ctx : 0;
+  memory.kv_cells_total = chat_ctx->kv_n_ctx;
+  memory.compute_device_bytes =
+      offloaded > 0 ? context_compute_bytes(chat_ctx->server_ctx.ctx, model, params.flash_attn) : 0;
+  memory.device_bytes = memory.weights_device_bytes + memory.kv_device_bytes + memory.compute_device_bytes;
+  chat_ctx->current_memory_usage = memory.weights_bytes + memory.compute_device_bytes;
+
+  WASI_NN_LOG_INFO(chat_ctx, "KV cache: n_ctx=%u across %u slots, K=%s V=%s, flash_attn=%s, %.1f MB",
+                   chat_ctx->kv_n_ctx, chat_ctx->kv_n_parallel, chat_ctx->kv_cache_type_k.c_str(),
+                   chat_ctx->kv_cache_type_v.c_str(), chat_ctx->kv_flash_attn ? "on" : "off",
+                   memory.kv_bytes / (1024.0 * 1024.0));
+  WASI_NN_LOG_INFO(chat_ctx, "Memory: weights %.1f MB (%.1f MB on device), device total %.1f MB (compute %.1f MB)",
+                   memory.weights_bytes / (1024.0 * 1024.0), memory.weights_device_bytes / (1024.0 * 1024.0),
+                   memory.device_bytes / (1024.0 * 1024.0), memory.compute_device_bytes / (1024.0 * 1024.0));
+}
+
+// Model shape from a GGUF header, read without loading any tensor data
+struct gguf_model_shape
+{
+  uint32_t n_layer = 0;
+  uint32_t n_head_kv = 0;
+  uint32_t n_ctx_train = 0;
+  uint32_t head_k = 0;
+  uint32_t head_v = 0;
+  uint64_t weights_bytes = 0;
+};
+
+static bool read_gguf_model_shape(const std::string &path, gguf_model_shape &shape) {
+  gguf_init_params gguf_params = {/*no_alloc =*/true, /*ctx =*/nullptr};
+  gguf_context *gguf = gguf_init_from_file(path.c_str(), gguf_params);
+  if (!gguf) {
+    return false;
+  }
+  auto get_u32 = [gguf](const std::string &key, uint32_t fallback) {
+    const int64_t id = gguf_find_key(gguf, key.c_str());
+    return id >= 0 && gguf_get_kv_type(gguf, id) == GGUF_TYPE_UINT32 ? gguf_get_val_u32(gguf, id) : fallback;
+  };
+  const int64_t arch_id = gguf_find_key(gguf, "general.architecture");
+  const std::string arch = arch_id >= 0 ? gguf_get_val_str(gguf, arch_id) : "";
+  const uint32_t n_embd = get_u32(arch + ".embedding_length", 0);
+  const uint32_t n_head = get_u32(arch + ".attention.head_count", 0);
+  shape.n_layer = get_u32(arch + ".block_count", 0);
+  shape.n_head_kv = get_u32(arch + ".attention.head_count_kv", n_head);
+  shape.n_ctx_train = get_u32(arch + ".context_length", 0);
+  shape.head_k = get_u32(arch + ".attention.key_length", n_head ? n_embd / n_head : 0);
+  shape.head_v = get_u32(arch + ".attention.value_length", shape.head_k);
+  shape.weights_bytes = 0;
+  for (int64_t i = 0; i < gguf_get_n_tensors(gguf); ++i) {
+    shape.weights_bytes += gguf_get_tensor_size(gguf, i);
+  }
+  gguf_free(gguf);
+  return true;
+}
+
+// Smallest per-slot context auto_ctx splits a budget into
+static const uint32_t AUTO_CTX_MIN_SLOT = 512;
+
+// With "auto_ctx", size n_ctx (and n_parallel if it has to shrink) from the GGUF
+// header so that the weights and the KV cache fit in vram_budget_mb, or else in
+// max_memory_mb. A tenth of the budget is kept for compute buffers.
+static void fit_context_to_budget(LlamaChatContext *chat_ctx, common_params &params, const char *config_json) {
+  cJSON *root = config_json ? cJSON_Parse(config_json) : nullptr;
+  if (!root) {
+    return;
+  }
+  cJSON *config_obj = cJSON_GetObjectItem(root, "model");
+  if (!cJSON_IsObject(config_obj)) {
+    config_obj = root;
+  }
+  const bool auto_ctx = cjson_get_value(config_obj, "auto_ctx", false);
+  const uint32_t vram_budget_mb = cjson_get_value(config_obj, "vram_budget_mb", (uint32_t)0);
+  cJSON_Delete(root);
+  if (!auto_ctx) {
+    return;
+  }
+
+  gguf_model_shape shape;
+  if (!read_gguf_model_shape(params.model.path, shape)) {
+    WASI_NN_LOG_WARN(chat_ctx, "auto_ctx: cannot read %s, keeping n_ctx=%d", params.model.path.c_str(), params.n_ctx);
+    return;
+  }
+  const uint32_t n_layer = shape.n_layer;
+  const uint32_t n_head_kv = shape.n_head_kv;
+  const uint32_t n_ctx_train = shape.n_ctx_train;
+  const uint32_t head_k = shape.head_k;
+  const uint32_t head_v = shape.head_v;
+  const uint64_t weights_bytes = shape.weights_bytes;
+
+  if (n_layer == 0 || head_k == 0 || n_head_kv == 0) {
+    WASI_NN_LOG_WARN(chat_ctx, "auto_ctx: unsupported model shape, keeping n_ctx=%d", params.n_ctx);
+    return;
+  }
+
+  // Only the offloaded layers count against a VRAM budget
+  uint64_t budget_mb = chat_ctx->max_memory_mb;
+  const char *budget_name = "max_memory_mb";
+  uint32_t n_layer_in_budget = n_layer;
+  if (vram_budget_mb > 0 && params.n_gpu_layers > 0) {
+    budget_mb = vram_budget_mb;
+    budget_name = "vram_budget_mb";
+    n_layer_in_budget = std::min((uint32_t)params.n_gpu_layers, n_layer);
+  }
+  if (budget_mb == 0) {
+    WASI_NN_LOG_WARN(chat_ctx, "auto_ctx needs max_memory_mb or vram_budget_mb, keeping n_ctx=%d", params.n_ctx);
+    return;
+  }
+
+  const uint64_t budget = budget_mb * 1024 * 1024;
+  const uint64_t weights = weights_bytes / n_layer * n_layer_in_budget;
+  const uint64_t per_token = kv_bytes_per_token(n_layer_in_budget, head_k * n_head_kv, head_v * n_head_kv,
+                                                params.cache_type_k, params.cache_type_v);
+  const uint64_t reserved = weights + budget / 10;
+  const uint64_t n_cells = budget > reserved && per_token > 0 ? (budget - reserved) / per_token : 0;
+
+  // Keep slots useful: fewer, larger slots rather than many tiny ones
+  uint32_t n_parallel = (uint32_t)std::max(params.n_parallel, 1);
+  if (n_cells / n_parallel < AUTO_CTX_MIN_SLOT) {
+    n_parallel = (uint32_t)std::max<uint64_t>(n_cells / AUTO_CTX_MIN_SLOT, 1);
+  }
+  uint64_t n_ctx_slot = n_cells / n_parallel;
+  if (n_ctx_train > 0) {
+    n_ctx_slot = std::min<uint64_t>(n_ctx_slot, n_ctx_train);
+  }
+  n_ctx_slot -= n_ctx_slot % 256;
+  if (n_ctx_slot < 256) {
+    WASI_NN_LOG_WARN(chat_ctx, "auto_ctx: %s of %lu MB leave no room for the KV cache (weights %.1f MB), keeping n_ctx=%d",
+                     budget_name, (unsigned long)budget_mb,
+                     weights / (1024.0 * 1024.0), params.n_ctx);
+    return;
+  }
+
+  if ((int32_t)n_parallel != params.n_parallel) {
+    WASI_NN_LOG_WARN(chat_ctx, "auto_ctx: reducing n_parallel from %d to %u to fit the budget",
+                     params.n_parallel, n_parallel);
+  }
+  params.n_parallel = (int32_t)n_parallel;
+  params.n_ctx = (int32_t)(n_ctx_slot * n_parallel);
+  WASI_NN_LOG_INFO(chat_ctx, "auto_ctx: n_ctx=%d (%lu per slot x %u) in %lu MB, %.1f KB per token",
+                   params.n_ctx, (unsigned long)n_ctx_slot, n_parallel, (unsigned long)budget_mb, per_token / 1024.0);
+}
+
+// Memory a loaded model holds: weights, its context's KV cache and compute buffers
+static uint64_t model_footprint_bytes(const memory_accounting &memory) {
+  return memory.weights_bytes + memory.kv_bytes + memory.compute_device_bytes;
+}
+
+// Forget the sources of models that are neither loaded nor used by a session,
+// so their graph handles stop resolving. Caller holds model_swap_mutex.
+static void prune_model_sources(LlamaChatContext *chat_ctx) {
+  std::unordered_set<graph> in_use = {chat_ctx->active_model.load()};
+  for (const auto &model : chat_ctx->resident_models) {
+    in_use.insert(model.id);
+  }
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    for (const auto &pair : chat_ctx->sessions) {
+      in_use.insert(pair.second.model);
+    }
+  }
+  for (auto it = chat_ctx->model_sources.begin(); it != chat_ctx->model_sources.end();) {
+    it = in_use.count(it->first) ? std::next(it) : chat_ctx->model_sources.erase(it);
+  }
+}
+
+// Free the least recently used resident model. Caller holds model_swap_mutex.
+static void unload_lru_resident_model(LlamaChatContext *chat_ctx) {
+  auto &models = chat_ctx->resident_models;
+  auto victim = std::min_element(models.begin(), models.end(),
+      [](const resident_model &a, const resident_model &b) { return a.last_used < b.last_used; });
+  WASI_NN_LOG_INFO(chat_ctx, "Unloading resident model %u (%s, %.1f MB)", victim->id,
+                   victim->path.c_str(), victim->size_bytes / (1024.0 * 1024.0));
+  models.erase(victim);
+}
+
+// Memory held by the active model and the resident ones
+static uint64_t loaded_models_bytes(LlamaChatContext *chat_ctx) {
+  uint64_t total = chat_ctx->server_ctx.model ? model_footprint_bytes(chat_ctx->memory) : 0;
+  for (const auto &model : chat_ctx->resident_models) {
+    total += model.size_bytes;
+  }
+  return total;
+}
+
+// Drop least recently used resident models until the registry fits both
+// max_resident_models and max_memory_mb (the active model counts too, with
+// its KV cache and compute buffers). Caller holds model_swap_mutex.
+static void evict_resident_models(LlamaChatContext *chat_ctx) {
+  auto &models = chat_ctx->resident_models;
+  const uint64_t budget = (uint64_t)chat_ctx->max_memory_mb * 1024 * 1024;
+  const size_t n_before = models.size();
+
+  while (!models.empty()) {
+    const uint64_t total = loaded_models_bytes(chat_ctx);
+    if (models.size() + 1 <= chat_ctx->max_resident_models && (budget == 0 || total <= budget)) {
+      break;
+    }
+    unload_lru_resident_model(chat_ctx);
+  }
+  if (models.size() != n_before) {
+    prune_model_sources(chat_ctx);
+  }
+}
+
+// The current model keeps serving while another one loads, so both have to
+// fit. Estimate the new model's weights and KV cache from its GGUF header and
+// unload resident models until it fits max_memory_mb and, for offloaded
+// layers, the GPUs' free memory. False if it still does not. Caller holds
+// model_swap_mutex.
+static bool make_room_for_load(LlamaChatContext *chat_ctx, const common_params &params) {
+  gguf_model_shape shape;
+  if (!read_gguf_model_shape(params.model.path, shape) || shape.n_layer == 0) {
+    return true;  // unknown shape: the load itself reports what does not fit
+  }
+  const uint64_t n_ctx = params.n_ctx > 0 ? (uint64_t)params.n_ctx : shape.n_ctx_train;
+  const uint64_t kv_bytes = n_ctx * kv_bytes_per_token(shape.n_layer, shape.head_k * shape.n_head_kv,
+                                                       shape.head_v * shape.n_head_kv,
+                                                       params.cache_type_k, params.cache_type_v);
+  const uint64_t need = shape.weights_bytes + kv_bytes;
+  const size_t n_before = chat_ctx->resident_models.size();
+
+  const uint64_t budget = (uint64_t)chat_ctx->max_memory_mb * 1024 * 1024;
+  if (budget > 0) {
+    while (!chat_ctx->resident_models.empty() && loaded_models_bytes(chat_ctx) + need > budget) {
+      unload_lru_resident_model(chat_ctx);
+    }
+  }
+  bool fits = budget == 0 || loaded_models_bytes(chat_ctx) + need <= budget;
+
+  const double offloaded = params.n_gpu_layers > 0
+                               ? std::min<uint32_t>(params.n_gpu_layers, shape.n_layer) / (double)shape.n_layer : 0.0;
+  const uint64_t need_device = (uint64_t)((shape.weights_bytes + (params.no_kv_offload ? 0 : kv_bytes)) * offloaded);
+  uint64_t device_free = 0;
+  if (fits && need_device > 0 && device_memory_free(device_free)) {
+    while (!chat_ctx->resident_models.empty() && device_free < need_device) {
+      unload_lru_resident_model(chat_ctx);
+      device_memory_free(device_free);
+    }
+    fits = device_free >= need_device;
+  }
+
+  if (chat_ctx->resident_models.size() != n_before) {
+    prune_model_sources(chat_ctx);
+  }
+  if (!fits) {
+    WASI_NN_LOG_ERROR(chat_ctx, "Not enough memory to load %s next to the current model: needs %.1f MB "
+                      "(%.1f MB on device, %.1f MB free), %.1f MB already loaded",
+                      params.model.path.c_str(), need / (1024.0 * 1024.0), need_device / (1024.0 * 1024.0),
+                      device_free / (1024.0 * 1024.0), loaded_models_bytes(chat_ctx) / (1024.0 * 1024.0));
+  }
+  return fits;
+}
+
+// Move a resident model out of the registry. Caller holds model_swap_mutex.
+static bool take_resident_model(LlamaChatContext *chat_ctx, graph id, resident_model &out) {
+  auto &models = chat_ctx->resident_models;
+  for (auto it = models.begin(); it != models.end(); ++it) {
+    if (it->id == id) {
+      out = std::move(*it);
+      models.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Replace the loaded model without downtime. The new model and context are
+// created and warmed up while the current model keeps serving; only the
+// handover (drain in-flight requests, swap contexts, restart the scheduler)
+// pauses new requests, which wait for it rather than fail. Both models are
+// resident during the load, which is refused with too_large if they would not
+// fit; if the running requests do not drain in time the switch is abandoned
+// with runtime_error. Sessions keep their chat history; their KV belongs
+// to the old model, so each is re-prefilled from history on its next turn
+// unless that model stays resident.
+//
+// model_id names the incoming model; a resident model with that id is installed
+// without loading. With max_resident_models > 1 the outgoing model is kept
+// resident instead of freed, together with its KV cache, slot caches and the
+// sequences of its sessions, so switching back to it re-prefills nothing; the
+// threadpools carry over when the thread settings match.
+//
+// With admitted set, a successful switch admits the caller's request to the new
+// model (see end_model_handover) and sets *admitted.
+static wasi_nn_error safe_model_switch(LlamaChatContext *chat_ctx, const char *filename, 
+                                       uint32_t filename_len, const char *config, graph model_id,
+                                       bool *admitted = nullptr) {
+  if (!chat_ctx) {
+    return invalid_argument;
+  }
+  
+  // Lock to prevent concurrent model switches
+  std::lock_guard<std::mutex> lock(chat_ctx->model_swap_mutex);
+  
+  if (chat_ctx->model_swapping_in_progress) {
+    WASI_NN_LOG_WARN(chat_ctx, "Model switch already in progress, skipping");
+    return runtime_error;
+  }
+  
+  if (model_id == chat_ctx->active_model && chat_ctx->server_ctx.model) {
+    return success;  // installed by a concurrent switch
+  }
+  
+  chat_ctx->model_swapping_in_progress = true;
+  
+  WASI_NN_LOG_INFO(chat_ctx, "Starting safe model switch to: %.*s", (int)filename_len, filename);
+  
+  const std::string path(filename, filename_len);
+  const std::string config_str = config ? config : "";
+  bool old_model_released = false;
+  bool old_model_parked = false;
+  const graph old_model = chat_ctx->active_model;
+  const bool park_old_model = chat_ctx->max_resident_models > 1 && old_model != 0;
+  try {
     chat_ctx->backup_params = chat_ctx->server_ctx.params_base;
+    // A fallback reload cannot restore unloaded adapter slots; drop them
+    auto &backup_lora = chat_ctx->backup_params.lora_adapters;
+    backup_lora.erase(std::remove_if(backup_lora.begin(), backup_lora.end(),
+                                     [](const common_adapter_lora_info &la) { return la.path.empty(); }),
+                      backup_lora.end());
+    common_params new_params;
+    common_init_result preloaded;
+
+    resident_model resident;
+    const bool was_resident = take_resident_model(chat_ctx, model_id, resident);
+    if (was_resident) {
+      // Step 1-2: The model is resident; nothing to load
+      new_params = resident.params;
+      preloaded = std::move(resident.init);
+      WASI_NN_LOG_INFO(chat_ctx, "Installing resident model %u", model_id);
+    } else {
+      // Step 1: Parse new configuration; adapters belong to the old base model
+      new_params = chat_ctx->server_ctx.params_base;
+      new_params.lora_adapters.clear();
+      if (config) {
+        parse_config_to_params(config, new_params, chat_ctx);
+      }
+      new_params.model.path = path;
+      fit_context_to_budget(chat_ctx, new_params, config);
+      
+      WASI_NN_LOG_INFO(chat_ctx, "New model config: n_gpu_layers=%d, ctx_size=%d, batch_size=%d, threads=%d",
+                       new_params.n_gpu_layers, new_params.n_ctx, 
+                       new_params.n_batch, new_params.cpuparams.n_threads);
+      
+      if (!make_room_for_load(chat_ctx, new_params)) {
+        chat_ctx->model_swapping_in_progress = false;
+        return too_large;
+      }
+      
+      // Step 2: Load and warm up the new model while the current one keeps serving
+      const auto t_load_start = std::chrono::steady_clock::now();
+      preloaded = common_init_from_params(new_params);
+      if (!preloaded.model || !preloaded.context) {
+        WASI_NN_LOG_ERROR(chat_ctx, "Failed to load new model, keeping the current model");
+        chat_ctx->model_swapping_in_progress = false;
+        return runtime_error;
+      }
+      WASI_NN_LOG_INFO(chat_ctx, "New model loaded in %lld ms, handing over",
+                       (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                           std::chrono::steady_clock::now() - t_load_start).count());
+    }
+    
+    // Step 3: Hold new requests and drain the ones running on the old model.
+    // If they do not finish in time the switch is abandoned: the old model
+    // keeps serving and a resident incoming model goes back to the registry.
+    if (begin_model_handover(chat_ctx, 30000) != success) {
+      WASI_NN_LOG_ERROR(chat_ctx, "In-flight requests did not drain, abandoning the switch to model %u", model_id);
+      if (was_resident) {
+        resident.init = std::move(preloaded);
+        chat_ctx->resident_models.push_back(std::move(resident));
+      }
+      chat_ctx->model_swapping_in_progress = false;
+      end_model_handover(chat_ctx);
+      return runtime_error;
+    }
     
-    // Step 3: Parse new configuration
-    common_params new_params = chat_ctx->server_ctx.params_base;
-    if (config) {
-      parse_config_to_params(config, new_params, chat_ctx);
+    // Sessions survive the switch. A parked model keeps its sessions' sequences
+    // and token caches for when it comes back; otherwise they are dropped.
+    resident_model parked;
+    {
+      std::lock_guard<std::mutex> sessions_lock(chat_ctx->sessions_mutex);
+      if (park_old_model) {
+        parked.seq_owner = chat_ctx->seq_owner;
+      }
+      std::fill(chat_ctx->seq_owner.begin(), chat_ctx->seq_owner.end(), 0);
+      for (auto &pair : chat_ctx->sessions) {
+        SessionInfo &session = pair.second;
+        session.seq_id = -1;
+        if (!park_old_model || session.model != old_model) {
+          session.state_path.clear();
+          session.prompt_text.clear();
+          session.prompt_tokens.clear();
+        }
+      }
     }
-    new_params.model.path = std::string(filename, filename_len);
     
-    WASI_NN_LOG_INFO(chat_ctx, "New model config: n_gpu_layers=%d, ctx_size=%d, batch_size=%d, threads=%d",
-                     new_params.n_gpu_layers, new_params.n_ctx, 
-                     new_params.n_batch, new_params.cpuparams.n_threads);
+    // Step 4: Stop the slot scheduler and park or release the old model
+    stop_server_loop(chat_ctx, true);
+    if (park_old_model) {
+      for (auto &slot : chat_ctx->server_ctx.slots) {
+        parked.slot_caches.push_back(std::move(slot.cache_tokens));
+      }
+    }
+    cleanup_all_slots(chat_ctx, park_old_model);
+    old_model_released = true;
     
-    // Step 4: Clean up all existing slots and contexts
-    cleanup_all_slots(chat_ctx);
+    if (park_old_model) {
+      parked.id = old_model;
+      parked.path = chat_ctx->current_model_path;
+      parked.config = chat_ctx->active_model_config;
+      parked.params = chat_ctx->server_ctx.params_base;
+      parked.init.model = std::move(chat_ctx->server_ctx.llama_init.model);
+      parked.init.context = std::move(chat_ctx->server_ctx.llama_init.context);
+      parked.init.lora = std::move(chat_ctx->server_ctx.llama_init.lora);
+      parked.size_bytes = model_footprint_bytes(chat_ctx->memory);
+      parked.last_used = std::chrono::steady_clock::now();
+      chat_ctx->resident_models.push_back(std::move(parked));
+      old_model_parked = true;
+    }
     
-    // Step 5: Reset server context state
-    chat_ctx->server_ctx.llama_init.model.reset();
     chat_ctx->server_ctx.llama_init.context.reset();
+    chat_ctx->server_ctx.llama_init.model.reset();
     chat_ctx->server_ctx.llama_init_dft.model.reset();
     chat_ctx->server_ctx.llama_init_dft.context.reset();
     
@@ -456,56 +1708,64 @@ static wasi_nn_error safe_model_switch(LlamaChatContext *chat_ctx, const char *f
     chat_ctx->server_ctx.model_dft = nullptr;
     chat_ctx->server_ctx.vocab = nullptr;
     
-    // Step 6: Load new model
-    chat_ctx->server_ctx.params_base = new_params;
-    
-    if (!chat_ctx->server_ctx.load_model(new_params)) {
-      WASI_NN_LOG_ERROR(chat_ctx, "Failed to load new model, attempting to restore previous model");
+    // Step 5: Install the preloaded model and restart the slot scheduler
+    if (!chat_ctx->server_ctx.load_model(new_params, std::move(preloaded))) {
+      WASI_NN_LOG_ERROR(chat_ctx, "Failed to install new model, attempting to restore previous model");
       
       // Attempt to restore previous model
-      if (!chat_ctx->server_ctx.load_model(chat_ctx->backup_params)) {
+      resident_model previous;
+      bool restored = old_model_parked && take_resident_model(chat_ctx, old_model, previous)
+                          ? chat_ctx->server_ctx.load_model(previous.params, std::move(previous.init))
+                          : chat_ctx->server_ctx.load_model(chat_ctx->backup_params);
+      if (!restored) {
         WASI_NN_LOG_ERROR(chat_ctx, "Failed to restore previous model - system in unstable state");
         chat_ctx->model_swapping_in_progress = false;
+        end_model_handover(chat_ctx);
         return runtime_error;
       }
       
+      chat_ctx->server_ctx.init();
+      start_server_loop(chat_ctx);
+
       WASI_NN_LOG_INFO(chat_ctx, "Previous model restored successfully");
       chat_ctx->model_swapping_in_progress = false;
+      end_model_handover(chat_ctx);
       return runtime_error;
     }
     
-    // Step 7: Reinitialize server context
     chat_ctx->server_ctx.init();
     
-    // Step 8: Update model information
-    chat_ctx->current_model_path = std::string(filename, filename_len);
-    chat_ctx->model_context_length = llama_model_n_ctx_train(chat_ctx->server_ctx.model);
-    chat_ctx->model_vocab_size = llama_vocab_n_tokens(chat_ctx->server_ctx.vocab);
-    
-    // Get model architecture and name if available
-    char model_desc[256] = {0};
-    if (llama_model_desc(chat_ctx->server_ctx.model, model_desc, sizeof(model_desc)) > 0) {
-      chat_ctx->model_architecture = std::string(model_desc);
+    // A resident model's KV cache is intact: give its slots their cached
+    // prompts and its sessions their sequences back
+    auto &slots = chat_ctx->server_ctx.slots;
+    if (resident.slot_caches.size() == slots.size()) {
+      for (size_t i = 0; i < slots.size(); ++i) {
+        slots[i].cache_tokens = std::move(resident.slot_caches[i]);
+      }
     }
-    
-    // Extract model name from path
-    std::string path(filename, filename_len);
-    size_t last_slash = path.find_last_of("/\\");
-    chat_ctx->model_name = (last_slash != std::string::npos) ? 
-                           path.substr(last_slash + 1) : path;
-    
-    // Generate version string
-    struct stat file_stat;
-    if (stat(filename, &file_stat) == 0) {
-      char version_buf[64];
-      snprintf(version_buf, sizeof(version_buf), "size_%ld_mtime_%ld", 
-               file_stat.st_size, file_stat.st_mtime);
-      chat_ctx->current_model_version = std::string(version_buf);
+    start_server_loop(chat_ctx);
+    if (resident.slot_caches.size() == slots.size() && resident.seq_owner.size() == slots.size()) {
+      std::lock_guard<std::mutex> sessions_lock(chat_ctx->sessions_mutex);
+      for (size_t i = 0; i < slots.size(); ++i) {
+        auto it = chat_ctx->sessions.find(resident.seq_owner[i]);
+        if (it != chat_ctx->sessions.end() && it->second.model == model_id && it->second.seq_id < 0 &&
+            chat_ctx->seq_owner[i] == 0) {
+          it->second.seq_id = (llama_seq_id)i;
+          chat_ctx->seq_owner[i] = it->first;
+        }
+      }
     }
     
-    // Step 9: Clear all sessions (context will be lost)
-    chat_ctx->sessions.clear();
-    chat_ctx->next_exec_ctx_id = 1;
+    // Step 6: Update model information and admit requests again
+    update_model_info(chat_ctx, filename, filename_len);
+    chat_ctx->active_model = model_id;
+    chat_ctx->active_model_config = config_str;
+    chat_ctx->model_sources[model_id] = {path, config_str};
+    evict_resident_models(chat_ctx);
+    end_model_handover(chat_ctx, admitted != nullptr);
+    if (admitted) {
+      *admitted = true;
+    }
     
     WASI_NN_LOG_INFO(chat_ctx, "Model switch completed successfully");
     WASI_NN_LOG_INFO(chat_ctx, "Model info: name=%s, arch=%s, vocab_size=%ld, ctx_len=%ld", 
@@ -518,19 +1778,29 @@ static wasi_nn_error safe_model_switch(LlamaChatContext *chat_ctx, const char *f
   } catch (const std::exception& e) {
     WASI_NN_LOG_ERROR(chat_ctx, "Exception during model switch: %s", e.what());
     
-    // Attempt to restore previous model
-    try {
-      if (!chat_ctx->server_ctx.load_model(chat_ctx->backup_params)) {
-        WASI_NN_LOG_ERROR(chat_ctx, "Failed to restore previous model after exception");
-      } else {
-        WASI_NN_LOG_INFO(chat_ctx, "Previous model restored after exception");
-        chat_ctx->server_ctx.init();
+    // The old model only needs restoring if it was already released
+    if (old_model_released) {
+      try {
+        stop_server_loop(chat_ctx);
+        cleanup_all_slots(chat_ctx);
+        resident_model previous;
+        bool restored = old_model_parked && take_resident_model(chat_ctx, old_model, previous)
+                            ? chat_ctx->server_ctx.load_model(previous.params, std::move(previous.init))
+                            : chat_ctx->server_ctx.load_model(chat_ctx->backup_params);
+        if (!restored) {
+          WASI_NN_LOG_ERROR(chat_ctx, "Failed to restore previous model after exception");
+        } else {
+          WASI_NN_LOG_INFO(chat_ctx, "Previous model restored after exception");
+          chat_ctx->server_ctx.init();
+          start_server_loop(chat_ctx);
+        }
+      } catch (...) {
+        WASI_NN_LOG_ERROR(chat_ctx, "Exception during model restoration");
       }
-    } catch (...) {
-      WASI_NN_LOG_ERROR(chat_ctx, "Exception during model restoration");
     }
     
     chat_ctx->model_swapping_in_progress = false;
+    end_model_handover(chat_ctx);
     return runtime_error;
   }
 }
@@ -545,58 +1815,56 @@ static int string_to_log_verbosity(const std::string& level) {
   return 1; // Default to INFO level
 }
 
+// Convert string log level to the runtime level of the backend's own logger
+static int string_to_nn_log_level(const std::string& level) {
+  if (level == "debug" || level == "DEBUG") return NN_LEVEL_DEBUG;
+  if (level == "warn" || level == "warning" || level == "WARN" || level == "WARNING") return NN_LEVEL_WARN;
+  if (level == "error" || level == "ERROR" || level == "fatal" || level == "FATAL") return NN_LEVEL_ERROR;
+  if (level == "none" || level == "NONE" || level == "off" || level == "OFF") return NN_LEVEL_NONE;
+  return NN_LEVEL_INFO;
+}
+
 // Initialize advanced logging system
 static bool initialize_advanced_logging(LlamaChatContext* chat_ctx) {
   if (!chat_ctx) return false;
-  
-  // Initialize llama.cpp logging system
-  if (chat_ctx->log_instance) {
-    common_log_free(chat_ctx->log_instance);
-  }
-  
-  chat_ctx->log_instance = common_log_init();
-  if (!chat_ctx->log_instance) {
-    NN_ERR_PRINTF("Failed to initialize advanced logging system");
-    return false;
-  }
-  
-  // Set logging verbosity based on configuration
+
+  // The backend's messages go through the asynchronous logger; the level,
+  // colors, timestamps and log file apply to it
+  wasi_nn_async_logger::instance().configure(string_to_nn_log_level(chat_ctx->log_level),
+                                             chat_ctx->enable_timestamps, chat_ctx->enable_colors,
+                                             chat_ctx->log_file, chat_ctx);
+
+  // llama.cpp's own messages (LOG_* in common and the server code) keep
+  // common_log's worker thread and stay on the console; it would truncate and
+  // interleave with the log file if pointed at the same path
   int verbosity = string_to_log_verbosity(chat_ctx->log_level);
   common_log_set_verbosity_thold(verbosity);
-  
-  // Configure colors
-  common_log_set_colors(chat_ctx->log_instance, chat_ctx->enable_colors);
-  
-  // Configure timestamps and prefixes
-  common_log_set_timestamps(chat_ctx->log_instance, chat_ctx->enable_timestamps);
-  common_log_set_prefix(chat_ctx->log_instance, true);
-  
-  // Configure file output if specified
-  if (!chat_ctx->log_file.empty()) {
-    common_log_set_file(chat_ctx->log_instance, chat_ctx->log_file.c_str());
-  }
-  
+  common_log_set_colors(common_log_main(), chat_ctx->enable_colors);
+  common_log_set_timestamps(common_log_main(), chat_ctx->enable_timestamps);
+  common_log_set_prefix(common_log_main(), true);
+
   chat_ctx->log_initialized = true;
-  
+
   // Log system initialization success
-  LOG_INF("Advanced logging system initialized");
-  LOG_INF("Log level: %s (verbosity: %d)", chat_ctx->log_level.c_str(), verbosity);
-  LOG_INF("Debug mode: %s", chat_ctx->enable_debug_log ? "enabled" : "disabled");
-  LOG_INF("Colors: %s", chat_ctx->enable_colors ? "enabled" : "disabled");
-  LOG_INF("Timestamps: %s", chat_ctx->enable_timestamps ? "enabled" : "disabled");
+  WASI_NN_LOG_INFO(chat_ctx, "Advanced logging system initialized");
+  WASI_NN_LOG_INFO(chat_ctx, "Log level: %s (verbosity: %d)", chat_ctx->log_level.c_str(), verbosity);
+  WASI_NN_LOG_INFO(chat_ctx, "Debug mode: %s", chat_ctx->enable_debug_log ? "enabled" : "disabled");
+  WASI_NN_LOG_INFO(chat_ctx, "Colors: %s", chat_ctx->enable_colors ? "enabled" : "disabled");
+  WASI_NN_LOG_INFO(chat_ctx, "Timestamps: %s", chat_ctx->enable_timestamps ? "enabled" : "disabled");
   if (!chat_ctx->log_file.empty()) {
-    LOG_INF("File logging: %s", chat_ctx->log_file.c_str());
+    WASI_NN_LOG_INFO(chat_ctx, "File logging: %s", chat_ctx->log_file.c_str());
   }
-  
+
   return true;
 }
 
-// Structured logging for task queue operations
-static void log_task_operation(LlamaChatContext* chat_ctx, const std::string& operation,
-                              int task_id, wasi_nn_task_priority priority = WASI_NN_PRIORITY_NORMAL,
-                              const std::string& additional_info = "") {
-  if (!chat_ctx || !chat_ctx->log_initialized) return;
-  
+// Structured logging for task queue operations; returns before formatting
+// anything when INFO is filtered out
+static void log_task_operation(LlamaChatContext* chat_ctx, const char* operation, int task_id,
+                               wasi_nn_task_priority priority, uint32_t queued, uint32_t capacity) {
+  if (!chat_ctx || !chat_ctx->log_initialized ||
+      !wasi_nn_async_logger::instance().enabled(NN_LEVEL_INFO)) return;
+
   const char* priority_str = "NORMAL";
   switch (priority) {
     case WASI_NN_PRIORITY_LOW: priority_str = "LOW"; break;
@@ -604,17 +1872,13 @@ static void log_task_operation(LlamaChatContext* chat_ctx, const std::string& op
     case WASI_NN_PRIORITY_HIGH: priority_str = "HIGH"; break;
     case WASI_NN_PRIORITY_URGENT: priority_str = "URGENT"; break;
   }
-  
-  if (additional_info.empty()) {
-    LOG_INF("[TASK] %s - Task %d (Priority: %s)", operation.c_str(), task_id, priority_str);
-  } else {
-    LOG_INF("[TASK] %s - Task %d (Priority: %s) - %s", 
-            operation.c_str(), task_id, priority_str, additional_info.c_str());
-  }
+
+  WASI_NN_LOG_INFO(chat_ctx, "[TASK] %s - Task %d (Priority: %s) - Queue: %u/%u",
+                   operation, task_id, priority_str, queued, capacity);
 }
 
 // Implementation of wasi_nn_task_queue methods
-bool wasi_nn_task_queue::enqueue_task(wasi_nn_task &&task, LlamaChatContext* ctx)
+wasi_nn_error wasi_nn_task_queue::enqueue_task(wasi_nn_task &&task, LlamaChatContext* ctx)
 {
   std::unique_lock<std::mutex> lock(queue_mutex);
   
@@ -628,27 +1892,59 @@ bool wasi_nn_task_queue::enqueue_task(wasi_nn_task &&task, LlamaChatContext* ctx
       NN_WARN_PRINTF("Task queue full (%d/%d), rejecting task %d", 
                      current_size, max_queue_size, task.id);
     }
-    return false;
+    return runtime_error;
   }
   
   // Assign task ID if not set
   if (task.id == -1) {
     task.id = next_task_id++;
   }
+
+  // Tag the task with its tenant's virtual finish time
+  const bool urgent = task.priority == WASI_NN_PRIORITY_URGENT;
+  if (!urgent) {
+    auto flow_it = flows.find(task.tenant);
+    const double start_tag = flow_it != flows.end() && !flow_it->second.empty()
+                                 ? std::max(virtual_time, flow_it->second.back().finish_tag)
+                                 : virtual_time;
+    task.finish_tag = start_tag + task.cost_tokens / priority_weight(task.priority);
+  }
+
+  // Admission: the work served before this task, spread over the workers,
+  // must leave it time to start before timeout_at and finish by its deadline
+  if (task.cost_ms > 0.0) {
+    double ahead_ms = 0.0;
+    for (const auto &queued : urgent_queue) {
+      ahead_ms += queued.cost_ms;
+    }
+    if (!urgent) {
+      for (const auto &flow : flows) {
+        for (const auto &queued : flow.second) {
+          if (queued.finish_tag <= task.finish_tag) {
+            ahead_ms += queued.cost_ms;
+          }
+        }
+      }
+    }
+    const auto start = std::chrono::steady_clock::now() +
+                       std::chrono::microseconds((int64_t)(ahead_ms * 1000.0 / std::max(n_workers, 1u)));
+    const bool late_start = start > task.timeout_at;
+    if (late_start || start + std::chrono::microseconds((int64_t)(task.cost_ms * 1000.0)) > task.deadline) {
+      tasks_rejected++;
+      NN_WARN_PRINTF("Rejecting task %d: it could not %s in time (%.0f ms of work ahead, %.0f ms to run)",
+                     task.id, late_start ? "start" : "finish", ahead_ms, task.cost_ms);
+      return timeout;
+    }
+  }
   
-  // Add to appropriate priority queue
-  switch (task.priority) {
-    case WASI_NN_PRIORITY_URGENT:
-      high_priority_queue.push_back(std::move(task));
-      break;
-    case WASI_NN_PRIORITY_HIGH:
-    case WASI_NN_PRIORITY_NORMAL:
-      normal_priority_queue.push_back(std::move(task));
-      break;
-    case WASI_NN_PRIORITY_LOW:
-    default:
-      low_priority_queue.push_back(std::move(task));
-      break;
+  const int task_id = task.id;
+  const wasi_nn_task_priority priority = task.priority;
+  queued_ms += task.cost_ms;
+  if (urgent) {
+    urgent_queue.push_back(std::move(task));
+  } else {
+    std::string tenant = task.tenant;
+    flows[tenant].push_back(std::move(task));
   }
   
   current_size++;
@@ -656,28 +1952,25 @@ bool wasi_nn_task_queue::enqueue_task(wasi_nn_task &&task, LlamaChatContext* ctx
   
   // Use advanced logging if available
   if (ctx) {
-    log_task_operation(ctx, "Task Queued", task.id, task.priority, 
-                      "Queue: " + std::to_string(current_size) + "/" + std::to_string(max_queue_size));
+    log_task_operation(ctx, "Task Queued", task_id, priority, current_size, max_queue_size);
   } else {
     NN_INFO_PRINTF("Task %d queued with priority %d. Queue size: %d/%d", 
-                   task.id, (int)task.priority, current_size, max_queue_size);
+                   task_id, (int)priority, current_size, max_queue_size);
   }
   
   // Notify waiting threads
   queue_condition.notify_one();
-  return true;
+  return success;
 }
 
 bool wasi_nn_task_queue::dequeue_task(wasi_nn_task &task, LlamaChatContext* ctx)
 {
   std::unique_lock<std::mutex> lock(queue_mutex);
   
-  // Wait for tasks to become available
-  queue_condition.wait(lock, [this] { 
-    return !running || 
-           !high_priority_queue.empty() || 
-           !normal_priority_queue.empty() || 
-           !low_priority_queue.empty(); 
+  // Wait for tasks to become available; wake up periodically so queued tasks
+  // expire on time even when nothing new arrives
+  queue_condition.wait_for(lock, std::chrono::milliseconds(100), [this] { 
+    return !running || current_size > 0;
   });
   
   if (!running) {
@@ -687,26 +1980,34 @@ bool wasi_nn_task_queue::dequeue_task(wasi_nn_task &task, LlamaChatContext* ctx)
   // Clean up expired tasks first
   cleanup_expired_tasks();
   
-  // Dequeue from highest priority queue first
-  if (!high_priority_queue.empty()) {
-    task = std::move(high_priority_queue.front());
-    high_priority_queue.pop_front();
-  } else if (!normal_priority_queue.empty()) {
-    task = std::move(normal_priority_queue.front());
-    normal_priority_queue.pop_front();
-  } else if (!low_priority_queue.empty()) {
-    task = std::move(low_priority_queue.front());
-    low_priority_queue.pop_front();
+  // Urgent tasks first, then the tenant head with the smallest finish tag
+  if (!urgent_queue.empty()) {
+    task = std::move(urgent_queue.front());
+    urgent_queue.pop_front();
   } else {
-    return false; // No tasks available
+    auto next = flows.end();
+    for (auto it = flows.begin(); it != flows.end(); ++it) {
+      if (next == flows.end() || it->second.front().finish_tag < next->second.front().finish_tag) {
+        next = it;
+      }
+    }
+    if (next == flows.end()) {
+      return false; // No tasks available
+    }
+    task = std::move(next->second.front());
+    next->second.pop_front();
+    if (next->second.empty()) {
+      flows.erase(next);
+    }
+    virtual_time = std::max(virtual_time, task.finish_tag);
   }
   
   current_size--;
+  queued_ms = std::max(queued_ms - task.cost_ms, 0.0);
   
   // Use advanced logging if available
   if (ctx) {
-    log_task_operation(ctx, "Task Dequeued", task.id, task.priority,
-                      "Queue: " + std::to_string(current_size) + "/" + std::to_string(max_queue_size));
+    log_task_operation(ctx, "Task Dequeued", task.id, task.priority, current_size, max_queue_size);
   } else {
     NN_INFO_PRINTF("Dequeued task %d with priority %d. Queue size: %d/%d",
                    task.id, (int)task.priority, current_size, max_queue_size);
@@ -720,14 +2021,19 @@ void wasi_nn_task_queue::cleanup_expired_tasks()
   // Note: This method assumes the queue_mutex is already locked
   auto now = std::chrono::steady_clock::now();
   
+  // A task whose deadline leaves less than its expected run time is dropped
+  // now rather than started and missed
   auto cleanup_queue = [&](std::deque<wasi_nn_task> &queue) {
     auto it = queue.begin();
     while (it != queue.end()) {
-      if (now > it->timeout_at) {
-        NN_WARN_PRINTF("Task %d expired (created %ldms ago)", 
-                       it->id,
+      const bool expired = now > it->timeout_at;
+      if (expired || now + std::chrono::microseconds((int64_t)(it->cost_ms * 1000.0)) > it->deadline) {
+        NN_WARN_PRINTF("Task %d %s (created %ldms ago)", it->id,
+                       expired ? "expired" : "cannot finish before its deadline",
                        std::chrono::duration_cast<std::chrono::milliseconds>(
                          now - it->created_at).count());
+        queued_ms = std::max(queued_ms - it->cost_ms, 0.0);
+        expired_tasks.push_back(std::move(*it));
         it = queue.erase(it);
         current_size--;
         tasks_timeout++;
@@ -737,16 +2043,26 @@ void wasi_nn_task_queue::cleanup_expired_tasks()
     }
   };
   
-  cleanup_queue(high_priority_queue);
-  cleanup_queue(normal_priority_queue);
-  cleanup_queue(low_priority_queue);
+  cleanup_queue(urgent_queue);
+  for (auto it = flows.begin(); it != flows.end();) {
+    cleanup_queue(it->second);
+    it = it->second.empty() ? flows.erase(it) : std::next(it);
+  }
+}
+
+void wasi_nn_task_queue::take_expired_tasks(std::vector<wasi_nn_task> &tasks)
+{
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  tasks = std::move(expired_tasks);
+  expired_tasks.clear();
 }
 
 void wasi_nn_task_queue::get_queue_status(uint32_t &queued, uint32_t &active, uint32_t &capacity)
 {
   std::unique_lock<std::mutex> lock(queue_mutex);
   queued = current_size;
-  active = tasks_queued - tasks_completed - tasks_timeout - tasks_rejected;
+  // Rejected tasks were never counted in tasks_queued
+  active = tasks_queued - tasks_completed - tasks_timeout;
   capacity = max_queue_size;
 }
 
@@ -754,24 +2070,32 @@ void wasi_nn_task_queue::get_queue_status(uint32_t &queued, uint32_t &active, ui
 // ================================================
 
 // Memory monitoring and pressure detection
-static uint64_t get_current_memory_usage() {
-  // Simple implementation using /proc/self/status on Linux
-  FILE* file = fopen("/proc/self/status", "r");
-  if (!file) {
-    return 0;
+
+// Refresh KV occupancy from the sequence position ranges; O(slots) and
+// cheap enough for every request. current_memory_usage becomes weights +
+// compute buffers + the KV cells in use. Caller holds server_loop_mutex.
+static void refresh_memory_accounting(LlamaChatContext* chat_ctx) {
+  llama_context *ctx = chat_ctx->server_ctx.ctx;
+  if (!ctx) {
+    return;
   }
   
-  char line[256];
-  uint64_t rss_kb = 0;
-  
-  while (fgets(line, sizeof(line), file)) {
-    if (sscanf(line, "VmRSS: %lu kB", &rss_kb) == 1) {
-      break;
+  memory_accounting &memory = chat_ctx->memory;
+  llama_memory_t mem = llama_get_memory(ctx);
+  const auto &slots = chat_ctx->server_ctx.slots;
+  memory.seq_cells.assign(slots.size(), 0);
+  memory.kv_cells_used = 0;
+  for (size_t i = 0; i < slots.size(); ++i) {
+    const llama_pos pos_min = llama_memory_seq_pos_min(mem, slots[i].id);
+    const llama_pos pos_max = llama_memory_seq_pos_max(mem, slots[i].id);
+    if (pos_min >= 0 && pos_max >= pos_min) {
+      memory.seq_cells[i] = (uint32_t)(pos_max - pos_min + 1);
+      memory.kv_cells_used += memory.seq_cells[i];
     }
   }
   
-  fclose(file);
-  return rss_kb * 1024; // Convert to bytes
+  const uint64_t kv_used = std::min<uint64_t>((uint64_t)memory.kv_cells_used * memory.kv_bytes_per_cell, memory.kv_bytes);
+  chat_ctx->current_memory_usage.store(memory.weights_bytes + memory.compute_device_bytes + kv_used);
 }
 
 static bool check_memory_pressure(LlamaChatContext* chat_ctx) {
@@ -786,100 +2110,477 @@ static bool check_memory_pressure(LlamaChatContext* chat_ctx) {
   return usage_ratio >= chat_ctx->memory_pressure_threshold;
 }
 
-// Context shifting implementation based on server.cpp
-static wasi_nn_error perform_context_shift(LlamaChatContext* chat_ctx, uint32_t session_id) {
-  if (!chat_ctx->context_shifting_enabled) {
-    NN_ERR_PRINTF("Context shifting is disabled");
-    return runtime_error;
+// Resolve the slot holding this session's KV sequence, if the session owns one
+// and the slot is idle. Caller holds sessions_mutex and server_loop_mutex.
+static server_slot *find_session_slot(LlamaChatContext* chat_ctx, graph_execution_context exec_ctx) {
+  auto it = chat_ctx->sessions.find(exec_ctx);
+  if (it == chat_ctx->sessions.end() || it->second.seq_id < 0) {
+    return nullptr;
   }
-  
-  auto& server_ctx = chat_ctx->server_ctx;
-  llama_context* ctx = server_ctx.ctx;
-  
-  if (!ctx) {
-    NN_ERR_PRINTF("No context available for shifting");
-    return runtime_error;
+
+  server_slot &slot = chat_ctx->server_ctx.slots[it->second.seq_id];
+  return slot.is_processing() ? nullptr : &slot;
+}
+
+// Session persistence: a session's KV sequence is written with the llama
+// state-seq API when it is closed, evicted or loses its sequence, next to a
+// JSON file holding the conversation. Reopening the same session_id reloads
+// both, and the KV snapshot is loaded into its sequence on the next turn, so
+// only the new message is prefilled.
+static std::string session_state_base(LlamaChatContext* chat_ctx, const std::string &session_id) {
+  std::string name;
+  for (char c : session_id) {
+    name += (isalnum((unsigned char)c) || c == '-' || c == '_') ? c : '_';
+  }
+  if (name.size() > 64) {
+    name.resize(64);
+  }
+
+  // Sanitizing may map different ids to one name; the hash keeps them apart
+  char hash_buf[24];
+  snprintf(hash_buf, sizeof(hash_buf), "%016llx",
+           (unsigned long long)std::hash<std::string>{}(session_id));
+  return chat_ctx->session_state_dir + "/" + name + "-" + hash_buf;
+}
+
+// A session's KV sequence and conversation, captured under server_loop_mutex
+// so the state files can be written once the locks are released
+struct session_snapshot {
+  graph_execution_context exec_ctx = 0;
+  std::string session_id;
+  std::string base;          // state file path without extension
+  llama_tokens tokens;       // tokens cached in the sequence
+  std::vector<uint8_t> kv;   // llama_state_seq_get_data() of the sequence
+  json meta;
+};
+
+// Copy the session's sequence and conversation into snap. Returns false if
+// there is nothing to save. Caller holds sessions_mutex or owns the session.
+static bool capture_session_state(LlamaChatContext* chat_ctx, graph_execution_context exec_ctx,
+                                  const SessionInfo &session, session_snapshot &snap) {
+  if (chat_ctx->session_state_dir.empty() || session.seq_id < 0 || !chat_ctx->server_ctx.ctx) {
+    return false;
   }
-  
-  const int n_ctx = llama_n_ctx(ctx);
-  const int n_keep = chat_ctx->n_keep_tokens;
-  
-  // In server.cpp, n_past is tracked per slot - here we use a simplified approach
-  // For a full implementation, you would track n_past per session
-  int n_past = n_ctx * 0.8f; // Assume 80% filled as a simplified estimate
-  const int n_left = n_past - n_keep;
-  
-  if (n_left <= 0) {
-    NN_WARN_PRINTF("No tokens to shift (n_past=%d, n_keep=%d)", n_past, n_keep);
-    return success;
+
+  {
+    std::lock_guard<std::mutex> loop_lock(chat_ctx->server_loop_mutex);
+    server_slot &slot = chat_ctx->server_ctx.slots[session.seq_id];
+    if (slot.is_processing() || slot.cache_tokens.empty()) {
+      return false;
+    }
+
+    llama_context *ctx = chat_ctx->server_ctx.ctx;
+    snap.tokens = slot.cache_tokens.get_text_tokens();
+    snap.kv.resize(llama_state_seq_get_size(ctx, slot.id));
+    snap.kv.resize(llama_state_seq_get_data(ctx, snap.kv.data(), snap.kv.size(), slot.id));
+  }
+
+  snap.exec_ctx = exec_ctx;
+  snap.session_id = session.session_id;
+  snap.base = session_state_base(chat_ctx, session.session_id);
+  snap.meta = {
+    {"session_id", session.session_id},
+    {"model_name", chat_ctx->model_name},
+    {"model_version", chat_ctx->current_model_version},
+    {"prompt_text", session.prompt_text},
+    {"prompt_tokens", session.prompt_tokens.get_text_tokens()},
+    {"chat_history", json::array()},
+  };
+  for (const auto &msg : session.chat_history) {
+    snap.meta["chat_history"].push_back({{"role", msg.role}, {"content", msg.content}});
   }
-  
-  const int n_discard = chat_ctx->n_discard_tokens > 0 ? 
-                        chat_ctx->n_discard_tokens : (n_left / 2);
-  
-  NN_INFO_PRINTF("Performing context shift: n_keep=%d, n_left=%d, n_discard=%d", 
-                 n_keep, n_left, n_discard);
-  
-  // Perform the actual context shift using llama.cpp memory functions
-  llama_memory_seq_rm(llama_get_memory(ctx), session_id, n_keep, n_keep + n_discard);
-  llama_memory_seq_add(llama_get_memory(ctx), session_id, n_keep + n_discard, n_past, -n_discard);
-  
-  NN_INFO_PRINTF("Context shift completed successfully");
-  return success;
+  return true;
 }
 
-// Partial KV cache deletion strategies
-static wasi_nn_error clear_partial_kv_cache(LlamaChatContext* chat_ctx, uint32_t session_id, 
-                                           const std::string& strategy) {
-  if (!chat_ctx->enable_partial_cache_deletion) {
-    NN_WARN_PRINTF("Partial cache deletion is disabled");
-    return invalid_argument;
+// Write a captured snapshot to its state files; the .kv file has the layout of
+// llama_state_seq_save_file() so llama_state_seq_load_file() restores it.
+// Needs no lock. Returns true if the KV snapshot was written.
+static bool write_session_state(LlamaChatContext* chat_ctx, const session_snapshot &snap) {
+  if (snap.kv.empty()) {
+    WASI_NN_LOG_WARN(chat_ctx, "Failed to save KV state of session '%s' to %s.kv",
+                     snap.session_id.c_str(), snap.base.c_str());
+    return false;
+  }
+
+  {
+    const uint32_t header[3] = {LLAMA_STATE_SEQ_MAGIC, LLAMA_STATE_SEQ_VERSION, (uint32_t)snap.tokens.size()};
+    std::ofstream out(snap.base + ".kv", std::ios::binary | std::ios::trunc);
+    out.write((const char *)header, sizeof(header));
+    out.write((const char *)snap.tokens.data(), snap.tokens.size() * sizeof(llama_token));
+    out.write((const char *)snap.kv.data(), snap.kv.size());
+    if (!out) {
+      WASI_NN_LOG_WARN(chat_ctx, "Failed to save KV state of session '%s' to %s.kv",
+                       snap.session_id.c_str(), snap.base.c_str());
+      return false;
+    }
+  }
+
+  std::ofstream out(snap.base + ".json", std::ios::trunc);
+  out << snap.meta.dump();
+  if (!out) {
+    WASI_NN_LOG_WARN(chat_ctx, "Failed to write session metadata %s.json", snap.base.c_str());
+    return false;
+  }
+
+  NN_INFO_PRINTF("Saved session '%s' (%zu tokens, %zu bytes) to %s.kv",
+                 snap.session_id.c_str(), snap.tokens.size(), snap.kv.size(), snap.base.c_str());
+  return true;
+}
+
+// Snapshot the session's sequence and conversation to session_state_dir.
+// Returns true if a KV snapshot was written. Caller holds sessions_mutex or
+// owns the session.
+static bool save_session_state(LlamaChatContext* chat_ctx, graph_execution_context exec_ctx,
+                               const SessionInfo &session) {
+  session_snapshot snap;
+  return capture_session_state(chat_ctx, exec_ctx, session, snap) && write_session_state(chat_ctx, snap);
+}
+
+// Write the snapshot of a session that gave up its sequence in
+// assign_session_seq(), then point the session at it so its next turn restores
+// it. Caller must not hold sessions_mutex.
+static void write_evicted_session_state(LlamaChatContext* chat_ctx, const session_snapshot &snap) {
+  if (snap.session_id.empty() || !write_session_state(chat_ctx, snap)) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+  auto it = chat_ctx->sessions.find(snap.exec_ctx);
+  if (it != chat_ctx->sessions.end() && it->second.seq_id < 0 && it->second.state_path.empty()) {
+    it->second.state_path = snap.base + ".kv";
+  }
+}
+
+// Reload the conversation of a previously saved session and mark its KV
+// snapshot for restore on the next turn. Snapshots from another model are
+// ignored. Caller holds sessions_mutex.
+static bool load_session_meta(LlamaChatContext* chat_ctx, SessionInfo &session) {
+  if (chat_ctx->session_state_dir.empty()) {
+    return false;
+  }
+
+  const std::string base = session_state_base(chat_ctx, session.session_id);
+  std::ifstream in(base + ".json");
+  if (!in) {
+    return false;
+  }
+
+  try {
+    json meta = json::parse(in);
+    if (meta.value("session_id", std::string()) != session.session_id ||
+        meta.value("model_name", std::string()) != chat_ctx->model_name ||
+        meta.value("model_version", std::string()) != chat_ctx->current_model_version) {
+      NN_INFO_PRINTF("Ignoring saved state of session '%s' from a different model",
+                     session.session_id.c_str());
+      return false;
+    }
+
+    session.chat_history.clear();
+    for (const auto &item : meta.at("chat_history")) {
+      common_chat_msg msg;
+      msg.role = item.at("role").get<std::string>();
+      msg.content = item.at("content").get<std::string>();
+      session.chat_history.push_back(msg);
+    }
+    session.prompt_text = meta.value("prompt_text", std::string());
+    llama_tokens prompt_tokens = meta.value("prompt_tokens", llama_tokens());
+    session.prompt_tokens = server_tokens(prompt_tokens);
+  } catch (const std::exception &e) {
+    WASI_NN_LOG_WARN(chat_ctx, "Invalid session metadata %s.json: %s", base.c_str(), e.what());
+    session.chat_history.clear();
+    session.prompt_text.clear();
+    session.prompt_tokens.clear();
+    return false;
+  }
+
+  session.state_path = base + ".kv";
+  NN_INFO_PRINTF("Resuming saved session '%s' (%zu messages)", session.session_id.c_str(),
+                 session.chat_history.size());
+  return true;
+}
+
+// Load the session's pending KV snapshot into its sequence. If the load fails
+// the sequence is left empty and the turn is prefilled from the token history.
+// Caller holds sessions_mutex.
+static void restore_session_state(LlamaChatContext* chat_ctx, SessionInfo &session) {
+  if (session.state_path.empty() || session.seq_id < 0 || !chat_ctx->server_ctx.ctx) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> loop_lock(chat_ctx->server_loop_mutex);
+  server_slot &slot = chat_ctx->server_ctx.slots[session.seq_id];
+  if (slot.is_processing()) {
+    return;  // retry on the next turn
+  }
+
+  llama_context *ctx = chat_ctx->server_ctx.ctx;
+  llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+  slot.cache_tokens.clear();
+
+  llama_tokens tokens(slot.n_ctx);
+  size_t n_loaded = 0;
+  const size_t n_read = llama_state_seq_load_file(ctx, session.state_path.c_str(), slot.id,
+                                                  tokens.data(), tokens.size(), &n_loaded);
+  if (n_read == 0) {
+    WASI_NN_LOG_WARN(chat_ctx, "Failed to restore KV state of session '%s' from %s",
+                     session.session_id.c_str(), session.state_path.c_str());
+    llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+  } else {
+    tokens.resize(n_loaded);
+    slot.cache_tokens.insert(tokens);
+    NN_INFO_PRINTF("Restored session '%s' into sequence %d (%zu tokens)",
+                   session.session_id.c_str(), slot.id, n_loaded);
+  }
+  session.state_path.clear();
+}
+
+// Give a session its own KV sequence. Each slot's sequence (seq_id = slot id) is
+// owned by at most one session, so interleaved sessions keep their warm prefixes.
+// With more sessions than slots, the least recently active idle session gives up
+// its sequence; if session_state_dir is set its KV is captured into evicted, for
+// write_evicted_session_state() once the locks are released; otherwise (or until
+// the write is done) it is re-prefilled from its own token history on its next
+// turn. Reserved sequences are never handed out. Returns false if every sequence
+// is reserved or belongs to a running request. Caller holds sessions_mutex.
+static bool assign_session_seq(LlamaChatContext* chat_ctx, graph_execution_context exec_ctx,
+                               SessionInfo &session, session_snapshot &evicted) {
+  if (session.seq_id >= 0) {
+    return true;
+  }
+
+  auto &owners = chat_ctx->seq_owner;
+  for (size_t i = 0; i < owners.size(); ++i) {
+    if (owners[i] == 0) {
+      owners[i] = exec_ctx;
+      session.seq_id = (llama_seq_id)i;
+      NN_DBG_PRINTF("Session %u allocated sequence %d", exec_ctx, session.seq_id);
+      return true;
+    }
+  }
+
+  // session_lru is ordered by last_activity: the first idle owner is the victim
+  graph_execution_context victim_ctx = 0;
+  SessionInfo *victim = nullptr;
+  for (graph_execution_context candidate : chat_ctx->session_lru) {
+    SessionInfo &other = chat_ctx->sessions.at(candidate);
+    if (other.seq_id >= 0 && other.n_running == 0) {
+      victim_ctx = candidate;
+      victim = &other;
+      break;
+    }
+  }
+
+  if (!victim) {
+    return false;
+  }
+
+  capture_session_state(chat_ctx, victim_ctx, *victim, evicted);
+  session.seq_id = victim->seq_id;
+  victim->seq_id = -1;
+  owners[session.seq_id] = exec_ctx;
+  NN_DBG_PRINTF("Session %u took over sequence %d from session '%s'", exec_ctx,
+                session.seq_id, victim->session_id.c_str());
+  return true;
+}
+
+// Return a session's sequence to the free pool. Caller holds sessions_mutex.
+static void release_session_seq(LlamaChatContext* chat_ctx, SessionInfo &session) {
+  if (session.seq_id < 0) {
+    return;
+  }
+
+  if ((size_t)session.seq_id < chat_ctx->seq_owner.size()) {
+    chat_ctx->seq_owner[session.seq_id] = 0;
+  }
+  NN_DBG_PRINTF("Sequence %d released by session '%s'", session.seq_id, session.session_id.c_str());
+  session.seq_id = -1;
+}
+
+// Drop a slot's sequence from pos onwards and keep its cached prompt tokens in step,
+// so the next prompt-prefix match in update_slots() only reuses cells that still exist
+static void truncate_slot_cache(llama_context* ctx, server_slot &slot, int pos) {
+  pos = std::max(0, std::min(pos, (int)slot.cache_tokens.size()));
+  llama_memory_seq_rm(llama_get_memory(ctx), slot.id, pos, -1);
+  slot.cache_tokens.keep_first(pos);
+}
+
+// Number of positions actually held by a slot's sequence. cache_tokens mirrors the
+// sequence; if it claims more than llama_memory_seq_pos_max() reports, resync it.
+static int sync_slot_cache(llama_context* ctx, server_slot &slot) {
+  const int n_pos = llama_memory_seq_pos_max(llama_get_memory(ctx), slot.id) + 1;
+  if ((int)slot.cache_tokens.size() > n_pos) {
+    NN_WARN_PRINTF("Slot %d cache out of sync (cached=%zu, seq_pos_max=%d), truncating",
+                   slot.id, slot.cache_tokens.size(), n_pos - 1);
+    slot.cache_tokens.keep_first(std::max(n_pos, 0));
+  }
+  return (int)slot.cache_tokens.size();
+}
+
+// Session owning a slot's sequence, if any. Caller holds sessions_mutex.
+static SessionInfo *find_slot_session(LlamaChatContext* chat_ctx, const server_slot &slot) {
+  if ((size_t)slot.id >= chat_ctx->seq_owner.size() || chat_ctx->seq_owner[slot.id] == 0) {
+    return nullptr;
+  }
+  auto it = chat_ctx->sessions.find(chat_ctx->seq_owner[slot.id]);
+  return it != chat_ctx->sessions.end() ? &it->second : nullptr;
+}
+
+// Remove positions [p0, p1) from a conversation. The slot's sequence is shifted
+// down so everything after p1 stays cached, and the token view (session or
+// pending prompt) drops the same range so the next prefix match lines up.
+static void erase_context_range(llama_context* ctx, server_slot *slot, llama_tokens *tokens,
+                                int p0, int p1) {
+  if (p1 <= p0) {
+    return;
+  }
+
+  if (slot) {
+    const int n_past = sync_slot_cache(ctx, *slot);
+    const int end = std::min(p1, n_past);
+    llama_memory_t mem = llama_get_memory(ctx);
+    if (p0 < end && llama_memory_can_shift(mem)) {
+      llama_memory_seq_rm(mem, slot->id, p0, end);
+      llama_memory_seq_add(mem, slot->id, end, n_past, -(end - p0));
+
+      llama_tokens new_tokens = slot->cache_tokens.get_text_tokens(); // copy
+      new_tokens.erase(new_tokens.begin() + p0, new_tokens.begin() + end);
+      slot->cache_tokens.clear();
+      slot->cache_tokens.insert(new_tokens);
+    } else if (p0 < end) {
+      truncate_slot_cache(ctx, *slot, p0);
+    }
+  }
+
+  if (tokens && p0 < (int)tokens->size()) {
+    tokens->erase(tokens->begin() + p0, tokens->begin() + std::min(p1, (int)tokens->size()));
+  }
+}
+
+// Context shifting implementation based on server.cpp update_slots(). Shifts only
+// when the prompt plus its generation budget would overflow the slot context.
+static wasi_nn_error perform_context_shift(LlamaChatContext* chat_ctx, uint32_t session_id,
+                                           llama_tokens &prompt, int n_reserve) {
+  if (!chat_ctx->context_shifting_enabled) {
+    NN_ERR_PRINTF("Context shifting is disabled");
+    return runtime_error;
   }
   
   auto& server_ctx = chat_ctx->server_ctx;
   llama_context* ctx = server_ctx.ctx;
   
-  if (!ctx) {
-    NN_ERR_PRINTF("No context available for cache deletion");
+  if (!ctx || server_ctx.slots.empty()) {
+    NN_ERR_PRINTF("No context available for shifting");
     return runtime_error;
   }
   
-  const int n_ctx = llama_n_ctx(ctx);
-  // Simplified approach - estimate current usage as 80% of context size
-  const int n_past = n_ctx * 0.8f;
+  const int n_ctx_slot = server_ctx.slots[0].n_ctx;
+  const int n_past = (int)prompt.size();
+  
+  if (n_past + n_reserve <= n_ctx_slot) {
+    return success; // Fits, nothing to shift
+  }
+  
+  const int n_keep = std::min((int)chat_ctx->n_keep_tokens, n_past);
+  const int n_left = n_past - n_keep;
+  
+  if (n_left <= 0) {
+    NN_WARN_PRINTF("No tokens to shift (n_past=%d, n_keep=%d)", n_past, n_keep);
+    return success;
+  }
+  
+  // Discard at least the overflow, at most everything after n_keep
+  int n_discard = chat_ctx->n_discard_tokens > 0 ? 
+                  (int)chat_ctx->n_discard_tokens : (n_left / 2);
+  n_discard = std::min(std::max(n_discard, n_past + n_reserve - n_ctx_slot), n_left);
+  
+  NN_INFO_PRINTF("Performing context shift for session %u: n_ctx_slot=%d, n_past=%d, n_keep=%d, n_discard=%d", 
+                 session_id, n_ctx_slot, n_past, n_keep, n_discard);
+  
+  erase_context_range(ctx, find_session_slot(chat_ctx, session_id), &prompt, n_keep, n_keep + n_discard);
+  
+  NN_INFO_PRINTF("Context shift completed successfully");
+  return success;
+}
+
+// Slots whose cache the clearing paths must leave alone: running ones, and the
+// slot pinned to the system prompt prefix (its KV is what new sessions copy)
+static bool slot_cache_in_use(const LlamaChatContext *chat_ctx, const server_slot &slot) {
+  return slot.is_processing() || slot.id == chat_ctx->pinned_prefix_slot;
+}
+
+// Apply a partial deletion strategy to one idle slot's cached tokens
+static void trim_slot_cache(LlamaChatContext* chat_ctx, llama_context* ctx, server_slot *slot,
+                            const std::string& strategy) {
+  const int n_past = sync_slot_cache(ctx, *slot);
+  SessionInfo *session = find_slot_session(chat_ctx, *slot);
+  llama_tokens *session_tokens = session ? &session->prompt_tokens.tokens : nullptr;
   
   if (strategy == "lru") {
-    // Clear the oldest entries (simplified implementation)
+    // Clear the oldest entries; later tokens are shifted down and stay cached
     const int n_clear = n_past / 4; // Clear 25% of oldest entries
     
     if (n_clear > 0) {
-      llama_memory_seq_rm(llama_get_memory(ctx), session_id, 0, n_clear);
-      NN_INFO_PRINTF("Cleared %d oldest KV cache entries using LRU strategy", n_clear);
+      erase_context_range(ctx, slot, session_tokens, 0, n_clear);
+      NN_INFO_PRINTF("Cleared %d oldest KV cache entries of slot %d using LRU strategy", n_clear, slot->id);
     }
   } else if (strategy == "fifo") {
-    // Clear the newest entries
+    // Clear the newest entries; they are re-decoded if the session continues
     const int n_clear = n_past / 4;
     
     if (n_clear > 0) {
-      llama_memory_seq_rm(llama_get_memory(ctx), session_id, n_past - n_clear, n_past);
-      NN_INFO_PRINTF("Cleared %d newest KV cache entries using FIFO strategy", n_clear);
+      truncate_slot_cache(ctx, *slot, n_past - n_clear);
+      NN_INFO_PRINTF("Cleared %d newest KV cache entries of slot %d using FIFO strategy", n_clear, slot->id);
     }
-  } else if (strategy == "smart") {
-    // Smart deletion based on token importance (simplified)
-    const int n_keep = chat_ctx->n_keep_tokens;
+  } else {
+    // Smart deletion: keep the first n_keep tokens and the recent tail, clear the middle
+    const int n_keep = std::min((int)chat_ctx->n_keep_tokens, n_past);
     const int n_clear = (n_past - n_keep) / 2;
     
     if (n_clear > 0) {
-      // Keep important tokens at the beginning and end, clear middle
       const int clear_start = n_keep + n_clear / 2;
-      llama_memory_seq_rm(llama_get_memory(ctx), session_id, clear_start, clear_start + n_clear);
-      NN_INFO_PRINTF("Cleared %d middle KV cache entries using smart strategy", n_clear);
+      erase_context_range(ctx, slot, session_tokens, clear_start, clear_start + n_clear);
+      NN_INFO_PRINTF("Cleared %d middle KV cache entries of slot %d using smart strategy", n_clear, slot->id);
     }
-  } else {
+  }
+}
+
+// Partial KV cache deletion strategies, applied to real per-slot occupancy
+static wasi_nn_error clear_partial_kv_cache(LlamaChatContext* chat_ctx, uint32_t session_id, 
+                                           const std::string& strategy) {
+  if (!chat_ctx->enable_partial_cache_deletion) {
+    NN_WARN_PRINTF("Partial cache deletion is disabled");
+    return invalid_argument;
+  }
+  
+  auto& server_ctx = chat_ctx->server_ctx;
+  llama_context* ctx = server_ctx.ctx;
+  
+  if (!ctx) {
+    NN_ERR_PRINTF("No context available for cache deletion");
+    return runtime_error;
+  }
+  
+  if (strategy != "lru" && strategy != "fifo" && strategy != "smart") {
     NN_ERR_PRINTF("Unknown cache deletion strategy: %s", strategy.c_str());
     return invalid_argument;
   }
   
+  // session_id = 0 applies the strategy to every idle slot
+  std::vector<server_slot *> targets;
+  if (session_id == 0) {
+    for (auto &slot : server_ctx.slots) {
+      if (!slot_cache_in_use(chat_ctx, slot)) {
+        targets.push_back(&slot);
+      }
+    }
+  } else if (server_slot *slot = find_session_slot(chat_ctx, session_id)) {
+    targets.push_back(slot);
+  }
+  
+  for (server_slot *slot : targets) {
+    trim_slot_cache(chat_ctx, ctx, slot, strategy);
+  }
+  
   return success;
 }
 
@@ -897,9 +2598,12 @@ static wasi_nn_error optimize_token_cache(LlamaChatContext* chat_ctx, uint32_t s
     return runtime_error;
   }
   
-  const int n_ctx = llama_n_ctx(ctx);
-  // Simplified approach - estimate cached tokens
-  const int n_cached = n_ctx * 0.7f; // Assume 70% cached
+  server_slot *slot = find_session_slot(chat_ctx, session_id);
+  if (!slot) {
+    return success; // Nothing cached for this session
+  }
+  
+  const int n_cached = sync_slot_cache(ctx, *slot);
   
   if (n_cached > (int)chat_ctx->max_cache_tokens) {
     // Perform cache cleanup
@@ -910,18 +2614,225 @@ static wasi_nn_error optimize_token_cache(LlamaChatContext* chat_ctx, uint32_t s
       return result;
     }
     
-    chat_ctx->cache_hits++;
-    NN_INFO_PRINTF("Token cache optimized: %d tokens cached, hit ratio: %.2f%%",
-                    n_cached, 
-                    (float)chat_ctx->cache_hits.load() / 
-                    (chat_ctx->cache_hits.load() + chat_ctx->cache_misses.load()) * 100.0f);
-  } else {
-    chat_ctx->cache_misses++;
+    NN_INFO_PRINTF("Token cache optimized: %d tokens cached", n_cached);
   }
   
   return success;
 }
 
+// FNV-1a over a token range; keys the shared-prefix registry
+static uint64_t hash_tokens(const llama_token *tokens, size_t n) {
+  uint64_t hash = 1469598103934665603ULL;
+  for (size_t i = 0; i < n; ++i) {
+    hash ^= (uint32_t)tokens[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static size_t common_token_prefix(const llama_tokens &a, const llama_tokens &b) {
+  size_t n = 0;
+  const size_t n_max = std::min(a.size(), b.size());
+  while (n < n_max && a[n] == b[n]) {
+    n++;
+  }
+  return n;
+}
+
+// Remember the first n tokens as a shared prefix. The registry is small; the
+// least used unpinned entry makes room. Caller holds server_loop_mutex.
+static shared_prefix_entry *register_shared_prefix(LlamaChatContext* chat_ctx, const llama_tokens &tokens,
+                                                   size_t n, bool pinned = false) {
+  const uint64_t hash = hash_tokens(tokens.data(), n);
+  auto &prefixes = chat_ctx->shared_prefixes;
+  for (auto &entry : prefixes) {
+    if (entry.hash == hash && entry.tokens.size() == n) {
+      return &entry;
+    }
+  }
+
+  const size_t max_prefixes = 16;
+  if (prefixes.size() >= max_prefixes) {
+    auto victim = prefixes.end();
+    for (auto it = prefixes.begin(); it != prefixes.end(); ++it) {
+      if (!it->pinned && (victim == prefixes.end() || it->hits < victim->hits)) {
+        victim = it;
+      }
+    }
+    if (victim == prefixes.end()) {
+      return nullptr;
+    }
+    prefixes.erase(victim);
+  }
+
+  shared_prefix_entry entry;
+  entry.hash = hash;
+  entry.tokens.assign(tokens.begin(), tokens.begin() + n);
+  entry.pinned = pinned;
+  prefixes.push_back(std::move(entry));
+  NN_DBG_PRINTF("Registered shared prefix of %zu tokens (hash %016llx)", n, (unsigned long long)hash);
+  return &prefixes.back();
+}
+
+// Before a turn runs on the session's sequence, copy the longest shared prefix
+// of its prompt that another slot already holds (llama_memory_seq_cp shares the
+// KV cells, nothing is recomputed). Registered prefixes are matched by hash;
+// otherwise other slots are scanned and a common prefix found there is
+// registered. Counts a cache hit when the turn starts from cached KV.
+// Caller holds sessions_mutex.
+static void share_prefix_kv(LlamaChatContext* chat_ctx, SessionInfo &session, const llama_tokens &prompt) {
+  server_context &server_ctx = chat_ctx->server_ctx;
+  if (!chat_ctx->enable_token_cache_reuse || session.seq_id < 0 || !server_ctx.ctx) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> loop_lock(chat_ctx->server_loop_mutex);
+  server_slot &slot = server_ctx.slots[session.seq_id];
+  if (slot.is_processing()) {
+    return;
+  }
+
+  llama_context *ctx = server_ctx.ctx;
+  llama_memory_t mem = llama_get_memory(ctx);
+  sync_slot_cache(ctx, slot);
+  const size_t n_own = common_token_prefix(slot.cache_tokens.get_text_tokens(), prompt);
+  const size_t n_min = std::max<size_t>(chat_ctx->prefix_cache_min_tokens, 1);
+
+  // Positions of a slot's sequence that are safe to copy
+  auto n_valid = [mem](const server_slot &other) {
+    const size_t n_pos = (size_t)(llama_memory_seq_pos_max(mem, other.id) + 1);
+    return std::min(n_pos, other.cache_tokens.size());
+  };
+
+  const server_slot *source = nullptr;
+  shared_prefix_entry *entry = nullptr;
+  size_t n_share = 0;
+
+  for (auto &candidate : chat_ctx->shared_prefixes) {
+    const size_t n = candidate.tokens.size();
+    if (n <= n_own || n <= n_share || n > prompt.size() ||
+        hash_tokens(prompt.data(), n) != candidate.hash) {
+      continue;
+    }
+    for (const auto &other : server_ctx.slots) {
+      if (other.id != slot.id && n_valid(other) >= n &&
+          common_token_prefix(other.cache_tokens.get_text_tokens(), candidate.tokens) >= n) {
+        source = &other;
+        entry = &candidate;
+        n_share = n;
+        break;
+      }
+    }
+  }
+
+  if (!source) {
+    for (const auto &other : server_ctx.slots) {
+      if (other.id == slot.id) {
+        continue;
+      }
+      const size_t n = std::min(common_token_prefix(other.cache_tokens.get_text_tokens(), prompt),
+                                n_valid(other));
+      if (n > n_share) {
+        source = &other;
+        n_share = n;
+      }
+    }
+    if (source && n_share >= n_min && n_share > n_own) {
+      entry = register_shared_prefix(chat_ctx, prompt, n_share);
+    }
+  }
+
+  if (!source || n_share < n_min || n_share <= n_own) {
+    if (n_own >= n_min) {
+      chat_ctx->cache_hits++;
+    } else {
+      chat_ctx->cache_misses++;
+    }
+    return;
+  }
+
+  llama_memory_seq_rm(mem, slot.id, (llama_pos)n_own, -1);
+  llama_memory_seq_cp(mem, source->id, slot.id, (llama_pos)n_own, (llama_pos)n_share);
+  slot.cache_tokens.keep_first(n_own);
+  slot.cache_tokens.insert(llama_tokens(prompt.begin() + n_own, prompt.begin() + n_share));
+
+  chat_ctx->cache_hits++;
+  if (entry) {
+    entry->hits++;
+  }
+  NN_INFO_PRINTF("Session '%s' reuses %zu prefix tokens from slot %d (had %zu cached)",
+                 session.session_id.c_str(), n_share, source->id, n_own);
+}
+
+// Decode the configured system prompt once into slot 0 so new sessions copy its
+// KV instead of prefilling it. The prefix is the longest token prefix shared by
+// any two conversations that start with the system message. Slot 0 is then
+// reserved for the prefix, so it needs a second slot to serve requests.
+// Called before the task loop starts.
+static void prefill_shared_prefix(LlamaChatContext* chat_ctx) {
+  server_context &server_ctx = chat_ctx->server_ctx;
+  chat_ctx->shared_prefixes.clear();
+  chat_ctx->pinned_prefix_slot = -1;
+
+  const std::string &system_prompt = server_ctx.params_base.system_prompt;
+  if (system_prompt.empty() || !chat_ctx->enable_token_cache_reuse || server_ctx.slots.size() < 2 ||
+      !server_ctx.chat_templates.get()) {
+    return;
+  }
+
+  common_chat_templates_inputs inputs;
+  common_chat_msg system_msg;
+  system_msg.role = "system";
+  system_msg.content = system_prompt;
+  common_chat_msg user_msg;
+  user_msg.role = "user";
+  user_msg.content = "a";
+  inputs.messages = {system_msg, user_msg};
+  inputs.add_generation_prompt = true;
+  llama_tokens tokens = common_tokenize(server_ctx.vocab,
+      common_chat_templates_apply(server_ctx.chat_templates.get(), inputs).prompt, true, true);
+  inputs.messages[1].content = "b";
+  const llama_tokens other = common_tokenize(server_ctx.vocab,
+      common_chat_templates_apply(server_ctx.chat_templates.get(), inputs).prompt, true, true);
+
+  server_slot &slot = server_ctx.slots[0];
+  const size_t n_prefix = common_token_prefix(tokens, other);
+  if (n_prefix < chat_ctx->prefix_cache_min_tokens || (int)n_prefix >= slot.n_ctx / 2) {
+    NN_INFO_PRINTF("System prompt prefix of %zu tokens not cached", n_prefix);
+    return;
+  }
+  tokens.resize(n_prefix);
+
+  llama_context *ctx = server_ctx.ctx;
+  const int n_batch = (int)llama_n_batch(ctx);
+  llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+  slot.cache_tokens.clear();
+
+  llama_batch batch = llama_batch_init(n_batch, 0, 1);
+  for (int i = 0; i < (int)n_prefix; i += n_batch) {
+    common_batch_clear(batch);
+    for (int j = i; j < std::min(i + n_batch, (int)n_prefix); ++j) {
+      common_batch_add(batch, tokens[j], j, {slot.id}, false);
+    }
+    if (llama_decode(ctx, batch) != 0) {
+      WASI_NN_LOG_WARN(chat_ctx, "Failed to decode the system prompt prefix");
+      llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+      llama_batch_free(batch);
+      return;
+    }
+  }
+  llama_batch_free(batch);
+
+  slot.cache_tokens.insert(tokens);
+  register_shared_prefix(chat_ctx, tokens, n_prefix, true);
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    chat_ctx->seq_owner[slot.id] = SEQ_RESERVED;
+  }
+  chat_ctx->pinned_prefix_slot = slot.id;
+  WASI_NN_LOG_INFO(chat_ctx, "System prompt prefix of %zu tokens cached in slot %d", n_prefix, slot.id);
+}
+
 // Complete KV cache clear (based on server.cpp implementation)
 static wasi_nn_error clear_kv_cache(LlamaChatContext* chat_ctx, uint32_t session_id) {
   auto& server_ctx = chat_ctx->server_ctx;
@@ -935,39 +2846,89 @@ static wasi_nn_error clear_kv_cache(LlamaChatContext* chat_ctx, uint32_t session
   NN_INFO_PRINTF("Clearing KV cache for session %u", session_id);
   
   if (session_id == 0) {
-    // Clear entire KV cache
-    llama_memory_clear(llama_get_memory(ctx), true);
-    NN_INFO_PRINTF("Cleared entire KV cache");
+    // Clear every idle slot; a slot mid-generation and the pinned prefix keep
+    // their sequences
+    bool all_idle = true;
+    for (auto &slot : server_ctx.slots) {
+      if (slot_cache_in_use(chat_ctx, slot)) {
+        all_idle = false;
+        continue;
+      }
+      slot.cache_tokens.clear();
+    }
+    if (all_idle) {
+      llama_memory_clear(llama_get_memory(ctx), true);
+      NN_INFO_PRINTF("Cleared entire KV cache");
+    } else {
+      for (auto &slot : server_ctx.slots) {
+        if (!slot_cache_in_use(chat_ctx, slot)) {
+          llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+        }
+      }
+      NN_INFO_PRINTF("Cleared KV cache of all idle slots");
+    }
   } else {
     // Clear cache for specific session
-    llama_memory_seq_rm(llama_get_memory(ctx), session_id, -1, -1);
+    server_slot *slot = find_session_slot(chat_ctx, session_id);
+    if (slot) {
+      truncate_slot_cache(ctx, *slot, 0);
+    }
     NN_INFO_PRINTF("Cleared KV cache for session %u", session_id);
   }
   
   return success;
 }
 
-// Memory pressure handling
+// Memory pressure handling: free just enough KV cells to get back under the
+// threshold, taking them from the least recently used idle slots first.
+// Caller holds server_loop_mutex and has refreshed the memory accounting.
 static wasi_nn_error handle_memory_pressure(LlamaChatContext* chat_ctx) {
   NN_WARN_PRINTF("Memory pressure detected, initiating cleanup");
   
-  // Strategy 1: Clear partial caches for all active sessions
-  wasi_nn_error result = clear_partial_kv_cache(chat_ctx, 0, chat_ctx->cache_deletion_strategy);
-  if (result != success) {
-    NN_WARN_PRINTF("Partial cache cleanup failed, trying full cache clear");
-    
-    // Strategy 2: Clear entire cache if partial cleanup failed
-    result = clear_kv_cache(chat_ctx, 0);
-    if (result != success) {
-      NN_ERR_PRINTF("Failed to handle memory pressure");
-      return result;
+  auto& server_ctx = chat_ctx->server_ctx;
+  llama_context* ctx = server_ctx.ctx;
+  if (!ctx) {
+    NN_ERR_PRINTF("No context available for memory pressure handling");
+    return runtime_error;
+  }
+  
+  const uint64_t limit = (uint64_t)(chat_ctx->max_memory_mb * chat_ctx->memory_pressure_threshold) * 1024 * 1024;
+  auto over_limit = [chat_ctx, limit]() {
+    refresh_memory_accounting(chat_ctx);
+    return chat_ctx->current_memory_usage.load() >= limit;
+  };
+  
+  std::vector<server_slot *> victims;
+  for (auto &slot : server_ctx.slots) {
+    if (!slot_cache_in_use(chat_ctx, slot) && !slot.cache_tokens.empty()) {
+      victims.push_back(&slot);
+    }
+  }
+  std::sort(victims.begin(), victims.end(),
+            [](const server_slot *a, const server_slot *b) { return a->t_last_used < b->t_last_used; });
+  
+  // Strategy 1: Trim idle slots with the configured deletion strategy
+  if (chat_ctx->enable_partial_cache_deletion) {
+    for (server_slot *slot : victims) {
+      trim_slot_cache(chat_ctx, ctx, slot, chat_ctx->cache_deletion_strategy);
+      if (!over_limit()) {
+        NN_INFO_PRINTF("Memory pressure handling completed");
+        return success;
+      }
     }
   }
   
-  // Update memory tracking
-  chat_ctx->current_memory_usage.store(get_current_memory_usage());
+  // Strategy 2: Drop whole idle sequences, oldest first
+  for (server_slot *slot : victims) {
+    truncate_slot_cache(ctx, *slot, 0);
+    if (!over_limit()) {
+      NN_INFO_PRINTF("Memory pressure handling completed");
+      return success;
+    }
+  }
   
-  NN_INFO_PRINTF("Memory pressure handling completed");
+  NN_WARN_PRINTF("Memory usage %.1f MB remains over the limit after clearing idle slots",
+                 chat_ctx->current_memory_usage.load() / (1024.0 * 1024.0));
   return success;
 }
 
@@ -1042,6 +3003,26 @@ std::string cjson_get_value<std::string>(cJSON *root, const char *key, const std
   return default_value;
 }
 
+// "priority" as 0-3 or low/normal/high/urgent; -1 if absent or unknown
+static int parse_priority_value(LlamaChatContext *chat_ctx, cJSON *root)
+{
+  cJSON *priority = cJSON_GetObjectItem(root, "priority");
+  if (cJSON_IsNumber(priority)) {
+    int value = (int)cJSON_GetNumberValue(priority);
+    if (value >= WASI_NN_PRIORITY_LOW && value <= WASI_NN_PRIORITY_URGENT) {
+      return value;
+    }
+  } else if (cJSON_IsString(priority)) {
+    std::string value = cJSON_GetStringValue(priority);
+    if (value == "low") return WASI_NN_PRIORITY_LOW;
+    if (value == "normal") return WASI_NN_PRIORITY_NORMAL;
+    if (value == "high") return WASI_NN_PRIORITY_HIGH;
+    if (value == "urgent") return WASI_NN_PRIORITY_URGENT;
+    WASI_NN_LOG_WARN(chat_ctx, "Unknown task priority '%s', using normal", value.c_str());
+  }
+  return -1;
+}
+
 // Function to parse runtime parameters from JSON configuration
 static bool parse_runtime_params(const char *config_json, uint32_t config_len,
                                 wasi_nn_runtime_params &runtime_params,
@@ -1081,6 +3062,7 @@ static bool parse_runtime_params(const char *config_json, uint32_t config_len,
   runtime_params.max_tokens = cjson_get_value(root, "max_tokens", runtime_params.max_tokens);
   runtime_params.max_tokens = cjson_get_value(root, "n_predict", runtime_params.max_tokens); // Alternative name
   runtime_params.seed = cjson_get_value(root, "seed", 1234); // Default seed
+  runtime_params.priority = parse_priority_value(chat_ctx, root);
 
   // Parse ignore_eos with explicit flag
   cJSON *ignore_eos_item = cJSON_GetObjectItem(root, "ignore_eos");
@@ -1133,6 +3115,28 @@ static bool parse_runtime_params(const char *config_json, uint32_t config_len,
     runtime_params.grammar_set = true;
   }
 
+  // Parse speculative decoding parameters (server.cpp names)
+  runtime_params.speculative_n_max = cjson_get_value(root, "speculative.n_max", runtime_params.speculative_n_max);
+  runtime_params.speculative_n_min = cjson_get_value(root, "speculative.n_min", runtime_params.speculative_n_min);
+  runtime_params.speculative_p_min = cjson_get_value(root, "speculative.p_min", runtime_params.speculative_p_min);
+  runtime_params.lookup_ngram = cjson_get_value(root, "lookup_ngram", runtime_params.lookup_ngram);
+
+  // Parse LoRA adapter selection: [{"id": 0, "scale": 1.0}, ...]
+  cJSON *lora = cJSON_GetObjectItem(root, "lora");
+  if (cJSON_IsArray(lora)) {
+    runtime_params.lora.clear();
+    int array_size = cJSON_GetArraySize(lora);
+    for (int i = 0; i < array_size; i++) {
+      cJSON *lora_item = cJSON_GetArrayItem(lora, i);
+      int32_t id = cjson_get_value(lora_item, "id", (int32_t)-1);
+      float scale = cjson_get_value(lora_item, "scale", 1.0f);
+      if (id >= 0) {
+        runtime_params.lora.emplace_back(id, scale);
+      }
+    }
+    runtime_params.lora_set = true;
+  }
+
   // Parameter validation
   if (runtime_params.temperature > 0.0f && (runtime_params.temperature < 0.01f || runtime_params.temperature > 10.0f)) {
     if (chat_ctx) {
@@ -1163,27 +3167,53 @@ static bool parse_runtime_params(const char *config_json, uint32_t config_len,
   return true;
 }
 
-// Function to apply runtime parameters to sampling context
-static void apply_runtime_params_to_sampling(common_sampler *&sampler, 
-                                            const wasi_nn_runtime_params &runtime_params,
-                                            const llama_model *model,
-                                            LlamaChatContext *chat_ctx = nullptr)
+// Build the per-request slot parameters from the model defaults
+static slot_params make_default_slot_params(LlamaChatContext *chat_ctx)
 {
-  if (!sampler || !model) {
-    if (chat_ctx) {
-      WASI_NN_LOG_ERROR(chat_ctx, "Invalid sampler context or model for runtime parameter application");
-    }
-    return;
+  const common_params &params_base = chat_ctx->server_ctx.params_base;
+
+  slot_params params;
+  params.stream = false;
+  params.cache_prompt = true;
+  params.n_predict = params_base.n_predict;
+  params.n_keep = params_base.n_keep;
+  params.antiprompt = params_base.antiprompt;
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->lora_mutex);
+    params.lora = params_base.lora_adapters;
+  }
+  params.sampling = params_base.sampling;
+  params.speculative = params_base.speculative;
+  params.lookup_ngram = chat_ctx->lookup_ngram;
+
+  return params;
+}
+
+// Function to apply runtime parameters to a completion task's slot parameters.
+// The slot creates its sampler from these when the task is launched.
+static void apply_runtime_params_to_slot(slot_params &params,
+                                         const wasi_nn_runtime_params &runtime_params,
+                                         LlamaChatContext *chat_ctx)
+{
+  common_params_sampling &current_params = params.sampling;
+
+  if (runtime_params.max_tokens > 0) {
+    params.n_predict = runtime_params.max_tokens;
+    WASI_NN_LOG_DEBUG(chat_ctx, "Applied max_tokens: %d", runtime_params.max_tokens);
+  }
+
+  if (runtime_params.priority >= 0 && chat_ctx && chat_ctx->priority_scheduling_enabled) {
+    params.priority = runtime_params.priority;
   }
 
-  // Get current sampling parameters from the chat context
-  common_params_sampling current_params = chat_ctx->server_ctx.params_base.sampling;
-  bool params_changed = false;
+  if (runtime_params.stop_sequences_set) {
+    params.antiprompt = runtime_params.stop_sequences;
+    WASI_NN_LOG_DEBUG(chat_ctx, "Applied %zu runtime stop sequences", runtime_params.stop_sequences.size());
+  }
 
   // Apply core sampling parameters
   if (runtime_params.temperature >= 0.0f) {
     current_params.temp = runtime_params.temperature;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied temperature: %.3f", runtime_params.temperature);
     }
@@ -1191,7 +3221,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.top_p >= 0.0f) {
     current_params.top_p = runtime_params.top_p;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied top_p: %.3f", runtime_params.top_p);
     }
@@ -1199,7 +3228,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.top_k >= 0) {
     current_params.top_k = runtime_params.top_k;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied top_k: %d", runtime_params.top_k);
     }
@@ -1207,7 +3235,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.min_p >= 0.0f) {
     current_params.min_p = runtime_params.min_p;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied min_p: %.3f", runtime_params.min_p);
     }
@@ -1215,7 +3242,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.typical_p >= 0.0f) {
     current_params.typ_p = runtime_params.typical_p;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied typical_p: %.3f", runtime_params.typical_p);
     }
@@ -1224,7 +3250,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
   // Apply penalty parameters
   if (runtime_params.repeat_penalty >= 0.0f) {
     current_params.penalty_repeat = runtime_params.repeat_penalty;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied repeat_penalty: %.3f", runtime_params.repeat_penalty);
     }
@@ -1232,7 +3257,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.frequency_penalty >= 0.0f) {
     current_params.penalty_freq = runtime_params.frequency_penalty;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied frequency_penalty: %.3f", runtime_params.frequency_penalty);
     }
@@ -1240,7 +3264,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.presence_penalty >= 0.0f) {
     current_params.penalty_present = runtime_params.presence_penalty;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied presence_penalty: %.3f", runtime_params.presence_penalty);
     }
@@ -1248,7 +3271,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.penalty_last_n >= 0) {
     current_params.penalty_last_n = runtime_params.penalty_last_n;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied penalty_last_n: %d", runtime_params.penalty_last_n);
     }
@@ -1257,7 +3279,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
   // Apply DRY sampling parameters
   if (runtime_params.dry_multiplier >= 0.0f) {
     current_params.dry_multiplier = runtime_params.dry_multiplier;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied dry_multiplier: %.3f", runtime_params.dry_multiplier);
     }
@@ -1265,7 +3286,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.dry_base >= 0.0f) {
     current_params.dry_base = runtime_params.dry_base;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied dry_base: %.3f", runtime_params.dry_base);
     }
@@ -1273,7 +3293,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.dry_allowed_length >= 0) {
     current_params.dry_allowed_length = runtime_params.dry_allowed_length;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied dry_allowed_length: %d", runtime_params.dry_allowed_length);
     }
@@ -1281,7 +3300,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.dry_penalty_last_n >= 0) {
     current_params.dry_penalty_last_n = runtime_params.dry_penalty_last_n;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied dry_penalty_last_n: %d", runtime_params.dry_penalty_last_n);
     }
@@ -1290,7 +3308,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
   // Apply dynamic temperature parameters
   if (runtime_params.dynatemp_range >= 0.0f) {
     current_params.dynatemp_range = runtime_params.dynatemp_range;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied dynatemp_range: %.3f", runtime_params.dynatemp_range);
     }
@@ -1298,7 +3315,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.dynatemp_exponent >= 0.0f) {
     current_params.dynatemp_exponent = runtime_params.dynatemp_exponent;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied dynatemp_exponent: %.3f", runtime_params.dynatemp_exponent);
     }
@@ -1307,7 +3323,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
   // Apply Mirostat parameters
   if (runtime_params.mirostat >= 0) {
     current_params.mirostat = runtime_params.mirostat;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied mirostat: %d", runtime_params.mirostat);
     }
@@ -1315,7 +3330,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.mirostat_tau >= 0.0f) {
     current_params.mirostat_tau = runtime_params.mirostat_tau;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied mirostat_tau: %.3f", runtime_params.mirostat_tau);
     }
@@ -1323,7 +3337,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.mirostat_eta >= 0.0f) {
     current_params.mirostat_eta = runtime_params.mirostat_eta;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied mirostat_eta: %.3f", runtime_params.mirostat_eta);
     }
@@ -1332,7 +3345,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
   // Apply other parameters
   if (runtime_params.seed >= 0) {
     current_params.seed = runtime_params.seed;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied seed: %d", runtime_params.seed);
     }
@@ -1340,7 +3352,6 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.n_probs >= 0) {
     current_params.n_probs = runtime_params.n_probs;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied n_probs: %d", runtime_params.n_probs);
     }
@@ -1348,15 +3359,26 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
 
   if (runtime_params.min_keep >= 0) {
     current_params.min_keep = runtime_params.min_keep;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied min_keep: %d", runtime_params.min_keep);
     }
   }
 
-  if (runtime_params.ignore_eos_set) {
+  if (runtime_params.ignore_eos_set && runtime_params.ignore_eos != current_params.ignore_eos) {
+    // ignore_eos is enforced through -inf biases on the end-of-generation tokens
+    auto &logit_bias = current_params.logit_bias;
+    if (runtime_params.ignore_eos) {
+      logit_bias.insert(logit_bias.end(), current_params.logit_bias_eog.begin(),
+                        current_params.logit_bias_eog.end());
+    } else {
+      const llama_vocab *vocab = chat_ctx->server_ctx.vocab;
+      logit_bias.erase(std::remove_if(logit_bias.begin(), logit_bias.end(),
+                                      [vocab](const llama_logit_bias &bias) {
+                                        return llama_vocab_is_eog(vocab, bias.token);
+                                      }),
+                       logit_bias.end());
+    }
     current_params.ignore_eos = runtime_params.ignore_eos;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied ignore_eos: %s", runtime_params.ignore_eos ? "true" : "false");
     }
@@ -1365,35 +3387,89 @@ static void apply_runtime_params_to_sampling(common_sampler *&sampler,
   // Apply grammar if provided
   if (runtime_params.grammar_set && !runtime_params.grammar.empty()) {
     current_params.grammar = runtime_params.grammar;
-    params_changed = true;
     if (chat_ctx) {
       WASI_NN_LOG_DEBUG(chat_ctx, "Applied grammar: %s", runtime_params.grammar.c_str());
     }
   }
 
-  // If any parameters changed, recreate the sampler
-  if (params_changed) {
-    // Free the old sampler
-    common_sampler_free(sampler);
-    
-    // Create new sampler with updated parameters
-    sampler = common_sampler_init(model, current_params);
-    
-    if (!sampler) {
-      if (chat_ctx) {
-        WASI_NN_LOG_ERROR(chat_ctx, "Failed to recreate sampler with runtime parameters");
-      }
-      return;
+  // Speculative decoding; n_max = 0 turns it off for this request
+  if (runtime_params.speculative_n_max >= 0) {
+    params.speculative.n_max = runtime_params.speculative_n_max;
+  }
+  if (runtime_params.speculative_n_min >= 0) {
+    params.speculative.n_min = runtime_params.speculative_n_min;
+  }
+  if (runtime_params.speculative_p_min >= 0.0f) {
+    params.speculative.p_min = std::min(runtime_params.speculative_p_min, 1.0f);
+  }
+  if (runtime_params.lookup_ngram >= 0) {
+    params.lookup_ngram = runtime_params.lookup_ngram;
+  }
+  params.speculative.n_min = std::min(params.speculative.n_max, params.speculative.n_min);
+  if (chat_ctx && (runtime_params.speculative_n_max >= 0 || runtime_params.lookup_ngram >= 0)) {
+    WASI_NN_LOG_DEBUG(chat_ctx, "Applied speculative: n_max=%d, n_min=%d, p_min=%.2f, lookup_ngram=%d",
+                      params.speculative.n_max, params.speculative.n_min,
+                      params.speculative.p_min, params.lookup_ngram);
+  }
+
+  // LoRA selection replaces the default adapter scales; slots only batch
+  // together with equal adapter sets (server_slot::can_batch_with)
+  if (runtime_params.lora_set) {
+    for (auto &adapter : params.lora) {
+      adapter.scale = 0.0f;
     }
-    
-    if (chat_ctx) {
-      WASI_NN_LOG_INFO(chat_ctx, "Runtime parameters applied to sampler successfully - sampler recreated");
+    for (const auto &selected : runtime_params.lora) {
+      if ((size_t)selected.first < params.lora.size() && params.lora[selected.first].ptr) {
+        params.lora[selected.first].scale = selected.second;
+      } else if (chat_ctx) {
+        WASI_NN_LOG_WARN(chat_ctx, "Unknown LoRA adapter id %d, ignoring", selected.first);
+      }
     }
-  } else {
-    if (chat_ctx) {
-      WASI_NN_LOG_DEBUG(chat_ctx, "No runtime parameters provided or changed, using existing sampler");
+  }
+}
+
+// Copy out the slot parameters of a registered runtime config, rebuilding them
+// first if the defaults they were derived from have changed
+static bool registered_config_params(LlamaChatContext *chat_ctx, uint32_t config_handle,
+                                     slot_params &params)
+{
+  std::lock_guard<std::mutex> lock(chat_ctx->runtime_configs_mutex);
+  if (config_handle == 0 || config_handle > chat_ctx->runtime_configs.size() ||
+      !chat_ctx->runtime_configs[config_handle - 1]) {
+    NN_ERR_PRINTF("Unknown runtime config handle %u", config_handle);
+    return false;
+  }
+
+  registered_runtime_config &config = *chat_ctx->runtime_configs[config_handle - 1];
+  const uint64_t generation = chat_ctx->slot_params_generation.load();
+  if (config.prepared_generation != generation) {
+    config.prepared = make_default_slot_params(chat_ctx);
+    apply_runtime_params_to_slot(config.prepared, config.runtime_params, chat_ctx);
+    config.prepared.sampling_key_prepared = config.prepared.sampling_key();
+    config.prepared.sampling_hash_prepared = std::hash<std::string>{}(config.prepared.sampling_key_prepared);
+    config.prepared_generation = generation;
+    WASI_NN_LOG_DEBUG(chat_ctx, "Prepared runtime config %u", config_handle);
+  }
+  params = config.prepared;
+  return true;
+}
+
+// KV cache types accepted by cache_type_k / cache_type_v (as in llama-server)
+static bool kv_cache_type_from_name(const std::string &name, ggml_type &type)
+{
+  static const ggml_type supported[] = {
+    GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_BF16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0,
+    GGML_TYPE_Q4_1, GGML_TYPE_IQ4_NL, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1,
+  };
+  for (ggml_type candidate : supported)
+  {
+    if (name == ggml_type_name(candidate))
+    {
+      type = candidate;
+      return true;
     }
   }
+  return false;
 }
 
 // Enhanced parameter parsing function (based on server.cpp params_from_json_cmpl)
@@ -1470,10 +3546,102 @@ static void parse_config_to_params(const char *config_json,
     params.n_ctx = cjson_get_value(config_obj, "n_ctx", params.n_ctx);  // Alternative name
     params.n_batch = cjson_get_value(config_obj, "batch_size", params.n_batch);
     params.n_batch = cjson_get_value(config_obj, "n_batch", params.n_batch);  // Alternative name
+    params.n_ubatch = cjson_get_value(config_obj, "ubatch_size", params.n_ubatch);
+    params.n_ubatch = cjson_get_value(config_obj, "n_ubatch", params.n_ubatch);  // Alternative name
+    
+    // Weight loading and placement; warmup decodes one batch while loading
+    params.use_mmap = cjson_get_value(config_obj, "use_mmap", params.use_mmap);
+    params.use_mlock = cjson_get_value(config_obj, "use_mlock", params.use_mlock);
+    params.no_kv_offload = cjson_get_value(config_obj, "no_kv_offload", params.no_kv_offload);
+    params.warmup = cjson_get_value(config_obj, "warmup", params.warmup);
+    
+    // Pooling of compute_embeddings()/rerank() outputs; unset keeps the model's own
+    std::string pooling = cjson_get_value(config_obj, "pooling", std::string());
+    if (!pooling.empty()) {
+      static const std::pair<const char *, llama_pooling_type> pooling_types[] = {
+        {"none", LLAMA_POOLING_TYPE_NONE}, {"mean", LLAMA_POOLING_TYPE_MEAN},
+        {"cls", LLAMA_POOLING_TYPE_CLS},   {"last", LLAMA_POOLING_TYPE_LAST},
+        {"rank", LLAMA_POOLING_TYPE_RANK},
+      };
+      bool known = false;
+      for (const auto &type : pooling_types) {
+        if (pooling == type.first) {
+          params.pooling_type = type.second;
+          known = true;
+        }
+      }
+      if (!known) {
+        NN_WARN_PRINTF("Unsupported pooling '%s', using the model's pooling type", pooling.c_str());
+      }
+    }
+    
+    // Slot scheduler: number of sequences decoded together; ctx_size is split across them
+    params.n_parallel = cjson_get_value(config_obj, "n_parallel", params.n_parallel);
+    params.n_parallel = cjson_get_value(config_obj, "parallel", params.n_parallel);  // Alternative name
+    params.n_parallel = std::max(params.n_parallel, 1);
+    params.cont_batching = cjson_get_value(config_obj, "cont_batching", params.cont_batching);
+    
+    // Reuse cached KV chunks past the common prefix by shifting them (0 = prefix only)
+    params.n_cache_reuse = cjson_get_value(config_obj, "n_cache_reuse", params.n_cache_reuse);
+    
+    // KV cache element types; a quantized V cache needs flash attention
+    params.flash_attn = cjson_get_value(config_obj, "flash_attn", params.flash_attn);
+    std::string cache_type_k = cjson_get_value(config_obj, "cache_type_k", std::string());
+    std::string cache_type_v = cjson_get_value(config_obj, "cache_type_v", std::string());
+    if (!cache_type_k.empty() && !kv_cache_type_from_name(cache_type_k, params.cache_type_k)) {
+      NN_WARN_PRINTF("Unsupported cache_type_k '%s', using %s", cache_type_k.c_str(), ggml_type_name(params.cache_type_k));
+    }
+    if (!cache_type_v.empty() && !kv_cache_type_from_name(cache_type_v, params.cache_type_v)) {
+      NN_WARN_PRINTF("Unsupported cache_type_v '%s', using %s", cache_type_v.c_str(), ggml_type_name(params.cache_type_v));
+    }
+    if (ggml_is_quantized(params.cache_type_v) && !params.flash_attn) {
+      NN_WARN_PRINTF("cache_type_v=%s requires flash attention, enabling flash_attn", ggml_type_name(params.cache_type_v));
+      params.flash_attn = true;
+    }
+    
+    // LoRA adapters loaded with the model: [{"path": "...", "scale": 1.0}, ...]
+    cJSON *lora = cJSON_GetObjectItem(config_obj, "lora");
+    if (cJSON_IsArray(lora)) {
+      params.lora_adapters.clear();
+      int array_size = cJSON_GetArraySize(lora);
+      for (int i = 0; i < array_size; i++) {
+        cJSON *lora_item = cJSON_GetArrayItem(lora, i);
+        common_adapter_lora_info adapter;
+        adapter.path = cjson_get_value(lora_item, "path", std::string());
+        adapter.scale = cjson_get_value(lora_item, "scale", 1.0f);
+        if (!adapter.path.empty()) {
+          params.lora_adapters.push_back(std::move(adapter));
+        }
+      }
+    }
+    
+    // System message opening every new session; its KV is decoded once and shared
+    params.system_prompt = cjson_get_value(config_obj, "system_prompt", params.system_prompt);
     
     uint32_t threads = cjson_get_value(config_obj, "threads", params.cpuparams.n_threads);
     params.cpuparams.n_threads = threads;
     params.cpuparams_batch.n_threads = threads;
+    
+    // CPU placement of the compute threadpools; the prompt threadpool shares it
+    const int32_t threads_batch = cjson_get_value(config_obj, "threads_batch", params.cpuparams_batch.n_threads);
+    std::string cpu_mask = cjson_get_value(config_obj, "cpu_mask", std::string());
+    std::string cpu_range = cjson_get_value(config_obj, "cpu_range", std::string());
+    if (!cpu_mask.empty() && !parse_cpu_mask(cpu_mask, params.cpuparams.cpumask)) {
+      NN_WARN_PRINTF("Invalid cpu_mask '%s', ignoring", cpu_mask.c_str());
+    } else if (!cpu_mask.empty()) {
+      params.cpuparams.mask_valid = true;
+    }
+    if (!cpu_range.empty() && !parse_cpu_range(cpu_range, params.cpuparams.cpumask)) {
+      NN_WARN_PRINTF("Invalid cpu_range '%s', ignoring", cpu_range.c_str());
+    } else if (!cpu_range.empty()) {
+      params.cpuparams.mask_valid = true;
+    }
+    params.cpuparams.strict_cpu = cjson_get_value(config_obj, "cpu_strict", params.cpuparams.strict_cpu);
+    int32_t priority = cjson_get_value(config_obj, "thread_priority", (int32_t)params.cpuparams.priority);
+    params.cpuparams.priority = (ggml_sched_priority)std::max(-1, std::min(priority, 3));
+    params.cpuparams.poll = std::min(cjson_get_value(config_obj, "poll", params.cpuparams.poll), 100u);
+    params.cpuparams_batch = params.cpuparams;
+    params.cpuparams_batch.n_threads = threads_batch;
   };
 
   // Parse nested model configuration or legacy flat structure
@@ -1565,6 +3733,36 @@ static void parse_config_to_params(const char *config_json,
     }
   }
 
+  // Parse speculative decoding configuration. A draft model is loaded next to
+  // the target by server_context::load_model(); without one, prompt lookup
+  // (lookup_ngram > 0) drafts from n-grams already in the context.
+  if (chat_ctx) {
+    chat_ctx->lookup_ngram = 0;
+  }
+  cJSON *speculative = cJSON_GetObjectItem(root, "speculative");
+  if (cJSON_IsObject(speculative))
+  {
+    params.speculative.model.path = cjson_get_value(speculative, "draft_model", params.speculative.model.path);
+    params.speculative.model.path = cjson_get_value(speculative, "model", params.speculative.model.path);  // Alternative name
+    params.speculative.n_max = cjson_get_value(speculative, "n_max", params.speculative.n_max);
+    params.speculative.n_min = cjson_get_value(speculative, "n_min", params.speculative.n_min);
+    params.speculative.p_min = cjson_get_value(speculative, "p_min", params.speculative.p_min);
+    params.speculative.n_ctx = cjson_get_value(speculative, "ctx_size", params.speculative.n_ctx);
+    params.speculative.n_gpu_layers = cjson_get_value(speculative, "n_gpu_layers", params.speculative.n_gpu_layers);
+
+    params.speculative.n_max = std::max(params.speculative.n_max, 0);
+    params.speculative.n_min = std::max(std::min(params.speculative.n_min, params.speculative.n_max), 0);
+
+    int32_t lookup_ngram = cjson_get_value(speculative, "lookup_ngram", (int32_t)0);
+    if (chat_ctx) {
+      chat_ctx->lookup_ngram = std::max(lookup_ngram, 0);
+      WASI_NN_LOG_INFO(chat_ctx, "Speculative decoding: draft_model=%s, n_max=%d, n_min=%d, p_min=%.2f, lookup_ngram=%d",
+                       params.speculative.model.path.empty() ? "none" : params.speculative.model.path.c_str(),
+                       params.speculative.n_max, params.speculative.n_min, params.speculative.p_min,
+                       chat_ctx->lookup_ngram);
+    }
+  }
+
   // Parse stopping criteria (enhanced version)
   cJSON *stopping = cJSON_GetObjectItem(root, "stopping");
   if (cJSON_IsObject(stopping))
@@ -1754,6 +3952,27 @@ static void parse_memory_config(const char *config_json, LlamaChatContext *chat_
                        cache_deletion_strategy.c_str(), chat_ctx->cache_deletion_strategy.c_str());
     }
 
+    // Shortest common prompt prefix copied between session sequences
+    chat_ctx->prefix_cache_min_tokens = cjson_get_value(memory, "prefix_cache_min_tokens", chat_ctx->prefix_cache_min_tokens);
+
+    // Session KV snapshot directory (created on demand)
+    std::string session_state_dir = cjson_get_value(memory, "session_state_dir", chat_ctx->session_state_dir);
+    if (!session_state_dir.empty() && session_state_dir != chat_ctx->session_state_dir)
+    {
+      while (session_state_dir.size() > 1 && session_state_dir.back() == '/')
+        session_state_dir.pop_back();
+      if (fs_create_directory_with_parents(session_state_dir))
+      {
+        chat_ctx->session_state_dir = session_state_dir;
+        WASI_NN_LOG_INFO(chat_ctx, "Session state directory set to: %s", session_state_dir.c_str());
+      }
+      else
+      {
+        WASI_NN_LOG_WARN(chat_ctx, "Cannot create session state directory '%s', session persistence disabled",
+                         session_state_dir.c_str());
+      }
+    }
+
     // Memory limit with validation
     uint32_t max_memory_mb = cjson_get_value(memory, "max_memory_mb", chat_ctx->max_memory_mb);
     if (max_memory_mb == 0 || max_memory_mb >= 64)  // 0 = unlimited, or at least 64MB
@@ -1784,80 +4003,33 @@ static void parse_memory_config(const char *config_json, LlamaChatContext *chat_
   cJSON_Delete(root);
 }
 
-// Helper function to setup threadpools (from main.cpp)
-static wasi_nn_error setup_threadpools(LlamaChatContext *chat_ctx)
-{
-  // Access server context members through server_ctx
-  common_params& params = chat_ctx->server_ctx.params_base;
-  
-  auto *reg = ggml_backend_dev_backend_reg(
-      ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
-  auto ggml_threadpool_new_fn =
-      (decltype(ggml_threadpool_new) *)ggml_backend_reg_get_proc_address(
-          reg, "ggml_threadpool_new");
-
-  struct ggml_threadpool_params tpp_batch =
-      ggml_threadpool_params_from_cpu_params(params.cpuparams_batch);
-  struct ggml_threadpool_params tpp =
-      ggml_threadpool_params_from_cpu_params(params.cpuparams);
-
-  // Create batch threadpool if different from main threadpool
-  ggml_threadpool* threadpool_batch = nullptr;
-  if (!ggml_threadpool_params_match(&tpp, &tpp_batch))
-  {
-    threadpool_batch = ggml_threadpool_new_fn(&tpp_batch);
-    if (!threadpool_batch)
-    {
-      NN_ERR_PRINTF("Failed to create batch threadpool");
-      return runtime_error;
-    }
-    tpp.paused = true;
-  }
-
-  ggml_threadpool* threadpool = ggml_threadpool_new_fn(&tpp);
-  if (!threadpool)
-  {
-    NN_ERR_PRINTF("Failed to create threadpool");
-    return runtime_error;
-  }
-
-  llama_attach_threadpool(chat_ctx->server_ctx.ctx, threadpool,
-                          threadpool_batch);
-  return success;
-}
-
 // ===============================================
 // Phase 4.3: Forward declarations for internal memory management functions
 // ===============================================
-static wasi_nn_error auto_clear_kv_cache_session(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx);
 static wasi_nn_error auto_clear_all_kv_cache(LlamaChatContext *chat_ctx);
-static wasi_nn_error auto_perform_context_shift_session(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx);
+static wasi_nn_error auto_perform_context_shift_session(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx,
+                                                        llama_tokens &prompt, int n_reserve);
 static wasi_nn_error auto_optimize_memory(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx);
 
-// Function to safely copy a string into tensor_data (from original)
-void copy_string_to_tensor_data(tensor_data dest, uint32_t dest_size,
-                                const std::string &src)
+// Write a response into a caller buffer of `capacity` bytes. Returns false, and
+// writes nothing, when the response plus its NUL does not fit.
+static bool write_output(tensor_data dest, uint32_t capacity, const std::string &src)
 {
-  if (dest == nullptr || dest_size == 0)
+  if (!dest || src.size() >= capacity)
   {
-    NN_ERR_PRINTF("Destination buffer is null or size is zero");
-    return;
+    return false;
   }
+  memcpy(dest, src.data(), src.size());
+  dest[src.size()] = '\0';
+  return true;
+}
 
-  size_t src_size = src.size();
-  if (src_size >= dest_size)
-  {
-    NN_WARN_PRINTF("Source string is too long, truncating");
-    src_size = dest_size - 1;
-  }
+static void preload_model(LlamaChatContext *chat_ctx);
+static void wait_for_preload(LlamaChatContext *chat_ctx);
+static wasi_nn_error load_model_by_name(LlamaChatContext *chat_ctx, const char *filename, uint32_t filename_len,
+                                        const char *config, graph *g);
 
-  std::copy(src.begin(), src.begin() + src_size,
-            reinterpret_cast<uint8_t *>(dest));
-  if (dest_size > 0)
-  {
-    dest[src_size] = '\0';
-  }
-}
+static wasi_nn_error create_backend(void **ctx, const char *config, uint32_t config_len, int32_t replica_node);
 
 // Main API functions
 __attribute__((visibility("default"))) wasi_nn_error init_backend(void **ctx)
@@ -1867,6 +4039,35 @@ __attribute__((visibility("default"))) wasi_nn_error init_backend(void **ctx)
 
 __attribute__((visibility("default"))) wasi_nn_error
 init_backend_with_config(void **ctx, const char *config, uint32_t config_len)
+{
+  return create_backend(ctx, config, config_len, -1);
+}
+
+// Start one replica backend per NUMA node past the first, each with the same
+// config. Returns false, with the started ones shut down, if one fails.
+static bool start_numa_replicas(LlamaChatContext *chat_ctx, const char *config, uint32_t config_len)
+{
+  for (uint32_t node = 1; node < chat_ctx->exec_ctx_stride; ++node)
+  {
+    void *replica = nullptr;
+    if (create_backend(&replica, config, config_len, (int32_t)node) != success)
+    {
+      NN_ERR_PRINTF("Failed to start the replica for NUMA node %u", node);
+      for (LlamaChatContext *started : chat_ctx->replicas)
+      {
+        deinit_backend(started);
+      }
+      chat_ctx->replicas.clear();
+      return false;
+    }
+    chat_ctx->replicas.push_back((LlamaChatContext *)replica);
+  }
+  NN_INFO_PRINTF("Serving from %u NUMA replicas", chat_ctx->exec_ctx_stride);
+  return true;
+}
+
+// init_backend_with_config, or with replica_node >= 0 the replica of that node
+static wasi_nn_error create_backend(void **ctx, const char *config, uint32_t config_len, int32_t replica_node)
 {
   LlamaChatContext *chat_ctx = new LlamaChatContext();
   if (!chat_ctx)
@@ -1912,6 +4113,57 @@ init_backend_with_config(void **ctx, const char *config, uint32_t config_len)
         // Boolean settings
         chat_ctx->auto_cleanup_enabled = cjson_get_value(config_obj, "auto_cleanup", chat_ctx->auto_cleanup_enabled);
 
+        // Concurrent compute() tasks with validation
+        uint32_t max_concurrent = cjson_get_value(config_obj, "max_concurrent", chat_ctx->max_concurrent);
+        if (max_concurrent > 0 && max_concurrent <= 256)
+        {
+          chat_ctx->max_concurrent = max_concurrent;
+          WASI_NN_LOG_INFO(chat_ctx, "Max concurrent tasks set to: %u", max_concurrent);
+        }
+        else if (max_concurrent != chat_ctx->max_concurrent)
+        {
+          WASI_NN_LOG_WARN(chat_ctx, "Invalid max_concurrent (%u), must be between 1-256, using default: %u", 
+                           max_concurrent, chat_ctx->max_concurrent);
+        }
+
+        // Models kept loaded at once (1 = a load replaces the current model)
+        uint32_t max_resident_models = cjson_get_value(config_obj, "max_resident_models", chat_ctx->max_resident_models);
+        if (max_resident_models >= 1 && max_resident_models <= 16)
+        {
+          chat_ctx->max_resident_models = max_resident_models;
+        }
+        else
+        {
+          WASI_NN_LOG_WARN(chat_ctx, "Invalid max_resident_models (%u), must be between 1-16, using default: %u",
+                           max_resident_models, chat_ctx->max_resident_models);
+        }
+
+        // NUMA: llama's memory and thread strategy, and optionally one model
+        // replica per node with sessions kept on their home replica
+        std::string numa = cjson_get_value(config_obj, "numa", std::string("disabled"));
+        if (numa == "disabled")
+        {
+          chat_ctx->numa_strategy = GGML_NUMA_STRATEGY_DISABLED;
+        }
+        else if (numa == "distribute")
+        {
+          chat_ctx->numa_strategy = GGML_NUMA_STRATEGY_DISTRIBUTE;
+        }
+        else if (numa == "isolate")
+        {
+          chat_ctx->numa_strategy = GGML_NUMA_STRATEGY_ISOLATE;
+        }
+        else if (numa == "numactl")
+        {
+          chat_ctx->numa_strategy = GGML_NUMA_STRATEGY_NUMACTL;
+        }
+        else
+        {
+          WASI_NN_LOG_WARN(chat_ctx, "Invalid numa strategy '%s', must be disabled/distribute/isolate/numactl",
+                           numa.c_str());
+        }
+        chat_ctx->numa_replicas = cjson_get_value(config_obj, "numa_replicas", chat_ctx->numa_replicas);
+
         // Queue size with validation
         uint32_t queue_size = cjson_get_value(config_obj, "queue_size", chat_ctx->queue_size);
         if (queue_size > 0 && queue_size <= 10000)  // Reasonable range
@@ -1950,6 +4202,18 @@ init_backend_with_config(void **ctx, const char *config, uint32_t config_len)
                                                            chat_ctx->fair_scheduling_enabled);
         chat_ctx->auto_queue_cleanup = cjson_get_value(config_obj, "auto_queue_cleanup", 
                                                       chat_ctx->auto_queue_cleanup);
+
+        int32_t preempt_max_steps = cjson_get_value(config_obj, "preempt_max_steps",
+                                                    chat_ctx->server_ctx.preempt_max_steps);
+        if (preempt_max_steps >= 0 && preempt_max_steps <= 4096)
+        {
+          chat_ctx->server_ctx.preempt_max_steps = preempt_max_steps;
+        }
+        else
+        {
+          WASI_NN_LOG_WARN(chat_ctx, "Invalid preempt_max_steps (%d), must be between 0-4096, using default: %d",
+                           preempt_max_steps, chat_ctx->server_ctx.preempt_max_steps);
+        }
         
         // Queue threshold settings with validation
         uint32_t queue_warning = cjson_get_value(config_obj, "queue_warning_threshold", chat_ctx->queue_warning_threshold);
@@ -2095,6 +4359,23 @@ init_backend_with_config(void **ctx, const char *config, uint32_t config_len)
         chat_ctx->enable_timestamps = cjson_get_value(logging, "timestamps", chat_ctx->enable_timestamps);
         chat_ctx->enable_colors = cjson_get_value(logging, "colors", chat_ctx->enable_colors);
 
+        // Span tracing for get_trace(); set_tracing() switches it at runtime
+        uint32_t trace_events = cjson_get_value(logging, "trace_events_per_thread", chat_ctx->trace_events_per_thread);
+        if (trace_events >= 256 && trace_events <= 1048576)
+        {
+          chat_ctx->trace_events_per_thread = trace_events;
+        }
+        else
+        {
+          WASI_NN_LOG_WARN(chat_ctx, "Invalid trace_events_per_thread (%u), must be between 256-1048576, using default: %u",
+                           trace_events, chat_ctx->trace_events_per_thread);
+        }
+        if (replica_node < 0)
+        {
+          wasi_nn_tracer::instance().configure(cjson_get_value(logging, "trace", false),
+                                               chat_ctx->trace_events_per_thread, chat_ctx);
+        }
+
         // Log file path validation
         std::string log_file = cjson_get_value(logging, "file", chat_ctx->log_file);
         if (!log_file.empty())
@@ -2120,6 +4401,61 @@ init_backend_with_config(void **ctx, const char *config, uint32_t config_len)
           WASI_NN_LOG_WARN(chat_ctx, "Invalid batch_size (%u), must be between 1-2048, using default: %u", 
                            batch_size, chat_ctx->batch_size);
         }
+
+        chat_ctx->pause_threads_when_idle = cjson_get_value(performance, "pause_threads_when_idle",
+                                                            chat_ctx->pause_threads_when_idle);
+
+        // Idle samplers kept for reuse by requests with the same sampling settings
+        uint32_t sampler_cache_size = cjson_get_value(performance, "sampler_cache_size",
+                                                      (uint32_t)chat_ctx->server_ctx.sampler_cache_size);
+        if (sampler_cache_size <= 256)
+        {
+          chat_ctx->server_ctx.sampler_cache_size = sampler_cache_size;
+        }
+        else
+        {
+          WASI_NN_LOG_WARN(chat_ctx, "Invalid sampler_cache_size (%u), must be between 0-256, using default: %zu",
+                           sampler_cache_size, chat_ctx->server_ctx.sampler_cache_size);
+        }
+
+        // Decode-step budget shared by generated tokens and prompt chunks
+        int32_t step_token_budget = cjson_get_value(performance, "step_token_budget",
+                                                    chat_ctx->server_ctx.step_token_budget);
+        if (step_token_budget >= -1 && step_token_budget <= 65536)
+        {
+          chat_ctx->server_ctx.step_token_budget = step_token_budget;
+        }
+        else
+        {
+          WASI_NN_LOG_WARN(chat_ctx, "Invalid step_token_budget (%d), must be between -1-65536, using default: %d",
+                           step_token_budget, chat_ctx->server_ctx.step_token_budget);
+        }
+      }
+
+      // Model to load in the background: {"model": path, "config": {...} or "...", "warmup": bool}
+      cJSON *preload = cJSON_GetObjectItem(json, "preload");
+      if (cJSON_IsObject(preload))
+      {
+        chat_ctx->preload_model_path = cjson_get_value(preload, "model", std::string());
+        cJSON *preload_config = cJSON_GetObjectItem(preload, "config");
+        if (cJSON_IsString(preload_config))
+        {
+          chat_ctx->preload_model_config = cJSON_GetStringValue(preload_config);
+        }
+        else if (cJSON_IsObject(preload_config))
+        {
+          char *printed = cJSON_PrintUnformatted(preload_config);
+          if (printed)
+          {
+            chat_ctx->preload_model_config = printed;
+            cJSON_free(printed);
+          }
+        }
+        chat_ctx->preload_warmup = cjson_get_value(preload, "warmup", chat_ctx->preload_warmup);
+        if (chat_ctx->preload_model_path.empty())
+        {
+          WASI_NN_LOG_WARN(chat_ctx, "preload has no model path, nothing will be preloaded");
+        }
       }
 
       cJSON_Delete(json);
@@ -2132,45 +4468,95 @@ init_backend_with_config(void **ctx, const char *config, uint32_t config_len)
     }
   }
 
-  // Initialize llama backend (from main.cpp)
-  llama_backend_init();
-  llama_numa_init(GGML_NUMA_STRATEGY_DISABLED);
+  // Replicas are pinned to their node and share the primary's process setup
+  if (replica_node >= 0)
+  {
+    chat_ctx->is_replica = true;
+    chat_ctx->numa_node = replica_node;
+    chat_ctx->numa_replicas = false;
+    chat_ctx->exec_ctx_stride = (uint32_t)numa_node_count();
+    chat_ctx->next_exec_ctx_id = (graph_execution_context)replica_node + 1;
+  }
+  else if (chat_ctx->numa_replicas)
+  {
+    const int n_nodes = numa_node_count();
+    if (n_nodes > 1)
+    {
+      chat_ctx->numa_node = 0;
+      chat_ctx->exec_ctx_stride = (uint32_t)n_nodes;
+    }
+    else
+    {
+      WASI_NN_LOG_WARN(chat_ctx, "numa_replicas needs more than one NUMA node (found %d), serving unreplicated",
+                       n_nodes);
+      chat_ctx->numa_replicas = false;
+    }
+  }
+
+  // Initialize llama backend (from main.cpp). The backend and the NUMA strategy
+  // are process wide: ggml applies the first strategy it is given.
+  if (replica_node < 0)
+  {
+    llama_backend_init();
+    llama_numa_init(chat_ctx->numa_strategy);
+  }
 
   // Initialize task queue system (Phase 4.2)
   chat_ctx->task_queue = std::make_shared<wasi_nn_task_queue>();
   chat_ctx->task_queue->max_queue_size = chat_ctx->queue_size;
+  chat_ctx->task_queue->n_workers = std::max(chat_ctx->max_concurrent, 1u);
   
-  // Start task processing thread if enabled
+  // Start task workers if enabled. Each worker runs one compute() task at a time
+  // through the slot scheduler, so up to max_concurrent turns are batched together.
   if (chat_ctx->task_processing_enabled) {
-    chat_ctx->task_processor_thread = std::thread([chat_ctx]() {
-      NN_INFO_PRINTF("Task processor thread started");
-      
-      wasi_nn_task task;
-      while (chat_ctx->task_queue->running) {
-        if (chat_ctx->task_queue->dequeue_task(task, chat_ctx)) {
-          // Process the task
-          NN_INFO_PRINTF("Processing task %d for execution context %d", 
-                         task.id, task.exec_ctx);
-          
-          // For now, just mark as completed
-          // In a full implementation, this would trigger actual inference
-          {
-            std::unique_lock<std::mutex> lock(chat_ctx->task_queue->queue_mutex);
-            chat_ctx->task_queue->tasks_completed++;
+    for (uint32_t i = 0; i < chat_ctx->max_concurrent; ++i) {
+      chat_ctx->task_workers.emplace_back([chat_ctx, i]() {
+        numa_thread_binding numa_binding(chat_ctx->numa_node);
+        NN_DBG_PRINTF("Task worker %u started", i);
+        
+        wasi_nn_task task;
+        std::vector<wasi_nn_task> expired;
+        while (chat_ctx->task_queue->running) {
+          chat_ctx->task_queue->take_expired_tasks(expired);
+          for (const auto &expired_task : expired) {
+            complete_compute_task(chat_ctx, expired_task.exec_ctx, timeout, "");
+          }
+
+          if (chat_ctx->task_queue->dequeue_task(task, chat_ctx)) {
+            chat_ctx->metrics.queue_wait.observe(std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - task.created_at).count());
+            NN_INFO_PRINTF("Processing task %d for execution context %d", 
+                           task.id, task.exec_ctx);
+            
+            process_compute_task(chat_ctx, task);
+            {
+              std::unique_lock<std::mutex> lock(chat_ctx->task_queue->queue_mutex);
+              chat_ctx->task_queue->tasks_completed++;
+            }
+            
+            NN_INFO_PRINTF("Task %d completed", task.id);
           }
-          
-          NN_INFO_PRINTF("Task %d completed", task.id);
         }
-      }
-      
-      NN_INFO_PRINTF("Task processor thread terminated");
-    });
+        
+        NN_DBG_PRINTF("Task worker %u terminated", i);
+      });
+    }
   }
 
+  start_session_reaper(chat_ctx);
+
   NN_INFO_PRINTF("Llama chat backend initialized successfully");
   
-  // Phase 5.1: Initialize advanced logging system
-  initialize_advanced_logging(chat_ctx);
+  // Phase 5.1: Initialize advanced logging system. Replicas log through the
+  // logger their primary has configured.
+  if (replica_node < 0)
+  {
+    initialize_advanced_logging(chat_ctx);
+  }
+  else
+  {
+    chat_ctx->log_initialized = true;
+  }
   
   // Use enhanced logging for configuration output
   WASI_NN_LOG_INFO(chat_ctx,
@@ -2200,6 +4586,16 @@ init_backend_with_config(void **ctx, const char *config, uint32_t config_len)
       "Performance config: batch_processing=%s, batch_size=%d",
       chat_ctx->batch_processing_enabled ? "true" : "false",
       chat_ctx->batch_size);
+
+  if (chat_ctx->numa_replicas && !start_numa_replicas(chat_ctx, config, config_len)) {
+    deinit_backend(chat_ctx);
+    return runtime_error;
+  }
+
+  if (!chat_ctx->preload_model_path.empty()) {
+    chat_ctx->preload_pending = true;
+    chat_ctx->preload_thread = std::thread(preload_model, chat_ctx);
+  }
   *ctx = (void *)chat_ctx;
   return success;
 }
@@ -2210,10 +4606,32 @@ __attribute__((visibility("default"))) wasi_nn_error deinit_backend(void *ctx)
   if (!chat_ctx)
     return invalid_argument;
 
+  for (LlamaChatContext *replica : chat_ctx->replicas)
+  {
+    deinit_backend(replica);
+  }
+  chat_ctx->replicas.clear();
+
   // Note: model and ctx are managed by common_init_result's unique_ptrs
   // They will be automatically cleaned up by the server_context
 
-  llama_backend_free();
+  wait_for_preload(chat_ctx);
+  stop_session_reaper(chat_ctx);
+  stop_server_loop(chat_ctx);
+  {
+    // Open sessions can be resumed by id after a restart
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    for (auto &pair : chat_ctx->sessions) {
+      save_session_state(chat_ctx, pair.first, pair.second);
+    }
+  }
+  if (!chat_ctx->is_replica)
+  {
+    llama_backend_free();
+  }
+  // Logging and tracing are process-wide; another live context may have set them since
+  wasi_nn_async_logger::instance().unconfigure(chat_ctx);
+  wasi_nn_tracer::instance().unconfigure(chat_ctx);
   delete chat_ctx;
   return success;
 }
@@ -2226,24 +4644,87 @@ load_by_name_with_config(void *ctx, const char *filename, uint32_t filename_len,
   if (!chat_ctx)
     return invalid_argument;
 
+  // A model switch is not undone; a replica that fails leaves a warning
+  replica_call call(chat_ctx, "load_by_name_with_config");
+  wasi_nn_error err = call.run([&](LlamaChatContext *replica, uint32_t &replica_graph) {
+    return load_by_name_with_config(replica, filename, filename_len, config, config_len, &replica_graph);
+  });
+  if (err != success)
+    return err;
+
+  wait_for_preload(chat_ctx);
+  err = load_model_by_name(chat_ctx, filename, filename_len, config, g);
+  if (err != success)
+    return err;
+  return call.commit(*g);
+}
+
+// Time of the load just finished; the first one also ends the cold start
+static void record_model_load(LlamaChatContext *chat_ctx, std::chrono::steady_clock::time_point t_start)
+{
+  const auto now = std::chrono::steady_clock::now();
+  chat_ctx->metrics.model_load_us.store(
+      std::chrono::duration_cast<std::chrono::microseconds>(now - t_start).count(), std::memory_order_relaxed);
+  uint64_t none = 0;
+  chat_ctx->metrics.cold_start_us.compare_exchange_strong(
+      none, std::chrono::duration_cast<std::chrono::microseconds>(now - chat_ctx->metrics.started).count(),
+      std::memory_order_relaxed);
+}
+
+static wasi_nn_error load_model_by_name(LlamaChatContext *chat_ctx, const char *filename, uint32_t filename_len,
+                                        const char *config, graph *g)
+{
+  const auto t_start = std::chrono::steady_clock::now();
   NN_DBG_PRINTF("Loading model: %s", filename);
+
+  // A replica allocates its context, and so its KV cache, on its own node
+  numa_thread_binding numa_binding(chat_ctx->numa_node);
   NN_DBG_PRINTF("Config: %s", config ? config : "null");
 
-  // Check if this is a model switch (if a model is already loaded)
-  bool is_model_switch = (chat_ctx->server_ctx.model != nullptr);
+  // A model is named by its file and load config; loading it again returns its graph
+  const std::string path(filename, filename_len);
+  const std::string config_str = config ? config : "";
+  graph model_id = 0;
+  bool is_model_switch = false;
+  graph active_model = 0;
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->model_swap_mutex);
+    for (const auto &source : chat_ctx->model_sources) {
+      if (source.second.first == path && source.second.second == config_str) {
+        model_id = source.first;
+        break;
+      }
+    }
+    if (model_id == 0) {
+      model_id = chat_ctx->next_model_id++;
+    }
+
+    // Check if this is a model switch (if a model is already loaded). The
+    // model is swapped under model_swap_mutex, so read it under the same lock.
+    is_model_switch = (chat_ctx->server_ctx.model != nullptr);
+    active_model = chat_ctx->active_model;
+  }
   
+  if (is_model_switch && model_id == active_model) {
+    NN_INFO_PRINTF("Model %s is already loaded as graph %u", filename, model_id);
+    if (g) *g = model_id;
+    return success;
+  }
+
   if (is_model_switch) {
     NN_INFO_PRINTF("Performing safe model switch from %s to %s", 
                    chat_ctx->current_model_path.c_str(), filename);
     
-    // Use safe model switching
-    wasi_nn_error switch_result = safe_model_switch(chat_ctx, filename, filename_len, config);
+    // Use safe model switching (free if the model is resident)
+    wasi_nn_error switch_result = safe_model_switch(chat_ctx, filename, filename_len, config, model_id);
     if (switch_result != success) {
       NN_ERR_PRINTF("Safe model switch failed: %d", switch_result);
       return switch_result;
     }
     
     NN_INFO_PRINTF("Safe model switch completed successfully");
+    record_model_load(chat_ctx, t_start);
+    if (g) *g = model_id;
     return success;
   }
 
@@ -2251,6 +4732,7 @@ load_by_name_with_config(void *ctx, const char *filename, uint32_t filename_len,
   // Parse config into params
   parse_config_to_params(config, chat_ctx->server_ctx.params_base, chat_ctx);
   chat_ctx->server_ctx.params_base.model.path = filename;
+  fit_context_to_budget(chat_ctx, chat_ctx->server_ctx.params_base, config);
 
   NN_INFO_PRINTF("Model config: n_gpu_layers=%d, ctx_size=%d, batch_size=%d, threads=%d",
                  chat_ctx->server_ctx.params_base.n_gpu_layers,
@@ -2264,8 +4746,10 @@ load_by_name_with_config(void *ctx, const char *filename, uint32_t filename_len,
       return runtime_error;
   }
 
-  // Initialize server context
+  // Initialize server context and start the slot scheduler
   chat_ctx->server_ctx.init();
+  chat_ctx->slot_params_generation.fetch_add(1);
+  start_server_loop(chat_ctx);
 
   // Check context size
   const int n_ctx_train = llama_model_n_ctx_train(chat_ctx->server_ctx.model);
@@ -2278,30 +4762,15 @@ load_by_name_with_config(void *ctx, const char *filename, uint32_t filename_len,
   }
 
   // Phase 5.2: Record model information for safe switching
-  chat_ctx->current_model_path = std::string(filename, filename_len);
-  chat_ctx->model_context_length = n_ctx_train;
-  chat_ctx->model_vocab_size = llama_vocab_n_tokens(chat_ctx->server_ctx.vocab);
-  
-  // Get model architecture and name if available
-  char model_desc[256] = {0};
-  if (llama_model_desc(chat_ctx->server_ctx.model, model_desc, sizeof(model_desc)) > 0) {
-    chat_ctx->model_architecture = std::string(model_desc);
-  }
-  
-  // Extract model name from path
-  std::string path(filename, filename_len);
-  size_t last_slash = path.find_last_of("/\\");
-  chat_ctx->model_name = (last_slash != std::string::npos) ? 
-                         path.substr(last_slash + 1) : path;
-  
-  // Generate simple version string based on file size and modification time
-  struct stat file_stat;
-  if (stat(filename, &file_stat) == 0) {
-    char version_buf[64];
-    snprintf(version_buf, sizeof(version_buf), "size_%ld_mtime_%ld", 
-             file_stat.st_size, file_stat.st_mtime);
-    chat_ctx->current_model_version = std::string(version_buf);
+  update_model_info(chat_ctx, filename, filename_len);
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->model_swap_mutex);
+    chat_ctx->active_model = model_id;
+    chat_ctx->active_model_config = config_str;
+    chat_ctx->model_sources[model_id] = {path, config_str};
   }
+  if (g) *g = model_id;
+  record_model_load(chat_ctx, t_start);
 
   NN_INFO_PRINTF("Model loaded successfully. Context size: %d", n_ctx);
   NN_INFO_PRINTF("Model info recorded: name=%s, arch=%s, vocab_size=%ld, ctx_len=%ld", 
@@ -2311,69 +4780,204 @@ load_by_name_with_config(void *ctx, const char *filename, uint32_t filename_len,
   return success;
 }
 
-// Auto-cleanup function: removes old/excess sessions
-static void auto_cleanup_sessions(LlamaChatContext *chat_ctx)
+// Session table: sessions by exec_ctx, session_index by session_id and an LRU
+// list ordered by last_activity, all updated together in O(1). Callers hold
+// sessions_mutex.
+
+// Mark a session as just used; it moves to the back of the LRU list
+static void touch_session(LlamaChatContext *chat_ctx, SessionInfo &session)
 {
-  if (!chat_ctx->auto_cleanup_enabled)
-    return;
+  session.last_activity = std::chrono::steady_clock::now();
+  chat_ctx->session_lru.splice(chat_ctx->session_lru.end(), chat_ctx->session_lru, session.lru_pos);
+}
 
-  auto now = std::chrono::steady_clock::now();
-  auto idle_timeout = std::chrono::milliseconds(chat_ctx->idle_timeout_ms);
+static void insert_session(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx, SessionInfo &&session)
+{
+  session.lru_pos = chat_ctx->session_lru.insert(chat_ctx->session_lru.end(), exec_ctx);
+  chat_ctx->session_index[session.session_id] = exec_ctx;
+  chat_ctx->sessions[exec_ctx] = std::move(session);
+}
+
+// Sessions taken out of the registry whose state is still to be saved
+using retired_sessions = std::vector<std::pair<graph_execution_context, SessionInfo>>;
 
-  // Remove idle sessions
-  for (auto it = chat_ctx->sessions.begin(); it != chat_ctx->sessions.end();)
+// Save and clear a session taken out of the registry, without
+// sessions_mutex. Its sequence stays owned by exec_ctx meanwhile, so no other
+// session can claim the slot; model_swap_mutex keeps the slot's model installed.
+static void retire_session(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx, SessionInfo &session)
+{
+  std::lock_guard<std::mutex> swap_lock(chat_ctx->model_swap_mutex);
   {
-    if ((now - it->second.last_activity) > idle_timeout)
+    // A model switch since the session was taken out reset its sequence
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    if (session.seq_id < 0 || (size_t)session.seq_id >= chat_ctx->seq_owner.size() ||
+        chat_ctx->seq_owner[session.seq_id] != exec_ctx)
     {
-      auto idle_time = std::chrono::duration_cast<std::chrono::milliseconds>(
-                         now - it->second.last_activity)
-                         .count();
-      NN_INFO_PRINTF("Auto-cleanup: removing idle session %d (idle for %lldms)",
-                     it->first, (long long)idle_time);
-      it = chat_ctx->sessions.erase(it);
+      session.seq_id = -1;
+      return;
     }
-    else
+  }
+
+  save_session_state(chat_ctx, exec_ctx, session);
+  std::lock_guard<std::mutex> loop_lock(chat_ctx->server_loop_mutex);
+  server_slot &slot = chat_ctx->server_ctx.slots[session.seq_id];
+  if (!slot.is_processing())
+  {
+    truncate_slot_cache(chat_ctx->server_ctx.ctx, slot, 0);
+  }
+}
+
+// Retire sessions taken out of the registry, then hand their sequences back to
+// the free pool. Caller must not hold sessions_mutex.
+static void retire_sessions(LlamaChatContext *chat_ctx, retired_sessions &retired)
+{
+  if (retired.empty())
+    return;
+
+  for (auto &entry : retired)
+  {
+    retire_session(chat_ctx, entry.first, entry.second);
+  }
+  std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+  for (auto &entry : retired)
+  {
+    const llama_seq_id seq = entry.second.seq_id;
+    if (seq >= 0 && (size_t)seq < chat_ctx->seq_owner.size() && chat_ctx->seq_owner[seq] == entry.first)
     {
-      ++it;
+      chat_ctx->seq_owner[seq] = 0;
     }
   }
+  retired.clear();
+}
 
-  // Remove excess sessions (LRU eviction)
-  if (chat_ctx->sessions.size() >= chat_ctx->max_sessions)
+// Take a session out of the registry. Its sequence stays reserved until
+// retire_sessions() has saved it once sessions_mutex is released.
+static void remove_session(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx, retired_sessions &retired)
+{
+  auto it = chat_ctx->sessions.find(exec_ctx);
+  if (it == chat_ctx->sessions.end())
+    return;
+
+  chat_ctx->session_lru.erase(it->second.lru_pos);
+  chat_ctx->session_index.erase(it->second.session_id);
+  retired.emplace_back(exec_ctx, std::move(it->second));
+  chat_ctx->sessions.erase(it);
+}
+
+// Evict least recently active idle sessions until a new one fits max_sessions
+static void evict_lru_sessions(LlamaChatContext *chat_ctx, retired_sessions &retired)
+{
+  if (!chat_ctx->auto_cleanup_enabled)
+    return;
+
+  auto lru_it = chat_ctx->session_lru.begin();
+  while (chat_ctx->sessions.size() >= chat_ctx->max_sessions && lru_it != chat_ctx->session_lru.end())
+  {
+    const graph_execution_context exec_ctx = *lru_it++;
+    const SessionInfo &session = chat_ctx->sessions.at(exec_ctx);
+    if (session.n_running > 0 || session.compute_pending)
+      continue;
+    NN_INFO_PRINTF("Auto-cleanup: removing session %d (max sessions reached)", exec_ctx);
+    remove_session(chat_ctx, exec_ctx, retired);
+  }
+}
+
+// Expire sessions idle for idle_timeout_ms. The front of session_lru is always
+// the next to expire, so the reaper sleeps until that deadline or a stop.
+// Expired sessions are taken out under sessions_mutex and saved after it is
+// released, so requests never wait for a state file to be written.
+static void session_reaper_loop(LlamaChatContext *chat_ctx)
+{
+  std::unique_lock<std::mutex> lock(chat_ctx->sessions_mutex);
+  while (chat_ctx->session_reaper_running)
   {
-    // Sort by last_activity and remove the oldest
-    std::vector<std::pair<graph_execution_context,
-                          std::chrono::steady_clock::time_point>>
-        sorted_sessions;
-    for (const auto &session : chat_ctx->sessions)
+    const auto idle_timeout = std::chrono::milliseconds(chat_ctx->idle_timeout_ms);
+    const auto now = std::chrono::steady_clock::now();
+    auto wake = now + idle_timeout;
+
+    retired_sessions expired;
+    auto lru_it = chat_ctx->session_lru.begin();
+    while (lru_it != chat_ctx->session_lru.end())
     {
-      sorted_sessions.emplace_back(session.first, session.second.last_activity);
+      const graph_execution_context exec_ctx = *lru_it++;
+      auto session_it = chat_ctx->sessions.find(exec_ctx);
+      SessionInfo &session = session_it->second;
+      if (now - session.last_activity <= idle_timeout)
+      {
+        wake = session.last_activity + idle_timeout;
+        break;
+      }
+      if (session.n_running > 0 || session.compute_pending)
+      {
+        continue;  // in use; its request touches it when done
+      }
+      NN_INFO_PRINTF("Auto-cleanup: removing idle session %d (idle for %lldms)", exec_ctx,
+                     (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                         now - session.last_activity).count());
+      chat_ctx->session_lru.erase(session.lru_pos);
+      chat_ctx->session_index.erase(session.session_id);
+      expired.emplace_back(exec_ctx, std::move(session));
+      chat_ctx->sessions.erase(session_it);
     }
 
-    std::sort(sorted_sessions.begin(), sorted_sessions.end(),
-              [](const auto &a, const auto &b)
-              { return a.second < b.second; });
-
-    // Remove oldest sessions to make room
-    size_t sessions_to_remove =
-        chat_ctx->sessions.size() - chat_ctx->max_sessions + 1;
-    for (size_t i = 0; i < sessions_to_remove && i < sorted_sessions.size();
-         ++i)
+    if (!expired.empty())
     {
-      auto exec_ctx_id = sorted_sessions[i].first;
-      NN_INFO_PRINTF("Auto-cleanup: removing session %d (max sessions reached)",
-                     exec_ctx_id);
-      chat_ctx->sessions.erase(exec_ctx_id);
+      lock.unlock();
+      retire_sessions(chat_ctx, expired);
+      lock.lock();
+      continue;  // sessions may have changed meanwhile
     }
+
+    chat_ctx->session_reaper_condition.wait_until(lock, wake, [chat_ctx] { return !chat_ctx->session_reaper_running; });
+  }
+}
+
+static void start_session_reaper(LlamaChatContext *chat_ctx)
+{
+  if (!chat_ctx->auto_cleanup_enabled)
+    return;
+
+  chat_ctx->session_reaper_running = true;
+  chat_ctx->session_reaper_thread = std::thread(session_reaper_loop, chat_ctx);
+}
+
+static void stop_session_reaper(LlamaChatContext *chat_ctx)
+{
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    chat_ctx->session_reaper_running = false;
   }
+  chat_ctx->session_reaper_condition.notify_all();
+  if (chat_ctx->session_reaper_thread.joinable())
+    chat_ctx->session_reaper_thread.join();
 }
 
 // Original function for WASI-NN compatibility (kept for backward compatibility)
+static wasi_nn_error open_session(LlamaChatContext *chat_ctx, const char *session_id, graph model,
+                                  graph_execution_context *exec_ctx);
+
 __attribute__((visibility("default"))) wasi_nn_error init_execution_context(
     void *ctx, graph g, graph_execution_context *exec_ctx)
 {
-  // Delegate to the session-aware version with a default session ID
-  return init_execution_context_with_session_id(ctx, "default_session", exec_ctx);
+  LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
+  if (!chat_ctx)
+    return invalid_argument;
+  wait_for_preload(chat_ctx);
+
+  // Delegate to the session-aware version with a default session ID. With
+  // several resident models each graph has its own default session.
+  graph model;
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->model_swap_mutex);
+    model = chat_ctx->active_model;
+    if (chat_ctx->max_resident_models > 1 && chat_ctx->model_sources.count(g)) {
+      model = g;
+    }
+  }
+  const std::string session_id = chat_ctx->max_resident_models > 1
+                                     ? "default_session_" + std::to_string(model)
+                                     : "default_session";
+  return open_session(chat_ctx, session_id.c_str(), model, exec_ctx);
 }
 
 // New function that properly handles session IDs (matches NIF expectations)
@@ -2381,7 +4985,17 @@ __attribute__((visibility("default"))) wasi_nn_error init_execution_context_with
     void *ctx, const char *session_id, graph_execution_context *exec_ctx)
 {
   LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
-  if (!chat_ctx || !chat_ctx->server_ctx.model)
+  if (!chat_ctx)
+    return invalid_argument;
+  wait_for_preload(chat_ctx);
+  return open_session(chat_ctx, session_id, chat_ctx->active_model, exec_ctx);
+}
+
+// Find or create the session with this id; a new session talks to `model`
+static wasi_nn_error open_session(LlamaChatContext *chat_ctx, const char *session_id, graph model,
+                                  graph_execution_context *exec_ctx)
+{
+  if (!chat_ctx->server_ctx.model)
     return invalid_argument;
 
   if (!session_id) {
@@ -2391,57 +5005,67 @@ __attribute__((visibility("default"))) wasi_nn_error init_execution_context_with
 
   std::string session_id_str(session_id);
 
-  // Check if session already exists
-  for (auto &pair : chat_ctx->sessions) {
-    if (pair.second.session_id == session_id_str) {
-      *exec_ctx = pair.first;
-      NN_INFO_PRINTF("Reusing existing session '%s' with execution context %d", 
-                     session_id, pair.first);
-      return success;
+  // With NUMA replicas a session lives on the replica its id hashes to, so a
+  // reopened session finds its KV cache on the same node
+  if (!chat_ctx->replicas.empty()) {
+    const size_t r = std::hash<std::string>{}(session_id_str) % chat_ctx->exec_ctx_stride;
+    if (r > 0) {
+      chat_ctx = chat_ctx->replicas[r - 1];
+      wait_for_preload(chat_ctx);
+      if (!chat_ctx->server_ctx.model)
+        return invalid_argument;
     }
   }
 
-  // Auto-cleanup on entry to free up space before checking session limits
-  auto_cleanup_sessions(chat_ctx);
+  std::unique_lock<std::mutex> lock(chat_ctx->sessions_mutex);
+
+  // Check if session already exists
+  auto index_it = chat_ctx->session_index.find(session_id_str);
+  if (index_it != chat_ctx->session_index.end()) {
+    *exec_ctx = index_it->second;
+    touch_session(chat_ctx, chat_ctx->sessions.at(index_it->second));
+    NN_INFO_PRINTF("Reusing existing session '%s' with execution context %d", 
+                   session_id, index_it->second);
+    return success;
+  }
+
+  // Make room before checking session limits; idle expiry runs on the reaper.
+  // Evicted sessions are saved once sessions_mutex is released.
+  retired_sessions evicted;
+  evict_lru_sessions(chat_ctx, evicted);
 
   // Check if we can create a new session (use sessions.size() vs max_sessions)
   if (chat_ctx->sessions.size() >= chat_ctx->max_sessions)
   {
     NN_ERR_PRINTF("Unable to create new session after cleanup. Current: %zu, Max: %d", 
                   chat_ctx->sessions.size(), chat_ctx->max_sessions);
+    lock.unlock();
+    retire_sessions(chat_ctx, evicted);
     return runtime_error;
   }
 
-  // Initialize sampler if not already done (from main.cpp)
-  // Setup threadpools if not already done
-  wasi_nn_error result = setup_threadpools(chat_ctx);
-  if (result != success)
-  {
-    return result;
-  }
-
-  // Initialize the server context
-  chat_ctx->server_ctx.init();
-
-  // Initialize samplers for all slots (crucial for inference)
-  for (auto &slot : chat_ctx->server_ctx.slots) {
-    if (slot.smpl != nullptr) {
-      common_sampler_free(slot.smpl);
-    }
-    slot.smpl = common_sampler_init(chat_ctx->server_ctx.model, slot.params.sampling);
-    if (slot.smpl == nullptr) {
-      NN_ERR_PRINTF("Failed to initialize sampler for slot %d", slot.id);
-      return runtime_error;
-    }
-  }
+  // Slots and threadpools are created once per model load; each completion task
+  // sets up its slot's sampler when the scheduler launches it
 
   // Create new session with provided session ID
-  graph_execution_context new_exec_ctx = chat_ctx->next_exec_ctx_id++;
+  graph_execution_context new_exec_ctx = chat_ctx->next_exec_ctx_id;
+  chat_ctx->next_exec_ctx_id += chat_ctx->exec_ctx_stride;
   SessionInfo session_info;
   session_info.session_id = session_id_str;  // Use the provided session ID
+  session_info.model = model;
   session_info.last_activity = std::chrono::steady_clock::now();
 
-  chat_ctx->sessions[new_exec_ctx] = std::move(session_info);
+  // A session saved on close or eviction picks up its conversation; the KV
+  // snapshot is loaded lazily once the session gets a sequence
+  load_session_meta(chat_ctx, session_info);
+  if (session_info.chat_history.empty() && !chat_ctx->server_ctx.params_base.system_prompt.empty()) {
+    common_chat_msg system_msg;
+    system_msg.role = "system";
+    system_msg.content = chat_ctx->server_ctx.params_base.system_prompt;
+    session_info.chat_history.push_back(system_msg);
+  }
+
+  insert_session(chat_ctx, new_exec_ctx, std::move(session_info));
 
   *exec_ctx = new_exec_ctx;
 
@@ -2449,393 +5073,1815 @@ __attribute__((visibility("default"))) wasi_nn_error init_execution_context_with
       "Execution context %d initialized for session '%s'. Total sessions: %zu, Max sessions: %d",
       new_exec_ctx, session_id, chat_ctx->sessions.size(), chat_ctx->max_sessions);
 
+  lock.unlock();
+  retire_sessions(chat_ctx, evicted);
   return success;
 }
 
 __attribute__((visibility("default"))) wasi_nn_error
 close_execution_context(void *ctx, graph_execution_context exec_ctx)
 {
-  LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
+  LlamaChatContext *chat_ctx = home_replica((LlamaChatContext *)ctx, exec_ctx);
   if (!chat_ctx)
     return invalid_argument;
 
-  auto it = chat_ctx->sessions.find(exec_ctx);
-  if (it != chat_ctx->sessions.end())
+  retired_sessions closed;
+  bool all_closed = false;
   {
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+
+    auto it = chat_ctx->sessions.find(exec_ctx);
+    if (it == chat_ctx->sessions.end())
+      return invalid_argument;
+
     NN_INFO_PRINTF("Closing execution context %d for session '%s'", exec_ctx,
                    it->second.session_id.c_str());
-    
-    // Phase 4.3: Auto-clear KV cache for this session before closing
-    auto_clear_kv_cache_session(chat_ctx, exec_ctx);
-    
-    chat_ctx->sessions.erase(it);
-    
-    // Phase 4.3: Check if we should do global memory optimization after session close
-    if (chat_ctx->sessions.empty()) {
-      // All sessions closed, good time for global cleanup
-      auto_clear_all_kv_cache(chat_ctx);
+    remove_session(chat_ctx, exec_ctx, closed);
+    all_closed = chat_ctx->sessions.empty();
+  }
+
+  // Phase 4.3: Save and clear the session's KV cache outside sessions_mutex
+  retire_sessions(chat_ctx, closed);
+
+  // Phase 4.3: Check if we should do global memory optimization after session close
+  if (all_closed) {
+    // All sessions closed, good time for global cleanup
+    auto_clear_all_kv_cache(chat_ctx);
+  }
+
+  return success;
+}
+
+// Fold a finished completion into the backend metrics. elapsed_ms runs from
+// posting the task to its final result; without a measured ttft_ms (< 0) the
+// time to first token is everything but the generation that followed it.
+static void record_completion_metrics(LlamaChatContext *chat_ctx, const result_timings &timings,
+                                      double elapsed_ms, double ttft_ms) {
+  backend_metrics &metrics = chat_ctx->metrics;
+  metrics.requests_total.fetch_add(1, std::memory_order_relaxed);
+  metrics.prompt_tokens.fetch_add(std::max(timings.prompt_n, 0), std::memory_order_relaxed);
+  metrics.prompt_us.fetch_add((uint64_t)(timings.prompt_ms * 1000.0), std::memory_order_relaxed);
+  metrics.predicted_tokens.fetch_add(std::max(timings.predicted_n, 0), std::memory_order_relaxed);
+  metrics.predicted_us.fetch_add((uint64_t)(timings.predicted_ms * 1000.0), std::memory_order_relaxed);
+  metrics.ttft.observe(ttft_ms >= 0 ? ttft_ms : elapsed_ms - timings.predicted_ms);
+  if (timings.predicted_n > 0) {
+    metrics.inter_token.observe(timings.predicted_ms / timings.predicted_n);
+  }
+}
+
+// Receives each streamed chunk of generated text; returning false stops generation
+using stream_chunk_fn = std::function<bool(const std::string &)>;
+
+// Lock a mutex on the request path, recording the wait as a span
+static std::unique_lock<std::mutex> traced_lock(std::mutex &mutex, const char *span) {
+  WASI_NN_TRACE_SCOPE(span);
+  return std::unique_lock<std::mutex>(mutex);
+}
+
+// Admits a request to the loaded model and counts it in active_requests until
+// it returns, so a model handover can drain it first. A request arriving during
+// a handover waits for the new model instead of failing.
+struct model_request_guard {
+  LlamaChatContext *chat_ctx;
+  bool admitted = false;
+
+  // Adopts a request safe_model_switch() already counted in active_requests
+  model_request_guard(LlamaChatContext *ctx, std::adopt_lock_t) : chat_ctx(ctx), admitted(true) {}
+
+  explicit model_request_guard(LlamaChatContext *ctx) : chat_ctx(ctx) {
+    WASI_NN_TRACE_SCOPE("wait model_handover");
+    std::unique_lock<std::mutex> lock(chat_ctx->handover_mutex);
+    chat_ctx->handover_condition.wait_for(lock, std::chrono::seconds(60),
+                                          [ctx] { return !ctx->model_handover; });
+    if (!chat_ctx->model_handover && chat_ctx->server_loop_running) {
+      chat_ctx->active_requests++;
+      admitted = true;
     }
-    
-    return success;
   }
 
-  return invalid_argument;
+  ~model_request_guard() {
+    if (admitted) {
+      std::lock_guard<std::mutex> lock(chat_ctx->handover_mutex);
+      chat_ctx->active_requests--;
+    }
+    chat_ctx->handover_condition.notify_all();
+  }
+};
+
+// Model a session talks to; 0 (whatever is active) if the session is unknown or
+// only one model is kept loaded
+static graph session_model(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx) {
+  if (chat_ctx->max_resident_models <= 1) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+  auto it = chat_ctx->sessions.find(exec_ctx);
+  return it == chat_ctx->sessions.end() ? 0 : it->second.model;
+}
+
+// Admit a request of the session to its model, installing that model first if
+// another one is active (cheap when it is resident). A request that triggered
+// the switch is admitted by it, so other sessions cannot switch the model away
+// before it runs.
+static wasi_nn_error admit_session_request(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx,
+                                           std::optional<model_request_guard> &guard) {
+  for (int attempt = 0; attempt < 3 && !guard; ++attempt) {
+    const graph model = session_model(chat_ctx, exec_ctx);
+    if (model != 0 && model != chat_ctx->active_model) {
+      std::pair<std::string, std::string> source;
+      {
+        std::unique_lock<std::mutex> lock = traced_lock(chat_ctx->model_swap_mutex, "lock model_swap_mutex");
+        auto it = chat_ctx->model_sources.find(model);
+        if (it == chat_ctx->model_sources.end()) {
+          NN_ERR_PRINTF("Unknown model %u for execution context %d", model, exec_ctx);
+          return invalid_argument;
+        }
+        source = it->second;
+      }
+      WASI_NN_LOG_INFO(chat_ctx, "Session %d switches to model %u", exec_ctx, model);
+      bool admitted = false;
+      wasi_nn_error err = safe_model_switch(chat_ctx, source.first.c_str(), source.first.size(),
+                                            source.second.empty() ? nullptr : source.second.c_str(), model,
+                                            &admitted);
+      if (err != success) {
+        return err;
+      }
+      if (admitted) {
+        guard.emplace(chat_ctx, std::adopt_lock);
+        break;
+      }
+    }
+
+    guard.emplace(chat_ctx);
+    if (!guard->admitted) {
+      break;
+    }
+    if (model != 0 && model != chat_ctx->active_model) {
+      guard.reset();  // another model was installed meanwhile
+    }
+  }
+
+  if (!guard || !guard->admitted || !chat_ctx->server_ctx.ctx) {
+    WASI_NN_LOG_WARN(chat_ctx, "Model is not ready for inference");
+    return runtime_error;
+  }
+  return success;
 }
 
-// Helper function to run inference loop (extracted from main.cpp)
-static std::string run_inference_for_session(LlamaChatContext *chat_ctx,
-                                             graph_execution_context exec_ctx,
-                                             const std::string &user_input)
+// Submit one chat turn to the slot scheduler and wait for its final result.
+// Turns from concurrent sessions are decoded together by update_slots(), and
+// each slot reuses the longest cached prefix of its previous prompt.
+// With on_chunk set, text is delivered as the slot produces it; process_token()
+// holds back incomplete UTF-8 sequences and partial stop words. A turn still
+// running at deadline is cancelled and returns timeout.
+static wasi_nn_error run_inference_for_session_with_params(LlamaChatContext *chat_ctx,
+                                                           graph_execution_context exec_ctx,
+                                                           const std::string &user_input,
+                                                           slot_params &&params,
+                                                           std::string &response,
+                                                           const stream_chunk_fn &on_chunk = nullptr,
+                                                           std::chrono::steady_clock::time_point deadline =
+                                                               std::chrono::steady_clock::time_point::max())
 {
-  // Find session
-  auto session_it = chat_ctx->sessions.find(exec_ctx);
-  if (session_it == chat_ctx->sessions.end())
+  server_context &server_ctx = chat_ctx->server_ctx;
+
+  if (!server_ctx.chat_templates.get()) {
+    NN_ERR_PRINTF("Chat templates not initialized for prompt generation");
+    return runtime_error;
+  }
+
+  common_chat_msg user_msg;
+  user_msg.role = "user";
+  user_msg.content = user_input;
+
+  // Snapshot the conversation; the session is only updated once the turn succeeds
+  common_chat_templates_inputs inputs;
+  std::string cached_text;
+  llama_tokens tokens;
+  {
+    std::unique_lock<std::mutex> lock = traced_lock(chat_ctx->sessions_mutex, "lock sessions_mutex");
+    auto session_it = chat_ctx->sessions.find(exec_ctx);
+    if (session_it == chat_ctx->sessions.end()) {
+      NN_ERR_PRINTF("Invalid session for execution context %d", exec_ctx);
+      return invalid_argument;
+    }
+    touch_session(chat_ctx, session_it->second);
+    inputs.messages = session_it->second.chat_history;
+    cached_text = session_it->second.prompt_text;
+    tokens = session_it->second.prompt_tokens.get_text_tokens();
+  }
+  inputs.messages.push_back(user_msg);
+  inputs.add_generation_prompt = true;
+
+  std::string full_prompt;
   {
-    return "Error: Invalid session";
+    WASI_NN_TRACE_SCOPE("chat_template");
+    full_prompt = common_chat_templates_apply(server_ctx.chat_templates.get(), inputs).prompt;
   }
 
-  SessionInfo &session_info = session_it->second;
-  auto &chat_msgs = session_info.chat_history;
+  WASI_NN_LOG_DEBUG(chat_ctx, "Processing prompt for session %d (%zu messages)",
+                    exec_ctx, inputs.messages.size());
 
-  // Update last activity
-  session_info.last_activity = std::chrono::steady_clock::now();
+  // The previous turn's prompt is normally a prefix of this one: tokenize only the
+  // appended text (last response + new message), as llama-cli does per message.
+  // The slot then re-decodes nothing past the common prefix of its cached tokens.
+  {
+    wasi_nn_trace_span span("tokenize");
+    if (!cached_text.empty() && full_prompt.compare(0, cached_text.size(), cached_text) == 0) {
+      llama_tokens suffix = common_tokenize(server_ctx.vocab, full_prompt.substr(cached_text.size()), false, true);
+      tokens.insert(tokens.end(), suffix.begin(), suffix.end());
+      span.set_value((int64_t)suffix.size());
+    } else {
+      tokens = common_tokenize(server_ctx.vocab, full_prompt, true, true);
+      span.set_value((int64_t)tokens.size());
+    }
+  }
+
+  // Build the completion task
+  server_task task(SERVER_TASK_TYPE_COMPLETION);
+  task.id = server_ctx.queue_tasks.get_new_id();
+  task.index = 0;
+  task.params = std::move(params);
+  task.params.stream = (bool)on_chunk;
+
+  // Pin the task to the session's own sequence so its cached prefix is reused
+  const int id_task = task.id;
+  session_snapshot evicted;
+  {
+    std::unique_lock<std::mutex> lock = traced_lock(chat_ctx->sessions_mutex, "lock sessions_mutex");
+    auto session_it = chat_ctx->sessions.find(exec_ctx);
+    if (session_it == chat_ctx->sessions.end()) {
+      NN_ERR_PRINTF("Session for execution context %d closed during prompt preparation", exec_ctx);
+      return invalid_argument;
+    }
+    if (!assign_session_seq(chat_ctx, exec_ctx, session_it->second, evicted)) {
+      WASI_NN_LOG_WARN(chat_ctx, "No KV sequence free for session %d, every slot is busy", exec_ctx);
+      return runtime_error;
+    }
+    restore_session_state(chat_ctx, session_it->second);
+    share_prefix_kv(chat_ctx, session_it->second, tokens);
+    session_it->second.n_running++;
+    task.id_selected_slot = session_it->second.seq_id;
+
+    // Shift the session's context only if this prompt plus its generation
+    // budget would overflow the slot; the shifted sequence stays cached
+    const int n_ctx_slot = server_ctx.slots.empty() ? 0 : server_ctx.slots[0].n_ctx;
+    const int n_reserve = std::min(task.params.n_predict > 0 ? task.params.n_predict : n_ctx_slot / 4,
+                                   n_ctx_slot / 2);
+    auto_perform_context_shift_session(chat_ctx, exec_ctx, tokens, n_reserve);
+  }
+  write_evicted_session_state(chat_ctx, evicted);
+  task.prompt_tokens = server_tokens(tokens);
+
+  server_ctx.queue_results.add_waiting_task_id(id_task);
+  const auto t_posted = std::chrono::steady_clock::now();
+  server_ctx.queue_tasks.post(std::move(task));
+
+  // Wait for the final result, forwarding partial results when streaming;
+  // bail out if the scheduler is stopped underneath us
+  const std::unordered_set<int> id_tasks = {id_task};
+  server_task_result_ptr result;
+  std::string streamed;
+  bool cancelled = false;
+  bool timed_out = false;
+  double ttft_ms = -1.0;
+  {
+    // The span ends with the wait, before the result is processed
+    wasi_nn_trace_span wait_span("wait_result", id_task);
+    while (true) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        server_task cancel_task(SERVER_TASK_TYPE_CANCEL);
+        cancel_task.id_target = id_task;
+        server_ctx.queue_tasks.post(std::move(cancel_task), true);
+        timed_out = true;
+        break;
+      }
+      result = server_ctx.queue_results.recv_with_timeout(id_tasks, 1);
+      if (!result) {
+        if (!chat_ctx->server_loop_running) {
+          break;
+        }
+        continue;
+      }
+      if (result->is_error() || result->is_stop()) {
+        break;
+      }
+
+      auto *partial = dynamic_cast<server_task_result_cmpl_partial *>(result.get());
+      if (partial && on_chunk && !partial->content.empty()) {
+        if (ttft_ms < 0) {
+          ttft_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_posted).count();
+        }
+        streamed += partial->content;
+        if (!on_chunk(partial->content)) {
+          // The slot is released without a final result; keep what was sent
+          server_task cancel_task(SERVER_TASK_TYPE_CANCEL);
+          cancel_task.id_target = id_task;
+          server_ctx.queue_tasks.post(std::move(cancel_task), true);
+          cancelled = true;
+          break;
+        }
+      }
+      result.reset();
+    }
+  }
+  server_ctx.queue_results.remove_waiting_task_id(id_task);
+
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    auto session_it = chat_ctx->sessions.find(exec_ctx);
+    if (session_it != chat_ctx->sessions.end()) {
+      session_it->second.n_running--;
+    }
+  }
+
+  if (cancelled) {
+    WASI_NN_LOG_DEBUG(chat_ctx, "Task %d stopped by the stream consumer after %zu bytes",
+                      id_task, streamed.size());
+    response = std::move(streamed);
+  } else if (timed_out) {
+    WASI_NN_LOG_WARN(chat_ctx, "Task %d cancelled at its deadline after %zu bytes", id_task, streamed.size());
+    chat_ctx->metrics.requests_failed.fetch_add(1, std::memory_order_relaxed);
+    response = std::move(streamed);
+    return timeout;
+  } else if (!result) {
+    NN_ERR_PRINTF("Slot scheduler stopped while waiting for task %d", id_task);
+    chat_ctx->metrics.requests_failed.fetch_add(1, std::memory_order_relaxed);
+    return runtime_error;
+  } else if (result->is_error()) {
+    auto *err = dynamic_cast<server_task_result_error *>(result.get());
+    WASI_NN_LOG_ERROR(chat_ctx, "Completion task %d failed: %s", id_task,
+                      err ? err->err_msg.c_str() : "unknown error");
+    chat_ctx->metrics.requests_failed.fetch_add(1, std::memory_order_relaxed);
+    return runtime_error;
+  } else {
+    auto *final_result = dynamic_cast<server_task_result_cmpl_final *>(result.get());
+    if (!final_result) {
+      NN_ERR_PRINTF("Unexpected result type for completion task %d", id_task);
+      return runtime_error;
+    }
+
+    response = std::move(final_result->content);
 
-  // Chat formatting function (from main.cpp)
-  auto chat_add_and_format = [&](const std::string &role,
-                                 const std::string &content)
+    // process_token() holds back a tail that may begin a stop word; when the
+    // generation ends otherwise (EOS, limit) that tail belongs to the answer
+    if (on_chunk && response.size() > streamed.size() &&
+        response.compare(0, streamed.size(), streamed) == 0) {
+      on_chunk(response.substr(streamed.size()));
+    }
+
+    WASI_NN_LOG_DEBUG(chat_ctx, "Task %d done on slot %d: prompt=%d (evaluated %d), predicted=%d, %.2f tokens/s",
+                      id_task, final_result->id_slot, final_result->n_prompt_tokens,
+                      final_result->timings.prompt_n, final_result->n_decoded,
+                      final_result->timings.predicted_per_second);
+
+    const result_timings &timings = final_result->timings;
+    record_completion_metrics(chat_ctx, timings,
+                              std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_posted).count(),
+                              ttft_ms);
+    if (timings.draft_n > 0) {
+      chat_ctx->draft_tokens_total += timings.draft_n;
+      chat_ctx->draft_tokens_accepted += timings.draft_n_accepted;
+      WASI_NN_LOG_DEBUG(chat_ctx, "Task %d speculative: %d/%d draft tokens accepted (%.1f%%)",
+                        id_task, timings.draft_n_accepted, timings.draft_n,
+                        100.0 * timings.draft_n_accepted / timings.draft_n);
+    }
+  }
+
+  // Record the turn in the session history (the session may have been closed meanwhile)
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    auto session_it = chat_ctx->sessions.find(exec_ctx);
+    if (session_it != chat_ctx->sessions.end()) {
+      common_chat_msg assistant_msg;
+      assistant_msg.role = "assistant";
+      assistant_msg.content = response;
+      session_it->second.chat_history.push_back(std::move(user_msg));
+      session_it->second.chat_history.push_back(std::move(assistant_msg));
+      session_it->second.prompt_text = std::move(full_prompt);
+      session_it->second.prompt_tokens = server_tokens(tokens);
+    }
+  }
+
+  return success;
+}
+
+// Mark up to n unowned sequences SEQ_RESERVED, lowest ids last, so no session
+// is given them while a batch call decodes into them. Caller holds sessions_mutex.
+static void reserve_free_seqs(LlamaChatContext *chat_ctx, size_t n, std::vector<int> &slots)
+{
+  for (size_t i = chat_ctx->seq_owner.size(); i-- > 0 && slots.size() < n;) {
+    if (chat_ctx->seq_owner[i] == 0) {
+      chat_ctx->seq_owner[i] = SEQ_RESERVED;
+      slots.push_back((int)i);
+    }
+  }
+}
+
+// Free the sequences reserve_free_seqs() marked. Caller holds sessions_mutex.
+static void release_reserved_seqs(LlamaChatContext *chat_ctx, const std::vector<int> &slots)
+{
+  for (int id_slot : slots) {
+    if ((size_t)id_slot < chat_ctx->seq_owner.size() && chat_ctx->seq_owner[id_slot] == SEQ_RESERVED) {
+      chat_ctx->seq_owner[id_slot] = 0;
+    }
+  }
+}
+
+// Sequences a batch call decodes into: unowned ones first, reserved until
+// release_batch_slots(), and the calling session's own sequence if there are
+// none; at most batch_size of them, one with batch_processing disabled. Counts
+// the call as running on the session.
+static wasi_nn_error reserve_batch_slots(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx,
+                                         std::vector<int> &free_slots)
+{
+  const size_t max_in_flight = chat_ctx->batch_processing_enabled
+                                   ? std::max<size_t>(chat_ctx->batch_size, 1) : 1;
+
+  session_snapshot evicted;
   {
-    common_chat_msg new_msg;
-    new_msg.role = role;
-    new_msg.content = content;
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    auto session_it = chat_ctx->sessions.find(exec_ctx);
+    if (session_it == chat_ctx->sessions.end()) {
+      NN_ERR_PRINTF("Invalid session for execution context %d", exec_ctx);
+      return invalid_argument;
+    }
+    touch_session(chat_ctx, session_it->second);
 
-    // Check if chat templates are available
-    if (!chat_ctx->server_ctx.chat_templates.get()) {
-      NN_ERR_PRINTF("Chat templates not initialized");
-      return std::string("Error: Chat templates not available");
+    reserve_free_seqs(chat_ctx, max_in_flight, free_slots);
+    if (free_slots.empty()) {
+      if (!assign_session_seq(chat_ctx, exec_ctx, session_it->second, evicted)) {
+        WASI_NN_LOG_WARN(chat_ctx, "No KV sequence free for the batch call of session %d", exec_ctx);
+        return runtime_error;
+      }
+      free_slots.push_back(session_it->second.seq_id);
     }
+    session_it->second.n_running++;
+  }
+  write_evicted_session_state(chat_ctx, evicted);
+  return success;
+}
 
-    auto formatted = common_chat_format_single(
-        chat_ctx->server_ctx.chat_templates.get(), chat_msgs, new_msg, role == "user",
-        false // use_jinja
-    );
+static void release_batch_slots(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx,
+                                const std::vector<int> &free_slots)
+{
+  std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+  release_reserved_seqs(chat_ctx, free_slots);
+  auto session_it = chat_ctx->sessions.find(exec_ctx);
+  if (session_it != chat_ctx->sessions.end()) {
+    session_it->second.n_running--;
+  }
+}
 
-    chat_msgs.push_back(new_msg);
-    NN_DBG_PRINTF("Formatted message: '%s'", formatted.c_str());
-    return formatted;
+// Run n_tasks tasks over the reserved slots. The first wave is posted at once
+// so update_slots() prefills it together; each slot that finishes is given the
+// next task. make_task(i, slot) builds task i; on_result gets every final
+// result, which it may take over, with the time its task was posted. After a
+// failed task nothing more is posted and the tasks still running are cancelled.
+static wasi_nn_error run_tasks_on_slots(
+    LlamaChatContext *chat_ctx, std::vector<int> free_slots, size_t n_tasks,
+    const std::function<server_task(size_t, int)> &make_task,
+    const std::function<void(server_task_result_ptr &, std::chrono::steady_clock::time_point)> &on_result)
+{
+  server_context &server_ctx = chat_ctx->server_ctx;
+
+  std::unordered_map<int, int> task_slot;  // in-flight task id -> slot
+  std::unordered_map<int, std::chrono::steady_clock::time_point> task_posted;
+  std::unordered_set<int> id_tasks;
+  size_t next = 0;
+
+  auto prepare = [&](size_t index, int id_slot) {
+    server_task task = make_task(index, id_slot);
+    task.id = server_ctx.queue_tasks.get_new_id();
+    task.index = (int)index;
+    task.id_selected_slot = id_slot;
+    task_slot[task.id] = id_slot;
+    task_posted[task.id] = std::chrono::steady_clock::now();
+    id_tasks.insert(task.id);
+    server_ctx.queue_results.add_waiting_task_id(task.id);
+    return task;
   };
 
-  // Add user message and get formatted prompt
-  std::string prompt = chat_add_and_format("user", user_input);
+  {
+    std::vector<server_task> tasks;
+    while (next < n_tasks && !free_slots.empty()) {
+      tasks.push_back(prepare(next++, free_slots.back()));
+      free_slots.pop_back();
+    }
+    server_ctx.queue_tasks.post(std::move(tasks));
+  }
+
+  wasi_nn_error status = success;
+  while (!id_tasks.empty()) {
+    server_task_result_ptr result = server_ctx.queue_results.recv_with_timeout(id_tasks, 1);
+    if (!result) {
+      if (!chat_ctx->server_loop_running) {
+        NN_ERR_PRINTF("Slot scheduler stopped with %zu batch tasks in flight", id_tasks.size());
+        status = runtime_error;
+        break;
+      }
+      continue;
+    }
+    if (dynamic_cast<server_task_result_cmpl_partial *>(result.get())) {
+      continue;
+    }
 
-  NN_DBG_PRINTF("Processing prompt for session %d: %s", exec_ctx,
-                prompt.c_str());
+    const int id_task = result->id;
+    if (result->is_error()) {
+      auto *err = dynamic_cast<server_task_result_error *>(result.get());
+      WASI_NN_LOG_ERROR(chat_ctx, "Batch task %d failed: %s", id_task,
+                        err ? err->err_msg.c_str() : "unknown error");
+      chat_ctx->metrics.requests_failed.fetch_add(1, std::memory_order_relaxed);
+      status = runtime_error;
+    } else {
+      on_result(result, task_posted[id_task]);
+    }
+    task_posted.erase(id_task);
 
-  // Clear KV cache for session isolation (as per user's requirement)
-  llama_memory_clear(llama_get_memory(chat_ctx->server_ctx.ctx), true);
+    server_ctx.queue_results.remove_waiting_task_id(id_task);
+    id_tasks.erase(id_task);
+    const int id_slot = task_slot[id_task];
+    task_slot.erase(id_task);
 
-  // Tokenize the complete conversation history
-  common_chat_templates_inputs inputs;
-  inputs.messages = chat_msgs;
-  inputs.add_generation_prompt = true;
+    // Keep the slot busy with the next task
+    if (status != success) {
+      break;
+    }
+    if (next < n_tasks) {
+      server_ctx.queue_tasks.post(prepare(next++, id_slot));
+    }
+  }
+
+  // Cancelled tasks release their slots without a result; the cancels are
+  // queued ahead of any task posted on those slots once they are released
+  if (!id_tasks.empty()) {
+    std::vector<server_task> cancel_tasks;
+    for (int id_task : id_tasks) {
+      server_task cancel_task(SERVER_TASK_TYPE_CANCEL);
+      cancel_task.id_target = id_task;
+      cancel_tasks.push_back(std::move(cancel_task));
+    }
+    server_ctx.queue_tasks.post(std::move(cancel_tasks), true);
+    NN_WARN_PRINTF("Cancelled %zu batch tasks after a failure", id_tasks.size());
+  }
+  server_ctx.queue_results.remove_waiting_task_ids(id_tasks);
+  return status;
+}
+
+// Run independent single-turn prompts side by side. Each prompt is a fresh
+// conversation (system prompt + user message) pinned to its own slot, so
+// update_slots() packs their prefill and generation into shared llama_batch
+// calls of up to n_batch tokens.
+static wasi_nn_error run_inference_batch_prompts(LlamaChatContext *chat_ctx,
+                                                 graph_execution_context exec_ctx,
+                                                 const std::vector<std::string> &prompts,
+                                                 const wasi_nn_runtime_params *runtime_params,
+                                                 std::vector<std::string> &responses)
+{
+  server_context &server_ctx = chat_ctx->server_ctx;
 
-  // Check if chat templates are available before using them
-  if (!chat_ctx->server_ctx.chat_templates.get()) {
+  if (!server_ctx.chat_templates.get()) {
     NN_ERR_PRINTF("Chat templates not initialized for prompt generation");
-    return "Error: Chat templates not available";
+    return runtime_error;
+  }
+
+  std::vector<int> free_slots;
+  wasi_nn_error status = reserve_batch_slots(chat_ctx, exec_ctx, free_slots);
+  if (status != success) {
+    return status;
+  }
+
+  // Every prompt gets the same parameters
+  slot_params params = make_default_slot_params(chat_ctx);
+  if (runtime_params) {
+    apply_runtime_params_to_slot(params, *runtime_params, chat_ctx);
+  }
+
+  auto make_task = [&](size_t index, int) {
+    common_chat_templates_inputs inputs;
+    if (!server_ctx.params_base.system_prompt.empty()) {
+      common_chat_msg system_msg;
+      system_msg.role = "system";
+      system_msg.content = server_ctx.params_base.system_prompt;
+      inputs.messages.push_back(std::move(system_msg));
+    }
+    common_chat_msg user_msg;
+    user_msg.role = "user";
+    user_msg.content = prompts[index];
+    inputs.messages.push_back(std::move(user_msg));
+    inputs.add_generation_prompt = true;
+
+    const std::string full_prompt =
+        common_chat_templates_apply(server_ctx.chat_templates.get(), inputs).prompt;
+
+    server_task task(SERVER_TASK_TYPE_COMPLETION);
+    task.params = params;
+    task.prompt_tokens = server_tokens(common_tokenize(server_ctx.vocab, full_prompt, true, true));
+    return task;
+  };
+
+  responses.assign(prompts.size(), std::string());
+  status = run_tasks_on_slots(
+      chat_ctx, free_slots, prompts.size(), make_task,
+      [&](server_task_result_ptr &result, std::chrono::steady_clock::time_point t_posted) {
+        auto *final_result = dynamic_cast<server_task_result_cmpl_final *>(result.get());
+        if (!final_result) {
+          return;
+        }
+        responses[final_result->index] = std::move(final_result->content);
+        record_completion_metrics(chat_ctx, final_result->timings,
+                                  std::chrono::duration<double, std::milli>(
+                                      std::chrono::steady_clock::now() - t_posted).count(),
+                                  -1.0);
+      });
+  release_batch_slots(chat_ctx, exec_ctx, free_slots);
+
+  WASI_NN_LOG_DEBUG(chat_ctx, "Batch of %zu prompts finished for session %d", prompts.size(), exec_ctx);
+  return status;
+}
+
+// Generate a few tokens on a free slot, reserved like a batch call's, so the
+// first request does not pay for the first decode steps, sampler setup and
+// lazily built device graphs
+static wasi_nn_error warmup_slots(LlamaChatContext *chat_ctx)
+{
+  server_context &server_ctx = chat_ctx->server_ctx;
+
+  std::vector<int> free_slots;
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    reserve_free_seqs(chat_ctx, 1, free_slots);
+  }
+  if (free_slots.empty()) {
+    return success;
+  }
+
+  slot_params params = make_default_slot_params(chat_ctx);
+  params.n_predict = 4;
+  params.cache_prompt = false;
+  wasi_nn_error status = run_tasks_on_slots(
+      chat_ctx, free_slots, 1,
+      [&](size_t, int) {
+        server_task task(SERVER_TASK_TYPE_COMPLETION);
+        task.params = params;
+        task.prompt_tokens = server_tokens(common_tokenize(server_ctx.vocab, "Hello", true, true));
+        return task;
+      },
+      [](server_task_result_ptr &, std::chrono::steady_clock::time_point) {});
+
+  std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+  release_reserved_seqs(chat_ctx, free_slots);
+  return status;
+}
+
+// preload_thread: load the configured model and warm it up. The backend is
+// ready, and the cold start over, when this returns.
+static void preload_model(LlamaChatContext *chat_ctx)
+{
+  const auto t_start = std::chrono::steady_clock::now();
+  const std::string &path = chat_ctx->preload_model_path;
+  const std::string &config = chat_ctx->preload_model_config;
+
+  wasi_nn_error err = load_model_by_name(chat_ctx, path.c_str(), path.size(),
+                                         config.empty() ? nullptr : config.c_str(), nullptr);
+  if (err == success && chat_ctx->preload_warmup) {
+    err = warmup_slots(chat_ctx);
+  }
+
+  const double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+  if (err == success) {
+    chat_ctx->metrics.cold_start_us.store(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - chat_ctx->metrics.started).count(),
+        std::memory_order_relaxed);
+    WASI_NN_LOG_INFO(chat_ctx, "Preloaded %s in %.0f ms%s", path.c_str(), elapsed_ms,
+                     chat_ctx->preload_warmup ? " (with warmup)" : "");
+  } else {
+    WASI_NN_LOG_ERROR(chat_ctx, "Preloading %s failed after %.0f ms: %d", path.c_str(), elapsed_ms, err);
+  }
+  chat_ctx->preload_result = err;
+  chat_ctx->preload_pending.store(false, std::memory_order_release);
+}
+
+static void wait_for_preload(LlamaChatContext *chat_ctx)
+{
+  std::lock_guard<std::mutex> lock(chat_ctx->preload_mutex);
+  if (chat_ctx->preload_thread.joinable()) {
+    chat_ctx->preload_thread.join();
+  }
+}
+
+// Embed or score tokenized inputs (EMBEDDING or RERANK tasks) on the reserved
+// batch slots. Inputs of several slots share one llama_batch; each one is
+// decoded whole and never reuses cached tokens, since pooling needs all of
+// its positions. That clears the sequences it runs on, so they have to be
+// reserved: no session may be given one of them meanwhile.
+// results[i] is input i's result.
+static wasi_nn_error run_embedding_tasks(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx,
+                                         server_task_type type, std::vector<llama_tokens> &inputs,
+                                         std::vector<server_task_result_ptr> &results)
+{
+  std::vector<int> free_slots;
+  wasi_nn_error status = reserve_batch_slots(chat_ctx, exec_ctx, free_slots);
+  if (status != success) {
+    return status;
+  }
+
+  slot_params params = make_default_slot_params(chat_ctx);
+  params.cache_prompt = false;
+
+  std::vector<server_task_result_ptr> received(inputs.size());
+  status = run_tasks_on_slots(
+      chat_ctx, free_slots, inputs.size(),
+      [&](size_t index, int) {
+        server_task task(type);
+        task.params = params;
+        task.prompt_tokens = server_tokens(inputs[index]);
+        return task;
+      },
+      [&](server_task_result_ptr &result, std::chrono::steady_clock::time_point) {
+        const int index = result->get_index();
+        if (index >= 0 && (size_t)index < received.size()) {
+          received[index] = std::move(result);
+        }
+      });
+  release_batch_slots(chat_ctx, exec_ctx, free_slots);
+
+  WASI_NN_LOG_DEBUG(chat_ctx, "%zu %s inputs finished for session %d", inputs.size(),
+                    type == SERVER_TASK_TYPE_RERANK ? "rerank" : "embedding", exec_ctx);
+  results = std::move(received);
+  return status;
+}
+
+// Shared front end of run_inference and run_inference_stream: validates the
+// request, takes its parameters from the registered config (config_handle != 0)
+// or parses the runtime config, and runs the turn
+static wasi_nn_error run_inference_request(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx,
+                                           tensor *input_tensor, const char *runtime_config,
+                                           uint32_t config_len, uint32_t config_handle,
+                                           std::string &response, const stream_chunk_fn &on_chunk,
+                                           std::chrono::steady_clock::time_point deadline =
+                                               std::chrono::steady_clock::time_point::max())
+{
+  if (!chat_ctx || !input_tensor)
+  {
+    return invalid_argument;
+  }
+  wasi_nn_trace_session trace_session((int32_t)exec_ctx);
+  WASI_NN_TRACE_SCOPE("run_inference");
+
+  char *prompt_text = (char *)input_tensor->data;
+  if (!prompt_text)
+  {
+    return invalid_argument;
+  }
+
+  std::optional<model_request_guard> model_guard;
+  wasi_nn_error admit_err = admit_session_request(chat_ctx, exec_ctx, model_guard);
+  if (admit_err != success)
+  {
+    return admit_err;
+  }
+
+  try
+  {
+    slot_params params;
+    if (config_handle != 0) {
+      if (!registered_config_params(chat_ctx, config_handle, params)) {
+        return invalid_argument;
+      }
+    } else {
+      params = make_default_slot_params(chat_ctx);
+
+      // Parse runtime parameters if provided
+      if (runtime_config && config_len > 0) {
+        wasi_nn_runtime_params runtime_params;
+        if (!parse_runtime_params(runtime_config, config_len, runtime_params, chat_ctx)) {
+          WASI_NN_LOG_ERROR(chat_ctx, "Failed to parse runtime configuration, using defaults");
+          // Continue with default parameters rather than failing
+        } else {
+          apply_runtime_params_to_slot(params, runtime_params, chat_ctx);
+          WASI_NN_LOG_INFO(chat_ctx, "Runtime configuration applied successfully");
+        }
+      }
+    }
+
+    // Submit to the slot scheduler
+    return run_inference_for_session_with_params(chat_ctx, exec_ctx, prompt_text, std::move(params),
+                                                 response, on_chunk, deadline);
+  }
+  catch (const std::exception &e)
+  {
+    WASI_NN_LOG_ERROR(chat_ctx, "Inference failed: %s", e.what());
+    return runtime_error;
+  }
+}
+
+// run_inference and run_inference_with_config_handle after argument checks
+static wasi_nn_error run_inference_to_tensor(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx,
+                                             tensor *input_tensor, tensor_data output_tensor,
+                                             uint32_t *output_tensor_size, const char *runtime_config,
+                                             uint32_t config_len, uint32_t config_handle)
+{
+  if (!output_tensor_size)
+  {
+    return invalid_argument;
+  }
+
+  std::string response;
+  wasi_nn_error err = run_inference_request(chat_ctx, exec_ctx, input_tensor, runtime_config,
+                                            config_len, config_handle, response, nullptr);
+  if (err != success)
+  {
+    return err;
+  }
+
+  WASI_NN_LOG_DEBUG(chat_ctx, "Generated response: %s", response.c_str());
+
+  const uint32_t capacity = *output_tensor_size;
+  *output_tensor_size = response.size() + 1;
+  if (write_output(output_tensor, capacity, response))
+  {
+    return success;
+  }
+
+  // Too small (or no buffer at all, to ask for the size): keep the response on
+  // the session so get_output() can fetch it without generating it again
+  std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+  auto session_it = chat_ctx->sessions.find(exec_ctx);
+  if (session_it != chat_ctx->sessions.end() && !session_it->second.compute_pending)
+  {
+    SessionInfo &session = session_it->second;
+    session.output = std::move(response);
+    session.output_status = success;
+    session.output_ready = true;
+  }
+  return too_large;
+}
+
+// run_inference_stream and run_inference_stream_with_config_handle after argument checks
+static wasi_nn_error run_inference_to_callback(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx,
+                                               tensor *input_tensor, const char *runtime_config,
+                                               uint32_t config_len, uint32_t config_handle,
+                                               wasi_nn_stream_callback callback, void *user_data)
+{
+  if (!callback)
+  {
+    return invalid_argument;
+  }
+
+  // Chunks are only forwarded on complete UTF-8 boundaries, so each one can be
+  // handed to the host as text on its own
+  std::string response;
+  wasi_nn_error err = run_inference_request(
+      chat_ctx, exec_ctx, input_tensor, runtime_config, config_len, config_handle, response,
+      [callback, user_data](const std::string &chunk) {
+        return callback(chunk.c_str(), (uint32_t)chunk.size(), user_data);
+      });
+  if (err != success)
+  {
+    return err;
+  }
+
+  WASI_NN_LOG_DEBUG(chat_ctx, "Streamed response: %s", response.c_str());
+  return success;
+}
+
+__attribute__((visibility("default"))) wasi_nn_error
+run_inference(void *ctx, graph_execution_context exec_ctx, uint32_t index,
+              tensor *input_tensor, tensor_data output_tensor,
+              uint32_t *output_tensor_size,
+              const char *runtime_config, uint32_t config_len)
+{
+  return run_inference_to_tensor(home_replica((LlamaChatContext *)ctx, exec_ctx), exec_ctx, input_tensor,
+                                 output_tensor, output_tensor_size, runtime_config, config_len, 0);
+}
+
+__attribute__((visibility("default"))) wasi_nn_error
+run_inference_stream(void *ctx, graph_execution_context exec_ctx, uint32_t index,
+                     tensor *input_tensor, const char *runtime_config, uint32_t config_len,
+                     wasi_nn_stream_callback callback, void *user_data)
+{
+  return run_inference_to_callback(home_replica((LlamaChatContext *)ctx, exec_ctx), exec_ctx, input_tensor,
+                                   runtime_config, config_len, 0, callback, user_data);
+}
+
+// Free a registered config on one context, without its replicas
+static wasi_nn_error remove_runtime_config(LlamaChatContext *chat_ctx, uint32_t config_handle)
+{
+  std::lock_guard<std::mutex> lock(chat_ctx->runtime_configs_mutex);
+  auto &configs = chat_ctx->runtime_configs;
+  if (config_handle == 0 || config_handle > configs.size() || !configs[config_handle - 1])
+  {
+    NN_ERR_PRINTF("Unknown runtime config handle %u", config_handle);
+    return invalid_argument;
+  }
+  configs[config_handle - 1].reset();
+  return success;
+}
+
+__attribute__((visibility("default"))) wasi_nn_error
+register_runtime_config(void *ctx, const char *runtime_config, uint32_t config_len,
+                        uint32_t *config_handle)
+{
+  LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
+  if (!chat_ctx || !runtime_config || config_len == 0 || !config_handle)
+  {
+    return invalid_argument;
+  }
+  replica_call call(chat_ctx, "register_runtime_config", remove_runtime_config);
+  wasi_nn_error replica_err = call.run([&](LlamaChatContext *replica, uint32_t &replica_handle) {
+    return register_runtime_config(replica, runtime_config, config_len, &replica_handle);
+  });
+  if (replica_err != success)
+  {
+    return replica_err;
+  }
+
+  // Parsed and validated here, once; slot parameters are built on first use
+  auto config = std::make_unique<registered_runtime_config>();
+  if (!parse_runtime_params(runtime_config, config_len, config->runtime_params, chat_ctx))
+  {
+    return invalid_argument;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->runtime_configs_mutex);
+    auto &configs = chat_ctx->runtime_configs;
+    size_t index = configs.size();
+    for (size_t i = 0; i < configs.size(); ++i)
+    {
+      if (!configs[i])
+      {
+        index = i;  // reuse the handle of a released config
+        break;
+      }
+    }
+    if (index == configs.size())
+    {
+      configs.emplace_back();
+    }
+    configs[index] = std::move(config);
+    *config_handle = (uint32_t)index + 1;
+  }
+
+  WASI_NN_LOG_INFO(chat_ctx, "Registered runtime config %u", *config_handle);
+  return call.commit(*config_handle);
+}
+
+__attribute__((visibility("default"))) wasi_nn_error
+release_runtime_config(void *ctx, uint32_t config_handle)
+{
+  LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
+  if (!chat_ctx)
+  {
+    return invalid_argument;
+  }
+  // A released config is not restored; a replica that fails leaves a warning
+  replica_call call(chat_ctx, "release_runtime_config");
+  wasi_nn_error replica_err = call.run([&](LlamaChatContext *replica, uint32_t &replica_handle) {
+    replica_handle = config_handle;
+    return remove_runtime_config(replica, config_handle);
+  });
+  if (replica_err != success)
+  {
+    return replica_err;
+  }
+
+  wasi_nn_error err = remove_runtime_config(chat_ctx, config_handle);
+  if (err != success)
+  {
+    return err;
+  }
+  return call.commit(config_handle);
+}
+
+__attribute__((visibility("default"))) wasi_nn_error
+run_inference_with_config_handle(void *ctx, graph_execution_context exec_ctx, uint32_t index,
+                                 tensor *input_tensor, tensor_data output_tensor,
+                                 uint32_t *output_tensor_size, uint32_t config_handle)
+{
+  if (config_handle == 0)
+  {
+    return invalid_argument;
+  }
+  return run_inference_to_tensor(home_replica((LlamaChatContext *)ctx, exec_ctx), exec_ctx, input_tensor,
+                                 output_tensor, output_tensor_size, nullptr, 0, config_handle);
+}
+
+__attribute__((visibility("default"))) wasi_nn_error
+run_inference_stream_with_config_handle(void *ctx, graph_execution_context exec_ctx, uint32_t index,
+                                        tensor *input_tensor, uint32_t config_handle,
+                                        wasi_nn_stream_callback callback, void *user_data)
+{
+  if (config_handle == 0)
+  {
+    return invalid_argument;
+  }
+  return run_inference_to_callback(home_replica((LlamaChatContext *)ctx, exec_ctx), exec_ctx, input_tensor,
+                                   nullptr, 0, config_handle, callback, user_data);
+}
+
+__attribute__((visibility("default"))) wasi_nn_error
+run_inference_batch(void *ctx, graph_execution_context exec_ctx,
+                    tensor *input_tensors, uint32_t n_inputs,
+                    tensor_data *output_tensors, uint32_t *output_tensor_sizes,
+                    const char *runtime_config, uint32_t config_len)
+{
+  LlamaChatContext *chat_ctx = home_replica((LlamaChatContext *)ctx, exec_ctx);
+  if (!chat_ctx || !input_tensors || n_inputs == 0 || !output_tensors || !output_tensor_sizes)
+  {
+    return invalid_argument;
+  }
+  wasi_nn_trace_session trace_session((int32_t)exec_ctx);
+  WASI_NN_TRACE_SCOPE("run_inference_batch");
+
+  std::vector<std::string> prompts;
+  prompts.reserve(n_inputs);
+  for (uint32_t i = 0; i < n_inputs; ++i)
+  {
+    const char *prompt_text = (const char *)input_tensors[i].data;
+    if (!prompt_text)
+    {
+      NN_ERR_PRINTF("Batch input %u has no data", i);
+      return invalid_argument;
+    }
+    prompts.emplace_back(prompt_text);
+  }
+
+  std::optional<model_request_guard> model_guard;
+  wasi_nn_error admit_err = admit_session_request(chat_ctx, exec_ctx, model_guard);
+  if (admit_err != success)
+  {
+    return admit_err;
+  }
+
+  std::vector<std::string> responses;
+  try
+  {
+    wasi_nn_runtime_params runtime_params;
+    bool params_valid = true;
+    if (runtime_config && config_len > 0) {
+      params_valid = parse_runtime_params(runtime_config, config_len, runtime_params, chat_ctx);
+      if (!params_valid) {
+        WASI_NN_LOG_ERROR(chat_ctx, "Failed to parse runtime configuration, using defaults");
+      }
+    }
+
+    wasi_nn_error err = run_inference_batch_prompts(
+        chat_ctx, exec_ctx, prompts,
+        (params_valid && (runtime_config && config_len > 0)) ? &runtime_params : nullptr,
+        responses);
+    if (err != success)
+    {
+      return err;
+    }
+  }
+  catch (const std::exception &e)
+  {
+    WASI_NN_LOG_ERROR(chat_ctx, "Batch inference failed: %s", e.what());
+    return runtime_error;
+  }
+
+  // Each size carries the buffer capacity in and the full response size out;
+  // responses that do not fit are left out and the call reports too_large
+  wasi_nn_error status = success;
+  for (uint32_t i = 0; i < n_inputs; ++i)
+  {
+    const uint32_t capacity = output_tensor_sizes[i];
+    output_tensor_sizes[i] = responses[i].size() + 1;
+    if (!write_output(output_tensors[i], capacity, responses[i]))
+    {
+      if (output_tensors[i] && capacity > 0)
+      {
+        output_tensors[i][0] = '\0';
+      }
+      status = too_large;
+    }
+  }
+  return status;
+}
+
+// Copy text inputs out of their tensors; returns false if one has no data
+static bool read_text_inputs(const tensor *input_tensors, uint32_t n_inputs, std::vector<std::string> &texts)
+{
+  texts.reserve(n_inputs);
+  for (uint32_t i = 0; i < n_inputs; ++i)
+  {
+    const char *text = (const char *)input_tensors[i].data;
+    if (!text)
+    {
+      NN_ERR_PRINTF("Input %u has no data", i);
+      return false;
+    }
+    texts.emplace_back(text);
+  }
+  return true;
+}
+
+__attribute__((visibility("default"))) wasi_nn_error
+compute_embeddings(void *ctx, graph_execution_context exec_ctx,
+                   tensor *input_tensors, uint32_t n_inputs,
+                   tensor_data *output_tensors, uint32_t *output_tensor_sizes)
+{
+  LlamaChatContext *chat_ctx = home_replica((LlamaChatContext *)ctx, exec_ctx);
+  if (!chat_ctx || !input_tensors || n_inputs == 0 || !output_tensors || !output_tensor_sizes)
+  {
+    return invalid_argument;
+  }
+  wasi_nn_trace_session trace_session((int32_t)exec_ctx);
+  WASI_NN_TRACE_SCOPE("compute_embeddings");
+
+  std::vector<std::string> texts;
+  if (!read_text_inputs(input_tensors, n_inputs, texts))
+  {
+    return invalid_argument;
+  }
+
+  std::optional<model_request_guard> model_guard;
+  wasi_nn_error admit_err = admit_session_request(chat_ctx, exec_ctx, model_guard);
+  if (admit_err != success)
+  {
+    return admit_err;
+  }
+
+  server_context &server_ctx = chat_ctx->server_ctx;
+  if (llama_pooling_type(server_ctx.ctx) == LLAMA_POOLING_TYPE_RANK)
+  {
+    NN_ERR_PRINTF("Model is loaded with rank pooling, use rerank() instead");
+    return unsupported_operation;
+  }
+
+  std::vector<server_task_result_ptr> results;
+  try
+  {
+    std::vector<llama_tokens> inputs;
+    inputs.reserve(n_inputs);
+    for (uint32_t i = 0; i < n_inputs; ++i)
+    {
+      inputs.push_back(common_tokenize(server_ctx.vocab, texts[i], true, true));
+      if (inputs.back().empty())
+      {
+        NN_ERR_PRINTF("Embedding input %u is empty", i);
+        return invalid_argument;
+      }
+    }
+
+    wasi_nn_error err = run_embedding_tasks(chat_ctx, exec_ctx, SERVER_TASK_TYPE_EMBEDDING, inputs, results);
+    if (err != success)
+    {
+      return err;
+    }
+  }
+  catch (const std::exception &e)
+  {
+    WASI_NN_LOG_ERROR(chat_ctx, "Embedding failed: %s", e.what());
+    return runtime_error;
+  }
+
+  // One L2-normalized fp32 vector of n_embd values per input, or one per token
+  // with pooling "none". Sizes are in bytes and negotiated as for run_inference_batch.
+  const bool pooled = llama_pooling_type(server_ctx.ctx) != LLAMA_POOLING_TYPE_NONE;
+  const int n_embd = llama_model_n_embd(server_ctx.model);
+  wasi_nn_error status = success;
+  for (uint32_t i = 0; i < n_inputs; ++i)
+  {
+    auto *embd = dynamic_cast<server_task_result_embd *>(results[i].get());
+    if (!embd)
+    {
+      return runtime_error;
+    }
+
+    const uint32_t capacity = output_tensor_sizes[i];
+    const size_t n_bytes = embd->embedding.size() * n_embd * sizeof(float);
+    output_tensor_sizes[i] = (uint32_t)n_bytes;
+    if (!output_tensors[i] || capacity < n_bytes)
+    {
+      status = too_large;
+      continue;
+    }
+
+    float *out = (float *)output_tensors[i];
+    for (const std::vector<float> &row : embd->embedding)
+    {
+      if (pooled)
+      {
+        memcpy(out, row.data(), n_embd * sizeof(float));  // normalized by send_embedding()
+      }
+      else
+      {
+        common_embd_normalize(row.data(), out, n_embd, 2);
+      }
+      out += n_embd;
+    }
+  }
+  return status;
+}
+
+__attribute__((visibility("default"))) wasi_nn_error
+rerank(void *ctx, graph_execution_context exec_ctx, tensor *query_tensor,
+       tensor *document_tensors, uint32_t n_documents,
+       tensor_data output_tensor, uint32_t *output_tensor_size)
+{
+  LlamaChatContext *chat_ctx = home_replica((LlamaChatContext *)ctx, exec_ctx);
+  if (!chat_ctx || !query_tensor || !query_tensor->data || !document_tensors || n_documents == 0 ||
+      !output_tensor_size)
+  {
+    return invalid_argument;
+  }
+  wasi_nn_trace_session trace_session((int32_t)exec_ctx);
+  WASI_NN_TRACE_SCOPE("rerank");
+
+  std::vector<std::string> documents;
+  if (!read_text_inputs(document_tensors, n_documents, documents))
+  {
+    return invalid_argument;
+  }
+
+  std::optional<model_request_guard> model_guard;
+  wasi_nn_error admit_err = admit_session_request(chat_ctx, exec_ctx, model_guard);
+  if (admit_err != success)
+  {
+    return admit_err;
+  }
+
+  server_context &server_ctx = chat_ctx->server_ctx;
+  if (llama_pooling_type(server_ctx.ctx) != LLAMA_POOLING_TYPE_RANK)
+  {
+    NN_ERR_PRINTF("Reranking needs a model loaded with rank pooling");
+    return unsupported_operation;
+  }
+
+  std::vector<server_task_result_ptr> results;
+  try
+  {
+    // Each document is scored as [BOS]query[EOS][SEP]document[EOS]
+    const llama_tokens query = common_tokenize(server_ctx.vocab, (const char *)query_tensor->data, false, true);
+    std::vector<llama_tokens> inputs;
+    inputs.reserve(n_documents);
+    for (uint32_t i = 0; i < n_documents; ++i)
+    {
+      inputs.push_back(format_rerank(server_ctx.vocab, query,
+                                     common_tokenize(server_ctx.vocab, documents[i], false, true)));
+    }
+
+    wasi_nn_error err = run_embedding_tasks(chat_ctx, exec_ctx, SERVER_TASK_TYPE_RERANK, inputs, results);
+    if (err != success)
+    {
+      return err;
+    }
+  }
+  catch (const std::exception &e)
+  {
+    WASI_NN_LOG_ERROR(chat_ctx, "Rerank failed: %s", e.what());
+    return runtime_error;
+  }
+
+  // One fp32 relevance score per document, in input order
+  const uint32_t capacity = *output_tensor_size;
+  *output_tensor_size = n_documents * sizeof(float);
+  if (!output_tensor || capacity < *output_tensor_size)
+  {
+    return too_large;
+  }
+  float *scores = (float *)output_tensor;
+  for (uint32_t i = 0; i < n_documents; ++i)
+  {
+    auto *ranked = dynamic_cast<server_task_result_rerank *>(results[i].get());
+    if (!ranked)
+    {
+      return runtime_error;
+    }
+    scores[i] = ranked->score;
+  }
+  return success;
+}
+
+// Unload an adapter on one context, without its replicas
+static wasi_nn_error remove_lora_adapter(LlamaChatContext *chat_ctx, uint32_t adapter_id)
+{
+  std::lock_guard<std::mutex> swap_lock(chat_ctx->model_swap_mutex);
+  server_context &server_ctx = chat_ctx->server_ctx;
+  {
+    std::lock_guard<std::mutex> lora_lock(chat_ctx->lora_mutex);
+    const auto &adapters = server_ctx.params_base.lora_adapters;
+    if (adapter_id >= adapters.size() || !adapters[adapter_id].ptr)
+    {
+      NN_ERR_PRINTF("Unknown LoRA adapter id %u", adapter_id);
+      return invalid_argument;
+    }
+  }
+
+  // New requests stop seeing the adapter at once and queued ones are detached
+  // from it when they launch (detach_unloaded_lora); it is freed as soon as
+  // no running slot applies it, so nothing has to drain
+  std::lock_guard<std::mutex> lora_lock(chat_ctx->lora_mutex);
+  std::lock_guard<std::mutex> loop_lock(chat_ctx->server_loop_mutex);
+  auto &adapters = server_ctx.params_base.lora_adapters;
+  llama_adapter_lora *ptr = adapters[adapter_id].ptr;
+
+  // Keep the entry as an empty placeholder so the other ids stay valid
+  adapters[adapter_id] = common_adapter_lora_info();
+  chat_ctx->slot_params_generation.fetch_add(1);
+
+  auto &owned = server_ctx.llama_init.lora;
+  auto it = std::find_if(owned.begin(), owned.end(),
+                         [ptr](const llama_adapter_lora_ptr &la) { return la.get() == ptr; });
+  if (it != owned.end())
+  {
+    chat_ctx->retired_lora.push_back(std::move(*it));
+    owned.erase(it);
+  }
+  free_retired_lora(chat_ctx);
+
+  WASI_NN_LOG_INFO(chat_ctx, "Unloaded LoRA adapter %u%s", adapter_id,
+                   chat_ctx->retired_lora.empty() ? "" : ", freed when its running requests finish");
+  return success;
+}
+
+// Load an adapter on one context, without its replicas
+static wasi_nn_error add_lora_adapter(LlamaChatContext *chat_ctx, const char *path, uint32_t path_len, float scale,
+                                      uint32_t *adapter_id)
+{
+  // Holding model_swap_mutex keeps the base model installed while the adapter
+  // loads; requests keep running meanwhile
+  std::lock_guard<std::mutex> swap_lock(chat_ctx->model_swap_mutex);
+  server_context &server_ctx = chat_ctx->server_ctx;
+  if (!server_ctx.model)
+  {
+    NN_ERR_PRINTF("No model loaded, cannot load a LoRA adapter");
+    return invalid_argument;
+  }
+
+  common_adapter_lora_info adapter;
+  adapter.path.assign(path, path_len);
+  adapter.scale = scale;
+
+  const auto t_start = std::chrono::steady_clock::now();
+  llama_adapter_lora_ptr loaded(llama_adapter_lora_init(server_ctx.model, adapter.path.c_str()));
+  if (!loaded)
+  {
+    WASI_NN_LOG_ERROR(chat_ctx, "Failed to load LoRA adapter: %s", adapter.path.c_str());
+    return runtime_error;
+  }
+  adapter.ptr = loaded.get();
+
+  std::lock_guard<std::mutex> lora_lock(chat_ctx->lora_mutex);
+  std::lock_guard<std::mutex> loop_lock(chat_ctx->server_loop_mutex);
+  auto &adapters = server_ctx.params_base.lora_adapters;
+  size_t id = adapters.size();
+  for (size_t i = 0; i < adapters.size(); ++i)
+  {
+    if (!adapters[i].ptr)
+    {
+      id = i;  // reuse the slot of an unloaded adapter
+      break;
+    }
+  }
+  if (id == adapters.size())
+  {
+    adapters.emplace_back();
+  }
+  adapters[id] = adapter;
+  server_ctx.llama_init.lora.push_back(std::move(loaded));
+  chat_ctx->slot_params_generation.fetch_add(1);
+
+  // Cached KV was computed without the new adapter; record it as disabled so
+  // requests that leave it off still reuse their slot's cached tokens
+  for (auto &slot : server_ctx.slots)
+  {
+    if (slot.lora.size() < adapters.size())
+    {
+      slot.lora.resize(adapters.size());
+    }
+    slot.lora[id] = adapter;
+    slot.lora[id].scale = 0.0f;
+  }
+
+  *adapter_id = (uint32_t)id;
+  WASI_NN_LOG_INFO(chat_ctx, "Loaded LoRA adapter %u (scale %.2f) in %lld ms: %s", *adapter_id, scale,
+                   (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - t_start).count(),
+                   adapter.path.c_str());
+  return success;
+}
+
+__attribute__((visibility("default"))) wasi_nn_error
+load_lora_adapter(void *ctx, const char *path, uint32_t path_len, float scale, uint32_t *adapter_id)
+{
+  LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
+  if (!chat_ctx || !path || path_len == 0 || !adapter_id)
+  {
+    return invalid_argument;
+  }
+  replica_call call(chat_ctx, "load_lora_adapter", remove_lora_adapter);
+  wasi_nn_error replica_err = call.run([&](LlamaChatContext *replica, uint32_t &replica_adapter_id) {
+    return add_lora_adapter(replica, path, path_len, scale, &replica_adapter_id);
+  });
+  if (replica_err != success)
+  {
+    return replica_err;
   }
 
-  std::string full_prompt =
-      common_chat_templates_apply(chat_ctx->server_ctx.chat_templates.get(), inputs)
-          .prompt;
-
-  // Tokenize
-  std::vector<llama_token> tokens =
-      common_tokenize(chat_ctx->server_ctx.ctx, full_prompt, true, true);
-
-  // Generate response (simplified version of main.cpp's loop)
-  std::string response;
+  wasi_nn_error err = add_lora_adapter(chat_ctx, path, path_len, scale, adapter_id);
+  if (err != success)
+  {
+    return err;
+  }
+  return call.commit(*adapter_id);
+}
 
-  // Process input tokens
-  llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
+__attribute__((visibility("default"))) wasi_nn_error
+unload_lora_adapter(void *ctx, uint32_t adapter_id)
+{
+  LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
+  if (!chat_ctx)
+  {
+    return invalid_argument;
+  }
+  // An unloaded adapter is not reloaded; a replica that fails leaves a warning
+  replica_call call(chat_ctx, "unload_lora_adapter");
+  wasi_nn_error replica_err = call.run([&](LlamaChatContext *replica, uint32_t &replica_adapter_id) {
+    replica_adapter_id = adapter_id;
+    return remove_lora_adapter(replica, adapter_id);
+  });
+  if (replica_err != success)
+  {
+    return replica_err;
+  }
 
-  if (llama_decode(chat_ctx->server_ctx.ctx, batch))
+  wasi_nn_error err = remove_lora_adapter(chat_ctx, adapter_id);
+  if (err != success)
   {
-    NN_ERR_PRINTF("Failed to decode input tokens");
-    return "Error: Failed to process input";
+    return err;
   }
+  return call.commit(adapter_id);
+}
+
+// One counter or gauge of a metrics snapshot
+struct metric_sample
+{
+  const char *name;
+  const char *help;
+  bool counter;
+  double value;
+};
+
+static double ratio(double part, double whole)
+{
+  return whole > 0 ? part / whole : 0.0;
+}
 
-  // Generate tokens one by one
-  for (int i = 0; i < chat_ctx->server_ctx.params_base.n_predict; ++i)
+// Snapshot of the counters; reads atomics plus two short critical sections per
+// context. NUMA replicas serve their own sessions, so their counters and gauges
+// are added to the primary's; load times are the primary's.
+static std::vector<metric_sample> collect_metric_samples(LlamaChatContext *chat_ctx)
+{
+  const backend_metrics &m = chat_ctx->metrics;
+  const auto relaxed = std::memory_order_relaxed;
+  std::vector<LlamaChatContext *> contexts = {chat_ctx};
+  contexts.insert(contexts.end(), chat_ctx->replicas.begin(), chat_ctx->replicas.end());
+
+  uint64_t queued = 0, active = 0, capacity = 0, timed_out = 0, rejected = 0, completed = 0;
+  size_t n_sessions = 0;
+  double requests = 0, requests_failed = 0, prompt_tokens = 0, prompt_s = 0, predicted_tokens = 0, predicted_s = 0;
+  double decode_steps = 0, busy_slot_steps = 0, slots = 0, slots_busy = 0;
+  double kv_total = 0, kv_used = 0, kv_bytes = 0, memory_bytes = 0;
+  double prefix_hits = 0, prefix_misses = 0, sampler_hits = 0, sampler_misses = 0;
+  double draft_total = 0, draft_accepted = 0;
+  for (LlamaChatContext *c : contexts)
   {
-    // Verify that slots[0] and its sampler are valid
-    if (chat_ctx->server_ctx.slots.empty() || chat_ctx->server_ctx.slots[0].smpl == nullptr) {
-      NN_ERR_PRINTF("Invalid slot or sampler state");
-      return "Error: Invalid sampler state";
+    if (c->task_queue)
+    {
+      uint32_t q = 0, a = 0, cap = 0;
+      c->task_queue->get_queue_status(q, a, cap);
+      queued += q;
+      active += a;
+      capacity += cap;
+      std::lock_guard<std::mutex> lock(c->task_queue->queue_mutex);
+      timed_out += c->task_queue->tasks_timeout;
+      rejected += c->task_queue->tasks_rejected;
+      completed += c->task_queue->tasks_completed;
+    }
+    {
+      std::lock_guard<std::mutex> lock(c->sessions_mutex);
+      n_sessions += c->sessions.size();
     }
 
-    llama_token new_token =
-        common_sampler_sample(chat_ctx->server_ctx.slots[0].smpl, chat_ctx->server_ctx.ctx, -1);
+    const backend_metrics &cm = c->metrics;
+    requests += cm.requests_total.load(relaxed);
+    requests_failed += cm.requests_failed.load(relaxed);
+    prompt_tokens += cm.prompt_tokens.load(relaxed);
+    prompt_s += cm.prompt_us.load(relaxed) / 1e6;
+    predicted_tokens += cm.predicted_tokens.load(relaxed);
+    predicted_s += cm.predicted_us.load(relaxed) / 1e6;
+    decode_steps += cm.decode_steps.load(relaxed);
+    busy_slot_steps += cm.busy_slot_steps.load(relaxed);
+    slots += cm.slots_total.load(relaxed);
+    slots_busy += cm.slots_busy.load(relaxed);
+    kv_total += cm.kv_cells_total.load(relaxed);
+    kv_used += cm.kv_cells_used.load(relaxed);
+    kv_bytes += cm.kv_bytes.load(relaxed);
+    memory_bytes += c->current_memory_usage.load(relaxed);
+    prefix_hits += c->cache_hits.load(relaxed);
+    prefix_misses += c->cache_misses.load(relaxed);
+    sampler_hits += cm.sampler_cache_hits.load(relaxed);
+    sampler_misses += cm.sampler_cache_misses.load(relaxed);
+    draft_total += c->draft_tokens_total.load(relaxed);
+    draft_accepted += c->draft_tokens_accepted.load(relaxed);
+  }
+
+  return {
+    {"uptime_seconds", "Seconds since the backend was initialized", false,
+     std::chrono::duration<double>(std::chrono::steady_clock::now() - m.started).count()},
+    {"cold_start_seconds", "Backend init until the first model was ready (and warmed up, if preloaded)", false,
+     m.cold_start_us.load(relaxed) / 1e6},
+    {"model_load_seconds", "Duration of the last model load", false, m.model_load_us.load(relaxed) / 1e6},
+    {"requests_total", "Completions finished", true, requests},
+    {"requests_failed_total", "Completions that failed", true, requests_failed},
+    {"prompt_tokens_total", "Prompt tokens evaluated (prefill)", true, prompt_tokens},
+    {"prompt_seconds_total", "Time spent evaluating prompts", true, prompt_s},
+    {"prefill_tokens_per_second", "Prefill throughput since start", false, ratio(prompt_tokens, prompt_s)},
+    {"predicted_tokens_total", "Tokens generated (decode)", true, predicted_tokens},
+    {"predicted_seconds_total", "Time spent generating tokens", true, predicted_s},
+    {"decode_tokens_per_second", "Decode throughput per request since start", false,
+     ratio(predicted_tokens, predicted_s)},
+    {"decode_steps_total", "Batched decode steps of the slot scheduler", true, decode_steps},
+    {"busy_slots_per_step", "Average slots decoded together per step", false,
+     ratio(busy_slot_steps, decode_steps)},
+    {"slots", "Slots of the loaded model", false, slots},
+    {"slots_busy", "Slots processing a request", false, slots_busy},
+    {"queue_depth", "compute() tasks waiting for a worker", false, (double)queued},
+    {"queue_active", "compute() tasks queued or running", false, (double)active},
+    {"queue_capacity", "compute() queue capacity", false, (double)capacity},
+    {"queue_completed_total", "compute() tasks completed", true, (double)completed},
+    {"queue_timeout_total", "compute() tasks that timed out in the queue", true, (double)timed_out},
+    {"queue_rejected_total", "compute() tasks rejected by a full queue", true, (double)rejected},
+    {"sessions", "Open sessions", false, (double)n_sessions},
+    {"numa_replicas", "Model replicas serving sessions, one per NUMA node", false,
+     (double)(1 + chat_ctx->replicas.size())},
+    {"kv_cells", "KV cache cells", false, kv_total},
+    {"kv_cache_bytes", "Allocated KV cache", false, kv_bytes},
+    {"kv_cells_used", "KV cache cells used by slot sequences", false, kv_used},
+    {"kv_occupancy_ratio", "Used share of the KV cache", false, ratio(kv_used, kv_total)},
+    {"memory_bytes", "Weights, device compute buffers and used KV cells", false,
+     memory_bytes},
+    {"prefix_cache_hits_total", "Turns that reused a cached prompt prefix", true, prefix_hits},
+    {"prefix_cache_misses_total", "Turns that prefilled from scratch", true, prefix_misses},
+    {"prefix_cache_hit_ratio", "Share of turns reusing a cached prefix", false,
+     ratio(prefix_hits, prefix_hits + prefix_misses)},
+    {"sampler_cache_hits_total", "Requests that reused a cached sampler", true, sampler_hits},
+    {"sampler_cache_misses_total", "Requests that built a new sampler", true, sampler_misses},
+    {"sampler_cache_hit_ratio", "Share of requests reusing a cached sampler", false,
+     ratio(sampler_hits, sampler_hits + sampler_misses)},
+    {"draft_tokens_total", "Speculative draft tokens proposed", true, draft_total},
+    {"draft_tokens_accepted_total", "Speculative draft tokens accepted", true, draft_accepted},
+    {"draft_acceptance_ratio", "Share of draft tokens accepted", false, ratio(draft_accepted, draft_total)},
+  };
+}
 
-    if (llama_vocab_is_eog(chat_ctx->server_ctx.vocab, new_token))
+static std::string format_metrics_json(LlamaChatContext *chat_ctx,
+                                       const std::vector<std::pair<const char *, const latency_histogram *>> &histograms)
+{
+  json out = json::object();
+  for (const auto &sample : collect_metric_samples(chat_ctx))
+  {
+    if (sample.value == std::floor(sample.value))
     {
-      break;
+      out[sample.name] = (uint64_t)sample.value;
     }
-
-    // Convert token to text
-    char buf[256];
-    int n = llama_token_to_piece(chat_ctx->server_ctx.vocab, new_token, buf, sizeof(buf),
-                                 0, true);
-    if (n > 0)
+    else
     {
-      response.append(buf, n);
+      out[sample.name] = sample.value;
     }
-
-    // Prepare next batch
-    batch = llama_batch_get_one(&new_token, 1);
-    if (llama_decode(chat_ctx->server_ctx.ctx, batch))
+  }
+  for (const auto &entry : histograms)
+  {
+    const latency_histogram &h = *entry.second;
+    json buckets = json::array();
+    for (size_t i = 0; i <= latency_histogram::n_bounds; ++i)
     {
-      NN_ERR_PRINTF("Failed to decode generated token");
-      break;
+      buckets.push_back({{"le", i < latency_histogram::n_bounds ? json(latency_histogram::bounds_ms[i]) : json("+Inf")},
+                         {"count", h.buckets[i].load(std::memory_order_relaxed)}});
     }
+    out[entry.first] = {{"count", h.count.load(std::memory_order_relaxed)},
+                        {"sum_ms", h.sum_us.load(std::memory_order_relaxed) / 1000.0},
+                        {"buckets", buckets}};
   }
-
-  // Add assistant response to chat history
-  chat_add_and_format("assistant", response);
-
-  return response;
+  return out.dump();
 }
 
-// Enhanced helper function to run inference with runtime parameter support
-static std::string run_inference_for_session_with_params(LlamaChatContext *chat_ctx,
-                                                        graph_execution_context exec_ctx,
-                                                        const std::string &user_input,
-                                                        const wasi_nn_runtime_params *runtime_params = nullptr)
+static std::string format_metrics_prometheus(LlamaChatContext *chat_ctx,
+                                             const std::vector<std::pair<const char *, const latency_histogram *>> &histograms)
 {
-  // Find session
-  auto session_it = chat_ctx->sessions.find(exec_ctx);
-  if (session_it == chat_ctx->sessions.end())
+  std::ostringstream out;
+  out << std::setprecision(15);
+  for (const auto &sample : collect_metric_samples(chat_ctx))
   {
-    return "Error: Invalid session";
-  }
-
-  SessionInfo &session_info = session_it->second;
-  auto &chat_msgs = session_info.chat_history;
-
-  // Update last activity
-  session_info.last_activity = std::chrono::steady_clock::now();
-
-  // Determine max_tokens for this generation
-  int max_tokens = chat_ctx->server_ctx.params_base.n_predict;
-  if (runtime_params && runtime_params->max_tokens > 0) {
-    max_tokens = runtime_params->max_tokens;
-    WASI_NN_LOG_DEBUG(chat_ctx, "Using runtime max_tokens: %d", max_tokens);
+    out << "# HELP wasi_nn_" << sample.name << " " << sample.help << "\n"
+        << "# TYPE wasi_nn_" << sample.name << " " << (sample.counter ? "counter" : "gauge") << "\n"
+        << "wasi_nn_" << sample.name << " " << sample.value << "\n";
   }
-
-  // Store original sampling parameters for restoration
-  common_params original_params = chat_ctx->server_ctx.params_base;
-
-  // Chat formatting function (from main.cpp)
-  auto chat_add_and_format = [&](const std::string &role,
-                                 const std::string &content)
+  for (const auto &entry : histograms)
   {
-    common_chat_msg new_msg;
-    new_msg.role = role;
-    new_msg.content = content;
-
-    // Check if chat templates are available
-    if (!chat_ctx->server_ctx.chat_templates.get()) {
-      NN_ERR_PRINTF("Chat templates not initialized");
-      return std::string("Error: Chat templates not available");
+    const latency_histogram &h = *entry.second;
+    out << "# TYPE wasi_nn_" << entry.first << " histogram\n";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= latency_histogram::n_bounds; ++i)
+    {
+      cumulative += h.buckets[i].load(std::memory_order_relaxed);
+      out << "wasi_nn_" << entry.first << "_bucket{le=\"";
+      if (i < latency_histogram::n_bounds)
+      {
+        out << latency_histogram::bounds_ms[i];
+      }
+      else
+      {
+        out << "+Inf";
+      }
+      out << "\"} " << cumulative << "\n";
     }
+    out << "wasi_nn_" << entry.first << "_sum " << h.sum_us.load(std::memory_order_relaxed) / 1000.0 << "\n"
+        << "wasi_nn_" << entry.first << "_count " << h.count.load(std::memory_order_relaxed) << "\n";
+  }
+  return out.str();
+}
 
-    auto formatted = common_chat_format_single(
-        chat_ctx->server_ctx.chat_templates.get(), chat_msgs, new_msg, role == "user",
-        false // use_jinja
-    );
+__attribute__((visibility("default"))) wasi_nn_error
+get_backend_metrics(void *ctx, wasi_nn_metrics_format format, char *buffer, uint32_t buffer_size,
+                    uint32_t *metrics_size)
+{
+  LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
+  if (!chat_ctx || !metrics_size || (!buffer && buffer_size > 0))
+  {
+    return invalid_argument;
+  }
 
-    chat_msgs.push_back(new_msg);
-    return formatted;
+  // Summed over the NUMA replicas, like the counters
+  latency_histogram ttft, inter_token, queue_wait;
+  ttft.add(chat_ctx->metrics.ttft);
+  inter_token.add(chat_ctx->metrics.inter_token);
+  queue_wait.add(chat_ctx->metrics.queue_wait);
+  for (LlamaChatContext *replica : chat_ctx->replicas)
+  {
+    ttft.add(replica->metrics.ttft);
+    inter_token.add(replica->metrics.inter_token);
+    queue_wait.add(replica->metrics.queue_wait);
+  }
+  const std::vector<std::pair<const char *, const latency_histogram *>> histograms = {
+    {"ttft_ms", &ttft},
+    {"inter_token_ms", &inter_token},
+    {"queue_wait_ms", &queue_wait},
   };
 
-  // Add user message and get formatted prompt
-  std::string prompt = chat_add_and_format("user", user_input);
-
-  WASI_NN_LOG_DEBUG(chat_ctx, "Processing prompt for session %d: %s", exec_ctx, prompt.c_str());
-
-  // Only clear KV cache if this is a new session (empty chat history)
-  // This preserves conversation context for ongoing sessions
-  if (chat_msgs.size() <= 1) {  // Only user message just added
-    WASI_NN_LOG_DEBUG(chat_ctx, "New session detected, clearing KV cache for session %d", exec_ctx);
-    llama_memory_clear(llama_get_memory(chat_ctx->server_ctx.ctx), true);
-  } else {
-    WASI_NN_LOG_DEBUG(chat_ctx, "Continuing session %d with %zu messages, preserving KV cache", 
-                       exec_ctx, chat_msgs.size());
+  std::string text;
+  switch (format)
+  {
+  case WASI_NN_METRICS_JSON:
+    text = format_metrics_json(chat_ctx, histograms);
+    break;
+  case WASI_NN_METRICS_PROMETHEUS:
+    text = format_metrics_prometheus(chat_ctx, histograms);
+    break;
+  default:
+    return invalid_argument;
   }
 
-  // Tokenize the complete conversation history
-  common_chat_templates_inputs inputs;
-  inputs.messages = chat_msgs;
-  inputs.add_generation_prompt = true;
+  *metrics_size = text.size() + 1;
+  return write_output((tensor_data)buffer, buffer_size, text) ? success : too_large;
+}
 
-  // Check if chat templates are available before using them
-  if (!chat_ctx->server_ctx.chat_templates.get()) {
-    NN_ERR_PRINTF("Chat templates not initialized for prompt generation");
-    return "Error: Chat templates not available";
+__attribute__((visibility("default"))) wasi_nn_error
+poll_backend_ready(void *ctx, bool *ready)
+{
+  LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
+  if (!chat_ctx || !ready)
+  {
+    return invalid_argument;
   }
 
-  std::string full_prompt =
-      common_chat_templates_apply(chat_ctx->server_ctx.chat_templates.get(), inputs)
-          .prompt;
-
-  // Tokenize
-  std::vector<llama_token> tokens =
-      common_tokenize(chat_ctx->server_ctx.ctx, full_prompt, true, true);
-
-  // Apply runtime parameters to sampler if provided
-  if (runtime_params && !chat_ctx->server_ctx.slots.empty() && chat_ctx->server_ctx.slots[0].smpl) {
-    apply_runtime_params_to_sampling(chat_ctx->server_ctx.slots[0].smpl, *runtime_params, 
-                                    chat_ctx->server_ctx.model, chat_ctx);
+  // Ready once every replica is
+  for (LlamaChatContext *replica : chat_ctx->replicas)
+  {
+    wasi_nn_error err = poll_backend_ready(replica, ready);
+    if (err != success || !*ready)
+    {
+      return err;
+    }
   }
 
-  // Apply stop sequences if provided
-  std::vector<std::string> original_antiprompt;
-  if (runtime_params && runtime_params->stop_sequences_set) {
-    // Temporarily replace antiprompt with runtime stop sequences
-    original_antiprompt = chat_ctx->server_ctx.params_base.antiprompt;
-    chat_ctx->server_ctx.params_base.antiprompt = runtime_params->stop_sequences;
-    WASI_NN_LOG_DEBUG(chat_ctx, "Applied %zu runtime stop sequences", runtime_params->stop_sequences.size());
+  *ready = false;
+  if (chat_ctx->preload_pending.load(std::memory_order_acquire))
+  {
+    return success;
   }
-
-  // Generate response (simplified version of main.cpp's loop)
-  std::string response;
-
-  // Process input tokens
-  llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
-
-  if (llama_decode(chat_ctx->server_ctx.ctx, batch))
+  if (chat_ctx->preload_result != success)
   {
-    NN_ERR_PRINTF("Failed to decode input tokens");
-    return "Error: Failed to process input";
+    return chat_ctx->preload_result;
   }
+  std::lock_guard<std::mutex> lock(chat_ctx->model_swap_mutex);
+  *ready = chat_ctx->active_model != 0;
+  return success;
+}
 
-  // Generate tokens one by one with runtime parameter support
-  for (int i = 0; i < max_tokens; ++i)
+__attribute__((visibility("default"))) wasi_nn_error
+set_tracing(void *ctx, bool enabled)
+{
+  LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
+  if (!chat_ctx)
   {
-    // Verify that slots[0] and its sampler are valid
-    if (chat_ctx->server_ctx.slots.empty() || chat_ctx->server_ctx.slots[0].smpl == nullptr) {
-      NN_ERR_PRINTF("Invalid slot or sampler state");
-      return "Error: Invalid sampler state";
-    }
+    return invalid_argument;
+  }
 
-    llama_token new_token =
-        common_sampler_sample(chat_ctx->server_ctx.slots[0].smpl, chat_ctx->server_ctx.ctx, -1);
+  wasi_nn_tracer::instance().configure(enabled, chat_ctx->trace_events_per_thread, chat_ctx);
+  NN_INFO_PRINTF("Tracing %s", enabled ? "enabled" : "disabled");
+  return success;
+}
 
-    // Check for EOS token (with runtime ignore_eos support)
-    bool should_stop_eos = llama_vocab_is_eog(chat_ctx->server_ctx.vocab, new_token);
-    if (runtime_params && runtime_params->ignore_eos_set) {
-      should_stop_eos = should_stop_eos && !runtime_params->ignore_eos;
-    }
-    
-    if (should_stop_eos) {
-    //   WASI_NN_LOG_DEBUG(chat_ctx, "Generation stopped at EOS token");
-      break;
+// Spans of one session: those recorded on its request path, the server loop's
+// spans of its tasks, and the untagged batch-wide spans (update_slots,
+// llama_decode) that ran while one of its tasks was in flight
+static void select_session_events(std::vector<wasi_nn_trace_event> &events, int32_t session)
+{
+  std::unordered_set<int32_t> tasks;
+  std::vector<std::pair<int64_t, int64_t>> windows;
+  for (const auto &e : events) {
+    if (e.session == session && e.task >= 0) {
+      tasks.insert(e.task);
+      windows.emplace_back(e.ts_us, e.ts_us + e.dur_us);
     }
+  }
 
-    // Convert token to text
-    char buf[256];
-    int n = llama_token_to_piece(chat_ctx->server_ctx.vocab, new_token, buf, sizeof(buf),
-                                 0, true);
-    if (n > 0)
-    {
-      response.append(buf, n);
-    }
-
-    // Check for stop sequences if provided
-    if (runtime_params && runtime_params->stop_sequences_set) {
-      for (const auto& stop_seq : runtime_params->stop_sequences) {
-        if (response.find(stop_seq) != std::string::npos) {
-          WASI_NN_LOG_DEBUG(chat_ctx, "Generation stopped by stop sequence: %s", stop_seq.c_str());
-          // Remove the stop sequence from the response
-          size_t pos = response.find(stop_seq);
-          if (pos != std::string::npos) {
-            response = response.substr(0, pos);
-          }
-          goto generation_complete;
-        }
-      }
+  auto keep = [&](const wasi_nn_trace_event &e) {
+    if (e.session == session || (e.task >= 0 && tasks.count(e.task))) {
+      return true;
     }
-
-    // Prepare next batch
-    batch = llama_batch_get_one(&new_token, 1);
-    if (llama_decode(chat_ctx->server_ctx.ctx, batch))
-    {
-      NN_ERR_PRINTF("Failed to decode generated token");
-      break;
+    if (e.session != 0 || e.task >= 0) {
+      return false;
     }
-  }
-
-generation_complete:
-  // Restore original antiprompt if we modified it
-  if (runtime_params && runtime_params->stop_sequences_set) {
-    chat_ctx->server_ctx.params_base.antiprompt = original_antiprompt;
-  }
-
-  // Add assistant response to chat history
-  chat_add_and_format("assistant", response);
-
-  return response;
+    for (const auto &w : windows) {
+      if (e.ts_us < w.second && e.ts_us + e.dur_us > w.first) {
+        return true;
+      }
+    }
+    return false;
+  };
+  events.erase(std::remove_if(events.begin(), events.end(),
+                              [&](const wasi_nn_trace_event &e) { return !keep(e); }),
+               events.end());
 }
 
 __attribute__((visibility("default"))) wasi_nn_error
-run_inference(void *ctx, graph_execution_context exec_ctx, uint32_t index,
-              tensor *input_tensor, tensor_data output_tensor,
-              uint32_t *output_tensor_size,
-              const char *runtime_config, uint32_t config_len)
+get_trace(void *ctx, graph_execution_context exec_ctx, char *buffer, uint32_t buffer_size,
+          uint32_t *trace_size)
 {
   LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
-  if (!chat_ctx || !chat_ctx->server_ctx.ctx)
+  if (!chat_ctx || !trace_size)
   {
     return invalid_argument;
   }
 
-  char *prompt_text = (char *)input_tensor->data;
-  if (!prompt_text)
+  std::vector<wasi_nn_trace_event> events;
+  wasi_nn_tracer::instance().snapshot(events);
+  if (exec_ctx != 0)
   {
-    return invalid_argument;
+    select_session_events(events, (int32_t)exec_ctx);
   }
+  std::sort(events.begin(), events.end(),
+            [](const wasi_nn_trace_event &a, const wasi_nn_trace_event &b) { return a.ts_us < b.ts_us; });
 
-  try
+  // Chrome trace event format, loadable in Perfetto or chrome://tracing
+  json trace_events = json::array();
+  for (const auto &e : events)
   {
-    // Parse runtime parameters if provided
-    wasi_nn_runtime_params runtime_params;
-    bool params_valid = true;
-    
-    if (runtime_config && config_len > 0) {
-      params_valid = parse_runtime_params(runtime_config, config_len, runtime_params, chat_ctx);
-      if (!params_valid) {
-        WASI_NN_LOG_ERROR(chat_ctx, "Failed to parse runtime configuration, using defaults");
-        // Continue with default parameters rather than failing
-      } else {
-        WASI_NN_LOG_INFO(chat_ctx, "Runtime configuration applied successfully");
-      }
+    json args = json::object();
+    if (e.session != 0)
+    {
+      args["session"] = e.session;
     }
-
-    // Run inference with enhanced function
-    std::string response = run_inference_for_session_with_params(
-        chat_ctx, exec_ctx, prompt_text, 
-        (params_valid && (runtime_config && config_len > 0)) ? &runtime_params : nullptr);
-
-    *output_tensor_size = response.size() + 1;
-    copy_string_to_tensor_data(output_tensor, *output_tensor_size, response);
-
-    WASI_NN_LOG_DEBUG(chat_ctx, "Generated response: %s", response.c_str());
-    return success;
-  }
-  catch (const std::exception &e)
-  {
-    WASI_NN_LOG_ERROR(chat_ctx, "Inference failed: %s", e.what());
-    return runtime_error;
+    if (e.task >= 0)
+    {
+      args["task"] = e.task;
+    }
+    if (e.value >= 0)
+    {
+      args["value"] = e.value;
+    }
+    trace_events.push_back({
+        {"name", e.name},
+        {"cat", "wasi_nn"},
+        {"ph", "X"},
+        {"ts", e.ts_us},
+        {"dur", e.dur_us},
+        {"pid", 1},
+        {"tid", e.tid},
+        {"args", args},
+    });
   }
+  const std::string text = json{{"traceEvents", trace_events}, {"displayTimeUnit", "ms"}}.dump();
+
+  *trace_size = text.size() + 1;
+  return write_output((tensor_data)buffer, buffer_size, text) ? success : too_large;
 }
 
 // Placeholder implementations for compatibility
@@ -2857,10 +6903,12 @@ __attribute__((visibility("default"))) wasi_nn_error
 set_input(void *ctx, graph_execution_context exec_ctx, uint32_t index,
           tensor *wasi_nn_tensor)
 {
-  LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
+  LlamaChatContext *chat_ctx = home_replica((LlamaChatContext *)ctx, exec_ctx);
   if (!chat_ctx || !wasi_nn_tensor)
     return invalid_argument;
 
+  std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+
   // Find the session
   auto session_it = chat_ctx->sessions.find(exec_ctx);
   if (session_it == chat_ctx->sessions.end())
@@ -2883,85 +6931,258 @@ set_input(void *ctx, graph_execution_context exec_ctx, uint32_t index,
   size_t prompt_len = strnlen(prompt_str, tensor_size);
   std::string prompt(prompt_str, prompt_len);
   
-  // Store the prompt for later processing in compute()
-  // For now, we'll store it in the session (could be optimized)
-  session_it->second.session_id = prompt; // Temporary storage
+  // Index 0 is the prompt, index 1 an optional runtime config (same JSON as
+  // run_inference, plus "priority" and "timeout_ms") for the next compute()
+  if (index == 1) {
+    session_it->second.pending_config = std::move(prompt);
+    NN_DBG_PRINTF("Runtime config set for execution context %d", exec_ctx);
+    return success;
+  }
+  if (index != 0) {
+    NN_ERR_PRINTF("Invalid input index %u for execution context %d", index, exec_ctx);
+    return invalid_argument;
+  }
+
+  session_it->second.pending_input = std::move(prompt);
   
   NN_INFO_PRINTF("Input set for execution context %d: %.100s%s", 
-                 exec_ctx, prompt.c_str(), 
-                 prompt.length() > 100 ? "..." : "");
+                 exec_ctx, session_it->second.pending_input.c_str(), 
+                 session_it->second.pending_input.length() > 100 ? "..." : "");
 
   return success;
 }
 
+// Scheduling options of a compute() task from its runtime config. The cost
+// is estimated from the prompt (~4 bytes per token) plus the generation
+// budget, and timed with the throughput measured so far.
+static void parse_task_options(LlamaChatContext *chat_ctx, const std::string &config,
+                               const std::string &default_tenant, wasi_nn_task &task)
+{
+  task.timeout_ms = chat_ctx->default_task_timeout_ms;
+  task.tenant = default_tenant;
+  int32_t max_tokens = -1;
+  uint32_t deadline_ms = 0;
+  if (!config.empty()) {
+    cJSON *root = cJSON_ParseWithLength(config.c_str(), config.size());
+    if (root) {
+      int priority = parse_priority_value(chat_ctx, root);
+      if (priority >= 0) {
+        task.priority = (wasi_nn_task_priority)priority;
+      }
+
+      uint32_t timeout_ms = cjson_get_value(root, "timeout_ms", task.timeout_ms);
+      if (timeout_ms > 0) {
+        task.timeout_ms = timeout_ms;
+      }
+      deadline_ms = cjson_get_value(root, "deadline_ms", deadline_ms);
+      task.tenant = cjson_get_value(root, "tenant", task.tenant);
+      max_tokens = cjson_get_value(root, "max_tokens", max_tokens);
+      max_tokens = cjson_get_value(root, "n_predict", max_tokens);
+      cJSON_Delete(root);
+    }
+  }
+
+  if (!chat_ctx->priority_scheduling_enabled) {
+    task.priority = WASI_NN_PRIORITY_NORMAL;
+  }
+  if (!chat_ctx->fair_scheduling_enabled) {
+    // One flow per priority: weighted sharing between the classes only
+    task.tenant = std::to_string((int)task.priority);
+  }
+  task.timeout_at = task.created_at + std::chrono::milliseconds(task.timeout_ms);
+  if (deadline_ms > 0) {
+    task.deadline = task.created_at + std::chrono::milliseconds(deadline_ms);
+  }
+
+  if (max_tokens <= 0) {
+    max_tokens = chat_ctx->default_max_tokens.load(std::memory_order_relaxed);
+  }
+  const uint64_t prompt_tokens = task.prompt.size() / 4 + 1;
+  task.cost_tokens = (uint32_t)std::min<uint64_t>(prompt_tokens + (uint64_t)max_tokens, UINT32_MAX);
+
+  const backend_metrics &m = chat_ctx->metrics;
+  const uint64_t n_prompt = m.prompt_tokens.load(std::memory_order_relaxed);
+  const uint64_t n_predicted = m.predicted_tokens.load(std::memory_order_relaxed);
+  if (n_prompt > 0 && n_predicted > 0) {
+    const double prompt_ms_per_token = m.prompt_us.load(std::memory_order_relaxed) / 1000.0 / n_prompt;
+    const double predicted_ms_per_token = m.predicted_us.load(std::memory_order_relaxed) / 1000.0 / n_predicted;
+    task.cost_ms = prompt_tokens * prompt_ms_per_token + max_tokens * predicted_ms_per_token;
+  }
+}
+
+// Queue the input set by set_input() for inference and return immediately.
+// The task runs on a task worker; get_output() waits for its result.
 __attribute__((visibility("default"))) wasi_nn_error
 compute(void *ctx, graph_execution_context exec_ctx)
 {
-  LlamaChatContext *chat_ctx = (LlamaChatContext *)ctx;
-  if (!chat_ctx)
+  LlamaChatContext *chat_ctx = home_replica((LlamaChatContext *)ctx, exec_ctx);
+  if (!chat_ctx || !chat_ctx->task_queue)
     return invalid_argument;
 
-  // Phase 4.3: Automatic memory optimization before processing
-  wasi_nn_error opt_result = auto_optimize_memory(chat_ctx, exec_ctx);
-  if (opt_result != success) {
-    NN_WARN_PRINTF("Memory optimization warning for session %u: %d", exec_ctx, opt_result);
-    // Continue with inference even if optimization has issues
-  }
+  std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
 
   // Find the session
   auto session_it = chat_ctx->sessions.find(exec_ctx);
   if (session_it == chat_ctx->sessions.end())
     return invalid_argument;
 
-  // For simplified version, process immediately without concurrency limits
-  NN_INFO_PRINTF("Processing compute request immediately for execution context %d", exec_ctx);
-  
-  // Update last activity time
-  session_it->second.last_activity = std::chrono::steady_clock::now();
-  
-  // Phase 4.3: Auto context shift if needed (context window approaching limit)
-  auto_perform_context_shift_session(chat_ctx, exec_ctx);
-  
-  // For Phase 4.2, we're mainly implementing the queuing mechanism
-  // The actual inference processing remains the same as before
-  // This would typically involve:
-  // 1. Creating server tasks
-  // 2. Processing through the server context
-  // 3. Managing the llama context and sampling
-  
+  SessionInfo &session = session_it->second;
+  if (session.pending_input.empty()) {
+    NN_ERR_PRINTF("No input set for execution context %d", exec_ctx);
+    return invalid_argument;
+  }
+  if (session.compute_pending) {
+    NN_ERR_PRINTF("Execution context %d already has a compute in progress", exec_ctx);
+    return runtime_error;
+  }
+
+  wasi_nn_task task;
+  task.exec_ctx = exec_ctx;
+  task.prompt = session.pending_input;
+  task.runtime_config = session.pending_config;
+  parse_task_options(chat_ctx, task.runtime_config,
+                     session.session_id.empty() ? std::to_string(exec_ctx) : session.session_id, task);
+  task.is_queued = true;
+
+  const wasi_nn_task_priority priority = task.priority;
+  wasi_nn_error queued = chat_ctx->task_queue->enqueue_task(std::move(task), chat_ctx);
+  if (queued != success) {
+    return queued;
+  }
+
+  session.compute_pending = true;
+  session.output_ready = false;
+  session.output.clear();
+  session.pending_input.clear();
+  session.pending_config.clear();
+  touch_session(chat_ctx, session);
+
+  NN_DBG_PRINTF("Compute queued for execution context %d (priority %d)", exec_ctx, (int)priority);
   return success;
 }
 
+// Publish the result of a compute() task to its session and wake get_output()
+static void complete_compute_task(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx,
+                                  wasi_nn_error status, std::string &&output)
+{
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    auto session_it = chat_ctx->sessions.find(exec_ctx);
+    if (session_it == chat_ctx->sessions.end()) {
+      return;  // closed while the task was in flight
+    }
+
+    SessionInfo &session = session_it->second;
+    session.output = std::move(output);
+    session.output_status = status;
+    session.output_ready = true;
+    session.compute_pending = false;
+  }
+  chat_ctx->output_condition.notify_all();
+
+  if (status == timeout) {
+    NN_WARN_PRINTF("Compute for execution context %d timed out", exec_ctx);
+  }
+}
+
+// Task worker body: run one compute() task through the slot scheduler
+static void process_compute_task(LlamaChatContext *chat_ctx, const wasi_nn_task &task)
+{
+  if (wasi_nn_tracer::instance().enabled()) {
+    // Time in the task queue, from compute() until a worker picked it up
+    wasi_nn_trace_session trace_session((int32_t)task.exec_ctx);
+    const int64_t now_us = wasi_nn_tracer::now_us();
+    const int64_t waited_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - task.created_at).count();
+    wasi_nn_tracer::instance().record("queue_wait", now_us - waited_us, waited_us, -1, task.cost_tokens);
+  }
+
+  // Phase 4.3: Automatic memory optimization before processing. It waits for
+  // server_loop_mutex, so it runs here rather than in compute().
+  {
+    std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+    wasi_nn_error opt_result = auto_optimize_memory(chat_ctx, task.exec_ctx);
+    if (opt_result != success) {
+      NN_WARN_PRINTF("Memory optimization warning for session %u: %d", task.exec_ctx, opt_result);
+      // Continue with inference even if optimization has issues
+    }
+  }
+
+  tensor input_tensor = {};
+  input_tensor.data = (tensor_data)task.prompt.c_str();
+
+  std::string response;
+  wasi_nn_error status = run_inference_request(chat_ctx, task.exec_ctx, &input_tensor,
+                                               task.runtime_config.c_str(),
+                                               (uint32_t)task.runtime_config.size(), 0,
+                                               response, nullptr, task.deadline);
+  complete_compute_task(chat_ctx, task.exec_ctx, status, std::move(response));
+}
+
+// Wait for the session's compute() result and copy it out. The result stays
+// readable until the next compute().
 __attribute__((visibility("default"))) wasi_nn_error
 get_output(void *ctx, graph_execution_context exec_ctx, uint32_t index,
            tensor_data output_tensor, uint32_t *output_tensor_size)
 {
-  return success;
-}
+  LlamaChatContext *chat_ctx = home_replica((LlamaChatContext *)ctx, exec_ctx);
+  if (!chat_ctx || !output_tensor_size || (!output_tensor && *output_tensor_size > 0))
+    return invalid_argument;
 
-// Phase 4.3: Internal Memory Management Functions
-// ===============================================
-// These functions are automatically called during inference for optimization
+  std::unique_lock<std::mutex> lock(chat_ctx->sessions_mutex);
 
-static wasi_nn_error
-auto_clear_kv_cache_session(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx)
-{
-  if (!chat_ctx) {
-    NN_ERR_PRINTF("Invalid context");
+  auto session_it = chat_ctx->sessions.find(exec_ctx);
+  if (session_it == chat_ctx->sessions.end())
+    return invalid_argument;
+  if (!session_it->second.output_ready && !session_it->second.compute_pending) {
+    NN_ERR_PRINTF("get_output called without compute for execution context %d", exec_ctx);
     return invalid_argument;
   }
-  
-  NN_DBG_PRINTF("Auto-clearing KV cache for session %u", exec_ctx);
-  
-  wasi_nn_error result = clear_kv_cache(chat_ctx, exec_ctx);
-  if (result != success) {
-    NN_WARN_PRINTF("Failed to auto-clear KV cache for session %u: %d", exec_ctx, result);
-    return result;
+
+  chat_ctx->output_condition.wait(lock, [&] {
+    session_it = chat_ctx->sessions.find(exec_ctx);
+    return session_it == chat_ctx->sessions.end() || session_it->second.output_ready;
+  });
+  if (session_it == chat_ctx->sessions.end()) {
+    return invalid_argument;  // closed while waiting
   }
-  
+
+  const SessionInfo &session = session_it->second;
+  if (session.output_status != success) {
+    return session.output_status;
+  }
+
+  // The output stays on the session, so a caller told too_large can retry with
+  // a buffer of the size reported back
+  const uint32_t capacity = *output_tensor_size;
+  *output_tensor_size = session.output.size() + 1;
+  return write_output(output_tensor, capacity, session.output) ? success : too_large;
+}
+
+// Non-blocking check for the result of the session's last compute()
+__attribute__((visibility("default"))) wasi_nn_error
+poll_output(void *ctx, graph_execution_context exec_ctx, bool *ready)
+{
+  LlamaChatContext *chat_ctx = home_replica((LlamaChatContext *)ctx, exec_ctx);
+  if (!chat_ctx || !ready)
+    return invalid_argument;
+
+  std::lock_guard<std::mutex> lock(chat_ctx->sessions_mutex);
+
+  auto session_it = chat_ctx->sessions.find(exec_ctx);
+  if (session_it == chat_ctx->sessions.end())
+    return invalid_argument;
+
+  *ready = session_it->second.output_ready;
   return success;
 }
 
+// Phase 4.3: Internal Memory Management Functions
+// ===============================================
+// These functions are automatically called during inference for optimization.
+// They take server_loop_mutex so KV edits happen between two update_slots() steps;
+// session-scoped calls expect the caller to hold sessions_mutex.
+
 static wasi_nn_error
 auto_clear_all_kv_cache(LlamaChatContext *chat_ctx)
 {
@@ -2972,6 +7193,7 @@ auto_clear_all_kv_cache(LlamaChatContext *chat_ctx)
   
   NN_DBG_PRINTF("Auto-clearing all KV cache");
   
+  std::lock_guard<std::mutex> lock(chat_ctx->server_loop_mutex);
   wasi_nn_error result = clear_kv_cache(chat_ctx, 0); // session_id = 0 means all sessions
   if (result != success) {
     NN_WARN_PRINTF("Failed to auto-clear all KV cache: %d", result);
@@ -2982,7 +7204,8 @@ auto_clear_all_kv_cache(LlamaChatContext *chat_ctx)
 }
 
 static wasi_nn_error
-auto_perform_context_shift_session(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx)
+auto_perform_context_shift_session(LlamaChatContext *chat_ctx, graph_execution_context exec_ctx,
+                                   llama_tokens &prompt, int n_reserve)
 {
   if (!chat_ctx) {
     NN_ERR_PRINTF("Invalid context");
@@ -2996,7 +7219,8 @@ auto_perform_context_shift_session(LlamaChatContext *chat_ctx, graph_execution_c
   
   NN_DBG_PRINTF("Auto-performing context shift for session %u", exec_ctx);
   
-  wasi_nn_error result = perform_context_shift(chat_ctx, exec_ctx);
+  std::lock_guard<std::mutex> lock(chat_ctx->server_loop_mutex);
+  wasi_nn_error result = perform_context_shift(chat_ctx, exec_ctx, prompt, n_reserve);
   if (result != success) {
     NN_WARN_PRINTF("Failed to auto-perform context shift for session %u: %d", exec_ctx, result);
     return result;
@@ -3012,10 +7236,15 @@ auto_optimize_memory(LlamaChatContext *chat_ctx, graph_execution_context exec_ct
     NN_ERR_PRINTF("Invalid context");
     return invalid_argument;
   }
+  wasi_nn_trace_session trace_session((int32_t)exec_ctx);
+  WASI_NN_TRACE_SCOPE("auto_optimize_memory");
   
   NN_DBG_PRINTF("Auto-optimizing memory for session %u", exec_ctx);
   
+  std::lock_guard<std::mutex> lock(chat_ctx->server_loop_mutex);
+  
   // Check for memory pressure and handle it
+  refresh_memory_accounting(chat_ctx);
   if (check_memory_pressure(chat_ctx)) {
     NN_INFO_PRINTF("Memory pressure detected, performing automatic cleanup");
     wasi_nn_error result = handle_memory_pressure(chat_ctx);
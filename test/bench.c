@@ -0,0 +1,416 @@
+// Benchmark suite over the public C API. Every scenario loads the model into a
+// fresh backend, runs its workload through run_inference_stream and prints one
+// JSON object per line on stdout, so runs can be stored and compared across
+// llama.cpp bumps or config changes. Progress goes to stderr.
+//
+// Usage: ./bench_suite [-m model.gguf] [-n n_predict] [-r requests] [-c concurrency]
+//                      [-t turns] [-g n_gpu_layers] [-s scenario]
+#define _POSIX_C_SOURCE 200809L
+
+#include "test_common.h"
+
+#include <sys/resource.h>
+
+typedef struct {
+    double *values;
+    size_t count;
+    size_t capacity;
+} sample_set;
+
+static void samples_push(sample_set *s, double value) {
+    if (s->count == s->capacity) {
+        size_t capacity = s->capacity ? s->capacity * 2 : 64;
+        double *values = realloc(s->values, capacity * sizeof(double));
+        if (!values) {
+            return;
+        }
+        s->values = values;
+        s->capacity = capacity;
+    }
+    s->values[s->count++] = value;
+}
+
+static void samples_append(sample_set *dst, const sample_set *src) {
+    for (size_t i = 0; i < src->count; i++) {
+        samples_push(dst, src->values[i]);
+    }
+}
+
+static void samples_free(sample_set *s) {
+    free(s->values);
+    memset(s, 0, sizeof(*s));
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile, the value at rank ceil(p/100 * n); sorts the set in place
+static double samples_percentile(sample_set *s, double p) {
+    if (s->count == 0) {
+        return 0.0;
+    }
+    qsort(s->values, s->count, sizeof(double), compare_double);
+    const double exact = p / 100.0 * (double)s->count;
+    size_t rank = (size_t)exact;
+    if ((double)rank < exact) {
+        rank++;
+    }
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > s->count) {
+        rank = s->count;
+    }
+    return s->values[rank - 1];
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Measurements of one scenario, or of one worker thread before merging
+typedef struct {
+    sample_set ttft_ms;
+    sample_set inter_token_ms;
+    uint64_t tokens;
+    double decode_ms;
+    uint32_t requests;
+    uint32_t failures;
+} bench_stats;
+
+static void stats_merge(bench_stats *dst, const bench_stats *src) {
+    samples_append(&dst->ttft_ms, &src->ttft_ms);
+    samples_append(&dst->inter_token_ms, &src->inter_token_ms);
+    dst->tokens += src->tokens;
+    dst->decode_ms += src->decode_ms;
+    dst->requests += src->requests;
+    dst->failures += src->failures;
+}
+
+static void stats_free(bench_stats *s) {
+    samples_free(&s->ttft_ms);
+    samples_free(&s->inter_token_ms);
+}
+
+typedef struct {
+    void *backend_ctx;
+    graph g;
+} bench_backend;
+
+typedef struct {
+    const char *model;
+    int n_predict;
+    int requests;
+    int concurrency;
+    int turns;
+    int n_gpu_layers;
+    const char *only;
+} bench_options;
+
+// Timestamps of one streamed request. A streamed chunk is one sampled token.
+typedef struct {
+    bench_stats *stats;
+    double t_first;
+    double t_last;
+    uint32_t chunks;
+} stream_probe;
+
+static bool probe_chunk(const char *chunk, uint32_t chunk_len, void *user_data) {
+    (void)chunk;
+    (void)chunk_len;
+    stream_probe *probe = (stream_probe *)user_data;
+    double t = now_ms();
+    if (probe->chunks == 0) {
+        probe->t_first = t;
+    } else {
+        samples_push(&probe->stats->inter_token_ms, t - probe->t_last);
+    }
+    probe->t_last = t;
+    probe->chunks++;
+    return true;
+}
+
+static void timed_request(void *backend_ctx, graph_execution_context exec_ctx, const char *prompt,
+                          const char *runtime_config, bench_stats *stats) {
+    tensor input_tensor;
+    setup_tensor(&input_tensor, prompt);
+    stream_probe probe = {stats, 0.0, 0.0, 0};
+
+    double t_start = now_ms();
+    wasi_nn_error err = wasi_run_inference_stream(backend_ctx, exec_ctx, 0, &input_tensor, runtime_config,
+                                                  runtime_config ? strlen(runtime_config) : 0,
+                                                  probe_chunk, &probe);
+    stats->requests++;
+    if (err != success || probe.chunks == 0) {
+        stats->failures++;
+        return;
+    }
+    samples_push(&stats->ttft_ms, probe.t_first - t_start);
+    stats->tokens += probe.chunks;
+    stats->decode_ms += probe.t_last - probe.t_first;
+}
+
+static int load_scenario_model(const bench_options *opts, const char *extra_model_config, bench_backend *backend) {
+    void *backend_ctx = NULL;
+    char backend_config[256];
+    snprintf(backend_config, sizeof(backend_config),
+             "{\"backend\":{\"max_sessions\":%d,\"max_concurrent\":%d,\"queue_size\":%d},"
+             "\"logging\":{\"level\":\"error\"}}",
+             opts->concurrency + 8, opts->concurrency, opts->concurrency * 4);
+    if (wasi_init_backend_with_config(&backend_ctx, backend_config, strlen(backend_config)) != success) {
+        return 0;
+    }
+
+    char model_config[4096];
+    snprintf(model_config, sizeof(model_config),
+             "{\"model\":{\"n_gpu_layers\":%d,\"ctx_size\":%d,\"n_parallel\":%d,\"n_predict\":%d%s%s}}",
+             opts->n_gpu_layers, 4096 * opts->concurrency, opts->concurrency, opts->n_predict,
+             extra_model_config ? "," : "", extra_model_config ? extra_model_config : "");
+    if (wasi_load_by_name_with_config(backend_ctx, opts->model, strlen(opts->model), model_config,
+                                      strlen(model_config), &backend->g) != success) {
+        wasi_deinit_backend(backend_ctx);
+        return 0;
+    }
+    backend->backend_ctx = backend_ctx;
+    return 1;
+}
+
+// Backend-side resident memory from the metrics snapshot, 0 if unavailable
+static double backend_memory_bytes(void *backend_ctx) {
+    static char metrics[16384];
+    uint32_t metrics_size = 0;
+    if (!wasi_get_backend_metrics ||
+        wasi_get_backend_metrics(backend_ctx, WASI_NN_METRICS_JSON, metrics, sizeof(metrics), &metrics_size) != success) {
+        return 0.0;
+    }
+    const char *field = strstr(metrics, "\"memory_bytes\":");
+    return field ? strtod(field + strlen("\"memory_bytes\":"), NULL) : 0.0;
+}
+
+static void report(const char *scenario, const bench_options *opts, bench_stats *stats, double wall_ms,
+                   double memory_bytes) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    uint32_t decoded = stats->tokens > stats->requests ? (uint32_t)(stats->tokens - stats->requests) : 0;
+
+    printf("{\"scenario\":\"%s\",\"model\":\"%s\",\"requests\":%u,\"failures\":%u,\"concurrency\":%d,"
+           "\"tokens\":%llu,\"wall_ms\":%.1f,\"tokens_per_second\":%.2f,\"decode_tokens_per_second\":%.2f,"
+           "\"ttft_p50_ms\":%.2f,\"ttft_p99_ms\":%.2f,\"inter_token_p50_ms\":%.2f,\"inter_token_p99_ms\":%.2f,"
+           "\"backend_memory_bytes\":%.0f,\"peak_rss_bytes\":%lld}\n",
+           scenario, opts->model, stats->requests, stats->failures, opts->concurrency,
+           (unsigned long long)stats->tokens, wall_ms,
+           wall_ms > 0 ? stats->tokens * 1000.0 / wall_ms : 0.0,
+           stats->decode_ms > 0 ? decoded * 1000.0 / stats->decode_ms : 0.0,
+           samples_percentile(&stats->ttft_ms, 50), samples_percentile(&stats->ttft_ms, 99),
+           samples_percentile(&stats->inter_token_ms, 50), samples_percentile(&stats->inter_token_ms, 99),
+           memory_bytes, (long long)usage.ru_maxrss * 1024);
+    fflush(stdout);
+}
+
+// One request in a new, anonymous session
+static void timed_session_request(const bench_backend *backend, const char *prompt, const char *runtime_config,
+                                  bench_stats *stats) {
+    graph_execution_context exec_ctx = 0;
+    if (wasi_init_execution_context(backend->backend_ctx, backend->g, &exec_ctx) != success) {
+        stats->requests++;
+        stats->failures++;
+        return;
+    }
+    timed_request(backend->backend_ctx, exec_ctx, prompt, runtime_config, stats);
+    wasi_close_execution_context(backend->backend_ctx, exec_ctx);
+}
+
+// One request at a time, each in a new session
+static int bench_single_stream(const bench_options *opts, bench_stats *stats, const bench_backend *backend) {
+    for (int i = 0; i < opts->requests; i++) {
+        timed_session_request(backend, "Write a short story about a lighthouse keeper.", NULL, stats);
+    }
+    return 1;
+}
+
+typedef struct {
+    const bench_backend *backend;
+    int requests;
+    bench_stats stats;
+} session_worker;
+
+static void *concurrent_session_worker(void *arg) {
+    session_worker *worker = (session_worker *)arg;
+    for (int i = 0; i < worker->requests; i++) {
+        timed_session_request(worker->backend, "List some facts about the ocean.", NULL, &worker->stats);
+    }
+    return NULL;
+}
+
+// `concurrency` sessions issuing requests at once; they share decode batches
+static int bench_concurrent_sessions(const bench_options *opts, bench_stats *stats, const bench_backend *backend) {
+    session_worker *workers = calloc(opts->concurrency, sizeof(session_worker));
+    pthread_t *threads = calloc(opts->concurrency, sizeof(pthread_t));
+    if (!workers || !threads) {
+        free(workers);
+        free(threads);
+        return 0;
+    }
+    int started = 0;
+    for (int i = 0; i < opts->concurrency; i++) {
+        workers[i].backend = backend;
+        workers[i].requests = opts->requests;
+        if (pthread_create(&threads[i], NULL, concurrent_session_worker, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        stats_merge(stats, &workers[i].stats);
+        stats_free(&workers[i].stats);
+    }
+    free(workers);
+    free(threads);
+    return started == opts->concurrency;
+}
+
+// One session whose history grows every turn; TTFT tracks the prefill of each turn
+static int bench_multi_turn(const bench_options *opts, bench_stats *stats, const bench_backend *backend) {
+    graph_execution_context exec_ctx = 0;
+    if (wasi_init_execution_context_with_session_id(backend->backend_ctx, "bench_multi_turn", &exec_ctx) != success) {
+        return 0;
+    }
+    for (int turn = 0; turn < opts->turns; turn++) {
+        char prompt[128];
+        snprintf(prompt, sizeof(prompt), "Continue the story with part %d, adding a new character.", turn + 1);
+        timed_request(backend->backend_ctx, exec_ctx, prompt, NULL, stats);
+    }
+    wasi_close_execution_context(backend->backend_ctx, exec_ctx);
+    return 1;
+}
+
+static const char *SHARED_SYSTEM_PROMPT =
+    "\"system_prompt\":\"You are a meticulous support assistant for a hardware store. Answer in plain "
+    "language, keep answers short, mention safety precautions for power tools, never invent product "
+    "names or prices, ask a clarifying question when a request is ambiguous, prefer metric units, and "
+    "suggest a simpler alternative when the customer's plan looks risky or needs professional help. "
+    "Stock categories: hand tools, power tools, fasteners, plumbing, electrical, paint, garden, lumber. "
+    "Opening hours are 8 to 20 on weekdays and 9 to 17 on weekends; returns are accepted for 30 days.\"";
+
+// New sessions opening with the same long system prompt; its KV is shared
+static int bench_shared_system_prompt(const bench_options *opts, bench_stats *stats, const bench_backend *backend) {
+    static const char *questions[] = {
+        "Which drill should I use for concrete?",
+        "How do I fix a dripping tap?",
+        "What paint works on a bathroom ceiling?",
+        "Can I return an opened box of screws?",
+    };
+    for (int i = 0; i < opts->requests; i++) {
+        timed_session_request(backend, questions[i % 4], NULL, stats);
+    }
+    return 1;
+}
+
+// Output constrained to a GBNF bullet list; measures grammar sampling overhead
+static int bench_grammar(const bench_options *opts, bench_stats *stats, const bench_backend *backend) {
+    char runtime_config[256];
+    snprintf(runtime_config, sizeof(runtime_config),
+             "{\"max_tokens\":%d,\"grammar\":\"root ::= item+\\nitem ::= \\\"- \\\" [a-z ]+ \\\"\\\\n\\\"\\n\"}",
+             opts->n_predict);
+    for (int i = 0; i < opts->requests; i++) {
+        timed_session_request(backend, "List things to pack for a camping trip.", runtime_config, stats);
+    }
+    return 1;
+}
+
+typedef struct {
+    const char *name;
+    const char *extra_model_config;
+    int single_slot;
+    int (*run)(const bench_options *opts, bench_stats *stats, const bench_backend *backend);
+} bench_scenario;
+
+static const bench_scenario *scenarios(size_t *count) {
+    static bench_scenario list[5];
+    list[0] = (bench_scenario){"single_stream", NULL, 1, bench_single_stream};
+    list[1] = (bench_scenario){"concurrent_sessions", NULL, 0, bench_concurrent_sessions};
+    list[2] = (bench_scenario){"multi_turn", NULL, 1, bench_multi_turn};
+    list[3] = (bench_scenario){"shared_system_prompt", SHARED_SYSTEM_PROMPT, 1, bench_shared_system_prompt};
+    list[4] = (bench_scenario){"grammar", NULL, 1, bench_grammar};
+    *count = 5;
+    return list;
+}
+
+static int run_scenario(const bench_scenario *scenario, const bench_options *opts) {
+    bench_options scenario_opts = *opts;
+    if (scenario->single_slot) {
+        scenario_opts.concurrency = 1;
+    }
+
+    fprintf(stderr, "▶ %s\n", scenario->name);
+    bench_backend backend = {NULL, 0};
+    if (!load_scenario_model(&scenario_opts, scenario->extra_model_config, &backend)) {
+        fprintf(stderr, "❌ %s: model loading failed\n", scenario->name);
+        return 0;
+    }
+
+    bench_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    double t_start = now_ms();
+    int ok = scenario->run(&scenario_opts, &stats, &backend) && stats.failures == 0;
+    double wall_ms = now_ms() - t_start;
+
+    report(scenario->name, &scenario_opts, &stats, wall_ms, backend_memory_bytes(backend.backend_ctx));
+    stats_free(&stats);
+    wasi_deinit_backend(backend.backend_ctx);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    bench_options opts = {MODEL_FILE, 64, 5, 4, 8, 99, NULL};
+    int opt;
+    while ((opt = getopt(argc, argv, "m:n:r:c:t:g:s:")) != -1) {
+        switch (opt) {
+        case 'm': opts.model = optarg; break;
+        case 'n': opts.n_predict = atoi(optarg); break;
+        case 'r': opts.requests = atoi(optarg); break;
+        case 'c': opts.concurrency = atoi(optarg); break;
+        case 't': opts.turns = atoi(optarg); break;
+        case 'g': opts.n_gpu_layers = atoi(optarg); break;
+        case 's': opts.only = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-m model] [-n n_predict] [-r requests] [-c concurrency] "
+                            "[-t turns] [-g n_gpu_layers] [-s scenario]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opts.n_predict < 1 || opts.requests < 1 || opts.concurrency < 1 || opts.turns < 1) {
+        fprintf(stderr, "❌ Counts must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!setup_library()) {
+        fprintf(stderr, "❌ FATAL: Failed to setup library\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t n_scenarios = 0;
+    const bench_scenario *list = scenarios(&n_scenarios);
+    int failed = 0, ran = 0;
+    for (size_t i = 0; i < n_scenarios; i++) {
+        if (opts.only && strcmp(opts.only, list[i].name) != 0) {
+            continue;
+        }
+        ran++;
+        if (!run_scenario(&list[i], &opts)) {
+            failed++;
+        }
+    }
+    if (ran == 0) {
+        fprintf(stderr, "❌ Unknown scenario: %s\n", opts.only);
+        return EXIT_FAILURE;
+    }
+
+    dlclose(handle);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -7,6 +7,7 @@ extern int test_legacy_flat_config();
 extern int test_enhanced_nested_config();
 extern int test_legacy_model_config();
 extern int test_enhanced_model_config();
+extern int test_kv_cache_layout();
 
 // Inference tests
 extern int test_basic_inference();
@@ -17,6 +18,7 @@ extern int test_dynamic_runtime_parameters();
 extern int test_session_management();
 extern int test_auto_session_cleanup();
 extern int test_concurrency_management();
+extern int test_parallel_session_inference();
 
 // Logging tests
 extern int test_logging_configuration();
@@ -25,6 +27,7 @@ extern int test_file_logging();
 
 // Model tests
 extern int test_safe_model_switch();
+extern int test_resident_models();
 
 // Stopping criteria tests
 extern int test_advanced_stopping_criteria();
@@ -32,6 +35,8 @@ extern int test_grammar_based_stopping();
 extern int test_dynamic_timeout_stopping();
 extern int test_token_pattern_stopping();
 extern int test_advanced_stopping_integration();
+extern int test_streaming_stop_sequences();
+extern int test_overlapping_stop_sequences();
 
 // Error handling tests
 extern int test_error_handling();
@@ -60,16 +65,33 @@ int main() {
     RUN_TEST("Enhanced Nested Configuration", test_enhanced_nested_config);
     RUN_TEST("Legacy Model Configuration", test_legacy_model_config);
     RUN_TEST("Enhanced Model Configuration with GPU", test_enhanced_model_config);
+    RUN_TEST("Quantized KV Cache and Auto Context", test_kv_cache_layout);
 
     TEST_SECTION("Inference and AI Functionality Tests (test_inference.c)");
     RUN_TEST("Basic Inference Test", test_basic_inference);
     RUN_TEST("Advanced Sampling Parameters", test_advanced_sampling);
     RUN_TEST("Dynamic Runtime Parameters", test_dynamic_runtime_parameters);
+    RUN_TEST("Streaming Inference", test_streaming_inference);
+    RUN_TEST("Asynchronous Compute Pipeline", test_async_compute_pipeline);
+    RUN_TEST("Fair Task Scheduling", test_fair_task_scheduling);
+    RUN_TEST("Chunked Prefill", test_chunked_prefill);
+    RUN_TEST("Speculative Prompt Lookup", test_speculative_prompt_lookup);
+    RUN_TEST("Batched Multi-Prompt Inference", test_batch_inference);
+    RUN_TEST("LoRA Adapter Hot-Loading", test_lora_adapters);
+    RUN_TEST("Backend Metrics Snapshot", test_backend_metrics);
+    RUN_TEST("Request Tracing", test_request_tracing);
+    RUN_TEST("Output Size Negotiation", test_output_size_negotiation);
+    RUN_TEST("Registered Runtime Config", test_registered_runtime_config);
+    RUN_TEST("Batched Embeddings", test_batched_embeddings);
 
     TEST_SECTION("Session Management Tests (test_session.c)");
     RUN_TEST("Session Management and Chat History", test_session_management);
     RUN_TEST("Auto Session Cleanup Validation", test_auto_session_cleanup);
     RUN_TEST("Concurrency Management", test_concurrency_management);
+    RUN_TEST("Parallel Session Inference", test_parallel_session_inference);
+    RUN_TEST("Session State Persistence", test_session_persistence);
+    RUN_TEST("Shared Prefix After Closing Sessions", test_shared_prefix_after_close);
+    RUN_TEST("NUMA Replicas", test_numa_replicas);
 
     TEST_SECTION("Advanced Logging System Tests (test_logging.c)");
     RUN_TEST("Basic Logging Configuration", test_logging_configuration);
@@ -78,6 +100,8 @@ int main() {
 
     TEST_SECTION("Model Management Tests (test_model.c)");
     RUN_TEST("Safe Model Switch", test_safe_model_switch);
+    RUN_TEST("Resident Models", test_resident_models);
+    RUN_TEST("Model Preload", test_model_preload);
 
     TEST_SECTION("Advanced Stopping Criteria Tests (test_stopping.c)");
     RUN_TEST("Advanced Stopping Criteria Configuration", test_advanced_stopping_criteria);
@@ -85,6 +109,8 @@ int main() {
     RUN_TEST("Dynamic Timeout and Context-Aware Stopping", test_dynamic_timeout_stopping);
     RUN_TEST("Token-Based and Pattern Stopping Conditions", test_token_pattern_stopping);
     RUN_TEST("Advanced Stopping Criteria Integration", test_advanced_stopping_integration);
+    RUN_TEST("Streaming Stop Sequences", test_streaming_stop_sequences);
+    RUN_TEST("Overlapping Stop Sequences", test_overlapping_stop_sequences);
 
     TEST_SECTION("Error Handling and Task Management Tests (test_error.c)");
     RUN_TEST("Error Handling and Edge Cases", test_error_handling);
@@ -163,3 +163,66 @@ int test_enhanced_model_config() {
     printf("✅ Enhanced model configuration with GPU working correctly\n");
     return 1;
 }
+
+// Test 6: Quantized KV cache sized to the memory budget
+int test_kv_cache_layout() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    const char *backend_config = "{\"memory\":{\"max_memory_mb\":16384}}";
+    err = wasi_init_backend_with_config(&backend_ctx, backend_config, strlen(backend_config));
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    // Same layout with a q8_0 and an f16 cache; only the element type differs
+    const char *cache_types[2] = {"q8_0", "f16"};
+    double kv_cells[2], kv_bytes[2];
+    for (int i = 0; i < 2; i++) {
+        char model_config[512];
+        snprintf(model_config, sizeof(model_config),
+                 "{\"model\":{\"n_gpu_layers\":98,\"n_parallel\":4,\"cache_type_k\":\"%s\","
+                 "\"cache_type_v\":\"%s\",\"flash_attn\":true,\"auto_ctx\":true,\"vram_budget_mb\":12288}}",
+                 cache_types[i], cache_types[i]);
+        err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                      model_config, strlen(model_config), &g);
+        ASSERT_SUCCESS(err, "Model loading with a KV cache type failed");
+
+        err = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+        ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+        tensor input_tensor;
+        uint8_t output_buffer[256];
+        uint32_t output_size = sizeof(output_buffer);
+        setup_tensor(&input_tensor, "Say hello.");
+        const char *runtime_config = "{\"max_tokens\":8}";
+        err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output_buffer, &output_size,
+                                 runtime_config, strlen(runtime_config));
+        ASSERT_SUCCESS(err, "Inference with the KV cache type failed");
+        wasi_close_execution_context(backend_ctx, exec_ctx);
+
+        // The scheduler publishes the layout once it has run a step
+        static char metrics[16384];
+        uint32_t metrics_size = 0;
+        err = wasi_get_backend_metrics(backend_ctx, WASI_NN_METRICS_JSON, metrics, sizeof(metrics), &metrics_size);
+        ASSERT_SUCCESS(err, "JSON metrics failed");
+        const char *cells = strstr(metrics, "\"kv_cells\":");
+        const char *bytes = strstr(metrics, "\"kv_cache_bytes\":");
+        ASSERT(cells != NULL && bytes != NULL, "Metrics should report the KV cache layout");
+        kv_cells[i] = strtod(cells + strlen("\"kv_cells\":"), NULL);
+        kv_bytes[i] = strtod(bytes + strlen("\"kv_cache_bytes\":"), NULL);
+        ASSERT(kv_cells[i] > 0 && kv_bytes[i] > 0, "KV cache should be allocated");
+        ASSERT(kv_bytes[i] <= 12288.0 * 1024 * 1024, "KV cache should fit the VRAM budget");
+        printf("✅ %s cache: %.0f cells, %.1f MB\n", cache_types[i], kv_cells[i], kv_bytes[i] / (1024.0 * 1024.0));
+    }
+
+    // q8_0 stores 34 bytes per 32 elements, f16 64
+    const double ratio = (kv_bytes[0] / kv_cells[0]) / (kv_bytes[1] / kv_cells[1]);
+    ASSERT(ratio > 0.5 && ratio < 0.56, "q8_0 cells should take about 17/32 of f16 cells");
+
+    err = wasi_deinit_backend(backend_ctx);
+    ASSERT_SUCCESS(err, "Backend cleanup failed");
+
+    printf("✅ Quantized KV cache with auto context sizing working correctly\n");
+    return 1;
+}
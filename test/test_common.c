@@ -16,13 +16,28 @@ init_execution_context_func_t wasi_init_execution_context = NULL;
 init_execution_context_with_session_id_func_t wasi_init_execution_context_with_session_id = NULL;
 close_execution_context_func_t wasi_close_execution_context = NULL;
 run_inference_func_t wasi_run_inference = NULL;
+run_inference_stream_func_t wasi_run_inference_stream = NULL;
+run_inference_batch_func_t wasi_run_inference_batch = NULL;
+register_runtime_config_func_t wasi_register_runtime_config = NULL;
+release_runtime_config_func_t wasi_release_runtime_config = NULL;
+run_inference_with_config_handle_func_t wasi_run_inference_with_config_handle = NULL;
+compute_embeddings_func_t wasi_compute_embeddings = NULL;
+rerank_func_t wasi_rerank = NULL;
+load_lora_adapter_func_t wasi_load_lora_adapter = NULL;
+unload_lora_adapter_func_t wasi_unload_lora_adapter = NULL;
+get_backend_metrics_func_t wasi_get_backend_metrics = NULL;
+set_tracing_func_t wasi_set_tracing = NULL;
+get_trace_func_t wasi_get_trace = NULL;
 set_input_func_t wasi_set_input = NULL;
 compute_func_t wasi_compute = NULL;
 get_output_func_t wasi_get_output = NULL;
+poll_output_func_t wasi_poll_output = NULL;
+poll_backend_ready_func_t wasi_poll_backend_ready = NULL;
 deinit_backend_func_t wasi_deinit_backend = NULL;
 
 const char *MODEL_FILE = "./test/qwen2.5-14b-instruct-q2_k.gguf";
 const char *MODEL_CONFIG = "{\"n_gpu_layers\":0,\"ctx_size\":512,\"n_predict\":10}";
+const char *LORA_FILE = "./test/lora-adapter.gguf";
 tensor_dimensions global_text_dims = {NULL, 0};
 
 void segfault_handler(int sig) {
@@ -52,9 +67,23 @@ int setup_library(void) {
     *(void **)(&wasi_init_execution_context_with_session_id) = dlsym(handle, "init_execution_context_with_session_id");
     *(void **)(&wasi_close_execution_context) = dlsym(handle, "close_execution_context");
     *(void **)(&wasi_run_inference) = dlsym(handle, "run_inference");
+    *(void **)(&wasi_run_inference_stream) = dlsym(handle, "run_inference_stream");
+    *(void **)(&wasi_run_inference_batch) = dlsym(handle, "run_inference_batch");
+    *(void **)(&wasi_register_runtime_config) = dlsym(handle, "register_runtime_config");
+    *(void **)(&wasi_release_runtime_config) = dlsym(handle, "release_runtime_config");
+    *(void **)(&wasi_run_inference_with_config_handle) = dlsym(handle, "run_inference_with_config_handle");
+    *(void **)(&wasi_compute_embeddings) = dlsym(handle, "compute_embeddings");
+    *(void **)(&wasi_rerank) = dlsym(handle, "rerank");
+    *(void **)(&wasi_load_lora_adapter) = dlsym(handle, "load_lora_adapter");
+    *(void **)(&wasi_unload_lora_adapter) = dlsym(handle, "unload_lora_adapter");
+    *(void **)(&wasi_get_backend_metrics) = dlsym(handle, "get_backend_metrics");
+    *(void **)(&wasi_set_tracing) = dlsym(handle, "set_tracing");
+    *(void **)(&wasi_get_trace) = dlsym(handle, "get_trace");
     *(void **)(&wasi_set_input) = dlsym(handle, "set_input");
     *(void **)(&wasi_compute) = dlsym(handle, "compute");
     *(void **)(&wasi_get_output) = dlsym(handle, "get_output");
+    *(void **)(&wasi_poll_output) = dlsym(handle, "poll_output");
+    *(void **)(&wasi_poll_backend_ready) = dlsym(handle, "poll_backend_ready");
     *(void **)(&wasi_deinit_backend) = dlsym(handle, "deinit_backend");
 
     char *error = dlerror();
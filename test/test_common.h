@@ -1,10 +1,16 @@
 #ifndef TEST_COMMON_H
 #define TEST_COMMON_H
 
+// clock_gettime and CLOCK_MONOTONIC under -std=c99
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <dlfcn.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -98,6 +104,11 @@ typedef struct {
 
 typedef uint8_t *tensor_data;
 
+typedef enum {
+    WASI_NN_METRICS_JSON = 0,
+    WASI_NN_METRICS_PROMETHEUS = 1
+} wasi_nn_metrics_format;
+
 // Function pointers for the APIs
 typedef wasi_nn_error (*init_backend_func_t)(void **ctx);
 typedef wasi_nn_error (*init_backend_with_config_func_t)(void **ctx, const char *config, uint32_t config_len);
@@ -109,10 +120,40 @@ typedef wasi_nn_error (*close_execution_context_func_t)(void *ctx, graph_executi
 typedef wasi_nn_error (*run_inference_func_t)(void *ctx, graph_execution_context exec_ctx, uint32_t index,
                                             tensor *input_tensor, tensor_data output_tensor, uint32_t *output_tensor_size,
                                             const char *runtime_config, uint32_t config_len);
+typedef bool (*stream_callback_t)(const char *chunk, uint32_t chunk_len, void *user_data);
+typedef wasi_nn_error (*run_inference_stream_func_t)(void *ctx, graph_execution_context exec_ctx, uint32_t index,
+                                                   tensor *input_tensor, const char *runtime_config, uint32_t config_len,
+                                                   stream_callback_t callback, void *user_data);
+typedef wasi_nn_error (*run_inference_batch_func_t)(void *ctx, graph_execution_context exec_ctx,
+                                                  tensor *input_tensors, uint32_t n_inputs,
+                                                  tensor_data *output_tensors, uint32_t *output_tensor_sizes,
+                                                  const char *runtime_config, uint32_t config_len);
+typedef wasi_nn_error (*register_runtime_config_func_t)(void *ctx, const char *runtime_config, uint32_t config_len,
+                                                      uint32_t *config_handle);
+typedef wasi_nn_error (*release_runtime_config_func_t)(void *ctx, uint32_t config_handle);
+typedef wasi_nn_error (*run_inference_with_config_handle_func_t)(void *ctx, graph_execution_context exec_ctx, uint32_t index,
+                                                               tensor *input_tensor, tensor_data output_tensor,
+                                                               uint32_t *output_tensor_size, uint32_t config_handle);
+typedef wasi_nn_error (*compute_embeddings_func_t)(void *ctx, graph_execution_context exec_ctx,
+                                                 tensor *input_tensors, uint32_t n_inputs,
+                                                 tensor_data *output_tensors, uint32_t *output_tensor_sizes);
+typedef wasi_nn_error (*rerank_func_t)(void *ctx, graph_execution_context exec_ctx, tensor *query_tensor,
+                                     tensor *document_tensors, uint32_t n_documents,
+                                     tensor_data output_tensor, uint32_t *output_tensor_size);
+typedef wasi_nn_error (*load_lora_adapter_func_t)(void *ctx, const char *path, uint32_t path_len, float scale,
+                                                uint32_t *adapter_id);
+typedef wasi_nn_error (*unload_lora_adapter_func_t)(void *ctx, uint32_t adapter_id);
+typedef wasi_nn_error (*get_backend_metrics_func_t)(void *ctx, wasi_nn_metrics_format format, char *buffer,
+                                                  uint32_t buffer_size, uint32_t *metrics_size);
+typedef wasi_nn_error (*set_tracing_func_t)(void *ctx, bool enabled);
+typedef wasi_nn_error (*get_trace_func_t)(void *ctx, graph_execution_context exec_ctx, char *buffer,
+                                        uint32_t buffer_size, uint32_t *trace_size);
 typedef wasi_nn_error (*set_input_func_t)(void *ctx, graph_execution_context exec_ctx, uint32_t index, tensor *input_tensor);
 typedef wasi_nn_error (*compute_func_t)(void *ctx, graph_execution_context exec_ctx);
 typedef wasi_nn_error (*get_output_func_t)(void *ctx, graph_execution_context exec_ctx, uint32_t index, 
                                           tensor_data output_tensor, uint32_t *output_tensor_size);
+typedef wasi_nn_error (*poll_output_func_t)(void *ctx, graph_execution_context exec_ctx, bool *ready);
+typedef wasi_nn_error (*poll_backend_ready_func_t)(void *ctx, bool *ready);
 typedef wasi_nn_error (*deinit_backend_func_t)(void *ctx);
 
 // Global function pointers
@@ -124,14 +165,29 @@ extern init_execution_context_func_t wasi_init_execution_context;
 extern init_execution_context_with_session_id_func_t wasi_init_execution_context_with_session_id;
 extern close_execution_context_func_t wasi_close_execution_context;
 extern run_inference_func_t wasi_run_inference;
+extern run_inference_stream_func_t wasi_run_inference_stream;
+extern run_inference_batch_func_t wasi_run_inference_batch;
+extern register_runtime_config_func_t wasi_register_runtime_config;
+extern release_runtime_config_func_t wasi_release_runtime_config;
+extern run_inference_with_config_handle_func_t wasi_run_inference_with_config_handle;
+extern compute_embeddings_func_t wasi_compute_embeddings;
+extern rerank_func_t wasi_rerank;
+extern load_lora_adapter_func_t wasi_load_lora_adapter;
+extern unload_lora_adapter_func_t wasi_unload_lora_adapter;
+extern get_backend_metrics_func_t wasi_get_backend_metrics;
+extern set_tracing_func_t wasi_set_tracing;
+extern get_trace_func_t wasi_get_trace;
 extern set_input_func_t wasi_set_input;
 extern compute_func_t wasi_compute;
 extern get_output_func_t wasi_get_output;
+extern poll_output_func_t wasi_poll_output;
+extern poll_backend_ready_func_t wasi_poll_backend_ready;
 extern deinit_backend_func_t wasi_deinit_backend;
 
 // Test configurations
 extern const char *MODEL_FILE;
 extern const char *MODEL_CONFIG;
+extern const char *LORA_FILE;
 
 // Global tensor dimensions for safe reuse
 extern tensor_dimensions global_text_dims;
@@ -147,16 +203,33 @@ int test_legacy_flat_config(void);
 int test_enhanced_nested_config(void);
 int test_legacy_model_config(void);
 int test_enhanced_model_config(void);
+int test_kv_cache_layout(void);
 
 // Inference tests
 int test_basic_inference(void);
 int test_advanced_sampling(void);
 int test_dynamic_runtime_parameters(void);
+int test_streaming_inference(void);
+int test_async_compute_pipeline(void);
+int test_fair_task_scheduling(void);
+int test_chunked_prefill(void);
+int test_speculative_prompt_lookup(void);
+int test_batch_inference(void);
+int test_lora_adapters(void);
+int test_backend_metrics(void);
+int test_request_tracing(void);
+int test_output_size_negotiation(void);
+int test_registered_runtime_config(void);
+int test_batched_embeddings(void);
 
 // Session tests
 int test_session_management(void);
 int test_auto_session_cleanup(void);
 int test_concurrency_management(void);
+int test_parallel_session_inference(void);
+int test_session_persistence(void);
+int test_shared_prefix_after_close(void);
+int test_numa_replicas(void);
 
 // Logging tests
 int test_logging_configuration(void);
@@ -165,6 +238,8 @@ int test_file_logging(void);
 
 // Model tests
 int test_safe_model_switch(void);
+int test_resident_models(void);
+int test_model_preload(void);
 
 // Stopping tests
 int test_advanced_stopping_criteria(void);
@@ -172,6 +247,8 @@ int test_grammar_based_stopping(void);
 int test_dynamic_timeout_stopping(void);
 int test_token_pattern_stopping(void);
 int test_advanced_stopping_integration(void);
+int test_streaming_stop_sequences(void);
+int test_overlapping_stop_sequences(void);
 
 // Error tests
 int test_error_handling(void);
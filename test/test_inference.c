@@ -302,3 +302,819 @@ int test_dynamic_runtime_parameters() {
 
     return 1;
 }
+
+// Collects streamed chunks for test_streaming_inference
+typedef struct {
+    char text[1024];
+    uint32_t length;
+    int chunks;
+    int max_chunks;  // stop generation after this many chunks, 0 = never
+    struct timespec first_chunk;
+} stream_capture;
+
+static bool capture_stream_chunk(const char *chunk, uint32_t chunk_len, void *user_data) {
+    stream_capture *cap = (stream_capture *)user_data;
+    if (cap->chunks == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &cap->first_chunk);
+    }
+    cap->chunks++;
+
+    uint32_t room = sizeof(cap->text) - 1 - cap->length;
+    uint32_t n = chunk_len < room ? chunk_len : room;
+    memcpy(cap->text + cap->length, chunk, n);
+    cap->length += n;
+    cap->text[cap->length] = '\0';
+
+    return cap->max_chunks == 0 || cap->chunks < cap->max_chunks;
+}
+
+// Test: Streaming inference delivers text incrementally and can be stopped early
+int test_streaming_inference() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    const char *model_config = "{\"model\":{\"n_gpu_layers\":98,\"ctx_size\":2048,\"n_predict\":60}}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  model_config, strlen(model_config), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    err = wasi_init_execution_context_with_session_id(backend_ctx, "streaming_session", &exec_ctx);
+    ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+    tensor input_tensor;
+    setup_tensor(&input_tensor, "Count from one to ten in words.");
+
+    // A NULL callback is rejected
+    err = wasi_run_inference_stream(backend_ctx, exec_ctx, 0, &input_tensor, NULL, 0, NULL, NULL);
+    ASSERT(err != 0, "Streaming without a callback should fail");
+
+    stream_capture cap;
+    memset(&cap, 0, sizeof(cap));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = wasi_run_inference_stream(backend_ctx, exec_ctx, 0, &input_tensor, NULL, 0,
+                                    capture_stream_chunk, &cap);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ASSERT_SUCCESS(err, "Streaming inference failed");
+    ASSERT(cap.chunks > 1, "Response should arrive in several chunks");
+
+    double ttfb_ms = (cap.first_chunk.tv_sec - start.tv_sec) * 1000.0 +
+                     (cap.first_chunk.tv_nsec - start.tv_nsec) / 1e6;
+    double total_ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    ASSERT(ttfb_ms < total_ms, "First chunk should arrive before generation ends");
+    printf("✅ Streamed %d chunks (%u bytes), first after %.1fms of %.1fms: %.60s%s\n",
+           cap.chunks, cap.length, ttfb_ms, total_ms, cap.text, cap.length > 60 ? "..." : "");
+
+    // Returning false from the callback stops generation
+    memset(&cap, 0, sizeof(cap));
+    cap.max_chunks = 3;
+    setup_tensor(&input_tensor, "Write a long story about a dragon.");
+    err = wasi_run_inference_stream(backend_ctx, exec_ctx, 0, &input_tensor, NULL, 0,
+                                    capture_stream_chunk, &cap);
+    ASSERT_SUCCESS(err, "Stopped streaming inference failed");
+    ASSERT(cap.chunks == 3, "Callback should not be called after returning false");
+    printf("✅ Generation stopped after %d chunks\n", cap.chunks);
+
+    // The session remains usable with the regular API
+    uint8_t output_buffer[512];
+    uint32_t output_size = sizeof(output_buffer);
+    setup_tensor(&input_tensor, "Say hello.");
+    err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output_buffer, &output_size, NULL, 0);
+    ASSERT_SUCCESS(err, "Inference after a stopped stream failed");
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// Test: compute() queues work and returns; get_output() collects the results
+int test_async_compute_pipeline() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    wasi_nn_error err;
+
+    const char *config = "{\"backend\":{\"max_concurrent\":2}}";
+    err = wasi_init_backend_with_config(&backend_ctx, config, strlen(config));
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    const char *model_config = "{\"model\":{\"n_gpu_layers\":98,\"ctx_size\":2048,\"n_predict\":40,\"n_parallel\":2}}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  model_config, strlen(model_config), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    const char *sessions[2] = {"async_session_a", "async_session_b"};
+    const char *prompts[2] = {"Name three fruits.", "Name three planets."};
+    graph_execution_context exec_ctx[2];
+    tensor input_tensor;
+    bool ready = true;
+
+    for (int i = 0; i < 2; i++) {
+        err = wasi_init_execution_context_with_session_id(backend_ctx, sessions[i], &exec_ctx[i]);
+        ASSERT_SUCCESS(err, "Execution context initialization failed");
+    }
+
+    // get_output without a compute is rejected
+    uint8_t output[512];
+    uint32_t output_size = sizeof(output);
+    err = wasi_get_output(backend_ctx, exec_ctx[0], 0, output, &output_size);
+    ASSERT(err != 0, "get_output without compute should fail");
+
+    // Queue both turns; the second one with a runtime config and high priority
+    const char *task_config = "{\"priority\":\"high\",\"timeout_ms\":60000,\"max_tokens\":20}";
+    for (int i = 0; i < 2; i++) {
+        setup_tensor(&input_tensor, prompts[i]);
+        err = wasi_set_input(backend_ctx, exec_ctx[i], 0, &input_tensor);
+        ASSERT_SUCCESS(err, "Setting input failed");
+        if (i == 1) {
+            setup_tensor(&input_tensor, task_config);
+            err = wasi_set_input(backend_ctx, exec_ctx[i], 1, &input_tensor);
+            ASSERT_SUCCESS(err, "Setting runtime config failed");
+        }
+        err = wasi_compute(backend_ctx, exec_ctx[i]);
+        ASSERT_SUCCESS(err, "Queuing compute failed");
+    }
+
+    // A second compute on a busy session is rejected
+    setup_tensor(&input_tensor, "Another question.");
+    wasi_set_input(backend_ctx, exec_ctx[0], 0, &input_tensor);
+    err = wasi_poll_output(backend_ctx, exec_ctx[0], &ready);
+    ASSERT_SUCCESS(err, "Polling output failed");
+    if (!ready) {
+        err = wasi_compute(backend_ctx, exec_ctx[0]);
+        ASSERT(err != 0, "Compute on a busy session should fail");
+    }
+
+    for (int i = 0; i < 2; i++) {
+        output_size = sizeof(output);
+        err = wasi_get_output(backend_ctx, exec_ctx[i], 0, output, &output_size);
+        ASSERT_SUCCESS(err, "Getting output failed");
+        ASSERT(output_size > 0, "No output generated");
+        err = wasi_poll_output(backend_ctx, exec_ctx[i], &ready);
+        ASSERT(err == 0 && ready, "Output should be ready after get_output");
+        printf("✅ Session %s (%d chars): %.60s%s\n", sessions[i], output_size,
+               (char *)output, output_size > 60 ? "..." : "");
+        wasi_close_execution_context(backend_ctx, exec_ctx[i]);
+    }
+
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// Test: compute() tasks share the queue by tenant and respect deadlines
+int test_fair_task_scheduling() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    wasi_nn_error err;
+
+    const char *config = "{\"backend\":{\"max_concurrent\":1,\"preempt_max_steps\":8}}";
+    err = wasi_init_backend_with_config(&backend_ctx, config, strlen(config));
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    const char *model_config = "{\"model\":{\"n_gpu_layers\":98,\"ctx_size\":2048,\"n_predict\":40,\"n_parallel\":2}}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  model_config, strlen(model_config), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    // Two bulk tasks of one tenant and a high-priority task of another
+    const char *task_configs[3] = {
+        "{\"tenant\":\"bulk\",\"priority\":\"low\",\"max_tokens\":24}",
+        "{\"tenant\":\"bulk\",\"priority\":\"low\",\"max_tokens\":24}",
+        "{\"tenant\":\"interactive\",\"priority\":\"high\",\"deadline_ms\":120000,\"max_tokens\":8}",
+    };
+    graph_execution_context exec_ctx[3];
+    tensor input_tensor;
+    uint8_t output[512];
+    uint32_t output_size;
+
+    for (int i = 0; i < 3; i++) {
+        err = wasi_init_execution_context(backend_ctx, g, &exec_ctx[i]);
+        ASSERT_SUCCESS(err, "Execution context initialization failed");
+        setup_tensor(&input_tensor, "Count from one to ten.");
+        err = wasi_set_input(backend_ctx, exec_ctx[i], 0, &input_tensor);
+        ASSERT_SUCCESS(err, "Setting input failed");
+        setup_tensor(&input_tensor, task_configs[i]);
+        err = wasi_set_input(backend_ctx, exec_ctx[i], 1, &input_tensor);
+        ASSERT_SUCCESS(err, "Setting runtime config failed");
+        err = wasi_compute(backend_ctx, exec_ctx[i]);
+        ASSERT_SUCCESS(err, "Queuing compute failed");
+    }
+    for (int i = 0; i < 3; i++) {
+        output_size = sizeof(output);
+        err = wasi_get_output(backend_ctx, exec_ctx[i], 0, output, &output_size);
+        ASSERT_SUCCESS(err, "Getting output failed");
+        ASSERT(output_size > 0, "No output generated");
+    }
+    printf("✅ Tasks of both tenants completed\n");
+
+    // With throughput measured, a deadline shorter than the generation is refused
+    setup_tensor(&input_tensor, "Write a long story about the sea.");
+    err = wasi_set_input(backend_ctx, exec_ctx[0], 0, &input_tensor);
+    ASSERT_SUCCESS(err, "Setting input failed");
+    const char *late_config = "{\"deadline_ms\":1,\"max_tokens\":200}";
+    setup_tensor(&input_tensor, late_config);
+    err = wasi_set_input(backend_ctx, exec_ctx[0], 1, &input_tensor);
+    ASSERT_SUCCESS(err, "Setting runtime config failed");
+    err = wasi_compute(backend_ctx, exec_ctx[0]);
+    ASSERT(err == timeout, "A task that cannot meet its deadline should be refused");
+    printf("✅ Task with an unreachable deadline refused\n");
+
+    for (int i = 0; i < 3; i++) {
+        wasi_close_execution_context(backend_ctx, exec_ctx[i]);
+    }
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// Test: a prompt much longer than n_batch is prefilled in chunks next to a
+// session that is generating, and an embedding input, which cannot be split,
+// is evaluated whole next to one
+int test_chunked_prefill() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    wasi_nn_error err;
+
+    const char *config = "{\"backend\":{\"max_concurrent\":2},\"performance\":{\"step_token_budget\":32}}";
+    err = wasi_init_backend_with_config(&backend_ctx, config, strlen(config));
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    const char *model_config = "{\"model\":{\"n_gpu_layers\":98,\"ctx_size\":4096,\"n_batch\":64,"
+                               "\"n_ubatch\":64,\"n_predict\":24,\"n_parallel\":2,\"pooling\":\"mean\"}}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  model_config, strlen(model_config), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    // About ten times n_batch tokens
+    static char long_prompt[8192];
+    const char *sentence = "The river flows past the old mill and the quiet village. ";
+    long_prompt[0] = '\0';
+    for (int i = 0; i < 50; i++) {
+        strcat(long_prompt, sentence);
+    }
+    strcat(long_prompt, "Where does the river flow?");
+
+    const char *prompts[2] = {"Count from one to twenty.", long_prompt};
+    graph_execution_context exec_ctx[2];
+    tensor input_tensor;
+    uint8_t output[1024];
+    uint32_t output_size;
+
+    for (int i = 0; i < 2; i++) {
+        err = wasi_init_execution_context(backend_ctx, g, &exec_ctx[i]);
+        ASSERT_SUCCESS(err, "Execution context initialization failed");
+        setup_tensor(&input_tensor, prompts[i]);
+        err = wasi_set_input(backend_ctx, exec_ctx[i], 0, &input_tensor);
+        ASSERT_SUCCESS(err, "Setting input failed");
+        err = wasi_compute(backend_ctx, exec_ctx[i]);
+        ASSERT_SUCCESS(err, "Queuing compute failed");
+    }
+    for (int i = 0; i < 2; i++) {
+        output_size = sizeof(output);
+        err = wasi_get_output(backend_ctx, exec_ctx[i], 0, output, &output_size);
+        ASSERT_SUCCESS(err, "Getting output failed");
+        ASSERT(output_size > 0, "No output generated");
+        wasi_close_execution_context(backend_ctx, exec_ctx[i]);
+    }
+    printf("✅ %zu-byte prompt prefilled in chunks next to a generating session\n", strlen(long_prompt));
+
+    // More tokens than step_token_budget, fewer than n_ubatch
+    tensor embed_input;
+    setup_tensor(&embed_input, "The river flows past the old mill and the quiet village. "
+                               "The river flows past the old mill and the quiet village. "
+                               "The river flows past the old mill and the quiet village. "
+                               "Where does the river flow?");
+    for (int i = 0; i < 2; i++) {
+        err = wasi_init_execution_context(backend_ctx, g, &exec_ctx[i]);
+        ASSERT_SUCCESS(err, "Execution context initialization failed");
+    }
+
+    tensor_data embed_alone = NULL;
+    uint32_t embed_size = 0;
+    err = wasi_compute_embeddings(backend_ctx, exec_ctx[1], &embed_input, 1, &embed_alone, &embed_size);
+    ASSERT(err == too_large && embed_size > 0, "Embedding size query failed");
+    const uint32_t n_embd = embed_size / sizeof(float);
+    embed_alone = malloc(embed_size);
+    tensor_data embed_shared = malloc(embed_size);
+    ASSERT(embed_alone != NULL && embed_shared != NULL, "Allocation failed");
+    err = wasi_compute_embeddings(backend_ctx, exec_ctx[1], &embed_input, 1, &embed_alone, &embed_size);
+    ASSERT_SUCCESS(err, "Computing the embedding alone failed");
+
+    // Same input while the other slot generates
+    setup_tensor(&input_tensor, prompts[0]);
+    err = wasi_set_input(backend_ctx, exec_ctx[0], 0, &input_tensor);
+    ASSERT_SUCCESS(err, "Setting input failed");
+    err = wasi_compute(backend_ctx, exec_ctx[0]);
+    ASSERT_SUCCESS(err, "Queuing compute failed");
+    uint32_t shared_size = embed_size;
+    err = wasi_compute_embeddings(backend_ctx, exec_ctx[1], &embed_input, 1, &embed_shared, &shared_size);
+    ASSERT_SUCCESS(err, "Computing the embedding next to a generating session failed");
+    ASSERT(shared_size == embed_size, "Embedding size changed");
+    output_size = sizeof(output);
+    err = wasi_get_output(backend_ctx, exec_ctx[0], 0, output, &output_size);
+    ASSERT_SUCCESS(err, "Getting output failed");
+    ASSERT(output_size > 0, "No output generated");
+
+    const float *a = (const float *)embed_alone;
+    const float *b = (const float *)embed_shared;
+    float similarity = 0.0f;
+    for (uint32_t j = 0; j < n_embd; ++j) {
+        similarity += a[j] * b[j];
+    }
+    ASSERT(similarity > 0.999f, "An embedding computed next to a generating slot should match it computed alone");
+    printf("✅ Embedding next to a generating session matches it alone (cosine %.5f)\n", similarity);
+
+    free(embed_alone);
+    free(embed_shared);
+    for (int i = 0; i < 2; i++) {
+        wasi_close_execution_context(backend_ctx, exec_ctx[i]);
+    }
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// Test: Prompt lookup speculation (no draft model) and per-request overrides
+int test_speculative_prompt_lookup() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    const char *model_config = "{"
+                              "\"model\":{\"n_gpu_layers\":98,\"ctx_size\":2048,\"n_predict\":80},"
+                              "\"speculative\":{\"lookup_ngram\":3,\"n_max\":8}"
+                              "}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  model_config, strlen(model_config), &g);
+    ASSERT_SUCCESS(err, "Model loading with speculative config failed");
+
+    err = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+    ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+    // Copying text back is the best case for prompt lookup
+    tensor input_tensor;
+    setup_tensor(&input_tensor, "Repeat exactly: {\"name\": \"Alice\", \"age\": 30, \"city\": \"Paris\"}");
+
+    uint8_t output_buffer[1024];
+    uint32_t output_size = sizeof(output_buffer);
+    err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output_buffer, &output_size, NULL, 0);
+    ASSERT_SUCCESS(err, "Inference with prompt lookup failed");
+    ASSERT(output_size > 0, "No output generated");
+    printf("✅ Prompt lookup response (%d chars): %.80s%s\n", output_size,
+           (char *)output_buffer, output_size > 80 ? "..." : "");
+
+    // Speculation can be turned off per request
+    const char *no_spec = "{\"speculative.n_max\":0,\"max_tokens\":20}";
+    output_size = sizeof(output_buffer);
+    err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output_buffer, &output_size,
+                           no_spec, strlen(no_spec));
+    ASSERT_SUCCESS(err, "Inference with speculation disabled failed");
+    ASSERT(output_size > 0, "No output generated without speculation");
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// Test: run_inference_batch answers independent prompts together
+int test_batch_inference() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    const char *model_config = "{\"model\":{\"n_gpu_layers\":98,\"ctx_size\":4096,\"n_predict\":16,\"n_parallel\":4}}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  model_config, strlen(model_config), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    err = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+    ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+    // More prompts than slots, so slots are refilled as prompts finish
+    const char *prompts[6] = {
+        "Is 'I love it' positive or negative? One word.",
+        "Is 'This is awful' positive or negative? One word.",
+        "What is the capital of France? One word.",
+        "What is 2 + 2? Answer with a number.",
+        "Name a primary color. One word.",
+        "What is the opposite of hot? One word.",
+    };
+    tensor inputs[6];
+    uint8_t buffers[6][256];
+    tensor_data outputs[6];
+    uint32_t sizes[6];
+    for (int i = 0; i < 6; i++) {
+        setup_tensor(&inputs[i], prompts[i]);
+        outputs[i] = buffers[i];
+        sizes[i] = sizeof(buffers[i]);
+    }
+
+    err = wasi_run_inference_batch(backend_ctx, exec_ctx, inputs, 0, outputs, sizes, NULL, 0);
+    ASSERT(err != 0, "An empty batch should be rejected");
+
+    const char *runtime_config = "{\"temperature\":0.1,\"max_tokens\":8}";
+    err = wasi_run_inference_batch(backend_ctx, exec_ctx, inputs, 6, outputs, sizes,
+                                   runtime_config, strlen(runtime_config));
+    ASSERT_SUCCESS(err, "Batch inference failed");
+    for (int i = 0; i < 6; i++) {
+        ASSERT(sizes[i] > 0, "Batch prompt produced no output");
+        printf("✅ [%d] %s -> %.40s\n", i, prompts[i], (char *)buffers[i]);
+    }
+
+    // Batch prompts leave the session history untouched
+    tensor input_tensor;
+    uint8_t output_buffer[256];
+    uint32_t output_size = sizeof(output_buffer);
+    setup_tensor(&input_tensor, "Say hello.");
+    err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output_buffer, &output_size, NULL, 0);
+    ASSERT_SUCCESS(err, "Inference after a batch failed");
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// Test: LoRA adapters load at runtime and are selected per request
+int test_lora_adapters() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    const char *model_config = "{\"model\":{\"n_gpu_layers\":98,\"ctx_size\":2048,\"n_predict\":16}}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  model_config, strlen(model_config), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    err = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+    ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+    uint32_t adapter_id = 0;
+    const char *missing = "./test/no-such-adapter.gguf";
+    err = wasi_load_lora_adapter(backend_ctx, missing, strlen(missing), 1.0f, &adapter_id);
+    ASSERT(err != 0, "Loading a missing adapter should fail");
+    err = wasi_unload_lora_adapter(backend_ctx, 42);
+    ASSERT(err != 0, "Unloading an unknown adapter should fail");
+
+    // Unknown adapter ids in the runtime config are ignored
+    tensor input_tensor;
+    uint8_t output_buffer[256];
+    uint32_t output_size = sizeof(output_buffer);
+    setup_tensor(&input_tensor, "Say hello.");
+    const char *unknown_lora = "{\"max_tokens\":8,\"lora\":[{\"id\":7,\"scale\":1.0}]}";
+    err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output_buffer, &output_size,
+                             unknown_lora, strlen(unknown_lora));
+    ASSERT_SUCCESS(err, "Inference with an unknown adapter id failed");
+
+    if (access(LORA_FILE, R_OK) != 0) {
+        printf("⚠️  %s not found, skipping adapter load/unload\n", LORA_FILE);
+    } else {
+        // Off by default, applied only where a request selects it
+        err = wasi_load_lora_adapter(backend_ctx, LORA_FILE, strlen(LORA_FILE), 0.0f, &adapter_id);
+        ASSERT_SUCCESS(err, "Adapter loading failed");
+        printf("✅ Loaded adapter %u\n", adapter_id);
+
+        char lora_config[128];
+        snprintf(lora_config, sizeof(lora_config), "{\"max_tokens\":8,\"lora\":[{\"id\":%u,\"scale\":1.0}]}",
+                 adapter_id);
+        output_size = sizeof(output_buffer);
+        err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output_buffer, &output_size,
+                                 lora_config, strlen(lora_config));
+        ASSERT_SUCCESS(err, "Inference with the adapter failed");
+
+        err = wasi_unload_lora_adapter(backend_ctx, adapter_id);
+        ASSERT_SUCCESS(err, "Adapter unloading failed");
+        err = wasi_unload_lora_adapter(backend_ctx, adapter_id);
+        ASSERT(err != 0, "Unloading an adapter twice should fail");
+
+        output_size = sizeof(output_buffer);
+        err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output_buffer, &output_size, NULL, 0);
+        ASSERT_SUCCESS(err, "Inference after unloading the adapter failed");
+    }
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+int test_backend_metrics() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  MODEL_CONFIG, strlen(MODEL_CONFIG), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    err = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+    ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+    tensor input_tensor;
+    uint8_t output_buffer[256];
+    uint32_t output_size = sizeof(output_buffer);
+    setup_tensor(&input_tensor, "Count to three.");
+    err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output_buffer, &output_size, NULL, 0);
+    ASSERT_SUCCESS(err, "Inference failed");
+
+    static char metrics[16384];
+    uint32_t metrics_size = 0;
+    err = wasi_get_backend_metrics(backend_ctx, WASI_NN_METRICS_JSON, metrics, sizeof(metrics), &metrics_size);
+    ASSERT_SUCCESS(err, "JSON metrics failed");
+    ASSERT(metrics_size <= sizeof(metrics), "JSON metrics were truncated");
+    ASSERT(strstr(metrics, "\"requests_total\":1") != NULL, "JSON metrics should count the request");
+    ASSERT(strstr(metrics, "\"ttft_ms\"") != NULL, "JSON metrics should include the TTFT histogram");
+    printf("✅ JSON snapshot: %u bytes\n", metrics_size);
+
+    err = wasi_get_backend_metrics(backend_ctx, WASI_NN_METRICS_PROMETHEUS, metrics, sizeof(metrics), &metrics_size);
+    ASSERT_SUCCESS(err, "Prometheus metrics failed");
+    ASSERT(strstr(metrics, "# TYPE wasi_nn_requests_total counter") != NULL, "Prometheus output should type counters");
+    ASSERT(strstr(metrics, "wasi_nn_ttft_ms_bucket{le=\"+Inf\"} 1") != NULL,
+           "Prometheus histogram should hold the request");
+
+    // No buffer: only the required size comes back
+    uint32_t full_size = metrics_size;
+    err = wasi_get_backend_metrics(backend_ctx, WASI_NN_METRICS_PROMETHEUS, NULL, 0, &metrics_size);
+    ASSERT(err == too_large && metrics_size >= full_size, "Metrics size query should report too_large with the size");
+
+    // A short buffer is left untouched and reports the size again
+    char small[16] = "untouched";
+    err = wasi_get_backend_metrics(backend_ctx, WASI_NN_METRICS_PROMETHEUS, small, sizeof(small), &metrics_size);
+    ASSERT(err == too_large && metrics_size >= full_size, "A short buffer should report too_large with the size");
+    ASSERT(strcmp(small, "untouched") == 0, "A short buffer should not be written");
+
+    err = wasi_get_backend_metrics(backend_ctx, (wasi_nn_metrics_format)9, metrics, sizeof(metrics), &metrics_size);
+    ASSERT(err != 0, "Unknown metrics format should fail");
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// Test: spans of an inference exported as Chrome trace JSON
+int test_request_tracing() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    const char *config = "{\"logging\":{\"trace\":true,\"trace_events_per_thread\":4096}}";
+    err = wasi_init_backend_with_config(&backend_ctx, config, strlen(config));
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  MODEL_CONFIG, strlen(MODEL_CONFIG), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    err = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+    ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+    tensor input_tensor;
+    uint8_t output_buffer[256];
+    uint32_t output_size = sizeof(output_buffer);
+    setup_tensor(&input_tensor, "Count to three.");
+    err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output_buffer, &output_size, NULL, 0);
+    ASSERT_SUCCESS(err, "Inference failed");
+
+    // No buffer: only the required size comes back
+    uint32_t trace_size = 0;
+    err = wasi_get_trace(backend_ctx, exec_ctx, NULL, 0, &trace_size);
+    ASSERT(err == too_large && trace_size > 1, "Trace size query should report too_large with the size");
+
+    static char trace[262144];
+    ASSERT(trace_size <= sizeof(trace), "Trace larger than the test buffer");
+    err = wasi_get_trace(backend_ctx, exec_ctx, trace, sizeof(trace), &trace_size);
+    ASSERT_SUCCESS(err, "Getting session trace failed");
+    ASSERT(strstr(trace, "\"traceEvents\"") != NULL, "Trace should be Chrome trace JSON");
+    ASSERT(strstr(trace, "\"run_inference\"") != NULL, "Trace should hold the request span");
+    ASSERT(strstr(trace, "\"llama_decode\"") != NULL, "Session trace should hold the decodes it ran in");
+    printf("✅ Session trace: %u bytes\n", trace_size);
+
+    // Stopped tracing keeps the recorded spans; restarting drops them
+    err = wasi_set_tracing(backend_ctx, false);
+    ASSERT_SUCCESS(err, "Disabling tracing failed");
+    err = wasi_get_trace(backend_ctx, 0, trace, sizeof(trace), &trace_size);
+    ASSERT_SUCCESS(err, "Getting full trace failed");
+    ASSERT(strstr(trace, "\"update_slots\"") != NULL, "Full trace should hold scheduler spans");
+
+    err = wasi_set_tracing(backend_ctx, true);
+    ASSERT_SUCCESS(err, "Enabling tracing failed");
+    err = wasi_get_trace(backend_ctx, exec_ctx, trace, sizeof(trace), &trace_size);
+    ASSERT_SUCCESS(err, "Getting empty trace failed");
+    ASSERT(strstr(trace, "\"run_inference\"") == NULL, "Restarted tracing should drop old spans");
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// Test: a too-small output buffer reports the size and keeps the response
+int test_output_size_negotiation() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  MODEL_CONFIG, strlen(MODEL_CONFIG), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    err = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+    ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+    // No buffer: only the required size comes back
+    tensor input_tensor;
+    setup_tensor(&input_tensor, "Describe the sea in one sentence.");
+    uint32_t required = 0;
+    err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, NULL, &required, NULL, 0);
+    ASSERT(err == too_large, "A missing buffer should report too_large");
+    ASSERT(required > 1, "The required size should cover the response and its NUL");
+    printf("✅ Response needs %u bytes\n", required);
+
+    // The kept response is fetched without generating it again
+    char *output = malloc(required);
+    ASSERT(output != NULL, "Allocation failed");
+    uint32_t output_size = 4;
+    err = wasi_get_output(backend_ctx, exec_ctx, 0, (tensor_data)output, &output_size);
+    if (required > 4) {
+        ASSERT(err == too_large && output_size == required, "A short buffer should report the same size again");
+    }
+    output_size = required;
+    err = wasi_get_output(backend_ctx, exec_ctx, 0, (tensor_data)output, &output_size);
+    ASSERT_SUCCESS(err, "Fetching the kept response failed");
+    ASSERT(output_size == required && strlen(output) + 1 == required, "Fetched response has the wrong size");
+    printf("✅ Fetched kept response: %.60s%s\n", output, required > 60 ? "..." : "");
+    free(output);
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+int test_registered_runtime_config() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx1 = 0, exec_ctx2 = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  MODEL_CONFIG, strlen(MODEL_CONFIG), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    // Invalid JSON is rejected at registration, not on every request
+    uint32_t config_handle = 0;
+    const char *bad_config = "{\"temperature\": ";
+    err = wasi_register_runtime_config(backend_ctx, bad_config, strlen(bad_config), &config_handle);
+    ASSERT(err == invalid_argument, "Invalid runtime config should be rejected");
+
+    const char *config = "{\"temperature\": 0.0, \"max_tokens\": 8, \"seed\": 42}";
+    err = wasi_register_runtime_config(backend_ctx, config, strlen(config), &config_handle);
+    ASSERT_SUCCESS(err, "Registering runtime config failed");
+    ASSERT(config_handle != 0, "Runtime config handle should not be 0");
+    printf("✅ Registered runtime config %u\n", config_handle);
+
+    err = wasi_init_execution_context(backend_ctx, g, &exec_ctx1);
+    ASSERT_SUCCESS(err, "First execution context initialization failed");
+    err = wasi_init_execution_context(backend_ctx, g, &exec_ctx2);
+    ASSERT_SUCCESS(err, "Second execution context initialization failed");
+
+    // Greedy sampling: the same first turn gives the same text in both sessions
+    tensor input_tensor;
+    setup_tensor(&input_tensor, "Name a primary color.");
+    char output1[1024] = {0}, output2[1024] = {0};
+    uint32_t output1_size = sizeof(output1), output2_size = sizeof(output2);
+    err = wasi_run_inference_with_config_handle(backend_ctx, exec_ctx1, 0, &input_tensor,
+                                                (tensor_data)output1, &output1_size, config_handle);
+    ASSERT_SUCCESS(err, "Inference with runtime config handle failed");
+    err = wasi_run_inference_with_config_handle(backend_ctx, exec_ctx2, 0, &input_tensor,
+                                                (tensor_data)output2, &output2_size, config_handle);
+    ASSERT_SUCCESS(err, "Second inference with runtime config handle failed");
+    ASSERT(strcmp(output1, output2) == 0, "Both sessions should generate the same text");
+    printf("✅ Both sessions answered: %s\n", output1);
+
+    // A released handle is no longer accepted
+    err = wasi_release_runtime_config(backend_ctx, config_handle);
+    ASSERT_SUCCESS(err, "Releasing runtime config failed");
+    output1_size = sizeof(output1);
+    err = wasi_run_inference_with_config_handle(backend_ctx, exec_ctx1, 0, &input_tensor,
+                                                (tensor_data)output1, &output1_size, config_handle);
+    ASSERT(err == invalid_argument, "Released runtime config handle should be rejected");
+    printf("✅ Released handle rejected\n");
+
+    wasi_close_execution_context(backend_ctx, exec_ctx1);
+    wasi_close_execution_context(backend_ctx, exec_ctx2);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+int test_batched_embeddings() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    const char *config = "{\"n_gpu_layers\":0,\"ctx_size\":1024,\"n_predict\":10,"
+                         "\"n_parallel\":2,\"pooling\":\"mean\"}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  config, strlen(config), &g);
+    ASSERT_SUCCESS(err, "Model loading with mean pooling failed");
+
+    err = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+    ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+    // The first and last inputs are equal, so their embeddings must be too
+    const char *texts[3] = {
+        "The cat sat on the mat.",
+        "Quarterly revenue grew by twelve percent.",
+        "The cat sat on the mat.",
+    };
+    tensor inputs[3];
+    tensor_data outputs[3] = {NULL, NULL, NULL};
+    uint32_t sizes[3] = {0, 0, 0};
+    for (int i = 0; i < 3; ++i) {
+        setup_tensor(&inputs[i], texts[i]);
+    }
+
+    // No buffers: only the sizes come back
+    err = wasi_compute_embeddings(backend_ctx, exec_ctx, inputs, 3, outputs, sizes);
+    ASSERT(err == too_large, "Missing buffers should report too_large");
+    ASSERT(sizes[0] > 0 && sizes[0] % sizeof(float) == 0, "Embedding size should be a whole number of floats");
+    ASSERT(sizes[1] == sizes[0] && sizes[2] == sizes[0], "Pooled embeddings should all have n_embd values");
+    const uint32_t n_embd = sizes[0] / sizeof(float);
+    printf("✅ Embeddings have %u dimensions\n", n_embd);
+
+    for (int i = 0; i < 3; ++i) {
+        outputs[i] = malloc(sizes[i]);
+        ASSERT(outputs[i] != NULL, "Allocation failed");
+    }
+    err = wasi_compute_embeddings(backend_ctx, exec_ctx, inputs, 3, outputs, sizes);
+    ASSERT_SUCCESS(err, "Computing embeddings failed");
+
+    const float *e0 = (const float *)outputs[0];
+    const float *e1 = (const float *)outputs[1];
+    const float *e2 = (const float *)outputs[2];
+    float norm0 = 0.0f, same = 0.0f, other = 0.0f;
+    for (uint32_t j = 0; j < n_embd; ++j) {
+        norm0 += e0[j] * e0[j];
+        same += e0[j] * e2[j];
+        other += e0[j] * e1[j];
+    }
+    ASSERT(norm0 > 0.999f && norm0 < 1.001f, "Embeddings should be L2-normalized");
+    ASSERT(same > 0.999f, "Equal inputs should have equal embeddings");
+    ASSERT(other < same, "Different inputs should be less similar than equal ones");
+    printf("✅ Cosine similarity: equal %.4f, different %.4f\n", same, other);
+
+    for (int i = 0; i < 3; ++i) {
+        free(outputs[i]);
+    }
+
+    // A generative model has no rank pooling
+    float score = 0.0f;
+    uint32_t score_size = sizeof(score);
+    tensor query;
+    setup_tensor(&query, "Where did the cat sit?");
+    err = wasi_rerank(backend_ctx, exec_ctx, &query, inputs, 1, (tensor_data)&score, &score_size);
+    ASSERT(err == unsupported_operation, "Rerank without rank pooling should be unsupported");
+    printf("✅ Rerank rejected without rank pooling\n");
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
@@ -62,7 +62,7 @@ int test_safe_model_switch() {
     ASSERT(result == 0, "Initial compute with first model should succeed");
     
     // Get output from first model
-    char output1[256];
+    char output1[4096];
     uint32_t output1_size = sizeof(output1);
     result = wasi_get_output(backend_ctx, exec_ctx, 0, (tensor_data)output1, &output1_size);
     if (result == 0 && output1_size > 0) {
@@ -101,7 +101,7 @@ int test_safe_model_switch() {
     printf("✅ Inference with switched model completed successfully\n");
     
     // Test output retrieval from second model
-    char output2[256];
+    char output2[4096];
     uint32_t output2_size = sizeof(output2);
     result = wasi_get_output(backend_ctx, new_exec_ctx, 0, (tensor_data)output2, &output2_size);
     
@@ -127,6 +127,16 @@ int test_safe_model_switch() {
                                            enhanced_config, strlen(enhanced_config), &g3);
     if (result == 0) {
         printf("✅ Successfully switched back to first model\n");
+
+        // Sessions survive the switch and are re-prefilled from their history
+        result = wasi_set_input(backend_ctx, new_exec_ctx, 0, &input);
+        ASSERT(result == 0, "Session opened before the switch should stay usable");
+        result = wasi_compute(backend_ctx, new_exec_ctx);
+        ASSERT(result == 0, "Compute on a session kept across the switch should succeed");
+        output2_size = sizeof(output2);
+        result = wasi_get_output(backend_ctx, new_exec_ctx, 0, (tensor_data)output2, &output2_size);
+        ASSERT(result == 0, "Output on a session kept across the switch should succeed");
+        printf("✅ Session kept across the switch answered on the new model\n");
     } else {
         printf("⚠️  Switch back failed (result: %d) - but primary switch test passed\n", result);
     }
@@ -144,3 +154,116 @@ int test_safe_model_switch() {
     
     return 1;
 }
+
+// Test: several models stay resident and each graph talks to its own model
+int test_resident_models() {
+    void *backend_ctx = NULL;
+    const char *config = "{\"backend\":{\"max_resident_models\":2}}";
+    const char *model_config = "{\"model\":{\"n_gpu_layers\":49,\"ctx_size\":2048,\"n_predict\":24}}";
+    const char *first_model = "./test/qwen2.5-14b-instruct-q2_k.gguf";
+    const char *second_model = "./test/ISrbGzQot05rs_HKC08O_SmkipYQnqgB1yC3mjZZeEo.gguf";
+
+    int result = wasi_init_backend_with_config(&backend_ctx, config, strlen(config));
+    ASSERT(result == 0, "Backend initialization with config should succeed");
+
+    graph g1 = 0, g2 = 0, g1_again = 0;
+    result = wasi_load_by_name_with_config(backend_ctx, first_model, strlen(first_model),
+                                           model_config, strlen(model_config), &g1);
+    ASSERT(result == 0, "First model loading should succeed");
+    result = wasi_load_by_name_with_config(backend_ctx, second_model, strlen(second_model),
+                                           model_config, strlen(model_config), &g2);
+    ASSERT(result == 0, "Second model loading should succeed");
+    ASSERT(g1 != g2, "Different models should get different graphs");
+
+    result = wasi_load_by_name_with_config(backend_ctx, first_model, strlen(first_model),
+                                           model_config, strlen(model_config), &g1_again);
+    ASSERT(result == 0, "Loading a resident model again should succeed");
+    ASSERT(g1 == g1_again, "A resident model should keep its graph");
+
+    graph_execution_context exec_ctx[2];
+    result = wasi_init_execution_context(backend_ctx, g1, &exec_ctx[0]);
+    ASSERT(result == 0, "Execution context on the first model should succeed");
+    result = wasi_init_execution_context(backend_ctx, g2, &exec_ctx[1]);
+    ASSERT(result == 0, "Execution context on the second model should succeed");
+    ASSERT(exec_ctx[0] != exec_ctx[1], "Each graph should have its own default session");
+
+    // Alternate between the models; each switch installs a resident model
+    tensor input;
+    setup_tensor(&input, "Say hello in one word.");
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 2; i++) {
+            char output[256];
+            uint32_t output_size = sizeof(output);
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            result = wasi_run_inference(backend_ctx, exec_ctx[i], 0, &input,
+                                        (tensor_data)output, &output_size, NULL, 0);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ASSERT(result == 0, "Inference on a resident model should succeed");
+            printf("✅ Model %d answered in %.1fms: %.40s\n", i + 1,
+                   (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6, output);
+        }
+    }
+
+    wasi_close_execution_context(backend_ctx, exec_ctx[0]);
+    wasi_close_execution_context(backend_ctx, exec_ctx[1]);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+int test_model_preload() {
+    void *backend_ctx = NULL;
+    const char *model_config = "{\"model\":{\"n_gpu_layers\":49,\"ctx_size\":2048,\"n_predict\":16,\"use_mmap\":true}}";
+    char config[512];
+    snprintf(config, sizeof(config), "{\"preload\":{\"model\":\"%s\",\"config\":%s,\"warmup\":true}}",
+             MODEL_FILE, model_config);
+
+    // init returns while the model loads in the background
+    int result = wasi_init_backend_with_config(&backend_ctx, config, strlen(config));
+    ASSERT(result == 0, "Backend initialization with preload should succeed");
+
+    bool ready = false;
+    const struct timespec poll_interval = {0, 100000000};  // 100ms
+    for (int i = 0; i < 1200 && !ready; i++) {
+        result = wasi_poll_backend_ready(backend_ctx, &ready);
+        ASSERT(result == 0, "Polling readiness should succeed");
+        if (!ready) {
+            nanosleep(&poll_interval, NULL);
+        }
+    }
+    ASSERT(ready, "Backend should become ready after the preload");
+
+    // The preloaded graph is returned without loading again
+    graph g = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                           model_config, strlen(model_config), &g);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ASSERT(result == 0, "Loading the preloaded model should succeed");
+    printf("✅ Preloaded graph %u returned in %.1fms\n", g,
+           (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+    graph_execution_context exec_ctx = 0;
+    result = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+    ASSERT(result == 0, "Execution context initialization should succeed");
+    tensor input;
+    setup_tensor(&input, "Say hello in one word.");
+    char output[256];
+    uint32_t output_size = sizeof(output);
+    result = wasi_run_inference(backend_ctx, exec_ctx, 0, &input, (tensor_data)output, &output_size, NULL, 0);
+    ASSERT(result == 0, "Inference on the preloaded model should succeed");
+
+    static char metrics[16384];
+    uint32_t metrics_size = 0;
+    result = wasi_get_backend_metrics(backend_ctx, WASI_NN_METRICS_JSON, metrics, sizeof(metrics), &metrics_size);
+    ASSERT(result == 0, "Getting metrics should succeed");
+    ASSERT(strstr(metrics, "\"cold_start_seconds\"") != NULL, "Metrics should report the cold start");
+    printf("✅ %.60s\n", strstr(metrics, "\"cold_start_seconds\""));
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
@@ -243,3 +243,231 @@ int test_concurrency_management() {
 
     return 1;
 }
+
+// Worker for test_parallel_session_inference
+typedef struct {
+    void *backend_ctx;
+    graph_execution_context exec_ctx;
+    const char *prompt;
+    uint8_t output[512];
+    uint32_t output_size;
+    wasi_nn_error err;
+} parallel_inference_job;
+
+static void *parallel_inference_worker(void *arg) {
+    parallel_inference_job *job = (parallel_inference_job *)arg;
+    tensor input_tensor;
+    setup_tensor(&input_tensor, job->prompt);
+
+    job->output_size = sizeof(job->output);
+    job->err = wasi_run_inference(job->backend_ctx, job->exec_ctx, 0, &input_tensor,
+                                  job->output, &job->output_size, NULL, 0);
+    return NULL;
+}
+
+// Test: Concurrent sessions share the slot scheduler (continuous batching)
+int test_parallel_session_inference() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    const char *model_config = "{\"model\":{\"n_gpu_layers\":98,\"ctx_size\":2048,\"n_predict\":40,\"n_parallel\":2}}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  model_config, strlen(model_config), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    parallel_inference_job jobs[2];
+    const char *sessions[2] = {"parallel_session_a", "parallel_session_b"};
+    const char *prompts[2] = {"Name three colors.", "Name three animals."};
+    pthread_t threads[2];
+
+    for (int i = 0; i < 2; i++) {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].backend_ctx = backend_ctx;
+        jobs[i].prompt = prompts[i];
+        err = wasi_init_execution_context_with_session_id(backend_ctx, sessions[i], &jobs[i].exec_ctx);
+        ASSERT_SUCCESS(err, "Execution context initialization failed");
+    }
+    ASSERT(jobs[0].exec_ctx != jobs[1].exec_ctx, "Sessions should have distinct execution contexts");
+
+    for (int i = 0; i < 2; i++) {
+        ASSERT(pthread_create(&threads[i], NULL, parallel_inference_worker, &jobs[i]) == 0,
+               "Failed to start inference thread");
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        ASSERT_SUCCESS(jobs[i].err, "Concurrent inference failed");
+        ASSERT(jobs[i].output_size > 0, "No output generated");
+        printf("✅ Session %s (%d chars): %.60s%s\n", sessions[i], jobs[i].output_size,
+               (char *)jobs[i].output, jobs[i].output_size > 60 ? "..." : "");
+        wasi_close_execution_context(backend_ctx, jobs[i].exec_ctx);
+    }
+
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// Test: A closed session is saved to session_state_dir and resumed by id
+int test_session_persistence() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    const char *config = "{\"memory\":{\"session_state_dir\":\"/tmp/wasi_nn_session_state\"}}";
+    err = wasi_init_backend_with_config(&backend_ctx, config, strlen(config));
+    ASSERT_SUCCESS(err, "Backend initialization with session_state_dir failed");
+
+    const char *model_config = "{\"model\":{\"n_gpu_layers\":98,\"ctx_size\":2048,\"n_predict\":40}}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  model_config, strlen(model_config), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    err = wasi_init_execution_context_with_session_id(backend_ctx, "persisted_session", &exec_ctx);
+    ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+    tensor input_tensor;
+    uint8_t output[512];
+    uint32_t output_size = sizeof(output);
+    setup_tensor(&input_tensor, "My favourite color is green. Remember it.");
+    err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output, &output_size, NULL, 0);
+    ASSERT_SUCCESS(err, "First turn failed");
+
+    // Closing snapshots the session's KV sequence and conversation
+    err = wasi_close_execution_context(backend_ctx, exec_ctx);
+    ASSERT_SUCCESS(err, "Closing the session failed");
+
+    // Reopening the same id restores the conversation; the KV snapshot loads on the next turn
+    err = wasi_init_execution_context_with_session_id(backend_ctx, "persisted_session", &exec_ctx);
+    ASSERT_SUCCESS(err, "Reopening the saved session failed");
+
+    output_size = sizeof(output);
+    setup_tensor(&input_tensor, "What is my favourite color?");
+    err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output, &output_size, NULL, 0);
+    ASSERT_SUCCESS(err, "Resumed turn failed");
+    ASSERT(output_size > 0, "No output generated for the resumed session");
+    printf("✅ Resumed session answered (%d chars): %.60s%s\n", output_size,
+           (char *)output, output_size > 60 ? "..." : "");
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// prefix_cache_hits_total from the JSON metrics, -1 if missing
+static long prefix_cache_hits(void *backend_ctx) {
+    static char metrics[16384];
+    uint32_t metrics_size = sizeof(metrics);
+    if (wasi_get_backend_metrics(backend_ctx, WASI_NN_METRICS_JSON, metrics, sizeof(metrics), &metrics_size) != success) {
+        return -1;
+    }
+    const char *key = strstr(metrics, "\"prefix_cache_hits_total\":");
+    return key ? atol(key + strlen("\"prefix_cache_hits_total\":")) : -1;
+}
+
+// Test: closing every session clears the KV cache but keeps the pinned system prompt prefix
+int test_shared_prefix_after_close() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    const char *model_config =
+        "{\"model\":{\"n_gpu_layers\":0,\"ctx_size\":1024,\"n_parallel\":2,\"n_predict\":8,"
+        "\"system_prompt\":\"You are a careful assistant for a library. Answer briefly, cite the shelf "
+        "section when you mention a book, never invent titles or authors, and ask a short clarifying question "
+        "when a request could mean several things. Opening hours are 9 to 18 on weekdays.\"}}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  model_config, strlen(model_config), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    const char *questions[] = {"Where are the atlases?", "Do you lend DVDs?"};
+    long hits[2] = {0, 0};
+    for (int i = 0; i < 2; i++) {
+        err = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+        ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+        tensor input_tensor;
+        uint8_t output[256];
+        uint32_t output_size = sizeof(output);
+        setup_tensor(&input_tensor, questions[i]);
+        err = wasi_run_inference(backend_ctx, exec_ctx, 0, &input_tensor, output, &output_size, NULL, 0);
+        ASSERT_SUCCESS(err, "Inference failed");
+        hits[i] = prefix_cache_hits(backend_ctx);
+
+        // The last open session closing clears the whole KV cache
+        err = wasi_close_execution_context(backend_ctx, exec_ctx);
+        ASSERT_SUCCESS(err, "Closing the session failed");
+    }
+
+    ASSERT(hits[0] >= 1, "The first session should copy the system prompt prefix");
+    ASSERT(hits[1] > hits[0], "A session after the clear should still copy the system prompt prefix");
+    printf("✅ Prefix reused before and after the clear (%ld, %ld hits)\n", hits[0], hits[1]);
+
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// Test: NUMA placement config; with one node numa_replicas serves unreplicated
+int test_numa_replicas() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    wasi_nn_error err;
+
+    const char *config = "{\"backend\":{\"numa\":\"isolate\",\"numa_replicas\":true}}";
+    err = wasi_init_backend_with_config(&backend_ctx, config, strlen(config));
+    ASSERT_SUCCESS(err, "Backend initialization with numa_replicas failed");
+
+    const char *model_config = "{\"model\":{\"n_gpu_layers\":0,\"ctx_size\":2048,\"n_predict\":16,"
+                               "\"n_parallel\":2,\"use_mmap\":false}}";
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  model_config, strlen(model_config), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    const char *sessions[4] = {"numa_session_a", "numa_session_b", "numa_session_c", "numa_session_d"};
+    graph_execution_context exec_ctx[4];
+    tensor input_tensor;
+    uint8_t output[512];
+    uint32_t output_size;
+    for (int i = 0; i < 4; i++) {
+        err = wasi_init_execution_context_with_session_id(backend_ctx, sessions[i], &exec_ctx[i]);
+        ASSERT_SUCCESS(err, "Execution context initialization failed");
+        setup_tensor(&input_tensor, "Say hello.");
+        output_size = sizeof(output);
+        err = wasi_run_inference(backend_ctx, exec_ctx[i], 0, &input_tensor, output, &output_size, NULL, 0);
+        ASSERT_SUCCESS(err, "Inference on the session's replica failed");
+    }
+
+    // A reopened session lands on its home replica again
+    graph_execution_context reopened = 0;
+    err = wasi_init_execution_context_with_session_id(backend_ctx, sessions[2], &reopened);
+    ASSERT_SUCCESS(err, "Reopening session failed");
+    ASSERT(reopened == exec_ctx[2], "Reopened session should keep its execution context");
+
+    static char metrics[16384];
+    uint32_t metrics_size = 0;
+    err = wasi_get_backend_metrics(backend_ctx, WASI_NN_METRICS_JSON, metrics, sizeof(metrics), &metrics_size);
+    ASSERT_SUCCESS(err, "JSON metrics failed");
+    ASSERT(strstr(metrics, "\"numa_replicas\":") != NULL, "Metrics should report the replica count");
+    printf("✅ %s\n", strstr(metrics, "\"numa_replicas\":1,") ? "Single node, serving unreplicated"
+                                                             : "Sessions spread over NUMA replicas");
+
+    for (int i = 0; i < 4; i++) {
+        wasi_close_execution_context(backend_ctx, exec_ctx[i]);
+    }
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
@@ -347,3 +347,104 @@ int test_advanced_stopping_integration() {
     
     return 1;
 }
+
+typedef struct {
+    char text[2048];
+    uint32_t len;
+} stop_stream_capture;
+
+static bool capture_stop_chunk(const char *chunk, uint32_t chunk_len, void *user_data) {
+    stop_stream_capture *capture = (stop_stream_capture *)user_data;
+    uint32_t room = sizeof(capture->text) - 1 - capture->len;
+    uint32_t n = chunk_len < room ? chunk_len : room;
+    memcpy(capture->text + capture->len, chunk, n);
+    capture->len += n;
+    capture->text[capture->len] = '\0';
+    return true;
+}
+
+// Test 6: Many overlapping stop strings, matched incrementally while streaming
+int test_streaming_stop_sequences() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  MODEL_CONFIG, strlen(MODEL_CONFIG), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    err = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+    ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+    // Overlapping stops: "5" is inside "5,", "six" shares a prefix with "sixty"
+    static const char *stops[] = {"5,", "5", "six", "sixty", "\n\n", "END"};
+    const char *stop_config = "{\"max_tokens\":48,\"temperature\":0,"
+                              "\"stop\":[\"5,\",\"5\",\"six\",\"sixty\",\"\\n\\n\",\"END\"]}";
+    tensor input_tensor;
+    setup_tensor(&input_tensor, "Count from 1 to 10, separated by commas.");
+
+    stop_stream_capture capture;
+    memset(&capture, 0, sizeof(capture));
+    err = wasi_run_inference_stream(backend_ctx, exec_ctx, 0, &input_tensor, stop_config, strlen(stop_config),
+                                    capture_stop_chunk, &capture);
+    ASSERT_SUCCESS(err, "Streaming inference with stop sequences failed");
+    printf("✅ Streamed (%u bytes): %.100s\n", capture.len, capture.text);
+
+    // Held-back partial matches must never leak into the stream
+    for (size_t i = 0; i < sizeof(stops) / sizeof(stops[0]); i++) {
+        ASSERT(strstr(capture.text, stops[i]) == NULL, "Streamed text contains a stop string");
+    }
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}
+
+// Test 7: Stop strings completed by the same token cut at the earliest start
+int test_overlapping_stop_sequences() {
+    void *backend_ctx = NULL;
+    graph g = 0;
+    graph_execution_context exec_ctx = 0;
+    wasi_nn_error err;
+
+    err = wasi_init_backend(&backend_ctx);
+    ASSERT_SUCCESS(err, "Backend initialization failed");
+
+    err = wasi_load_by_name_with_config(backend_ctx, MODEL_FILE, strlen(MODEL_FILE),
+                                  MODEL_CONFIG, strlen(MODEL_CONFIG), &g);
+    ASSERT_SUCCESS(err, "Model loading failed");
+
+    err = wasi_init_execution_context(backend_ctx, g, &exec_ctx);
+    ASSERT_SUCCESS(err, "Execution context initialization failed");
+
+    // " world" is one token: "wor" ends inside it before "hello world" does,
+    // but "hello world" starts first, so nothing of it may be left behind
+    const char *stop_config = "{\"max_tokens\":32,\"temperature\":0,"
+                              "\"stop\":[\"wor\",\"hello world\"]}";
+    tensor input_tensor;
+    setup_tensor(&input_tensor, "Repeat exactly, in lowercase: hello world");
+
+    stop_stream_capture capture;
+    memset(&capture, 0, sizeof(capture));
+    err = wasi_run_inference_stream(backend_ctx, exec_ctx, 0, &input_tensor, stop_config, strlen(stop_config),
+                                    capture_stop_chunk, &capture);
+    ASSERT_SUCCESS(err, "Streaming inference with overlapping stop sequences failed");
+    printf("✅ Streamed (%u bytes): %.100s\n", capture.len, capture.text);
+
+    while (capture.len > 0 && (capture.text[capture.len - 1] == ' ' || capture.text[capture.len - 1] == '\n')) {
+        capture.text[--capture.len] = '\0';
+    }
+    ASSERT(strstr(capture.text, "wor") == NULL, "Streamed text contains a stop string");
+    ASSERT(capture.len < 5 || strcmp(capture.text + capture.len - 5, "hello") != 0,
+           "Cut at the later-starting stop string");
+
+    wasi_close_execution_context(backend_ctx, exec_ctx);
+    wasi_deinit_backend(backend_ctx);
+
+    return 1;
+}